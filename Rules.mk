@@ -91,6 +91,7 @@ endif
 
 WINDOWS = $(filter-out windows,$(TARGET_HOST))
 OSX = $(filter-out osx,$(TARGET_HOST))
+LINUX = $(filter-out linux,$(TARGET_HOST))
 
 $(WINDOWS)EXE_SUFFIX = .exe
 $(OSX)EXE_SUFFIX =
@@ -13,5 +13,7 @@ struct page_fingerprint {
 } __attribute__((__packed__));
 
 uint64_t page_fingerprint(const uint8_t *_page, uint16_t *rotate);
+void page_fingerprint_many(const uint8_t **pages, int n, uint64_t *hashes,
+                           uint16_t *rotates);
 
 #endif  /* _FINGERPRINT_H_ */
@@ -0,0 +1,138 @@
+/*
+ * Copyright 2019, Bromium, Inc.
+ * SPDX-License-Identifier: ISC
+ */
+
+/* Check that background compaction keeps to the write budget set for it.
+ * Fills level 0 of the dubtree with incompressible blocks enough times for
+ * the compaction thread to get a level to merge, without stalling the writes
+ * behind it, which would lift the budget, and then waits for the compaction
+ * to have been held back. */
+
+#include <err.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <inttypes.h>
+#include "libimg.h"
+
+void init_genrand64(unsigned long long seed);
+unsigned long long genrand64_int64(void);
+
+#if defined(_WIN32)
+#include <windows.h>
+DECLARE_PROGNAME;
+#else
+#include <unistd.h>
+#endif	/* _WIN32 */
+
+#define WRITE_SECTORS 256
+#define TOTAL_SECTORS ((40ULL << 20) / BDRV_SECTOR_SIZE)
+#define BUDGET (1ULL << 20) /* Bytes/s, so that a merge takes seconds. */
+#define WAIT_MS 30000
+
+static void fill(uint64_t sector, uint8_t *out)
+{
+    int i;
+
+    init_genrand64(sector);
+    for (i = 0; i < WRITE_SECTORS * BDRV_SECTOR_SIZE; i += sizeof(uint64_t)) {
+        *((uint64_t *) (out + i)) = genrand64_int64();
+    }
+}
+
+static void sleep_ms(int ms)
+{
+#ifdef _WIN32
+    Sleep(ms);
+#else
+    usleep(ms * 1000);
+#endif
+}
+
+int main(int argc, char **argv)
+{
+#ifdef _WIN32
+    setprogname(argv[0]);
+#endif
+
+    BlockDriverState *bs;
+    uint8_t buf[WRITE_SECTORS * BDRV_SECTOR_SIZE];
+    uint8_t expect[WRITE_SECTORS * BDRV_SECTOR_SIZE];
+    uint64_t budget = BUDGET;
+    uint64_t throttled = 0;
+    uint64_t sector;
+    int background = 1;
+    int waited;
+    int r;
+
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s <swap:dst.swap>\n", argv[0]);
+        exit(-1);
+    }
+
+    ioh_init();
+    bh_init();
+    aio_init();
+    bdrv_init();
+
+    bs = bdrv_new("");
+    if (!bs) {
+        printf("no bs\n");
+        return -1;
+    }
+
+    r = bdrv_create(argv[1], 1ULL << 30ULL, 0);
+    assert(r >= 0);
+
+    r = bdrv_open(bs, argv[1], BDRV_O_RDWR);
+    assert(r >= 0);
+
+    r = bdrv_ioctl(bs, 4, &background);
+    assert(r >= 0);
+    r = bdrv_ioctl(bs, 9, &budget);
+    assert(r >= 0);
+
+    for (sector = 0; sector < TOTAL_SECTORS; sector += WRITE_SECTORS) {
+        fill(sector, buf);
+        if (bdrv_write(bs, sector, buf, WRITE_SECTORS) < 0) {
+            errx(1, "write of sector %"PRIu64" failed", sector);
+        }
+    }
+    bdrv_flush(bs);
+
+    for (waited = 0; waited < WAIT_MS; waited += 100) {
+        r = bdrv_ioctl(bs, 10, &throttled);
+        assert(r >= 0);
+        if (throttled) {
+            break;
+        }
+        sleep_ms(100);
+    }
+    printf("compaction held back for %"PRIu64"ms\n", throttled);
+    if (!throttled) {
+        errx(1, "compaction not held back by a budget of %"PRIu64" bytes/s",
+             budget);
+    }
+
+    /* Lift the budget, so that the merge in progress can finish. */
+    budget = 0;
+    r = bdrv_ioctl(bs, 9, &budget);
+    assert(r >= 0);
+
+    for (sector = 0; sector < TOTAL_SECTORS; sector += WRITE_SECTORS) {
+        if (bdrv_read(bs, sector, buf, WRITE_SECTORS) < 0) {
+            errx(1, "read of sector %"PRIu64" failed", sector);
+        }
+        fill(sector, expect);
+        if (memcmp(buf, expect, sizeof(buf))) {
+            errx(1, "sector %"PRIu64" is BAD", sector);
+        }
+    }
+
+    bdrv_delete(bs);
+    printf("test complete\n");
+    return 0;
+}
@@ -0,0 +1,219 @@
+/*
+ * Copyright 2019, Bromium, Inc.
+ * SPDX-License-Identifier: ISC
+ */
+
+/* Check the garbage accounting of dubtree merges for values shared by
+ * several keys: a value is only garbage once all of its keys have been
+ * overwritten, whichever of them goes first. Also checks that zero blocks
+ * take up no space. Compaction is run inline, so that each write is merged
+ * straight away into the tree before it, and the tree is sealed before each
+ * step, which copies it and so drops the garbage of the steps before. */
+
+#include <err.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <inttypes.h>
+#include "libimg.h"
+
+#if defined(_WIN32)
+#include <windows.h>
+DECLARE_PROGNAME;
+#endif	/* _WIN32 */
+
+#define BLOCK_SECTORS 8 /* Sectors per swap block. */
+#define BLOCK_SIZE (BLOCK_SECTORS * BDRV_SECTOR_SIZE)
+#define EXTENT_BLOCKS 16
+
+static BlockDriverState *bs;
+static int level = 1;
+static int version[1024];
+
+static void fill(uint64_t block, int ver, uint8_t *out)
+{
+    int i;
+
+    uint64_t x = (block << 8) ^ ver;
+
+    /* Noise in the first quarter, so that runs of blocks compress to more
+     * than a block and make extents. */
+    for (i = 0; i < BLOCK_SIZE; i += sizeof(uint64_t)) {
+        if (i < BLOCK_SIZE / 4) {
+            x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+            *((uint64_t *) (out + i)) = x ^ (x >> 29);
+        } else {
+            *((uint64_t *) (out + i)) = (block << 8) ^ (ver << 4) ^ (i & 0xff);
+        }
+    }
+}
+
+/* Write count blocks from block on, at version ver, where 0 means zero
+ * blocks and negative versions all have the same contents. */
+static void write_blocks(uint64_t block, int count, int ver)
+{
+    uint8_t buf[EXTENT_BLOCKS * BLOCK_SIZE];
+    int i;
+
+    assert(count <= EXTENT_BLOCKS);
+    for (i = 0; i < count; ++i) {
+        if (ver > 0) {
+            fill(block + i, ver, buf + i * BLOCK_SIZE);
+        } else {
+            fill(0, -ver, buf + i * BLOCK_SIZE);
+        }
+        if (!ver) {
+            memset(buf + i * BLOCK_SIZE, 0, BLOCK_SIZE);
+        }
+        version[block + i] = ver;
+    }
+    if (bdrv_write(bs, block * BLOCK_SECTORS, buf, count * BLOCK_SECTORS) < 0) {
+        errx(1, "write of block %"PRIu64" failed", block);
+    }
+}
+
+/* Push everything written so far down into a level of its own. */
+static void seal(void)
+{
+    int r;
+
+    bdrv_flush(bs);
+    r = bdrv_ioctl(bs, 1, &level);
+    assert(r >= 0);
+    ++level;
+}
+
+/* Return the bytes used and the garbage, once written. */
+static void measure(uint64_t *usage)
+{
+    int r;
+
+    bdrv_flush(bs);
+    r = bdrv_ioctl(bs, 8, usage);
+    assert(r >= 0);
+    printf("used %"PRIu64" garbage %"PRIu64"\n", usage[0], usage[1]);
+}
+
+static void check(void)
+{
+    uint8_t buf[BLOCK_SIZE], expect[BLOCK_SIZE];
+    int i;
+
+    for (i = 0; i < sizeof(version) / sizeof(version[0]); ++i) {
+        if (bdrv_read(bs, i * BLOCK_SECTORS, buf, BLOCK_SECTORS) < 0) {
+            errx(1, "read of block %d failed", i);
+        }
+        if (version[i] > 0) {
+            fill(i, version[i], expect);
+        } else if (version[i] < 0) {
+            fill(0, -version[i], expect);
+        } else {
+            memset(expect, 0, sizeof(expect));
+        }
+        if (memcmp(buf, expect, sizeof(buf))) {
+            errx(1, "block %d is BAD", i);
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+#ifdef _WIN32
+    setprogname(argv[0]);
+#endif
+
+    uint64_t usage[2];
+    uint64_t used;
+    int extent_blocks = EXTENT_BLOCKS;
+    int background = 0;
+    int r;
+
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s <swap:dst.swap>\n", argv[0]);
+        exit(-1);
+    }
+
+    ioh_init();
+    bh_init();
+    aio_init();
+    bdrv_init();
+
+    bs = bdrv_new("");
+    if (!bs) {
+        printf("no bs\n");
+        return -1;
+    }
+
+    r = bdrv_create(argv[1], 1ULL << 30ULL, 0);
+    assert(r >= 0);
+
+    r = bdrv_open(bs, argv[1], BDRV_O_RDWR);
+    assert(r >= 0);
+
+    r = bdrv_ioctl(bs, 4, &background);
+    assert(r >= 0);
+    r = bdrv_ioctl(bs, 7, &extent_blocks);
+    assert(r >= 0);
+
+    /* A run of blocks sharing one extent, of which the first goes, and then
+     * the rest. */
+    write_blocks(0, EXTENT_BLOCKS, 1);
+    seal();
+    write_blocks(0, 1, 2);
+    measure(usage);
+    if (usage[1]) {
+        errx(1, "extent still in use counted as garbage");
+    }
+    seal();
+    write_blocks(1, EXTENT_BLOCKS - 1, 2);
+    measure(usage);
+    if (!usage[1]) {
+        errx(1, "extent no longer in use not counted as garbage");
+    }
+
+    /* Equal blocks apart from each other, written with the same insert,
+     * share a value too. */
+    seal();
+    write_blocks(100, 1, -1);
+    write_blocks(300, 1, -1);
+    seal();
+    write_blocks(100, 1, 1);
+    measure(usage);
+    if (usage[1]) {
+        errx(1, "deduplicated value still in use counted as garbage");
+    }
+    seal();
+    write_blocks(300, 1, 1);
+    measure(usage);
+    if (!usage[1]) {
+        errx(1, "deduplicated value no longer in use not counted as "
+             "garbage");
+    }
+
+    /* Zero blocks take up no space, and overwriting them makes no
+     * garbage. */
+    seal();
+    measure(usage);
+    used = usage[0];
+    write_blocks(500, EXTENT_BLOCKS, 0);
+    measure(usage);
+    if (usage[0] != used) {
+        errx(1, "zero blocks take up %"PRIu64" bytes", usage[0] - used);
+    }
+    seal();
+    write_blocks(500, 1, 1);
+    measure(usage);
+    if (usage[1]) {
+        errx(1, "overwritten zero block counted as garbage");
+    }
+
+    check();
+    r = bdrv_ioctl(bs, 2, NULL);
+    assert(r == 0);
+
+    bdrv_delete(bs);
+    printf("test complete\n");
+    return 0;
+}
@@ -133,9 +133,9 @@ int main(int argc, char **argv)
     BlockDriverState *bs;
     int r;
 
-    if (argc != 5) {
-        fprintf(stderr, "usage: %s <swap:dst.swap> <N> <ROUNDS> <align|unalign>\n",
-                argv[0]);
+    if (argc != 5 && argc != 6) {
+        fprintf(stderr, "usage: %s <swap:dst.swap> <N> <ROUNDS> <align|unalign>"
+                " [inline|background]\n", argv[0]);
         exit(-1);
     }
 
@@ -161,6 +161,14 @@ int main(int argc, char **argv)
     r = bdrv_open(bs, dst, BDRV_O_RDWR);
     assert(r >= 0);
 
+    if (argc == 6) {
+        /* Select how dubtree level merges are performed, to compare insert
+         * latencies with and without the compaction thread. */
+        int background = (!strcmp("background", argv[5]));
+        r = bdrv_ioctl(bs, 4, &background);
+        assert(r >= 0);
+    }
+
     uint8_t buf[0x20000];
     uint8_t *b;
     uint64_t sector;
@@ -204,6 +212,13 @@ int main(int argc, char **argv)
         printf("%.1f writes/s, %.2fMiB/s %s\n", ((double)i) / dt,
                 (double) (total_sectors >> 11) / dt,
                 align ? "4kiB-aligned" : "unaligned");
+        if (argc == 6) {
+            uint64_t lat[2];
+            if (bdrv_ioctl(bs, 5, lat) > 0) {
+                printf("insert latency p50 %"PRIu64"us, p99 %"PRIu64"us\n",
+                        lat[0], lat[1]);
+            }
+        }
 
         t0 = t1;
         init_genrand64(round);
@@ -7,6 +7,8 @@
 #define _LIBIMG_H_
 
 typedef struct BlockDriverState BlockDriverState;
+typedef struct BlockDriverAIOCB BlockDriverAIOCB;
+typedef void BlockDriverCompletionFunc(void *opaque, int ret);
 
 #define BDRV_O_RDWR        0x0002
 
@@ -18,6 +20,10 @@ void ioh_init(void);
 void bh_init(void);
 void aio_init(void);
 void bdrv_init(void);
+void aio_flush(void);
+
+/* Merge queued requests to named devices, off by default. */
+extern uint64_t block_merge;
 
 BlockDriverState *bdrv_new(const char *device_name);
 void bdrv_delete(BlockDriverState *bs);
@@ -35,6 +41,14 @@ int bdrv_read(BlockDriverState *bs, int64_t sector_num,
 int bdrv_write(BlockDriverState *bs, int64_t sector_num,
                const uint8_t *buf, int nb_sectors);
 
+BlockDriverAIOCB *bdrv_aio_read(BlockDriverState *bs, int64_t sector_num,
+                                uint8_t *buf, int nb_sectors,
+                                BlockDriverCompletionFunc *cb, void *opaque);
+BlockDriverAIOCB *bdrv_aio_write(BlockDriverState *bs, int64_t sector_num,
+                                 const uint8_t *buf, int nb_sectors,
+                                 BlockDriverCompletionFunc *cb, void *opaque);
+void bdrv_merge_dispatch(BlockDriverState *bs);
+
 int bdrv_snapshot_delete(BlockDriverState *bs, const char *id);
 
 #endif  /* _LIBIMG_H_ */
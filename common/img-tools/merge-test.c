@@ -0,0 +1,176 @@
+/*
+ * Copyright 2019, Bromium, Inc.
+ * SPDX-License-Identifier: ISC
+ */
+
+/* Exercise the merging of queued guest requests, against a driver that
+ * completes most of them before returning from bdrv_aio_read/write. The
+ * swap driver does so for aligned writes, and for reads served from its
+ * cache. Best run under a memory checker. */
+
+#include <err.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <inttypes.h>
+#include "libimg.h"
+
+#if defined(_WIN32)
+#include <windows.h>
+DECLARE_PROGNAME;
+#endif	/* _WIN32 */
+
+#define NR_REQS 256
+#define MAX_REQ_SECTORS 32
+
+struct req {
+    uint64_t sector;
+    int nb_sectors;
+    int done;
+    int ret;
+    uint8_t buf[MAX_REQ_SECTORS * BDRV_SECTOR_SIZE];
+};
+
+static struct req reqs[NR_REQS];
+
+static void req_cb(void *opaque, int ret)
+{
+    struct req *r = opaque;
+
+    r->done++;
+    r->ret = ret;
+}
+
+static void fill(uint64_t sector, int pass, uint8_t *out)
+{
+    int i;
+
+    for (i = 0; i < BDRV_SECTOR_SIZE; i += sizeof(uint64_t)) {
+        *((uint64_t *) (out + i)) = (sector << 8) ^ (pass << 4) ^ i;
+    }
+}
+
+/* Lay out the requests in contiguous runs separated by holes, so that both
+ * merged and lone requests are dispatched. Runs that are not 4kiB aligned
+ * go through the asynchronous read-modify-write path of the driver. */
+static void layout(int align)
+{
+    uint64_t sector = 0;
+    int i;
+
+    for (i = 0; i < NR_REQS; ++i) {
+        struct req *r = &reqs[i];
+        r->nb_sectors = align ? 8 * (1 + i % 4) : 1 + i % MAX_REQ_SECTORS;
+        if (!(i % 5)) {
+            sector += align ? 64 : 13;
+        }
+        r->sector = sector;
+        sector += r->nb_sectors;
+    }
+}
+
+static void check_done(const char *what)
+{
+    int i;
+
+    aio_flush();
+    for (i = 0; i < NR_REQS; ++i) {
+        if (reqs[i].done != 1 || reqs[i].ret) {
+            errx(1, "%s %d: completed %d times, ret %d", what, i,
+                 reqs[i].done, reqs[i].ret);
+        }
+        reqs[i].done = 0;
+    }
+}
+
+static void run(BlockDriverState *bs, int align, int pass)
+{
+    uint8_t expect[BDRV_SECTOR_SIZE];
+    int i, j;
+
+    layout(align);
+
+    /* Submit in reverse, which the merging has to sort out. */
+    for (i = NR_REQS - 1; i >= 0; --i) {
+        struct req *r = &reqs[i];
+        for (j = 0; j < r->nb_sectors; ++j) {
+            fill(r->sector + j, pass, r->buf + j * BDRV_SECTOR_SIZE);
+        }
+        if (!bdrv_aio_write(bs, r->sector, r->buf, r->nb_sectors,
+                            req_cb, r)) {
+            errx(1, "write %d failed to submit", i);
+        }
+    }
+    bdrv_merge_dispatch(bs);
+    check_done("write");
+
+    for (i = 0; i < NR_REQS; ++i) {
+        struct req *r = &reqs[i];
+        memset(r->buf, 0, sizeof(r->buf));
+        if (!bdrv_aio_read(bs, r->sector, r->buf, r->nb_sectors,
+                           req_cb, r)) {
+            errx(1, "read %d failed to submit", i);
+        }
+    }
+    bdrv_merge_dispatch(bs);
+    check_done("read");
+
+    for (i = 0; i < NR_REQS; ++i) {
+        struct req *r = &reqs[i];
+        for (j = 0; j < r->nb_sectors; ++j) {
+            fill(r->sector + j, pass, expect);
+            if (memcmp(r->buf + j * BDRV_SECTOR_SIZE, expect,
+                       BDRV_SECTOR_SIZE)) {
+                errx(1, "sector 0x%"PRIx64" of read %d is BAD",
+                     r->sector + j, i);
+            }
+        }
+    }
+    printf("%s pass %d ok\n", align ? "aligned" : "unaligned", pass);
+}
+
+int main(int argc, char **argv)
+{
+#ifdef _WIN32
+    setprogname(argv[0]);
+#endif
+
+    BlockDriverState *bs;
+    int r;
+
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s <swap:dst.swap>\n", argv[0]);
+        exit(-1);
+    }
+
+    ioh_init();
+    bh_init();
+    aio_init();
+    bdrv_init();
+    block_merge = 1;
+
+    /* Only requests to named, guest facing devices are merged. */
+    bs = bdrv_new("merge-test");
+    if (!bs) {
+        printf("no bs\n");
+        return -1;
+    }
+
+    r = bdrv_create(argv[1], 1ULL << 30ULL, 0);
+    assert(r >= 0);
+
+    r = bdrv_open(bs, argv[1], BDRV_O_RDWR);
+    assert(r >= 0);
+
+    run(bs, 1, 0);
+    run(bs, 1, 1);
+    run(bs, 0, 2);
+    run(bs, 1, 3);
+
+    bdrv_flush(bs);
+    bdrv_delete(bs);
+    printf("test complete\n");
+    return 0;
+}
@@ -0,0 +1,431 @@
+/*
+ * Copyright 2019, Bromium, Inc.
+ * SPDX-License-Identifier: ISC
+ *
+ * Fold the ancestors of an incremental vm save file into a standalone
+ * save file: the pages the save references in its parent files are
+ * appended as page batches, and the page directory and page offsets are
+ * rewritten to refer to them.
+ */
+
+#define _FILE_OFFSET_BITS 64
+
+#include <err.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <compiler.h>
+#include <lz4.h>
+#include <xen/hvm/e820.h>
+
+#include "vm-savefile.h"
+
+#ifdef _WIN32
+#include "sys.h"
+DECLARE_PROGNAME;
+#endif
+
+#define PAGE_SHIFT 12
+#define PAGE_SIZE (1UL << PAGE_SHIFT)
+
+#define PCI_HOLE_START_PFN (HVM_BELOW_4G_MMIO_START >> PAGE_SHIFT)
+#define PCI_HOLE_END_PFN (HVM_BELOW_4G_MMIO_END >> PAGE_SHIFT)
+#define unskip_pci_hole(idx) ((idx) < PCI_HOLE_START_PFN ?              \
+                              (idx) :                                   \
+                              (idx) + (PCI_HOLE_END_PFN - PCI_HOLE_START_PFN))
+
+#define PAGE_OFFSET_INDEX_PFN_OFF_COMPRESSED (1ULL << 63)
+
+typedef uint16_t cs16_t;
+
+struct ancestor {
+    char *file;
+    FILE *f;
+};
+
+static void
+read_at(FILE *f, uint64_t offset, void *buf, size_t size, const char *what)
+{
+
+    if (fseeko(f, offset, SEEK_SET))
+        err(1, "fseeko(%s, %"PRIu64")", what, offset);
+    if (size && fread(buf, size, 1, f) != 1)
+        errx(1, "short read of %s at %"PRIu64, what, offset);
+}
+
+static void
+write_out(FILE *f, const void *buf, size_t size)
+{
+
+    if (size && fwrite(buf, size, 1, f) != 1)
+        err(1, "fwrite");
+}
+
+/* the index entries at the end of a save file, up to the end marker --
+ * returns the offset of the end marker */
+static uint64_t
+find_index(FILE *f, int32_t marker, uint64_t *offset)
+{
+    struct xc_save_index index;
+    off_t pos;
+
+    *offset = 0;
+    if (fseeko(f, 0, SEEK_END))
+        err(1, "fseeko(SEEK_END)");
+    pos = ftello(f);
+    for (;;) {
+        if (pos < (off_t)sizeof(index))
+            errx(1, "no end marker");
+        pos -= sizeof(index);
+        read_at(f, pos, &index, sizeof(index), "index");
+        if (!index.marker)
+            break;
+        if (index.marker == marker && !*offset)
+            *offset = index.offset;
+    }
+
+    return pos + sizeof(index.offset);
+}
+
+/* the save id of an ancestor, to tell it apart from a file which
+ * replaced it */
+static void
+read_save_id(FILE *f, const char *file, uint8_t *id)
+{
+    struct xc_save_save_id s_save_id;
+    uint64_t o;
+
+    find_index(f, XC_SAVE_ID_SAVE_ID, &o);
+    if (!o)
+        errx(1, "%s has no save id", file);
+    read_at(f, o, &s_save_id, sizeof(s_save_id), "save id");
+    if (s_save_id.marker != XC_SAVE_ID_SAVE_ID ||
+        s_save_id.size != sizeof(s_save_id))
+        errx(1, "invalid save id in %s", file);
+    memcpy(id, s_save_id.id, sizeof(s_save_id.id));
+}
+
+static void
+copy_range(FILE *out, FILE *in, uint64_t offset, uint64_t size)
+{
+    static uint8_t buf[1 << 20];
+    size_t n;
+
+    if (fseeko(in, offset, SEEK_SET))
+        err(1, "fseeko(%"PRIu64")", offset);
+    while (size) {
+        n = size < sizeof(buf) ? size : sizeof(buf);
+        if (fread(buf, n, 1, in) != 1)
+            errx(1, "short read at %"PRIu64, offset);
+        write_out(out, buf, n);
+        size -= n;
+        offset += n;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    FILE *in, *out;
+    struct xc_save_generic s_generic;
+    struct xc_save_parent_files s_parent_files;
+    struct xc_save_parent_file s_parent_file;
+    struct xc_save_page_directory s_page_directory;
+    struct xc_save_index page_offsets_index = { 0, XC_SAVE_ID_PAGE_OFFSETS };
+    struct xc_save_index fingerprints_index = { 0, XC_SAVE_ID_FINGERPRINTS };
+    struct xc_save_index page_directory_index =
+        { 0, XC_SAVE_ID_PAGE_DIRECTORY };
+    struct xc_save_index save_id_index = { 0, XC_SAVE_ID_SAVE_ID };
+    struct xc_save_page_extent *extents, *e;
+    struct ancestor *ancestors;
+    uint32_t *pfn_entry, *ext_start, *ext_pfns;
+    uint64_t *pfn_off = NULL;
+    uint64_t parent_files_pos, dir_pos, pos, end_pos, o;
+    uint32_t pfns[MAX_BATCH_SIZE];
+    uint8_t save_id[16];
+    uint8_t *data, *pages, *section;
+    uint32_t i, x, a, n, k, page, files_nr;
+    int32_t marker, compress_size;
+    int total = 0, decompressed = 0;
+    cs16_t cs1;
+
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s <incremental.save> <out.save>\n",
+                argv[0]);
+        exit(1);
+    }
+
+    in = fopen(argv[1], "rb");
+    if (!in)
+        err(1, "fopen(%s)", argv[1]);
+
+    end_pos = find_index(in, XC_SAVE_ID_PARENT_FILES, &parent_files_pos);
+    if (!parent_files_pos)
+        errx(1, "%s is not an incremental save file", argv[1]);
+    find_index(in, XC_SAVE_ID_PAGE_DIRECTORY, &dir_pos);
+    if (!dir_pos)
+        errx(1, "%s has no page directory", argv[1]);
+
+    read_at(in, parent_files_pos, &s_parent_files, sizeof(s_parent_files),
+            "parent files");
+    files_nr = s_parent_files.files_nr;
+    if (s_parent_files.marker != XC_SAVE_ID_PARENT_FILES || !files_nr ||
+        files_nr > PAGE_EXTENT_ANCESTOR_MAX)
+        errx(1, "invalid parent files section");
+    ancestors = calloc(files_nr + 1, sizeof(ancestors[0]));
+    if (!ancestors)
+        err(1, "calloc");
+    for (a = 1; a <= files_nr; a++) {
+        if (fread(&s_parent_file, sizeof(s_parent_file), 1, in) != 1)
+            errx(1, "short read of parent file %d", a);
+        ancestors[a].file = calloc(1, s_parent_file.size + 1);
+        if (!ancestors[a].file)
+            err(1, "calloc");
+        if (s_parent_file.size &&
+            fread(ancestors[a].file, s_parent_file.size, 1, in) != 1)
+            errx(1, "short read of parent file %d", a);
+        ancestors[a].f = fopen(ancestors[a].file, "rb");
+        if (!ancestors[a].f)
+            err(1, "fopen(%s)", ancestors[a].file);
+        find_index(ancestors[a].f, XC_SAVE_ID_PAGE_DIRECTORY, &o);
+        read_save_id(ancestors[a].f, ancestors[a].file, save_id);
+        if (o != s_parent_file.page_directory_offset ||
+            memcmp(save_id, s_parent_file.save_id, sizeof(save_id)))
+            errx(1, "parent file %s changed", ancestors[a].file);
+    }
+
+    read_at(in, dir_pos, &s_page_directory, sizeof(s_page_directory),
+            "page directory");
+    if (s_page_directory.marker != XC_SAVE_ID_PAGE_DIRECTORY ||
+        s_page_directory.size != sizeof(s_page_directory) +
+        (uint64_t)s_page_directory.extents_nr * sizeof(extents[0]) +
+        (uint64_t)s_page_directory.pfn_nr * sizeof(pfn_entry[0]))
+        errx(1, "invalid page directory");
+    extents = malloc(s_page_directory.extents_nr * sizeof(extents[0]) + 1);
+    pfn_entry = malloc(s_page_directory.pfn_nr * sizeof(pfn_entry[0]) + 1);
+    ext_start = calloc(s_page_directory.extents_nr + 1, sizeof(ext_start[0]));
+    ext_pfns = malloc(s_page_directory.pfn_nr * sizeof(ext_pfns[0]) + 1);
+    data = malloc(MAX_BATCH_SIZE << PAGE_SHIFT);
+    pages = malloc(MAX_BATCH_SIZE << PAGE_SHIFT);
+    if (!extents || !pfn_entry || !ext_start || !ext_pfns || !data || !pages)
+        err(1, "malloc");
+    if (s_page_directory.extents_nr &&
+        fread(extents, s_page_directory.extents_nr * sizeof(extents[0]), 1,
+              in) != 1)
+        errx(1, "short read of page directory extents");
+    if (s_page_directory.pfn_nr &&
+        fread(pfn_entry, s_page_directory.pfn_nr * sizeof(pfn_entry[0]), 1,
+              in) != 1)
+        errx(1, "short read of page directory entries");
+
+    /* the pfns of each inherited extent, as in uxenvm_load_inherited */
+    for (i = 0; i < s_page_directory.pfn_nr; i++) {
+        if (pfn_entry[i] == PAGE_DIRECTORY_NONE)
+            continue;
+        x = page_directory_extent(pfn_entry[i]);
+        if (x >= s_page_directory.extents_nr)
+            errx(1, "invalid page directory entry %x", pfn_entry[i]);
+        if (page_extent_ancestor(extents[x].flags))
+            ext_start[x + 1]++;
+    }
+    for (x = 0; x < s_page_directory.extents_nr; x++)
+        ext_start[x + 1] += ext_start[x];
+    for (i = 0; i < s_page_directory.pfn_nr; i++) {
+        if (pfn_entry[i] == PAGE_DIRECTORY_NONE)
+            continue;
+        x = page_directory_extent(pfn_entry[i]);
+        if (page_extent_ancestor(extents[x].flags))
+            ext_pfns[ext_start[x]++] = i;
+    }
+
+    out = fopen(argv[2], "wb");
+    if (!out)
+        err(1, "fopen(%s)", argv[2]);
+
+    /* everything up to the parent files section is kept as is */
+    copy_range(out, in, 0, parent_files_pos);
+
+    /* page offsets of the inherited pages, patched into the page
+     * offsets section below */
+    pfn_off = calloc(s_page_directory.pfn_nr + 1, sizeof(pfn_off[0]));
+    if (!pfn_off)
+        err(1, "calloc");
+
+    for (x = 0, i = 0; x < s_page_directory.extents_nr; i = ext_start[x++]) {
+        if (i == ext_start[x])
+            continue;
+        e = &extents[x];
+        a = page_extent_ancestor(e->flags);
+        n = ext_start[x] - i;
+        if (a > files_nr || !e->nr_pages || e->nr_pages > MAX_BATCH_SIZE ||
+            n > e->nr_pages || e->size > e->nr_pages << PAGE_SHIFT ||
+            ((e->flags & PAGE_EXTENT_RAW) &&
+             e->size != e->nr_pages << PAGE_SHIFT))
+            errx(1, "invalid extent %d", x);
+        read_at(ancestors[a].f, e->offset, data, e->size, ancestors[a].file);
+        e->flags &= ~(PAGE_EXTENT_ANCESTOR_MAX << PAGE_EXTENT_ANCESTOR_SHIFT);
+
+        if (n == e->nr_pages) {
+            /* all pages of the extent are used, keep the extent data */
+            for (; i < ext_start[x]; i++) {
+                page = page_directory_page(pfn_entry[ext_pfns[i]]);
+                if (page >= n)
+                    errx(1, "invalid page %d of extent %d", page, x);
+                pfns[page] = unskip_pci_hole(ext_pfns[i]);
+            }
+            if (n == 1) {
+                /* single page batch, the extent data follows the size */
+                marker = 1 + 2 * MAX_BATCH_SIZE;
+                cs1 = e->size;
+                compress_size = sizeof(cs1) + cs1;
+                write_out(out, &marker, sizeof(marker));
+                write_out(out, pfns, sizeof(pfns[0]));
+                write_out(out, &compress_size, sizeof(compress_size));
+                pos = ftello(out);
+                write_out(out, &cs1, sizeof(cs1));
+                e->offset = pos + sizeof(cs1);
+                pfn_off[ext_pfns[i - 1]] = cs1 == PAGE_SIZE ? e->offset :
+                    pos + PAGE_OFFSET_INDEX_PFN_OFF_COMPRESSED;
+            } else if (!(e->flags & PAGE_EXTENT_RAW)) {
+                marker = n + MAX_BATCH_SIZE;
+                compress_size = e->size;
+                write_out(out, &marker, sizeof(marker));
+                write_out(out, pfns, n * sizeof(pfns[0]));
+                write_out(out, &compress_size, sizeof(compress_size));
+                e->offset = ftello(out);
+            } else {
+                marker = n;
+                write_out(out, &marker, sizeof(marker));
+                write_out(out, pfns, n * sizeof(pfns[0]));
+                e->offset = ftello(out);
+                for (k = 0; k < n; k++)
+                    pfn_off[ext_pfns[i - n + k]] = e->offset +
+                        (page_directory_page(pfn_entry[ext_pfns[i - n + k]]) <<
+                         PAGE_SHIFT);
+            }
+            write_out(out, data, e->size);
+            total += n;
+            continue;
+        }
+
+        /* only some pages of the extent are used, write them out raw */
+        if (e->flags & PAGE_EXTENT_RAW)
+            memcpy(pages, data, e->size);
+        else if (LZ4_decompress_safe((const char *)data, (char *)pages,
+                                     e->size, e->nr_pages << PAGE_SHIFT) !=
+                 e->nr_pages << PAGE_SHIFT)
+            errx(1, "decompression of extent %d of %s failed", x,
+                 ancestors[a].file);
+        for (k = 0; k < n; k++)
+            pfns[k] = unskip_pci_hole(ext_pfns[i + k]);
+        marker = n;
+        write_out(out, &marker, sizeof(marker));
+        write_out(out, pfns, n * sizeof(pfns[0]));
+        pos = ftello(out);
+        for (k = 0; i < ext_start[x]; i++, k++) {
+            page = page_directory_page(pfn_entry[ext_pfns[i]]);
+            if (page >= e->nr_pages)
+                errx(1, "invalid page %d of extent %d", page, x);
+            write_out(out, &pages[page << PAGE_SHIFT], PAGE_SIZE);
+            pfn_entry[ext_pfns[i]] = page_directory_entry(x, k);
+            pfn_off[ext_pfns[i]] = pos + (k << PAGE_SHIFT);
+        }
+        e->offset = pos;
+        e->size = n << PAGE_SHIFT;
+        e->nr_pages = n;
+        e->flags = PAGE_EXTENT_RAW;
+        total += n;
+        decompressed += n;
+    }
+
+    /* the sections following the parent files section, up to the end
+     * marker */
+    read_at(in, parent_files_pos, &s_generic, sizeof(s_generic),
+            "parent files");
+    for (o = parent_files_pos + s_generic.size; o < end_pos;
+         o += s_generic.size) {
+        read_at(in, o, &s_generic, sizeof(s_generic), "section");
+        if (s_generic.size < sizeof(s_generic) ||
+            o + s_generic.size > end_pos)
+            errx(1, "invalid section %d at %"PRIu64, s_generic.marker, o);
+        pos = ftello(out);
+        switch (s_generic.marker) {
+        case XC_SAVE_ID_PAGE_DIRECTORY:
+            page_directory_index.offset = pos;
+            write_out(out, &s_page_directory, sizeof(s_page_directory));
+            write_out(out, extents,
+                      s_page_directory.extents_nr * sizeof(extents[0]));
+            write_out(out, pfn_entry,
+                      s_page_directory.pfn_nr * sizeof(pfn_entry[0]));
+            continue;
+        case XC_SAVE_ID_PAGE_OFFSETS: {
+            struct xc_save_vm_page_offsets *s_vm_page_offsets;
+
+            page_offsets_index.offset = pos;
+            section = malloc(s_generic.size);
+            if (!section)
+                err(1, "malloc");
+            read_at(in, o, section, s_generic.size, "page offsets");
+            s_vm_page_offsets = (struct xc_save_vm_page_offsets *)section;
+            if (sizeof(*s_vm_page_offsets) +
+                (uint64_t)s_vm_page_offsets->pfn_off_nr *
+                sizeof(s_vm_page_offsets->pfn_off[0]) > s_generic.size)
+                errx(1, "invalid page offsets");
+            for (i = 0; i < s_vm_page_offsets->pfn_off_nr &&
+                     i < s_page_directory.pfn_nr; i++)
+                if (pfn_off[i])
+                    s_vm_page_offsets->pfn_off[i] = pfn_off[i];
+            write_out(out, section, s_generic.size);
+            free(section);
+            continue;
+        }
+        case XC_SAVE_ID_FINGERPRINTS:
+            /* the fingerprints only cover the pages of the save itself */
+            fingerprints_index.offset = pos;
+            break;
+        case XC_SAVE_ID_SAVE_ID:
+            /* kept, such that the output can be the base of incremental
+             * saves */
+            save_id_index.offset = pos;
+            break;
+        }
+        copy_range(out, in, o, s_generic.size);
+    }
+
+    /* 0: end marker */
+    marker = 0;
+    write_out(out, &marker, sizeof(marker));
+
+    /* indexes */
+    write_out(out, &page_offsets_index, sizeof(page_offsets_index));
+    if (fingerprints_index.offset)
+        write_out(out, &fingerprints_index, sizeof(fingerprints_index));
+    if (save_id_index.offset)
+        write_out(out, &save_id_index, sizeof(save_id_index));
+    /* footer: the page directory index is always the last entry */
+    write_out(out, &page_directory_index, sizeof(page_directory_index));
+
+    if (fclose(out))
+        err(1, "fclose(%s)", argv[2]);
+
+    printf("%s: %d pages from %d parent files, %d decompressed\n", argv[2],
+           total, files_nr, decompressed);
+
+    for (a = 1; a <= files_nr; a++) {
+        fclose(ancestors[a].f);
+        free(ancestors[a].file);
+    }
+    free(ancestors);
+    free(pfn_off);
+    free(pages);
+    free(data);
+    free(ext_pfns);
+    free(ext_start);
+    free(pfn_entry);
+    free(extents);
+    fclose(in);
+
+    return 0;
+}
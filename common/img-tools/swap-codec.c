@@ -0,0 +1,92 @@
+/*
+ * Copyright 2019, Bromium, Inc.
+ * SPDX-License-Identifier: ISC
+ *
+ * Set the block codec used for new writes to a swap disk, e.g. "lz4hc:9".
+ * "lz4dict" trains a compression dictionary on the disk first if needed.
+ * Optionally also set how many consecutive blocks get compressed together.
+ */
+
+#include <assert.h>
+#include <err.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libimg.h"
+
+#ifdef _WIN32
+#include "sys.h"
+DECLARE_PROGNAME;
+#endif
+
+int main(int argc, char **argv)
+{
+    BlockDriverState *bs;
+    int extent_blocks = -1;
+    int r;
+
+#ifdef _WIN32
+    setprogname(argv[0]);
+    reduce_io_priority();
+#endif
+
+    if (argc != 3 && argc != 4) {
+        fprintf(stderr, "Usage: %s <disk.swap> <lz4|lz4hc[:level]|lz4dict> "
+                "[extent-blocks]\n", argv[0]);
+        return -1;
+    }
+    char *disk;
+    if (strncmp(argv[1], "swap:", 5) != 0) {
+        disk = malloc(5 + strlen(argv[1]) + 1);
+        sprintf(disk, "swap:%s", argv[1]);
+    } else {
+        disk = argv[1];
+    }
+    if (argc == 4) {
+        extent_blocks = atoi(argv[3]);
+    }
+
+    ioh_init();
+    bh_init();
+    aio_init();
+    bdrv_init();
+    bs = bdrv_new("");
+
+    if (!bs) {
+        fprintf(stderr, "no bs\n");
+        return -1;
+    }
+
+    r = bdrv_open(bs, disk, BDRV_O_RDWR);
+    if (r < 0) {
+        fprintf(stderr, "%s: unable to open %s\n", argv[0], disk);
+        return r;
+    }
+
+    r = bdrv_ioctl(bs, 6, argv[2]);
+    if (r < 0) {
+        fprintf(stderr, "%s: unable to set codec %s for %s\n",
+                argv[0], argv[2], disk);
+    } else if (r > 0) {
+        /* Closing the disk waits for the training to finish. */
+        fprintf(stderr, "training dictionary...\n");
+        r = 0;
+    }
+    if (r == 0 && extent_blocks >= 0) {
+        r = bdrv_ioctl(bs, 7, &extent_blocks);
+        if (r < 0) {
+            fprintf(stderr, "%s: unable to set extent blocks %d for %s\n",
+                    argv[0], extent_blocks, disk);
+        }
+    }
+
+    bdrv_delete(bs);
+
+    if (r == 0) {
+        fprintf(stderr, "codec set to %s.\n", argv[2]);
+    }
+    return r;
+}
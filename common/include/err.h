@@ -108,6 +108,12 @@ setprogname(const char *name)
     _progname = name;
 #endif
 }
+#elif defined(__linux__)
+static inline const char *
+getprogname(void)
+{
+    return program_invocation_short_name;
+}
 #endif
 
 #ifndef _err_vprintf
@@ -140,7 +140,7 @@ unsigned int SPB;
 #endif
 
 /******VHD DEFINES******/
-#define VHD_CACHE_SIZE               32
+#define VHD_CACHE_SIZE               256
 
 #if 0
 #define VHD_REQS_DATA                TAPDISK_DATA_REQUESTS
@@ -757,7 +757,8 @@ _vhd_open(td_driver_t *driver, const char *name, td_flag_t flags)
 
 	/* pre-allocate for all but NFS and LVM storage */
 	if (driver->storage != TAPDISK_STORAGE_TYPE_NFS &&
-	    driver->storage != TAPDISK_STORAGE_TYPE_LVM)
+	    driver->storage != TAPDISK_STORAGE_TYPE_LVM &&
+	    !(flags & TD_OPEN_NO_PREALLOCATE))
 		vhd_flags |= VHD_FLAG_OPEN_PREALLOCATE;
 
 	return __vhd_open(driver, name, vhd_flags);
@@ -59,6 +59,16 @@ typedef off_t off64_t;
 #define PRIdS "zd"
 #define PRIuS "zu"
 #define lseek64 lseek
+#elif defined(__linux__)
+#include <libgen.h>
+#define O_BINARY 0
+#define FMT_SIZE "z"
+#define read_return_t ssize_t
+#define write_return_t ssize_t
+#define read_write_size_t size_t
+#define PRIx_rw_size "zx"
+#define PRIdS "zd"
+#define PRIuS "zu"
 #else
 #define PRIdS "zd"
 #define PRIuS "zu"
@@ -165,6 +175,8 @@ posix_memfree(void *ptr)
 #define __STR(...) #__VA_ARGS__
 #define STR(...) __STR(__VA_ARGS__)
 
+/* the posix versions from libgen.h on linux */
+#if !defined(__linux__)
 static inline char *
 basename(char *path)
 {
@@ -218,5 +230,6 @@ dirname(char *path)
     *r = 0;
     return path;
 }
+#endif  /* !__linux__ */
 
 #endif
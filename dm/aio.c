@@ -15,11 +15,16 @@
 #include <sys/types.h>
 #include <sys/event.h>
 #include <sys/time.h>
+#elif defined(__linux__)
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
 #endif
 
 #include "aio.h"
 #include "block.h"
 #include "block-int.h"
+#include "dm.h"
 #include "introspection.h"
 #include "ioh.h"
 #include "iovec.h"
@@ -27,6 +32,11 @@
 /* XXX per device */
 WaitObjects aio_wait_objects;
 
+#ifdef LIBIMG
+/* off unless turned on by the libimg user */
+uint64_t block_merge = 0;
+#endif
+
 void *
 aio_get(AIOPool *pool, BlockDriverState *bs,
         BlockDriverCompletionFunc *cb, void *opaque)
@@ -141,6 +151,53 @@ wait_for_objects(int timeout, WaitObjects *w)
             event->func(event->opaque);
     }
 }
+#elif defined(__linux__)
+static void
+wait_for_objects(int timeout, WaitObjects *w)
+{
+    ioh_event_queue events = TAILQ_HEAD_INITIALIZER(events);
+    ioh_event *event, *next;
+    struct epoll_event evs[64];
+    uint64_t count;
+    int num;
+    int ev;
+
+    do {
+        num = epoll_wait(w->queue_fd, evs, 64, timeout);
+        if (num == -1) {
+            if (errno == EINTR)
+                break;
+            err(1, "%s: epoll_wait failed", __FUNCTION__);
+        }
+
+        for (ev = 0; ev < num; ev++) {
+            if (evs[ev].data.u64 == IOH_EPOLL_INTERRUPT) {
+                if (read((int)w->interrupt, &count, sizeof(count)) == -1 &&
+                    errno != EAGAIN)
+                    err(1, "%s: read failed", __FUNCTION__);
+                continue;
+            }
+            if (evs[ev].data.u64 == IOH_EPOLL_TIMER ||
+                (evs[ev].data.u64 & IOH_EPOLL_FD))
+                continue;
+            event = (ioh_event *)(uintptr_t)evs[ev].data.u64;
+            if (event->processq)
+                TAILQ_REMOVE(event->processq, event, link);
+            event->processq = &events;
+            TAILQ_INSERT_TAIL(&events, event, link);
+        }
+
+        timeout = 0;
+    } while (num == 64);
+
+    TAILQ_FOREACH_SAFE(event, &events, link, next) {
+        TAILQ_REMOVE(&events, event, link);
+        event->processq = NULL;
+        ioh_event_reset(event);
+        if (event->func)
+            event->func(event->opaque);
+    }
+}
 #endif
 
 void
@@ -181,7 +238,7 @@ void aio_flush(void)
 {
     aio_wait_start();
     aio_poll();
-#if defined(__APPLE__)
+#if defined(__APPLE__) || defined(__linux__)
     while (aio_wait_objects.queue_len) {
 #else
     while (aio_wait_objects.num) {
@@ -191,6 +248,303 @@ void aio_flush(void)
     aio_wait_end();
 }
 
+/*
+ * Requests to guest devices are queued per BlockDriverState and handed
+ * to the driver from a bottom half, at the end of the main loop
+ * iteration in which they were submitted.  The queued requests are
+ * sorted by sector, and runs of contiguous requests in the same
+ * direction are merged into one driver request through a bounce buffer,
+ * whose result is split back to the original requests.  The order of
+ * overlapping requests submitted together is undefined, as it is for
+ * the drivers, which complete requests out of order.
+ */
+
+#define MERGE_MAX_SECTORS (1 << 11)  /* 1M */
+
+typedef struct MergeAIOCB {
+    BlockDriverAIOCB common;
+    int64_t sector_num;
+    int nb_sectors;
+    uint8_t *buf;
+    int is_write;
+    int cancelled;
+    uint64_t seq;
+    struct MergeGroup *group;
+    TAILQ_ENTRY(MergeAIOCB) link;
+} MergeAIOCB;
+
+typedef struct MergeGroup {
+    int64_t sector_num;
+    int nb_sectors;
+    int is_write;
+    int nr_reqs;
+    int refs;                   /* completion, and dispatch while in driver */
+    int done;
+    uint8_t *bounce;            /* NULL if not merged */
+    BlockDriverAIOCB *aiocb;
+    TAILQ_HEAD(, MergeAIOCB) reqs;
+} MergeGroup;
+
+struct BlockMerge {
+    BH *bh;
+    TAILQ_HEAD(, MergeAIOCB) pending;
+    int nr_pending;
+    uint64_t seq;
+};
+
+static void bdrv_merge_cancel(BlockDriverAIOCB *acb);
+
+static AIOPool bdrv_merge_aio_pool = {
+    .aiocb_size         = sizeof(MergeAIOCB),
+    .cancel             = bdrv_merge_cancel,
+};
+
+static void
+bdrv_merge_group_put(MergeGroup *g)
+{
+
+    if (--g->refs)
+        return;
+    align_free(g->bounce);
+    free(g);
+}
+
+static void
+bdrv_merge_group_cb(void *opaque, int ret)
+{
+    MergeGroup *g = opaque;
+    MergeAIOCB *acb, *next;
+
+    TAILQ_FOREACH_SAFE(acb, &g->reqs, link, next) {
+        TAILQ_REMOVE(&g->reqs, acb, link);
+        if (!acb->cancelled) {
+            if (g->bounce && !g->is_write && !ret)
+                memcpy(acb->buf, g->bounce + ((acb->sector_num -
+                                               g->sector_num) <<
+                                              BDRV_SECTOR_BITS),
+                       acb->nb_sectors << BDRV_SECTOR_BITS);
+            acb->common.cb(acb->common.opaque, ret);
+        }
+        aio_release(acb);
+    }
+    g->done = 1;
+    bdrv_merge_group_put(g);
+}
+
+static void
+bdrv_merge_dispatch_group(BlockDriverState *bs, MergeGroup *g)
+{
+    BlockDriver *drv = bs->drv;
+    MergeAIOCB *acb;
+    uint8_t *buf = TAILQ_FIRST(&g->reqs)->buf;
+
+    if (g->nr_reqs > 1) {
+        g->bounce = bdrv_blockalign(bs, g->nb_sectors << BDRV_SECTOR_BITS);
+        if (!g->bounce)
+            goto fail;
+        buf = g->bounce;
+        if (g->is_write)
+            TAILQ_FOREACH(acb, &g->reqs, link)
+                memcpy(g->bounce + ((acb->sector_num - g->sector_num) <<
+                                    BDRV_SECTOR_BITS),
+                       acb->buf, acb->nb_sectors << BDRV_SECTOR_BITS);
+    }
+
+    if (!drv)
+        goto fail;
+    /* drivers may complete the request before returning, which must not
+     * free the group underneath us */
+    g->refs++;
+    g->aiocb = g->is_write ?
+        drv->bdrv_aio_write(bs, g->sector_num, buf, g->nb_sectors,
+                            bdrv_merge_group_cb, g) :
+        drv->bdrv_aio_read(bs, g->sector_num, buf, g->nb_sectors,
+                           bdrv_merge_group_cb, g);
+    if (!g->aiocb && !g->done)
+        bdrv_merge_group_cb(g, -EIO);
+    bdrv_merge_group_put(g);
+    return;
+
+  fail:
+    bdrv_merge_group_cb(g, -EIO);
+}
+
+static int
+bdrv_merge_compare(const void *a, const void *b)
+{
+    const MergeAIOCB *x = *(const MergeAIOCB **)a;
+    const MergeAIOCB *y = *(const MergeAIOCB **)b;
+
+    if (x->sector_num != y->sector_num)
+        return x->sector_num < y->sector_num ? -1 : 1;
+    return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+void
+bdrv_merge_dispatch(BlockDriverState *bs)
+{
+    struct BlockMerge *m = bs->merge;
+    MergeAIOCB **reqs, *acb;
+    MergeGroup *g = NULL;
+    int i, n;
+
+    if (!m || !m->nr_pending)
+        return;
+
+    bh_cancel(m->bh);
+
+    n = m->nr_pending;
+    reqs = malloc(n * sizeof(reqs[0]));
+    if (!reqs) {
+        /* dispatch in submission order, unmerged */
+        while ((acb = TAILQ_FIRST(&m->pending))) {
+            TAILQ_REMOVE(&m->pending, acb, link);
+            m->nr_pending--;
+            g = calloc(1, sizeof(*g));
+            if (!g) {
+                acb->common.cb(acb->common.opaque, -ENOMEM);
+                aio_release(acb);
+                continue;
+            }
+            TAILQ_INIT(&g->reqs);
+            g->sector_num = acb->sector_num;
+            g->nb_sectors = acb->nb_sectors;
+            g->is_write = acb->is_write;
+            g->nr_reqs = 1;
+            g->refs = 1;
+            acb->group = g;
+            TAILQ_INSERT_TAIL(&g->reqs, acb, link);
+            bdrv_merge_dispatch_group(bs, g);
+        }
+        return;
+    }
+
+    i = 0;
+    while ((acb = TAILQ_FIRST(&m->pending))) {
+        TAILQ_REMOVE(&m->pending, acb, link);
+        reqs[i++] = acb;
+    }
+    m->nr_pending = 0;
+
+    qsort(reqs, n, sizeof(reqs[0]), bdrv_merge_compare);
+
+    for (i = 0; i < n; i++) {
+        acb = reqs[i];
+        if (g && acb->is_write == g->is_write &&
+            acb->sector_num == g->sector_num + g->nb_sectors &&
+            g->nb_sectors + acb->nb_sectors <= MERGE_MAX_SECTORS) {
+            g->nb_sectors += acb->nb_sectors;
+            g->nr_reqs++;
+            acb->group = g;
+            TAILQ_INSERT_TAIL(&g->reqs, acb, link);
+            bs->nr_merged[acb->is_write ? BDRV_ACCT_WRITE :
+                          BDRV_ACCT_READ]++;
+            continue;
+        }
+        if (g)
+            bdrv_merge_dispatch_group(bs, g);
+        g = calloc(1, sizeof(*g));
+        if (!g) {
+            acb->common.cb(acb->common.opaque, -ENOMEM);
+            aio_release(acb);
+            continue;
+        }
+        TAILQ_INIT(&g->reqs);
+        g->sector_num = acb->sector_num;
+        g->nb_sectors = acb->nb_sectors;
+        g->is_write = acb->is_write;
+        g->nr_reqs = 1;
+        g->refs = 1;
+        acb->group = g;
+        TAILQ_INSERT_TAIL(&g->reqs, acb, link);
+    }
+    if (g)
+        bdrv_merge_dispatch_group(bs, g);
+
+    free(reqs);
+}
+
+static void
+bdrv_merge_bh(void *opaque)
+{
+    BlockDriverState *bs = opaque;
+
+    bdrv_merge_dispatch(bs);
+}
+
+static BlockDriverAIOCB *
+bdrv_merge_queue(BlockDriverState *bs, int64_t sector_num, uint8_t *buf,
+                 int nb_sectors, BlockDriverCompletionFunc *cb, void *opaque,
+                 int is_write)
+{
+    struct BlockMerge *m = bs->merge;
+    MergeAIOCB *acb;
+
+    if (!m) {
+        m = calloc(1, sizeof(*m));
+        if (!m)
+            return NULL;
+        m->bh = bh_new(bdrv_merge_bh, bs);
+        TAILQ_INIT(&m->pending);
+        bs->merge = m;
+    }
+
+    acb = aio_get(&bdrv_merge_aio_pool, bs, cb, opaque);
+    acb->sector_num = sector_num;
+    acb->nb_sectors = nb_sectors;
+    acb->buf = buf;
+    acb->is_write = is_write;
+    acb->cancelled = 0;
+    acb->seq = m->seq++;
+    acb->group = NULL;
+    TAILQ_INSERT_TAIL(&m->pending, acb, link);
+    m->nr_pending++;
+
+    bh_schedule(m->bh);
+
+    return &acb->common;
+}
+
+static void
+bdrv_merge_cancel(BlockDriverAIOCB *_acb)
+{
+    MergeAIOCB *acb = container_of(_acb, MergeAIOCB, common);
+    struct BlockMerge *m = acb->common.bs->merge;
+    MergeGroup *g = acb->group;
+
+    if (!g) {
+        TAILQ_REMOVE(&m->pending, acb, link);
+        m->nr_pending--;
+        aio_release(acb);
+        return;
+    }
+
+    /* a request which wasn't merged is cancelled in the driver, the
+     * other requests of a merged one only don't see its completion */
+    if (!g->bounce) {
+        bdrv_aio_cancel(g->aiocb);
+        TAILQ_REMOVE(&g->reqs, acb, link);
+        aio_release(acb);
+        bdrv_merge_group_put(g);
+        return;
+    }
+    acb->cancelled = 1;
+}
+
+void
+bdrv_merge_close(BlockDriverState *bs)
+{
+    struct BlockMerge *m = bs->merge;
+
+    if (!m)
+        return;
+
+    bdrv_merge_dispatch(bs);
+    bh_delete(m->bh);
+    free(m);
+    bs->merge = NULL;
+}
+
 BlockDriverAIOCB *
 bdrv_aio_read(BlockDriverState *bs, int64_t sector_num,
               uint8_t *buf, int nb_sectors,
@@ -204,7 +558,12 @@ bdrv_aio_read(BlockDriverState *bs, int64_t sector_num,
     if (bdrv_check_request(bs, sector_num, nb_sectors))
         return NULL;
 
-    ret = drv->bdrv_aio_read(bs, sector_num, buf, nb_sectors, cb, opaque);
+    if (block_merge && bs->device_name[0])
+        ret = bdrv_merge_queue(bs, sector_num, buf, nb_sectors, cb, opaque,
+                               0);
+    else
+        ret = drv->bdrv_aio_read(bs, sector_num, buf, nb_sectors, cb,
+                                 opaque);
 
     if (ret) {
 	/* Update stats even though technically transfer has not happened. */
@@ -235,7 +594,12 @@ bdrv_aio_write(BlockDriverState *bs, int64_t sector_num,
         lava_check_mbr_vbr_write(sector_num);
 #endif
 
-    ret = drv->bdrv_aio_write(bs, sector_num, buf, nb_sectors, cb, opaque);
+    if (block_merge && bs->device_name[0])
+        ret = bdrv_merge_queue(bs, sector_num, (uint8_t *)buf, nb_sectors,
+                               cb, opaque, 1);
+    else
+        ret = drv->bdrv_aio_write(bs, sector_num, buf, nb_sectors, cb,
+                                  opaque);
 
     if (ret) {
 	/* Update stats even though technically transfer has not happened. */
@@ -262,6 +626,9 @@ bdrv_aio_flush(BlockDriverState *bs, BlockDriverCompletionFunc *cb,
     if (!drv)
         return NULL;
 
+    /* the flush covers the queued writes */
+    bdrv_merge_dispatch(bs);
+
     return drv->bdrv_aio_flush(bs, cb, opaque);
 }
 
@@ -24,6 +24,9 @@ bdrv_aio_write(BlockDriverState *bs, int64_t sector_num,
                const uint8_t *buf, int nb_sectors,
                BlockDriverCompletionFunc *cb, void *opaque);
 
+void bdrv_merge_dispatch(BlockDriverState *bs);
+void bdrv_merge_close(BlockDriverState *bs);
+
 void aio_setup_em(BlockDriver *bdrv);
 
 void aio_init(void);
@@ -126,8 +126,12 @@ struct BlockDriverState {
     uint64_t nr_bytes[BDRV_MAX_IOTYPE];
     uint64_t nr_ops[BDRV_MAX_IOTYPE];
     uint64_t total_time_ns[BDRV_MAX_IOTYPE];
+    uint64_t nr_merged[BDRV_MAX_IOTYPE]; /* ops merged into a preceding one */
     uint64_t wr_highest_sector;
 
+    /* requests queued for merging, see aio.c */
+    struct BlockMerge *merge;
+
     /* Whether the disk can expand beyond total_sectors */
     int growable;
 
@@ -40,9 +40,11 @@
 #include "block-swap/dubtree.h"
 #include "block-swap/hashtable.h"
 #include "block-swap/lrucache.h"
+#include "block-swap/sharedcache.h"
 #include "block-swap/swapfmt.h"
 
 #include <lz4.h>
+#include <lz4hc.h>
 
 #include "uuidgen.h"
 
@@ -83,12 +85,76 @@ extern HRESULT WINAPI FilterConnectCommunicationPort(
 #define WRITE_BLOCK_THR_BYTES (WRITE_RATELIMIT_THR_BYTES * 2)
 #define WRITE_RATELIMIT_GAP_MS 10
 
-#define SWAP_SIZE_SHIFT (51ULL)
+/* Block codecs, selected per image with a codec= line in the swap header.
+ * They all produce LZ4 blocks, so an image can read blocks written by its
+ * fallbacks whatever codec these were using, as long as the dictionary of the
+ * image chain is loaded whenever there is one. */
+enum {
+    SWAP_CODEC_LZ4 = 0,
+    SWAP_CODEC_LZ4HC = 1,
+    SWAP_CODEC_LZ4DICT = 2,
+};
+
+#define SWAP_CODEC_LZ4HC_MAX_LEVEL 16
+
+/* Required in the dubtree once blocks compressed against the dictionary may
+ * have been written, after which the image chain can't be read without it. */
+#define SWAP_FEATURE_DICT (1U << DUBTREE_FEATURE_USER_SHIFT)
+#define SWAP_FEATURES SWAP_FEATURE_DICT /* The ones we know of. */
+
+#define SWAP_DICT_NAME "codec.dict"
+#define SWAP_DICT_SIZE (64 << 10) /* LZ4 looks back at most 64kiB. */
+#define SWAP_DICT_SEGMENT 32
+#define SWAP_DICT_RUNS 256 /* Number of places to sample the image at. */
+#define SWAP_DICT_RUN_BLOCKS 16
+
+/* Runs of up to extent_blocks consecutive blocks, as set with an
+ * extent-blocks= line in the swap header, are compressed together into a
+ * single value shared by all of their keys. Extents are always larger than a
+ * block, which is how we tell them from single-block values. */
+#define SWAP_EXTENT_MAX_BLOCKS 16
+#define SWAP_EXTENT_CACHE_LINES 4 /* Number of decompressed extents kept. */
+
+typedef struct SwapExtent {
+    uint64_t hash; /* Of the compressed data, to tell extents apart. */
+    uint64_t start; /* First block in the extent. */
+    uint32_t num_blocks;
+} __attribute__((__packed__)) SwapExtent;
+
+/* The hash is over compressed data the guest controls, so a line only
+ * matches an extent with the same compressed bytes, kept in value. */
+typedef struct SwapExtentCacheLine {
+    uint64_t hash;
+    uint64_t start;
+    uint8_t *data;
+    uint8_t *value;
+    size_t size;
+} SwapExtentCacheLine;
+
+/* Number of dubtree_insert() latency samples kept for percentiles. */
+#define SWAP_INSERT_LATENCY_SAMPLES 4096
+
+#define SWAP_SIZE_SHIFT (48ULL) /* Leaves room for extent sizes. */
 #define SWAP_SIZE_MASK (((1ULL<<(64-SWAP_SIZE_SHIFT))-1) << SWAP_SIZE_SHIFT)
+/* Tags the busy entry of a zero block, which points at the compressed buffer
+ * of its insert instead of at a value. Buffers are aligned. */
+#define SWAP_ZERO_TAG 1
+
+#ifdef _WIN32
+#define SWAP_SHARED_CACHE_NAME "uxen-swap-cache"
+#else
+#define SWAP_SHARED_CACHE_NAME "/uxen-swap-cache"
+#endif
 
 uint64_t log_swap_fills = 0;
+uint64_t swap_chunk_cache_lines = 0;
+uint64_t swap_shared_cache_mb = 0;
 static int swap_backend_active = 0;
 
+/* Decompressed fallback blocks, shared with the user's other dm instances. */
+static SharedCache *swap_shared_cache = NULL;
+static int swap_shared_cache_users = 0;
+
 #if !defined(LIBIMG) && defined(CONFIG_DUMP_SWAP_STAT)
   #define SWAP_STATS
 #endif
@@ -280,6 +346,32 @@ typedef struct BDRVSwapState {
 
     int log_swap_fills;
     int store_uncompressed;
+    int shared_cache;
+
+    int codec;
+    int codec_level;
+    char *dict;
+    int dict_size;
+    LZ4_stream_t *dict_stream; /* Compression state with dict loaded. */
+    LZ4_stream_t *stream; /* Scratch copy of dict_stream. */
+    uxen_thread dict_thread;
+    int dict_thread_started;
+    volatile int dict_training;
+
+    int extent_blocks;
+    uint64_t compaction_budget; /* Bytes/s, 0 means unlimited. */
+    SwapExtentCacheLine extent_cache[SWAP_EXTENT_CACHE_LINES];
+    int extent_cache_hand;
+    uint64_t extent_hits;
+    uint64_t extent_misses;
+
+    uint64_t zero_blocks; /* Written as zero marks, taking no space. */
+    uint64_t dup_blocks; /* Written as a reference to an equal block. */
+
+    TAILQ_ENTRY(BDRVSwapState) swap_entry; /* For dump_swapstat(). */
+
+    uint32_t insert_latency[SWAP_INSERT_LATENCY_SAMPLES]; /* In us. */
+    uint32_t num_insert_latency;
 
 #ifdef _WIN32
     HANDLE heap;
@@ -290,6 +382,9 @@ typedef struct BDRVSwapState {
 } BDRVSwapState;
 
 
+static TAILQ_HEAD(, BDRVSwapState) swap_states =
+    TAILQ_HEAD_INITIALIZER(swap_states);
+
 #ifdef SWAP_STATS
 struct {
     uint64_t blocked_time;
@@ -310,6 +405,7 @@ typedef struct SwapAIOCB {
     uint32_t modulo;
     uint8_t *decomp;
     uint32_t *sizes;
+    DubTreeOrigin *origins;
     uint8_t *map;
     size_t orig_size;
     ioh_event event;
@@ -331,24 +427,64 @@ static DWORD WINAPI swap_read_thread(void *_s);
 #else
 static void *swap_read_thread(void *_s);
 #endif
+static int swap_shared_lookup(void *opaque, int idx,
+                              const DubTreeOrigin *origin);
 
 /* Wrappers for compress and expand functions. */
 
+static inline uint64_t swap_hash(const uint8_t *p, size_t len)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    size_t i;
+    for (i = 0; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t)) {
+        uint64_t w;
+        memcpy(&w, p + i, sizeof(w));
+        h = (h ^ w) * 0x100000001b3ULL;
+        h ^= h >> 29;
+    }
+    for (; i < len; ++i) {
+        h = (h ^ p[i]) * 0x100000001b3ULL;
+    }
+    return h;
+}
+
+/* Compress size bytes with the codec of the image, returning 0 if the result
+ * would be larger than max. */
+static inline int swap_compress(BDRVSwapState *s, void *out, const void *in,
+                                int size, int max)
+{
+    switch (s->codec) {
+    case SWAP_CODEC_LZ4HC:
+        return LZ4_compressHC2_limitedOutput((const char*)in, (char*) out,
+                                             size, max, s->codec_level);
+    case SWAP_CODEC_LZ4DICT:
+        /* Restart from the freshly loaded dictionary every time, as values
+         * must decompress independently. */
+        memcpy(s->stream, s->dict_stream, sizeof(*s->stream));
+        return LZ4_compress_limitedOutput_continue(s->stream,
+                                                   (const char*)in,
+                                                   (char*) out, size, max);
+    default:
+        return LZ4_compress_limitedOutput((const char*)in, (char*) out, size,
+                                          max);
+    }
+}
+
 static inline
-size_t swap_set_key(void *out, const void *in)
+size_t swap_set_key(BDRVSwapState *s, void *out, const void *in)
 {
-    /* Caller has allocated ample space for compression overhead, so we don't
-     * worry about about running out of space. However, there is no point in
-     * storing more than DUBTREE_BLOCK_SIZE bytes, so if we exceed that we
-     * revert to a straight memcpy(). When uncompressing we treat DUBTREE_BLOCK_SIZE'd
-     * keys as special, and use memcpy() there as well. */
+    /* There is no point in storing more than DUBTREE_BLOCK_SIZE bytes, so if
+     * compression does not get us below that we revert to a straight
+     * memcpy(). When uncompressing we treat DUBTREE_BLOCK_SIZE'd keys as
+     * special, and use memcpy() there as well. */
 
 #ifdef SWAP_STATS
     swap_stats.compressed += DUBTREE_BLOCK_SIZE;
 #endif
 
-    size_t sz = LZ4_compress((const char*)in, (char*) out, DUBTREE_BLOCK_SIZE);
-    if (sz >= DUBTREE_BLOCK_SIZE) {
+    size_t sz = swap_compress(s, out, in, DUBTREE_BLOCK_SIZE,
+                              DUBTREE_BLOCK_SIZE - 1);
+    if (sz == 0) {
         memcpy(out, in, DUBTREE_BLOCK_SIZE);
         sz = DUBTREE_BLOCK_SIZE;
     }
@@ -356,7 +492,50 @@ size_t swap_set_key(void *out, const void *in)
     return sz;
 }
 
-static inline int swap_get_key(void *out, const void *in, size_t sz)
+static inline int swap_is_zero_block(const void *p)
+{
+    const uint64_t *q = p;
+    int i;
+
+    for (i = 0; i < DUBTREE_BLOCK_SIZE / sizeof(q[0]); ++i) {
+        if (q[i]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Compress the n blocks starting at block start into one extent value, and
+ * return its size, or 0 if the blocks are better off compressed one by
+ * one. */
+static inline
+size_t swap_set_extent(BDRVSwapState *s, void *out, const void *in,
+                       uint64_t start, int n)
+{
+    SwapExtent *x = out;
+    int max = n * DUBTREE_BLOCK_SIZE - 1;
+    int sz;
+
+    if (max > DUBTREE_MAX_VALUE_SIZE) {
+        max = DUBTREE_MAX_VALUE_SIZE;
+    }
+    sz = swap_compress(s, x + 1, in, n * DUBTREE_BLOCK_SIZE,
+                       max - sizeof(*x));
+    if (!sz || sizeof(*x) + sz <= DUBTREE_BLOCK_SIZE) {
+        return 0;
+    }
+
+#ifdef SWAP_STATS
+    swap_stats.compressed += n * DUBTREE_BLOCK_SIZE;
+#endif
+    x->hash = swap_hash((const uint8_t *) (x + 1), sz);
+    x->start = start;
+    x->num_blocks = n;
+    return sizeof(*x) + sz;
+}
+
+static inline int swap_get_key(BDRVSwapState *s, void *out, const void *in,
+                               size_t sz)
 {
 #ifdef SWAP_STATS
     swap_stats.decompressed += DUBTREE_BLOCK_SIZE;
@@ -365,8 +544,13 @@ static inline int swap_get_key(void *out, const void *in, size_t sz)
     if (sz == DUBTREE_BLOCK_SIZE) {
         memcpy(out, in, DUBTREE_BLOCK_SIZE);
     } else {
-        int unsz = LZ4_decompress_safe((const char*)in, (char*)out,
-                sz, DUBTREE_BLOCK_SIZE);
+        /* Blocks compressed without the dictionary never refer back past
+         * their own start, so always supplying it is harmless. */
+        int unsz = s->dict ?
+            LZ4_decompress_safe_usingDict((const char*)in, (char*)out,
+                    sz, DUBTREE_BLOCK_SIZE, s->dict, s->dict_size) :
+            LZ4_decompress_safe((const char*)in, (char*)out,
+                    sz, DUBTREE_BLOCK_SIZE);
         if (unsz != DUBTREE_BLOCK_SIZE) {
 #ifndef __APPLE__
             /* On OSX we don't like unclean exists, but on Windows our guest
@@ -381,6 +565,86 @@ static inline int swap_get_key(void *out, const void *in, size_t sz)
     return 0;
 }
 
+/* Decompress an extent into the extent cache, unless it is there already, and
+ * return the cached copy. Called with the swap lock held. */
+static const uint8_t *swap_get_extent(BDRVSwapState *s, const SwapExtent *x,
+                                      size_t sz)
+{
+    SwapExtentCacheLine *cl;
+    int unsz;
+    int i;
+
+    for (i = 0; i < SWAP_EXTENT_CACHE_LINES; ++i) {
+        cl = &s->extent_cache[i];
+        if (cl->data && cl->hash == x->hash && cl->start == x->start &&
+                cl->size == sz && !memcmp(cl->value, x, sz)) {
+            ++(s->extent_hits);
+            return cl->data;
+        }
+    }
+    ++(s->extent_misses);
+
+    cl = &s->extent_cache[s->extent_cache_hand];
+    s->extent_cache_hand = (s->extent_cache_hand + 1) %
+        SWAP_EXTENT_CACHE_LINES;
+    if (!cl->data) {
+        cl->data = malloc(SWAP_EXTENT_MAX_BLOCKS * DUBTREE_BLOCK_SIZE);
+        cl->value = malloc(DUBTREE_MAX_VALUE_SIZE);
+        if (!cl->data || !cl->value) {
+            errx(1, "OOM error %s line %d", __FUNCTION__, __LINE__);
+        }
+    }
+    cl->size = 0;
+#ifdef SWAP_STATS
+    swap_stats.decompressed += x->num_blocks * DUBTREE_BLOCK_SIZE;
+#endif
+    unsz = s->dict ?
+        LZ4_decompress_safe_usingDict((const char*)(x + 1), (char*)cl->data,
+                sz - sizeof(*x), x->num_blocks * DUBTREE_BLOCK_SIZE, s->dict,
+                s->dict_size) :
+        LZ4_decompress_safe((const char*)(x + 1), (char*)cl->data,
+                sz - sizeof(*x), x->num_blocks * DUBTREE_BLOCK_SIZE);
+    if (unsz != x->num_blocks * DUBTREE_BLOCK_SIZE) {
+        cl->hash = cl->start = 0;
+        return NULL;
+    }
+    cl->hash = x->hash;
+    cl->start = x->start;
+    memcpy(cl->value, x, sz);
+    cl->size = sz;
+    return cl->data;
+}
+
+/* Expand the block with the given key out of a value, which may be an extent
+ * covering it. Called with the swap lock held. */
+static inline int swap_get_block(BDRVSwapState *s, void *out, uint64_t key,
+                                 const void *in, size_t sz)
+{
+    const SwapExtent *x = in;
+    const uint8_t *data = NULL;
+
+    if (sz <= DUBTREE_BLOCK_SIZE) {
+        return swap_get_key(s, out, in, sz);
+    }
+
+    if (sz <= DUBTREE_MAX_VALUE_SIZE &&
+            x->num_blocks >= 2 && x->num_blocks <= SWAP_EXTENT_MAX_BLOCKS &&
+            x->start <= key && key < x->start + x->num_blocks) {
+        data = swap_get_extent(s, x, sz);
+    }
+    if (!data) {
+#ifndef __APPLE__
+        errx(1, "swap: bad extent for block %"PRIx64, key);
+#else
+        warnx("swap: bad extent for block %"PRIx64, key);
+#endif
+        return -1;
+    }
+    memcpy(out, data + (key - x->start) * DUBTREE_BLOCK_SIZE,
+           DUBTREE_BLOCK_SIZE);
+    return 0;
+}
+
 static inline void swap_lock(BDRVSwapState *s)
 {
     critical_section_enter(&s->mutex);
@@ -520,18 +784,23 @@ swap_insert_thread(void * _s)
         int n = c->n;
         int i;
         uint32_t load;
+        int64_t t0 = os_get_clock();
 
         r = dubtree_insert(&s->t, n, keys, cbuf, c->sizes, 0);
         free(c->sizes);
 
         swap_lock(s);
+        s->insert_latency[s->num_insert_latency++ %
+                          SWAP_INSERT_LATENCY_SAMPLES] =
+            (os_get_clock() - t0) / SCALE_US;
         for (i = 0; i < n; ++i) {
             HashEntry *e;
             e = hashtable_find_entry(&s->busy_blocks, keys[i]);
             assert(e);
             uint8_t *ptr = (uint8_t *) (uintptr_t) (e->value & ~SWAP_SIZE_MASK);
 
-            if (cbuf <= ptr && ptr < cbuf + c->total_size) {
+            if ((cbuf <= ptr && ptr < cbuf + c->total_size) ||
+                    ptr == cbuf + SWAP_ZERO_TAG) {
                 hashtable_delete_entry(&s->busy_blocks, e);
             }
         }
@@ -569,6 +838,34 @@ static inline int is_ratelimited_soft(BDRVSwapState *s)
     return (buffered_size(s) > WRITE_RATELIMIT_THR_BYTES);
 }
 
+static void swap_queue_insert(BDRVSwapState *s, int n, uint8_t *cbuf,
+                              uint64_t *keys, uint32_t *sizes,
+                              size_t total_size)
+{
+    struct insert_context *c = malloc(sizeof(*c));
+    if (!c) {
+        errx(1, "OOM error %s line %d", __FUNCTION__, __LINE__);
+    }
+    c->n = n;
+    c->s = s;
+    c->cbuf = cbuf;
+    c->keys = keys;
+    c->sizes = sizes;
+    c->total_size = total_size;
+
+    swap_wait_can_insert(s);
+    s->insert_context = c;
+    swap_signal_insert(s);
+}
+
+static inline int swap_extent_blocks(BDRVSwapState *s)
+{
+    if (s->store_uncompressed || s->extent_blocks < 2) {
+        return 1;
+    }
+    return s->extent_blocks;
+}
+
 #ifdef _WIN32
 static DWORD WINAPI
 #else
@@ -581,10 +878,41 @@ swap_write_thread(void *_s)
     uint8_t *cbuf = NULL;
     uint64_t *keys = NULL;
     uint32_t *sizes = NULL;
+    uint32_t *offsets = NULL; /* Where in cbuf each value is. */
     uint32_t total_size = 0;
     int max = 0;
     int n = 0;
 
+    /* Run of consecutive blocks waiting to be compressed together. */
+    void *run[SWAP_EXTENT_MAX_BLOCKS];
+    uint64_t run_values[SWAP_EXTENT_MAX_BLOCKS];
+    uint64_t run_start = 0;
+    int run_len = 0;
+    uint8_t *extent;
+
+    /* The last block queued for insert, if it has a single-block value. A
+     * block equal to the one before it shares its value, which the dubtree
+     * stores only once. */
+    uint8_t *prev;
+    uint8_t *prev_value = NULL;
+    uint32_t prev_size = 0;
+    int have_prev = 0;
+
+    /* Single-block values of this insert by the hash of their block, so
+     * that equal blocks anywhere in it share a value. Values are only ever
+     * shared within the chunk they are written to, so the index does not
+     * reach back past the current insert. */
+    HashTable dups;
+    uint8_t *dup;
+
+    extent = malloc(SWAP_EXTENT_MAX_BLOCKS * DUBTREE_BLOCK_SIZE);
+    prev = malloc(DUBTREE_BLOCK_SIZE);
+    dup = malloc(DUBTREE_BLOCK_SIZE);
+    if (!extent || !prev || !dup) {
+        errx(1, "OOM error %s line %d", __FUNCTION__, __LINE__);
+    }
+    hashtable_init(&dups, NULL, NULL);
+
     swap_signal_can_write(s);
 
     for (;;) {
@@ -598,9 +926,10 @@ swap_write_thread(void *_s)
         void *ptr = NULL;
         int quit;
         uint32_t size;
+        int i;
 
         swap_lock(s);
-        if (n == 0 && pq_empty(pq1) && pq_empty(pq2)) {
+        if (n == 0 && run_len == 0 && pq_empty(pq1) && pq_empty(pq2)) {
 wait:
             quit = s->quit;
             swap_unlock(s);
@@ -642,73 +971,174 @@ wait:
 
         swap_unlock(s);
 
-        if (flush || total_size + 2 * SWAP_SECTOR_SIZE > max_sz) {
+        /* Compress the pending run once the new block cannot extend it. The
+         * same block may show up again, as the skip check above only works
+         * for duplicates already queued, not ones that could arrive when not
+         * holding lock. We just replace it then. */
+        if (run_len && (!ptr || (key != run_start + run_len - 1 &&
+                        (key != run_start + run_len ||
+                         run_len == swap_extent_blocks(s))))) {
+
+            uint8_t *values[SWAP_EXTENT_MAX_BLOCKS];
+            uint32_t value_sizes[SWAP_EXTENT_MAX_BLOCKS];
+
+            if (total_size + (run_len + 1) * SWAP_SECTOR_SIZE > max_sz) {
+                swap_queue_insert(s, n, cbuf, keys, sizes, total_size);
+                cbuf = NULL;
+                keys = NULL;
+                sizes = NULL;
+                max = n = 0;
+                total_size = 0;
+                have_prev = 0;
+                hashtable_clear(&dups);
+            }
+
+            if (!cbuf) {
+                cbuf = swap_malloc(s, max_sz);
+            }
+
+            if (n + run_len > max) {
+                while (n + run_len > max) {
+                    max = max ? 2 * max : SWAP_EXTENT_MAX_BLOCKS;
+                }
+                keys = realloc(keys, sizeof(keys[0]) * max);
+                sizes = realloc(sizes, sizeof(sizes[0]) * max);
+                offsets = realloc(offsets, sizeof(offsets[0]) * max);
+                if (!keys || !sizes || !offsets) {
+                    errx(1, "OOM error %s line %d", __FUNCTION__, __LINE__);
+                }
+            }
+
+            /* A run of zero blocks is not worth an extent. */
+            for (i = 0; i < run_len && swap_is_zero_block(run[i]); ++i);
+
+            size = 0;
+            if (run_len > 1 && i < run_len) {
+                for (i = 0; i < run_len; ++i) {
+                    memcpy(extent + i * DUBTREE_BLOCK_SIZE, run[i],
+                           DUBTREE_BLOCK_SIZE);
+                }
+                size = swap_set_extent(s, cbuf + total_size, extent,
+                                       run_start, run_len);
+            }
+
+            for (i = 0; i < run_len; ++i) {
+                keys[n + i] = run_start + i;
+                if (size) {
+                    /* All blocks share the extent. */
+                    values[i] = cbuf + total_size;
+                    value_sizes[i] = size;
+                    sizes[n + i] = i ? DUBTREE_SHARED_VALUE : size;
+                } else if (s->store_uncompressed) {
+                    values[i] = cbuf + total_size;
+                    memcpy(values[i], run[i], DUBTREE_BLOCK_SIZE);
+                    value_sizes[i] = DUBTREE_BLOCK_SIZE;
+                    sizes[n + i] = value_sizes[i];
+                    total_size += value_sizes[i];
+                } else if (swap_is_zero_block(run[i])) {
+                    values[i] = cbuf + SWAP_ZERO_TAG;
+                    value_sizes[i] = 0;
+                    sizes[n + i] = DUBTREE_ZERO_VALUE;
+                    ++(s->zero_blocks);
+                } else if ((i || (have_prev && n &&
+                                  keys[n - 1] == run_start - 1)) &&
+                           !memcmp(i ? run[i - 1] : prev, run[i],
+                                   DUBTREE_BLOCK_SIZE)) {
+                    values[i] = prev_value;
+                    value_sizes[i] = prev_size;
+                    sizes[n + i] = DUBTREE_SHARED_VALUE;
+                    ++(s->dup_blocks);
+                } else {
+                    uint64_t hash = swap_hash(run[i], DUBTREE_BLOCK_SIZE);
+                    HashEntry *d = hashtable_find_entry(&dups, hash);
+                    uint64_t j;
+
+                    /* Hashes may collide, so check the block against the
+                     * value found. */
+                    if (d) {
+                        j = d->value;
+                        if (swap_get_key(s, dup, cbuf + offsets[j],
+                                         sizes[j]) == 0 &&
+                                !memcmp(dup, run[i], DUBTREE_BLOCK_SIZE)) {
+                            values[i] = cbuf + offsets[j];
+                            value_sizes[i] = sizes[j];
+                            sizes[n + i] = DUBTREE_REF_VALUE(j);
+                            ++(s->dup_blocks);
+                            goto next;
+                        }
+                    }
+
+                    values[i] = cbuf + total_size;
+                    value_sizes[i] = swap_set_key(s, values[i], run[i]);
+                    sizes[n + i] = value_sizes[i];
+                    offsets[n + i] = total_size;
+                    total_size += value_sizes[i];
+                    if (d) {
+                        d->value = n + i;
+                    } else {
+                        hashtable_insert(&dups, hash, n + i);
+                    }
+                }
+next:
+                prev_value = values[i];
+                prev_size = value_sizes[i];
+            }
+            total_size += size;
+            n += run_len;
 
-            struct insert_context *c = malloc(sizeof(*c));
-            c->n = n;
-            c->s = s;
-            c->cbuf = cbuf;
-            c->keys = keys;
-            c->sizes = sizes;
-            c->total_size = total_size;
+            have_prev = !size && !s->store_uncompressed;
+            if (have_prev) {
+                memcpy(prev, run[run_len - 1], DUBTREE_BLOCK_SIZE);
+            }
+
+            swap_lock(s);
+            for (i = 0; i < run_len; ++i) {
+                e = hashtable_find_entry(&s->busy_blocks, run_start + i);
+                if (e && e->value == run_values[i]) {
+                    e->value = (((uint64_t ) value_sizes[i]) <<
+                                SWAP_SIZE_SHIFT) | (uintptr_t) values[i];
+                }
+            }
+            swap_unlock(s);
 
-            swap_wait_can_insert(s);
-            s->insert_context = c;
-            swap_signal_insert(s);
+            for (i = 0; i < run_len; ++i) {
+                swap_free(s, run[i]);
+            }
+            run_len = 0;
+        }
 
+        if (flush) {
+            swap_queue_insert(s, n, cbuf, keys, sizes, total_size);
             cbuf = NULL;
             keys = NULL;
             sizes = NULL;
             max = n = 0;
             total_size = 0;
+            have_prev = 0;
+            hashtable_clear(&dups);
         }
 
         if (!ptr) {
             continue;
         }
 
-        if (!cbuf) {
-            cbuf = swap_malloc(s, max_sz);
-        }
-
-        if (n == max) {
-            max = max ? 2 * max : 1;
-            keys = realloc(keys, sizeof(keys[0]) * max);
-            sizes = realloc(sizes, sizeof(sizes[0]) * max);
-        }
-
-        /* The skip check about only works for duplicates already queued,
-         * not ones that could arrive when not holding lock. So we have to
-         * re-check here. */
-        if (n && keys[n - 1] == key) {
-            --n;
-            total_size -= sizes[n];
+        if (run_len && key == run_start + run_len - 1) {
+            swap_free(s, run[--run_len]);
         }
-
-        keys[n] = key;
-        if (s->store_uncompressed) {
-            memcpy(cbuf + total_size, ptr, DUBTREE_BLOCK_SIZE);
-            size = DUBTREE_BLOCK_SIZE;
-        } else {
-            size = swap_set_key(cbuf + total_size, ptr);
-        }
-
-        swap_lock(s);
-        e = hashtable_find_entry(&s->busy_blocks, key);
-        if (e && e->value == value) {
-            e->value = (((uint64_t ) size) << SWAP_SIZE_SHIFT) |
-                (uintptr_t) (cbuf + total_size);
+        if (!run_len) {
+            run_start = key;
         }
-        swap_unlock(s);
-
-        swap_free(s, ptr);
-
-        sizes[n] = size;
-        total_size += size;
-        ++n;
+        run[run_len] = ptr;
+        run_values[run_len] = value;
+        ++run_len;
     }
 
     assert(!cbuf);
+    hashtable_clear(&dups);
+    free(offsets);
+    free(extent);
+    free(prev);
+    free(dup);
 
     debug_printf("%s exiting cleanly\n", __FUNCTION__);
     return 0;
@@ -749,6 +1179,31 @@ static char *strsep(char **stringp, const char *delim)
 }
 #endif
 
+static int swap_parse_codec(const char *spec, int *codec, int *level)
+{
+    if (!strcmp(spec, "lz4")) {
+        *codec = SWAP_CODEC_LZ4;
+    } else if (!strncmp(spec, "lz4hc", 5) &&
+               (spec[5] == '\0' || spec[5] == ':')) {
+        *codec = SWAP_CODEC_LZ4HC;
+        *level = 0; /* LZ4HC's default. */
+        if (spec[5]) {
+            char *end;
+            long l = strtol(spec + 6, &end, 10);
+            if (end == spec + 6 || *end || l < 0 ||
+                    l > SWAP_CODEC_LZ4HC_MAX_LEVEL) {
+                return -1;
+            }
+            *level = l;
+        }
+    } else if (!strcmp(spec, "lz4dict")) {
+        *codec = SWAP_CODEC_LZ4DICT;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
 static int swap_read_header(BDRVSwapState *s)
 {
     ssize_t got;
@@ -802,6 +1257,23 @@ static int swap_read_header(BDRVSwapState *s)
             }
         } else if (!strncmp(line, "fallback=", 9)) {
             s->fallbacks[s->num_fallbacks++] = strdup(line + 9);
+        } else if (!strncmp(line, "extent-blocks=", 14)) {
+            s->extent_blocks = atoi(line + 14);
+            if (s->extent_blocks < 0 ||
+                    s->extent_blocks > SWAP_EXTENT_MAX_BLOCKS) {
+                warnx("swap: extent-blocks must be at most %d",
+                      SWAP_EXTENT_MAX_BLOCKS);
+                free(buff);
+                return -1;
+            }
+        } else if (!strncmp(line, "compaction-budget=", 18)) {
+            s->compaction_budget = strtoull(line + 18, NULL, 0);
+        } else if (!strncmp(line, "codec=", 6)) {
+            if (swap_parse_codec(line + 6, &s->codec, &s->codec_level) < 0) {
+                warnx("swap: unknown codec %s", line + 6);
+                free(buff);
+                return -1;
+            }
         }
     }
 
@@ -1016,6 +1488,332 @@ char *swap_resolve_via_fallback(BDRVSwapState *s, const char *fn)
     return check;
 }
 
+/* Load the LZ4 dictionary from fn and prepare compression state for it. */
+static int swap_load_dict(BDRVSwapState *s, const char *fn)
+{
+    FILE *file;
+    char *dict;
+    LZ4_stream_t *dict_stream, *stream;
+    size_t len;
+
+    file = fopen(fn, "rb");
+    if (!file) {
+        warn("swap: unable to open %s", fn);
+        return -1;
+    }
+    dict = malloc(SWAP_DICT_SIZE);
+    dict_stream = calloc(1, sizeof(*dict_stream));
+    stream = calloc(1, sizeof(*stream));
+    if (!dict || !dict_stream || !stream) {
+        errx(1, "OOM error %s line %d", __FUNCTION__, __LINE__);
+    }
+    len = fread(dict, 1, SWAP_DICT_SIZE, file);
+    fclose(file);
+    if (!len) {
+        warnx("swap: empty dictionary %s", fn);
+        free(dict);
+        free(dict_stream);
+        free(stream);
+        return -1;
+    }
+    LZ4_loadDict(dict_stream, dict, len);
+
+    s->dict_size = len;
+    s->dict_stream = dict_stream;
+    s->stream = stream;
+    __sync_synchronize();
+    s->dict = dict;
+    debug_printf("swap: loaded %d byte dictionary %s\n", (int) len, fn);
+    return 0;
+}
+
+static inline uint64_t swap_hash_segment(const uint8_t *p)
+{
+    const uint64_t *w = (const uint64_t *) p;
+    uint64_t h = 0xcbf29ce484222325ULL;
+    int i;
+    for (i = 0; i < SWAP_DICT_SEGMENT / sizeof(*w); ++i) {
+        h = (h ^ w[i]) * 0x100000001b3ULL;
+        h ^= h >> 29;
+    }
+    return h | 1;
+}
+
+struct swap_dict_segment {
+    uint32_t count;
+    uint32_t index;
+};
+
+static int swap_cmp_segments(const void *a, const void *b)
+{
+    const struct swap_dict_segment *x = a;
+    const struct swap_dict_segment *y = b;
+    if (x->count != y->count) {
+        return x->count < y->count ? -1 : 1;
+    }
+    return x->index < y->index ? -1 : x->index > y->index;
+}
+
+/* Build an LZ4 dictionary for the image chain from a sample of the blocks
+ * already in it, and store it as fn. The dictionary is made up of the
+ * SWAP_DICT_SEGMENT-sized pieces that recur most often across the sample,
+ * with the most common ones last, where they are cheapest to refer to. */
+static int swap_train_dict(BDRVSwapState *s, const char *fn)
+{
+    const size_t seg_per_block = DUBTREE_BLOCK_SIZE / SWAP_DICT_SEGMENT;
+    uint64_t num_blocks = s->size / DUBTREE_BLOCK_SIZE;
+    uint8_t *samples;
+    struct swap_dict_segment *segs;
+    size_t num_samples = 0;
+    size_t num_segs = 0;
+    size_t i, j;
+    HashTable counts;
+    void *ctx;
+    FILE *file;
+    int r = 0;
+
+    samples = malloc(SWAP_DICT_RUNS * SWAP_DICT_RUN_BLOCKS *
+                     DUBTREE_BLOCK_SIZE);
+    if (!samples) {
+        errx(1, "OOM error %s line %d", __FUNCTION__, __LINE__);
+    }
+
+    ctx = dubtree_prepare_find(&s->t);
+    if (!ctx) {
+        errx(1, "swap: failed to create find context");
+    }
+    for (i = 0; i < SWAP_DICT_RUNS; ++i) {
+        uint64_t start = num_blocks * i / SWAP_DICT_RUNS;
+        int n = num_blocks - start < SWAP_DICT_RUN_BLOCKS ?
+            num_blocks - start : SWAP_DICT_RUN_BLOCKS;
+        uint8_t map[SWAP_DICT_RUN_BLOCKS] = {};
+        uint32_t sizes[SWAP_DICT_RUN_BLOCKS];
+        uint8_t *cbuf, *in, *v = NULL;
+        size_t vsz = 0;
+
+        do {
+            r = dubtree_find(&s->t, start, n, &cbuf, map, sizes, NULL, NULL,
+                             NULL, ctx);
+        } while (r == -EAGAIN);
+        if (r < 0) {
+            warnx("swap: dubtree read failed while sampling");
+            break;
+        }
+        swap_lock(s);
+        for (j = 0, in = cbuf; j < n; ++j) {
+            if (sizes[j] == DUBTREE_ZERO_VALUE) {
+                continue;
+            }
+            if (sizes[j] && sizes[j] != DUBTREE_SHARED_VALUE) {
+                v = in;
+                vsz = sizes[j];
+                in += sizes[j];
+            }
+            if (sizes[j] && swap_get_block(s, samples + num_samples *
+                                           DUBTREE_BLOCK_SIZE, start + j, v,
+                                           vsz) == 0) {
+                ++num_samples;
+            }
+        }
+        swap_unlock(s);
+        free(cbuf);
+    }
+    dubtree_end_find(&s->t, ctx);
+
+    if (r < 0 || !num_samples) {
+        warnx("swap: nothing to train dictionary on");
+        free(samples);
+        return -1;
+    }
+
+    /* Count how often each segment occurs, remembering where we first saw
+     * it. */
+    hashtable_init(&counts, NULL, NULL);
+    for (i = 0; i < num_samples * seg_per_block; ++i) {
+        const uint8_t *p = samples + i * SWAP_DICT_SEGMENT;
+        HashEntry *e;
+        for (j = 0; j < SWAP_DICT_SEGMENT && !p[j]; ++j);
+        if (j == SWAP_DICT_SEGMENT) {
+            continue; /* Zeroes compress fine without help. */
+        }
+        e = hashtable_find_entry(&counts, swap_hash_segment(p));
+        if (e) {
+            e->value += 1ULL << 32;
+        } else {
+            hashtable_insert(&counts, swap_hash_segment(p), (1ULL << 32) | i);
+        }
+    }
+
+    segs = malloc(sizeof(segs[0]) * num_samples * seg_per_block);
+    if (!segs) {
+        errx(1, "OOM error %s line %d", __FUNCTION__, __LINE__);
+    }
+    for (i = 0; i < num_samples * seg_per_block; ++i) {
+        const uint8_t *p = samples + i * SWAP_DICT_SEGMENT;
+        uint64_t v;
+        if (hashtable_find(&counts, swap_hash_segment(p), &v) &&
+                (uint32_t) v == i && (v >> 32) > 1) {
+            segs[num_segs].count = v >> 32;
+            segs[num_segs].index = i;
+            ++num_segs;
+        }
+    }
+    hashtable_clear(&counts);
+    qsort(segs, num_segs, sizeof(segs[0]), swap_cmp_segments);
+
+    i = num_segs > SWAP_DICT_SIZE / SWAP_DICT_SEGMENT ?
+        num_segs - SWAP_DICT_SIZE / SWAP_DICT_SEGMENT : 0;
+    file = fopen(fn, "wb");
+    if (!file) {
+        warn("swap: unable to create %s", fn);
+        r = -1;
+    } else {
+        for (; i < num_segs; ++i) {
+            if (fwrite(samples + segs[i].index * SWAP_DICT_SEGMENT,
+                       SWAP_DICT_SEGMENT, 1, file) != 1) {
+                warn("swap: unable to write %s", fn);
+                r = -1;
+                break;
+            }
+        }
+        fclose(file);
+    }
+    debug_printf("swap: trained dictionary on %d blocks, %d segments\n",
+                 (int) num_samples, (int) num_segs);
+
+    free(segs);
+    free(samples);
+    return r;
+}
+
+/* Append a setting to the swap header, so that it sticks. */
+static int swap_append_header(BDRVSwapState *s, const char *name,
+                              const char *value)
+{
+    FILE *file;
+    int r;
+
+    file = fopen(s->filename, "a");
+    if (!file) {
+        warn("swap: unable to open %s", s->filename);
+        return -errno;
+    }
+#undef fprintf
+    r = fprintf(file, "%s=%s\n", name, value);
+    fclose(file);
+    if (r < 0) {
+        warn("swap: unable to update %s", s->filename);
+        return -EIO;
+    }
+    return 0;
+}
+
+/* Record codec in the swap header and start using it for new blocks. */
+static int swap_use_codec(BDRVSwapState *s, const char *spec, int codec,
+                          int level)
+{
+    int r;
+
+    if (codec == SWAP_CODEC_LZ4DICT) {
+        dubtree_require_features(&s->t, SWAP_FEATURE_DICT);
+    }
+    r = swap_append_header(s, "codec", spec);
+    if (r < 0) {
+        return r;
+    }
+
+    s->codec_level = level;
+    __sync_synchronize();
+    s->codec = codec;
+    return 0;
+}
+
+#ifdef _WIN32
+static DWORD WINAPI swap_dict_thread(void *_s)
+#else
+static void *swap_dict_thread(void *_s)
+#endif
+{
+    BDRVSwapState *s = _s;
+    char *fn;
+    int r;
+
+    asprintf(&fn, "%s/%s", s->fallbacks[0], SWAP_DICT_NAME);
+    if (!fn) {
+        errx(1, "OOM error %s line %d", __FUNCTION__, __LINE__);
+    }
+    r = swap_train_dict(s, fn);
+    if (r == 0) {
+        r = swap_load_dict(s, fn);
+    }
+    free(fn);
+    if (r == 0) {
+        r = swap_use_codec(s, "lz4dict", SWAP_CODEC_LZ4DICT, 0);
+    }
+    if (r < 0) {
+        warnx("swap: no dictionary for %s, codec unchanged", s->filename);
+    }
+    s->dict_training = 0;
+    return 0;
+}
+
+/* Switch to the block codec described by spec. Only affects blocks written
+ * from now on. Returns 1 if a dictionary must be trained first, which
+ * happens in the background, and the codec is switched once it is done. */
+static int swap_set_codec(BDRVSwapState *s, const char *spec)
+{
+    int codec, level = 0;
+
+    if (swap_parse_codec(spec, &codec, &level) < 0) {
+        warnx("swap: unknown codec %s", spec);
+        return -EINVAL;
+    }
+    if (s->dict_training) {
+        return -EBUSY;
+    }
+
+    if (codec == SWAP_CODEC_LZ4DICT && !s->dict) {
+        if (s->dict_thread_started) {
+            wait_thread(s->dict_thread);
+            close_thread_handle(s->dict_thread);
+            s->dict_thread_started = 0;
+        }
+        s->dict_training = 1;
+        if (create_thread(&s->dict_thread, swap_dict_thread, (void*) s) < 0) {
+            warnx("swap: unable to create dictionary thread");
+            s->dict_thread_started = s->dict_training = 0;
+            return -EIO;
+        }
+        s->dict_thread_started = 1;
+        return 1;
+    }
+
+    return swap_use_codec(s, spec, codec, level);
+}
+
+/* Set how many consecutive blocks may be compressed together, with 0 or 1
+ * meaning one at a time. Only affects blocks written from now on. */
+static int swap_set_extent_blocks(BDRVSwapState *s, int n)
+{
+    char value[16];
+    int r;
+
+    if (n < 0 || n > SWAP_EXTENT_MAX_BLOCKS) {
+        warnx("swap: extent-blocks must be at most %d",
+              SWAP_EXTENT_MAX_BLOCKS);
+        return -EINVAL;
+    }
+    if (n > 1) {
+        dubtree_require_features(&s->t, DUBTREE_FEATURE_SHARED_VALUES);
+    }
+    snprintf(value, sizeof(value), "%d", n);
+    r = swap_append_header(s, "extent-blocks", value);
+    if (r < 0) {
+        return r;
+    }
+    s->extent_blocks = n;
+    return 0;
+}
 
 static int swap_open(BlockDriverState *bs, const char *filename, int flags)
 {
@@ -1025,6 +1823,7 @@ static int swap_open(BlockDriverState *bs, const char *filename, int flags)
     char *swapdata = NULL;
     char *cow = NULL;
     char *map;
+    char *dict;
     char *c, *last;
     int i;
     /* Start out with well-defined state. */
@@ -1105,11 +1904,56 @@ static int swap_open(BlockDriverState *bs, const char *filename, int flags)
     }
 
     debug_printf("swap: initializing dubtree\n");
-    if (dubtree_init(&s->t, s->fallbacks, swap_malloc, swap_free, s) != 0) {
+    if (dubtree_init(&s->t, s->fallbacks, swap_malloc, swap_free, s,
+                     swap_chunk_cache_lines) != 0) {
         warn("swap: failed to init dubtree");
         r = -1;
         goto out;
     }
+    dubtree_set_compaction_budget(&s->t, s->compaction_budget);
+
+    if (dubtree_features(&s->t) & DUBTREE_FEATURES_USER & ~SWAP_FEATURES) {
+        warnx("swap: %s requires unknown features %x", s->filename,
+              dubtree_features(&s->t) & DUBTREE_FEATURES_USER &
+              ~SWAP_FEATURES);
+        r = -1;
+    }
+    /* Recorded by the swap header lines alone in older images. */
+    if (s->codec == SWAP_CODEC_LZ4DICT) {
+        dubtree_require_features(&s->t, SWAP_FEATURE_DICT);
+    }
+    if (s->extent_blocks > 1) {
+        dubtree_require_features(&s->t, DUBTREE_FEATURE_SHARED_VALUES);
+    }
+
+    debug_printf("swap: resolving %s\n", SWAP_DICT_NAME);
+    dict = swap_resolve_via_fallback(s, SWAP_DICT_NAME);
+    if (r == 0 && dict) {
+        r = swap_load_dict(s, dict);
+    }
+    free(dict);
+    if (r == 0 && (dubtree_features(&s->t) & SWAP_FEATURE_DICT) &&
+            !s->dict) {
+        warnx("swap: %s has blocks compressed against %s, which is missing",
+              s->filename, SWAP_DICT_NAME);
+        r = -1;
+    }
+    if (r < 0) {
+        dubtree_close(&s->t);
+        goto out;
+    }
+
+    if (swap_shared_cache_mb && s->num_fallbacks > 1) {
+        if (!swap_shared_cache) {
+            swap_shared_cache = shared_cache_open(SWAP_SHARED_CACHE_NAME,
+                                                  swap_shared_cache_mb << 20);
+        }
+        if (swap_shared_cache) {
+            ++swap_shared_cache_users;
+            s->shared_cache = 1;
+            dubtree_set_lookup(&s->t, swap_shared_lookup);
+        }
+    }
 
     debug_printf("swap: resolving map.idx\n");
     map = swap_resolve_via_fallback(s, "map.idx");
@@ -1205,6 +2049,9 @@ out:
     }
 
     free(cow);
+    if (r >= 0) {
+        TAILQ_INSERT_TAIL(&swap_states, s, swap_entry);
+    }
     swap_backend_active = 1; /* activates stats logging. */
     return r;
 }
@@ -1245,6 +2092,27 @@ void dump_swapstat(void)
                 swap_stats.decompressed >> 20ULL,
                 swap_stats.shallowed >> 20ULL);
     }
+
+    BDRVSwapState *s;
+    TAILQ_FOREACH(s, &swap_states, swap_entry) {
+        uint64_t hits, misses, evictions;
+        dubtree_cache_stats(&s->t, &hits, &misses, &evictions);
+        debug_printf("SWAP %s chunk cache hits=%"PRIu64" misses=%"PRIu64
+                " evictions=%"PRIu64"\n", s->filename, hits, misses,
+                evictions);
+        debug_printf("SWAP %s extent cache hits=%"PRIu64" misses=%"PRIu64
+                "\n", s->filename, s->extent_hits, s->extent_misses);
+        debug_printf("SWAP %s elided zero=%"PRIu64" dup=%"PRIu64"\n",
+                s->filename, s->zero_blocks, s->dup_blocks);
+    }
+    if (swap_shared_cache) {
+        uint64_t hits, misses, inserts, corrupt, recovered;
+        shared_cache_stats(swap_shared_cache, &hits, &misses, &inserts,
+                           &corrupt, &recovered);
+        debug_printf("SWAP shared cache hits=%"PRIu64" misses=%"PRIu64
+                " inserts=%"PRIu64" corrupt=%"PRIu64" recovered=%"PRIu64
+                "\n", hits, misses, inserts, corrupt, recovered);
+    }
 #endif
 }
 
@@ -1844,10 +2712,13 @@ static void dubtree_read_complete_cb(void *opaque, int result)
     BDRVSwapState *s = acb->bs->opaque;
     uint8_t *o = acb->tmp ? acb->tmp : acb->buffer;
     uint8_t *t = acb->decomp;
+    uint8_t *v = NULL;
     int64_t count = acb->size;
     uint32_t *sizes = acb->sizes;
     uint8_t tmp[SWAP_SECTOR_SIZE];
     uint64_t key = acb->block;
+    DubTreeOrigin *origin = acb->origins;
+    size_t vsz = 0;
     int r = 0;
 
     if (result < 0) {
@@ -1860,24 +2731,37 @@ static void dubtree_read_complete_cb(void *opaque, int result)
             size_t sz = *sizes++;
 
             //debug_printf("sz %x\n", (uint32_t) sz);
-            if (sz != 0) {
-#ifdef SWAP_STATS
-                swap_stats.decompressed += DUBTREE_BLOCK_SIZE;
-#endif
+            if (sz == DUBTREE_ZERO_VALUE) {
+                memset(o, 0, count < SWAP_SECTOR_SIZE ?
+                       count : SWAP_SECTOR_SIZE);
+            } else if (sz != 0) {
                 uint8_t *dst = (count < SWAP_SECTOR_SIZE) ? tmp : o;
-                r = swap_get_key(dst, t, sz);
+                /* Blocks of an extent share its value. */
+                if (sz != DUBTREE_SHARED_VALUE) {
+                    v = t;
+                    vsz = sz;
+                    t += sz;
+                }
+                r = swap_get_block(s, dst, key, v, vsz);
                 assert(r >= 0);
 
                 if (dst == tmp) {
                     memcpy(o, tmp, count);
                 }
                 __swap_nonblocking_write(s, dst, key, SWAP_SECTOR_SIZE, 0);
-                t += sz;
+                if (origin && origin->fallback) {
+                    SharedCacheKey k = {origin->fallback, origin->chunk_id,
+                                        origin->offset, key};
+                    shared_cache_insert(swap_shared_cache, &k, dst);
+                }
             }
 
             o += SWAP_SECTOR_SIZE;
             count -= SWAP_SECTOR_SIZE;
             ++key;
+            if (origin) {
+                ++origin;
+            }
         }
         swap_unlock(s);
     }
@@ -1888,9 +2772,32 @@ static void dubtree_read_complete_cb(void *opaque, int result)
 #endif
 
     free(acb->decomp);
+    free(acb->origins);
     complete_read_acb(acb);
 }
 
+/* Fill in the idx'th block of a read from the shared cache. Called from
+ * dubtree_find(), before any value is read. */
+static int swap_shared_lookup(void *opaque, int idx,
+                              const DubTreeOrigin *origin)
+{
+    SwapAIOCB *acb = opaque;
+    uint8_t *o = (acb->tmp ? acb->tmp : acb->buffer) + idx * SWAP_SECTOR_SIZE;
+    int64_t count = acb->size - idx * SWAP_SECTOR_SIZE;
+    uint8_t tmp[SWAP_SECTOR_SIZE];
+    SharedCacheKey k = {origin->fallback, origin->chunk_id, origin->offset,
+                        acb->block + idx};
+
+    if (count >= SWAP_SECTOR_SIZE) {
+        return shared_cache_lookup(swap_shared_cache, &k, o);
+    }
+    if (!shared_cache_lookup(swap_shared_cache, &k, tmp)) {
+        return 0;
+    }
+    memcpy(o, tmp, count);
+    return 1;
+}
+
 static int __swap_dubtree_read(BDRVSwapState *s, SwapAIOCB *acb)
 {
     int r = 0;
@@ -1900,7 +2807,6 @@ static int __swap_dubtree_read(BDRVSwapState *s, SwapAIOCB *acb)
     uint64_t start = offset / SWAP_SECTOR_SIZE;
     uint64_t end = (offset + count + SWAP_SECTOR_SIZE - 1) / SWAP_SECTOR_SIZE;
     uint32_t *sizes;
-    void *decomp;
 
     /* Returns number of unresolved blocks, or negative on
      * error. */
@@ -1912,11 +2818,13 @@ static int __swap_dubtree_read(BDRVSwapState *s, SwapAIOCB *acb)
     }
     acb->sizes = sizes;
 
-    decomp = malloc(DUBTREE_BLOCK_SIZE * (end - start));
-    if (!decomp) {
-        errx(1, "OOM error %s line %d", __FUNCTION__, __LINE__);
+    acb->origins = NULL;
+    if (s->shared_cache) {
+        acb->origins = calloc(end - start, sizeof(acb->origins[0]));
+        if (!acb->origins) {
+            errx(1, "OOM error %s line %d", __FUNCTION__, __LINE__);
+        }
     }
-    acb->decomp = decomp;
 
     if (!s->find_context) {
         s->find_context = dubtree_prepare_find(&s->t);
@@ -1926,8 +2834,8 @@ static int __swap_dubtree_read(BDRVSwapState *s, SwapAIOCB *acb)
     }
 
     do {
-        r = dubtree_find(&s->t, start, end - start, decomp, map, sizes,
-                dubtree_read_complete_cb, acb, s->find_context);
+        r = dubtree_find(&s->t, start, end - start, &acb->decomp, map, sizes,
+                acb->origins, dubtree_read_complete_cb, acb, s->find_context);
     } while (r == -EAGAIN);
 
     /* dubtree_find returns 0 for success, <0 for error, >0 if some blocks
@@ -1993,11 +2901,17 @@ static int __swap_nonblocking_read(BDRVSwapState *s, uint8_t *buf,
             found += take;
         } else if (hashtable_find(&s->busy_blocks, key, &value)) {
             uint8_t *dst;
+            if (!(value & SWAP_SIZE_MASK) && (value & SWAP_ZERO_TAG)) {
+                memset(buf, 0, take);
+                map[i] = 1;
+                found += take;
+                continue;
+            }
             if (value & SWAP_SIZE_MASK) {
                 dst = take < SWAP_SECTOR_SIZE ? tmp : buf;
                 b = (void *) (uintptr_t) (value & ~SWAP_SIZE_MASK);
                 int sz = value >> SWAP_SIZE_SHIFT;
-                swap_get_key(dst, b, sz);
+                swap_get_block(s, dst, key, b, sz);
                 if (dst == tmp) {
                     memcpy(buf, tmp, take);
                 }
@@ -2391,6 +3305,12 @@ static void swap_close(BlockDriverState *bs)
     BDRVSwapState *s = (BDRVSwapState*) bs->opaque;
     int i;
 
+    if (s->dict_thread_started) {
+        wait_thread(s->dict_thread);
+        close_thread_handle(s->dict_thread);
+        s->dict_thread_started = 0;
+    }
+
     /* Signal write thread to quit and wait for it. */
     s->quit = 1;
 
@@ -2407,8 +3327,14 @@ static void swap_close(BlockDriverState *bs)
         dubtree_end_find(&s->t, s->find_context);
         s->find_context = NULL;
     }
+    TAILQ_REMOVE(&swap_states, s, swap_entry);
     dubtree_close(&s->t);
 
+    if (s->shared_cache && !--swap_shared_cache_users) {
+        shared_cache_close(swap_shared_cache);
+        swap_shared_cache = NULL;
+    }
+
     if (s->shallow_map.mapping) {
         swap_unmap_file(&s->shallow_map);
     }
@@ -2439,6 +3365,14 @@ static void swap_close(BlockDriverState *bs)
     hashtable_clear(&s->cached_blocks);
     lruCacheClose(&s->fc);
     hashtable_clear(&s->open_files);
+
+    free(s->dict);
+    free(s->dict_stream);
+    free(s->stream);
+    for (i = 0; i < SWAP_EXTENT_CACHE_LINES; ++i) {
+        free(s->extent_cache[i].data);
+        free(s->extent_cache[i].value);
+    }
 }
 
 static int
@@ -2483,6 +3417,39 @@ swap_create(const char *filename, int64_t size, int flags)
     return ret;
 }
 
+static int swap_cmp_latency(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *) a;
+    uint32_t y = *(const uint32_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+/* Fill out p50 and p99 dubtree_insert() latencies in microseconds, over the
+ * samples collected since last time. */
+static int swap_insert_latency(BDRVSwapState *s, uint64_t *out)
+{
+    uint32_t *samples;
+    uint32_t n;
+
+    swap_lock(s);
+    n = s->num_insert_latency < SWAP_INSERT_LATENCY_SAMPLES ?
+        s->num_insert_latency : SWAP_INSERT_LATENCY_SAMPLES;
+    samples = malloc(sizeof(samples[0]) * (n ? n : 1));
+    if (!samples) {
+        swap_unlock(s);
+        return -ENOMEM;
+    }
+    memcpy(samples, s->insert_latency, sizeof(samples[0]) * n);
+    s->num_insert_latency = 0;
+    swap_unlock(s);
+
+    qsort(samples, n, sizeof(samples[0]), swap_cmp_latency);
+    out[0] = n ? samples[n / 2] : 0;
+    out[1] = n ? samples[(n * 99) / 100] : 0;
+    free(samples);
+    return n;
+}
+
 static int swap_ioctl(BlockDriverState *bs, unsigned long int req, void *buf)
 {
     BDRVSwapState *s = (BDRVSwapState*) bs->opaque;
@@ -2499,10 +3466,57 @@ static int swap_ioctl(BlockDriverState *bs, unsigned long int req, void *buf)
         int sl = *((int *) buf);
         return dubtree_insert(&s->t, 0, NULL, NULL, NULL, sl);
     } else if (req == 2) {
-        return dubtree_sanity_check(&s->t);
+        return dubtree_sanity_check(&s->t, s->dict, s->dict_size);
     } else if (req == 3) {
         s->store_uncompressed = 1;
         return 0;
+    } else if (req == 4) {
+        /* Select background (1) or inline (0) dubtree compaction. */
+        if (!buf) {
+            return -EINVAL;
+        }
+        return dubtree_set_compaction(&s->t, *((int *) buf));
+    } else if (req == 5) {
+        if (!buf) {
+            return -EINVAL;
+        }
+        return swap_insert_latency(s, buf);
+    } else if (req == 6) {
+        /* Switch block codec, e.g. "lz4hc:9" or "lz4dict". Returns 1 if
+         * the switch waits for a dictionary to be trained. */
+        if (!buf) {
+            return -EINVAL;
+        }
+        return swap_set_codec(s, buf);
+    } else if (req == 7) {
+        /* Compress up to *buf consecutive blocks together. */
+        if (!buf) {
+            return -EINVAL;
+        }
+        return swap_set_extent_blocks(s, *(int *) buf);
+    } else if (req == 8) {
+        /* Fill out bytes used and garbage bytes in the dubtree. */
+        if (!buf) {
+            return -EINVAL;
+        }
+        dubtree_usage(&s->t, (uint64_t *) buf, (uint64_t *) buf + 1);
+        return 0;
+    } else if (req == 9) {
+        /* Limit background compaction to *buf bytes/s, 0 for no limit. */
+        if (!buf) {
+            return -EINVAL;
+        }
+        s->compaction_budget = *(uint64_t *) buf;
+        dubtree_set_compaction_budget(&s->t, s->compaction_budget);
+        return 0;
+    } else if (req == 10) {
+        /* Fill out the milliseconds compaction was held back by the
+         * budget. */
+        if (!buf) {
+            return -EINVAL;
+        }
+        *(uint64_t *) buf = dubtree_compaction_throttled(&s->t);
+        return 0;
     }
     return -ENOTSUP;
 }
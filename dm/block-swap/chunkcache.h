@@ -0,0 +1,236 @@
+/*
+ * Copyright 2019, Bromium, Inc.
+ * SPDX-License-Identifier: ISC
+ */
+
+#ifndef __CHUNKCACHE_H__
+#define __CHUNKCACHE_H__
+
+/* Cache of open chunk file handles.
+ *
+ * Lines are spread over CHUNK_CACHE_SHARDS shards by chunk id, and each shard
+ * has its own lock, taken only when a line is filled or dropped. Lookups take
+ * no lock at all: they scan the keys of the shard, and pin a matching line by
+ * incrementing its user count, which is only allowed while the count is
+ * non-negative. A line is claimed for reuse by swinging its count from 0 to
+ * -1, so a pinned line can never be evicted or refilled underneath its users.
+ * Eviction within a shard follows the CLOCK algorithm. */
+
+#define CHUNK_CACHE_SHARDS 16
+
+typedef struct ChunkCacheLine {
+    uintptr_t value;
+    volatile int users; /* -1 while the line is being refilled. */
+    volatile int referenced;
+    volatile int delete;
+} ChunkCacheLine;
+
+typedef struct ChunkCacheShard {
+    critical_section lock;
+    int hand;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+} __attribute__((aligned(64))) ChunkCacheShard;
+
+typedef struct ChunkCache {
+    int lines_per_shard;
+    volatile uint64_t *keys; /* Scanned by lookups, kept apart from lines. */
+    ChunkCacheLine *lines;
+    ChunkCacheShard shards[CHUNK_CACHE_SHARDS];
+} ChunkCache;
+
+static inline int chunk_cache_init(ChunkCache *cc, int capacity)
+{
+    int i;
+    int n;
+
+    cc->lines_per_shard = (capacity + CHUNK_CACHE_SHARDS - 1) /
+        CHUNK_CACHE_SHARDS;
+    if (cc->lines_per_shard < 1) {
+        cc->lines_per_shard = 1;
+    }
+    n = cc->lines_per_shard * CHUNK_CACHE_SHARDS;
+
+    cc->keys = calloc(n, sizeof(cc->keys[0]));
+    if (!cc->keys) {
+        return -1;
+    }
+    cc->lines = calloc(n, sizeof(cc->lines[0]));
+    if (!cc->lines) {
+        free((void *) cc->keys);
+        return -1;
+    }
+    for (i = 0; i < CHUNK_CACHE_SHARDS; ++i) {
+        ChunkCacheShard *sh = &cc->shards[i];
+        critical_section_init(&sh->lock);
+        sh->hand = 0;
+        sh->hits = sh->misses = sh->evictions = 0;
+    }
+    return 0;
+}
+
+static inline void chunk_cache_close(ChunkCache *cc)
+{
+    int i;
+    for (i = 0; i < cc->lines_per_shard * CHUNK_CACHE_SHARDS; ++i) {
+        ChunkCacheLine *cl = &cc->lines[i];
+        if (cl->users) {
+            printf("leaked cache line %d\n", i);
+        }
+    }
+    for (i = 0; i < CHUNK_CACHE_SHARDS; ++i) {
+        critical_section_free(&cc->shards[i].lock);
+    }
+    free((void *) cc->keys);
+    free(cc->lines);
+}
+
+static inline int chunk_cache_shard_index(ChunkCache *cc, uint64_t key)
+{
+    /* Chunk ids are handed out sequentially, so the low bits spread well. */
+    return key & (CHUNK_CACHE_SHARDS - 1);
+}
+
+static inline ChunkCacheShard *chunk_cache_shard(ChunkCache *cc, uint64_t key)
+{
+    return &cc->shards[chunk_cache_shard_index(cc, key)];
+}
+
+static inline ChunkCacheShard *chunk_cache_line_shard(ChunkCache *cc,
+                                                      int line)
+{
+    return &cc->shards[line / cc->lines_per_shard];
+}
+
+static inline int chunk_cache_pin(ChunkCache *cc, int line)
+{
+    ChunkCacheLine *cl = &cc->lines[line];
+    int users;
+
+    do {
+        users = cl->users;
+        if (users < 0) {
+            return 0;
+        }
+    } while (!__sync_bool_compare_and_swap(&cl->users, users, users + 1));
+    return 1;
+}
+
+/* Add a reference to a line that the caller has already pinned. */
+static inline void chunk_cache_ref(ChunkCache *cc, int line)
+{
+    __sync_fetch_and_add(&cc->lines[line].users, 1);
+}
+
+/* Drop a reference, returning the number of users left. */
+static inline int chunk_cache_unpin(ChunkCache *cc, int line)
+{
+    return __sync_sub_and_fetch(&cc->lines[line].users, 1);
+}
+
+static inline void chunk_cache_touch(ChunkCache *cc, int line)
+{
+    cc->lines[line].referenced = 1;
+}
+
+/* Find and pin the line holding key, without taking any locks. Returns -1 if
+ * key is not cached. */
+static inline int chunk_cache_find(ChunkCache *cc, uint64_t key)
+{
+    int first = chunk_cache_shard_index(cc, key) * cc->lines_per_shard;
+    int i;
+
+    for (i = first; i < first + cc->lines_per_shard; ++i) {
+        if (cc->keys[i] == key && chunk_cache_pin(cc, i)) {
+            /* The line may have been refilled before we pinned it. */
+            if (cc->keys[i] == key) {
+                chunk_cache_touch(cc, i);
+                return i;
+            }
+            chunk_cache_unpin(cc, i);
+        }
+    }
+    return -1;
+}
+
+/* Try to claim an unused line for exclusive use. */
+static inline int chunk_cache_claim_line(ChunkCache *cc, int line)
+{
+    return __sync_bool_compare_and_swap(&cc->lines[line].users, 0, -1);
+}
+
+/* Claim a line to refill with key, evicting its old contents which are
+ * returned through old_key and old_value. Must be called with the lock of
+ * the shard for key held. Returns -1 if every line in the shard is in use. */
+static inline int chunk_cache_evict(ChunkCache *cc, uint64_t key,
+                                    uint64_t *old_key, uintptr_t *old_value)
+{
+    ChunkCacheShard *sh = chunk_cache_shard(cc, key);
+    int first = chunk_cache_shard_index(cc, key) * cc->lines_per_shard;
+    int i;
+
+    /* Two sweeps are enough to clear every referenced bit once. */
+    for (i = 0; i < 2 * cc->lines_per_shard; ++i) {
+        int line = first + sh->hand;
+        ChunkCacheLine *cl = &cc->lines[line];
+
+        sh->hand = (sh->hand + 1) % cc->lines_per_shard;
+        if (cl->users) {
+            continue;
+        }
+        if (cl->referenced) {
+            cl->referenced = 0;
+            continue;
+        }
+        if (chunk_cache_claim_line(cc, line)) {
+            *old_key = cc->keys[line];
+            *old_value = cl->value;
+            if (*old_key) {
+                ++(sh->evictions);
+            }
+            return line;
+        }
+    }
+    return -1;
+}
+
+/* Publish a claimed line, leaving it pinned once for the caller. */
+static inline void chunk_cache_fill(ChunkCache *cc, int line, uint64_t key,
+                                    uintptr_t value)
+{
+    ChunkCacheLine *cl = &cc->lines[line];
+    cl->value = value;
+    cl->delete = 0;
+    cl->referenced = 1;
+    cc->keys[line] = key;
+    __sync_synchronize();
+    cl->users = 1;
+}
+
+/* Empty a claimed line and make it available for reuse. */
+static inline void chunk_cache_clear_line(ChunkCache *cc, int line)
+{
+    ChunkCacheLine *cl = &cc->lines[line];
+    cc->keys[line] = 0;
+    cl->value = 0;
+    cl->delete = 0;
+    cl->referenced = 0;
+    __sync_synchronize();
+    cl->users = 0;
+}
+
+static inline void chunk_cache_stats(ChunkCache *cc, uint64_t *hits,
+                                     uint64_t *misses, uint64_t *evictions)
+{
+    int i;
+    *hits = *misses = *evictions = 0;
+    for (i = 0; i < CHUNK_CACHE_SHARDS; ++i) {
+        ChunkCacheShard *sh = &cc->shards[i];
+        *hits += sh->hits;
+        *misses += sh->misses;
+        *evictions += sh->evictions;
+    }
+}
+
+#endif /* __CHUNKCACHE_H__ */
@@ -8,19 +8,27 @@
 #include "dubtree_io.h"
 
 #include "dubtree.h"
-#include "lrucache.h"
+#include "chunkcache.h"
 #include "simpletree.h"
 #include "lz4.h"
+#include <stddef.h>
 #include <dm/aio.h>
+#include <dm/clock.h>
 
 #define DUBTREE_FILE_MAGIC_MMAP 0x73776170
 
 #define DUBTREE_FILE_VERSION 12
+/* Version of images that require features, which builds only knowing
+ * version 12 refuse to open. */
+#define DUBTREE_FILE_VERSION_FEATURES 13
 
 #define DUBTREE_MMAPPED_NAME "top.lvl"
 
+/* How far past its nominal size level 0 may grow while waiting for
+ * background compaction to catch up. */
+#define DUBTREE_INSERT_OVERCOMMIT 4
+
 #ifndef _WIN32
-#include <aio.h>
 #include <sys/mman.h>
 #include <sys/file.h>
 #include <errno.h>
@@ -31,11 +39,52 @@
 
 #ifdef _WIN32
 static DWORD WINAPI dubtree_read_thread(void *opaque);
+static DWORD WINAPI dubtree_compaction_thread(void *opaque);
+#else
+static void *dubtree_read_thread(void *opaque);
+static void *dubtree_compaction_thread(void *opaque);
 #endif
 
-void dubtree_close(DubTree *t)
+static void dubtree_stop_compaction(DubTree *t)
 {
-    char **fb;
+    if (!t->compact_running) {
+        return;
+    }
+    debug_printf("dubtree: wait for compaction thread to exit\n");
+    t->compact_quit = 1;
+    thread_event_set(&t->compact_event);
+    wait_thread(t->compact_thread);
+    t->compact_running = 0;
+    t->compact_quit = 0;
+    /* Wake up any insert that was stalled behind compaction, it will now
+     * fall back to merging synchronously. */
+    thread_event_set(&t->compact_done_event);
+    debug_printf("dubtree: compaction thread exited\n");
+}
+
+static int dubtree_start_compaction(DubTree *t)
+{
+    if (t->compact_running) {
+        return 0;
+    }
+    t->compact_failed = 0;
+    t->compact_running = 1;
+    if (create_thread(&t->compact_thread, dubtree_compaction_thread,
+                      (void*) t) < 0) {
+        t->compact_running = 0;
+        warnx("dubtree: unable to create compaction thread");
+        return -1;
+    }
+    /* Levels may have been left for us by a previous instance. */
+    thread_event_set(&t->compact_event);
+    return 0;
+}
+
+static void dubtree_stop_read_threads(DubTree *t)
+{
+#ifndef _WIN32
+    int i;
+#endif
 
 #ifdef _WIN32
     debug_printf("dubtree: wait for read thread to exit\n");
@@ -48,12 +97,41 @@ void dubtree_close(DubTree *t)
     ioh_del_wait_object(&t->read_thread_event, &t->ioh_wait_objects);
     ioh_cleanup_wait_objects(&t->ioh_wait_objects);
     ioh_event_close(&t->read_thread_event);
+#else
+    debug_printf("dubtree: wait for read threads to exit\n");
+    critical_section_enter(&t->pending_read_lock);
+    t->read_thread_quit = true;
+    pthread_cond_broadcast(&t->read_cond);
+    critical_section_leave(&t->pending_read_lock);
+    for (i = 0; i < t->num_read_threads; ++i) {
+        wait_thread(t->read_threads[i]);
+    }
+    pthread_cond_destroy(&t->read_cond);
+    critical_section_free(&t->pending_read_lock);
+    debug_printf("dubtree: read threads exited\n");
 #endif
+}
+
+void dubtree_close(DubTree *t)
+{
+    char **fb;
+
+    dubtree_stop_compaction(t);
+    thread_event_close(&t->compact_event);
+    thread_event_close(&t->compact_done_event);
+
+    dubtree_stop_read_threads(t);
 
-    hashtable_clear(&t->ht);
-    lruCacheClose(&t->lru);
+    debug_printf("dubtree: key filters skipped %"PRIu64" of %"PRIu64
+                 " level lookups\n", t->filter_skips, t->filter_probes);
 
-    free(t->buffered);
+    chunk_cache_close(&t->cache);
+
+    free(t->insert_buffer.buffered);
+    free(t->insert_buffer.groups);
+    free(t->insert_buffer.values);
+    free(t->compact_buffer.buffered);
+    free(t->compact_buffer.groups);
 
     fb = t->fallbacks;
     while (*fb) {
@@ -73,9 +151,80 @@ void dubtree_close(DubTree *t)
 #endif
 }
 
+/* Chunk ids are handed out in increasing order, and an image starts out with
+ * a copy of the header of its first fallback, so each fallback wrote the chunk
+ * ids after the last one of the fallback below it, up to its own last one.
+ * Fallbacks are never written to, which lets values read from their chunks be
+ * recognized as the same across instances. A fallback is identified by its
+ * path and header, and a fallback without a header is not identified at all,
+ * which leaves the chunks of it and of those below it untagged. */
+static void dubtree_init_fallbacks(DubTree *t)
+{
+    DubTreeHeader hdr;
+    dubtree_handle_t f;
+    const char *p;
+    uint64_t h;
+    char *fn;
+    int i, j;
+
+    for (i = 1; t->fallbacks[i]; ++i) {
+        asprintf(&fn, "%s/%s", t->fallbacks[i], DUBTREE_MMAPPED_NAME);
+        assert(fn);
+        f = dubtree_open_existing_readonly(fn);
+        free(fn);
+        if (f == DUBTREE_INVALID_HANDLE) {
+            break;
+        }
+        /* Headers written before the feature word are that much shorter,
+         * and require no features. */
+        memset(&hdr, 0, sizeof(hdr));
+        if (dubtree_pread(f, &hdr, sizeof(hdr), 0) <
+                (int) offsetof(DubTreeHeader, features)) {
+            dubtree_close_file(f);
+            break;
+        }
+        dubtree_close_file(f);
+
+        h = 0xcbf29ce484222325ULL;
+        for (p = t->fallbacks[i]; *p; ++p) {
+            h = (h ^ (uint8_t) *p) * 0x100000001b3ULL;
+        }
+        h = (h ^ hdr.out_chunk) * 0x100000001b3ULL;
+        for (j = 0; j < DUBTREE_MAX_LEVELS; ++j) {
+            h = (h ^ hdr.levels[j]) * 0x100000001b3ULL;
+        }
+        t->fallback_ids[i] = h ? h : 1;
+        t->fallback_chunks[i] = hdr.out_chunk;
+    }
+
+    /* Our own chunks must come after those of the fallbacks. */
+    if (t->fallback_ids[1] &&
+            t->header->out_chunk < t->fallback_chunks[1]) {
+        printf("chunk ids overlap with fallback %s\n", t->fallbacks[1]);
+        t->fallback_ids[1] = 0;
+    }
+}
+
+/* Return the id of the fallback that wrote chunk_id, or 0 if it is ours or
+ * can't be told. */
+static inline uint64_t chunk_fallback(DubTree *t, uint64_t chunk_id)
+{
+    int i;
+
+    for (i = 1; t->fallbacks[i]; ++i) {
+        if (!t->fallback_ids[i]) {
+            return 0;
+        }
+        if (chunk_id > t->fallback_chunks[i]) {
+            return t->fallback_ids[i - 1];
+        }
+    }
+    return t->fallback_ids[i - 1];
+}
+
 int dubtree_init(DubTree *t, char **fallbacks,
         malloc_callback malloc_cb, free_callback free_cb,
-        void *opaque)
+        void *opaque, int cache_lines)
 {
     int i;
     char *fn;
@@ -90,13 +239,20 @@ int dubtree_init(DubTree *t, char **fallbacks,
     t->malloc_cb = malloc_cb;
     t->free_cb = free_cb;
     t->opaque = opaque;
-    critical_section_init(&t->cache_lock);
+    critical_section_init(&t->levels_lock);
     critical_section_init(&t->write_lock);
+    critical_section_init(&t->compact_lock);
+    t->compact_buffer.throttle = 1;
+    if (thread_event_init(&t->compact_event) < 0 ||
+        thread_event_init(&t->compact_done_event) < 0) {
+        return -1;
+    }
 
-    critical_section_enter(&t->cache_lock);
-    hashtable_init(&t->ht, NULL, NULL);
-    lru_cache_init(&t->lru, 9);
-    critical_section_leave(&t->cache_lock);
+    if (chunk_cache_init(&t->cache, cache_lines ? cache_lines :
+                         DUBTREE_CACHE_LINES) < 0) {
+        warnx("dubtree: unable to allocate chunk cache");
+        return -1;
+    }
 
     debug_printf("dubtree: enum fallbacks\n");
     fb = t->fallbacks;
@@ -127,6 +283,9 @@ int dubtree_init(DubTree *t, char **fallbacks,
         }
         debug_printf("dubtree: resize file\n");
         dubtree_set_file_size(f, sizeof(DubTreeHeader));
+    } else if (dubtree_get_file_size(f) < sizeof(DubTreeHeader)) {
+        /* Written before the header had a feature word. */
+        dubtree_set_file_size(f, sizeof(DubTreeHeader));
     }
 
     debug_printf("dubtree: mapping file\n");
@@ -195,6 +354,8 @@ int dubtree_init(DubTree *t, char **fallbacks,
         __sync_synchronize();
     }
 
+    dubtree_init_fallbacks(t);
+
 #ifdef _WIN32
     critical_section_init(&t->pending_read_lock);
     TAILQ_INIT(&t->pending_reads);
@@ -207,12 +368,34 @@ int dubtree_init(DubTree *t, char **fallbacks,
     if (create_thread(&t->read_thread, dubtree_read_thread, (void*) t) < 0) {
         Werr(1, "dubtree: unable to create thread!");
     }
+#else
+    critical_section_init(&t->pending_read_lock);
+    TAILQ_INIT(&t->pending_reads);
+    t->read_thread_quit = false;
+    t->num_pending_reads = 0;
+    pthread_cond_init(&t->read_cond, NULL);
+    for (t->num_read_threads = 0; t->num_read_threads < DUBTREE_READ_THREADS;
+            ++t->num_read_threads) {
+        if (create_thread(&t->read_threads[t->num_read_threads],
+                          dubtree_read_thread, (void*) t) < 0) {
+            err(1, "dubtree: unable to create thread!");
+        }
+    }
 #endif
 
     /* Check that shared data structure matches current version and
      * configuration. */
+    if (t->header->version == DUBTREE_FILE_VERSION_FEATURES &&
+            (t->header->features & ~DUBTREE_FEATURES_KNOWN)) {
+        printf("dubtree requires unknown features %x!\n",
+               t->header->features & ~DUBTREE_FEATURES_KNOWN);
+        dubtree_stop_read_threads(t);
+        return -1;
+    }
     if ((t->header->magic == DUBTREE_FILE_MAGIC_MMAP) &&
-        (t->header->version == DUBTREE_FILE_VERSION) &&
+        ((t->header->version == DUBTREE_FILE_VERSION &&
+          !t->header->features) ||
+         t->header->version == DUBTREE_FILE_VERSION_FEATURES) &&
         (t->header->dubtree_slot_size == DUBTREE_SLOT_SIZE) &&
         (t->header->dubtree_max_levels == DUBTREE_MAX_LEVELS)) {
 
@@ -221,10 +404,15 @@ int dubtree_init(DubTree *t, char **fallbacks,
                 printf("level %d = %"PRIu64"\n", i, t->levels[i]);
             }
         }
+        if (dubtree_start_compaction(t) < 0) {
+            dubtree_stop_read_threads(t);
+            return -1;
+        }
         debug_printf("dubtree: opened\n");
         return 0;
     } else {
         printf("mismatched dubtree header!\n");
+        dubtree_stop_read_threads(t);
         return -1;
     }
 }
@@ -234,10 +422,29 @@ dubtree_quiesce(DubTree *t)
 {
 }
 
-static void __put_chunk(DubTree *t, dubtree_handle_t f, int line);
+void dubtree_require_features(DubTree *t, uint32_t features)
+{
+    if ((t->header->features & features) == features) {
+        return;
+    }
+    __sync_fetch_and_or(&t->header->features, features);
+    __sync_synchronize();
+    t->header->version = DUBTREE_FILE_VERSION_FEATURES;
+    __sync_synchronize();
+}
+
+uint32_t dubtree_features(DubTree *t)
+{
+    return t->header->features;
+}
+
+void dubtree_cache_stats(DubTree *t, uint64_t *hits, uint64_t *misses,
+    uint64_t *evictions)
+{
+    chunk_cache_stats(&t->cache, hits, misses, evictions);
+}
+
 static void put_chunk(DubTree *t, dubtree_handle_t f, int line);
-static dubtree_handle_t __get_chunk(DubTree *t, uint64_t chunk_id,
-                                       int dirty, int *l);
 static dubtree_handle_t get_chunk(DubTree *t, uint64_t chunk_id,
                                      int dirty, int *l);
 
@@ -306,6 +513,8 @@ static void set_event_cb(void *opaque, int result)
 {
 #ifdef _WIN32
     SetEvent(opaque);
+#else
+    thread_event_set(opaque);
 #endif
 }
 
@@ -449,18 +658,142 @@ dubtree_read_thread(void *opaque)
     return 0;
 }
 
+#else
+
+/* On posix hosts there is no overlapped IO to hand reads off to, so they are
+ * queued for a pool of read threads instead. This lets a lookup keep several
+ * chunk reads in flight, rather than blocking its caller on each in turn.
+ * Each queued read holds a reference on its chunk, so that the chunk cannot
+ * be deleted underneath it. */
+
+#define DUBTREE_MAX_PENDING_READS 128
+
+typedef struct {
+    dubtree_pending_read_t pr;
+    DubTree *t;
+    dubtree_handle_t f;
+    int line;
+    Read *first;
+    int n;
+    uint8_t *dst;
+    CallbackState *cs;
+} ReadContext;
+
+static void read_scatter(dubtree_handle_t f, uint8_t *dst, Read *first, int n)
+{
+    int i;
+    Read *rd;
+
+#ifdef __APPLE__
+
+    int r;
+
+    if (n > 1) {
+        struct radvisory ra = {first->src_offset,
+            first[n - 1].src_offset + first[n - 1].size - first->src_offset};
+        r = fcntl(f, F_RDADVISE, &ra);
+        assert(r >= 0);
+    }
+
+    for (i = 0, rd = first; i < n; ++i, ++rd) {
+        do {
+            r = pread(f, dst + rd->dst_offset, rd->size, rd->src_offset);
+        } while (r < 0 && errno == EINTR);
+        if (r < 0) {
+            err(1, "pread failed f=%d r %d", f, r);
+        }
+    }
+
+#else
+
+    int take;
+    int r;
+    for (i = 0, rd = first; i < n; i += take) {
+        int j;
+        uint32_t offset;
+        struct iovec v[IOV_MAX];
+        take = (n - i) < IOV_MAX ? (n - i): IOV_MAX;
+
+        for (j = 0, offset = rd->src_offset; j < take; ++j, ++rd) {
+            v[j].iov_base = dst + rd->dst_offset;
+            v[j].iov_len = rd->size;
+        }
+        do {
+            r = preadv(f, v, take, offset);
+        } while (r < 0 && errno == EINTR);
+        if (r < 0) {
+            err(1, "preadv failed f=%d r %d", f, r);
+        }
+    }
+#endif
+}
+
+static void
+pending_read_insert(DubTree *t, ReadContext *ctx)
+{
+    dubtree_pending_read_t *pr = &ctx->pr;
+
+    pr->read_ctx = ctx;
+    critical_section_enter(&t->pending_read_lock);
+    while (t->num_pending_reads >= DUBTREE_MAX_PENDING_READS) {
+        pthread_cond_wait(&t->read_cond, &t->pending_read_lock);
+    }
+    ++(t->num_pending_reads);
+    TAILQ_INSERT_TAIL(&t->pending_reads, pr, entry);
+    pthread_cond_broadcast(&t->read_cond);
+    critical_section_leave(&t->pending_read_lock);
+}
+
+static void *
+dubtree_read_thread(void *opaque)
+{
+    DubTree *t = opaque;
+
+    for (;;) {
+        dubtree_pending_read_t *pr;
+        ReadContext *ctx;
+
+        critical_section_enter(&t->pending_read_lock);
+        while (!(pr = TAILQ_FIRST(&t->pending_reads)) && !t->read_thread_quit) {
+            pthread_cond_wait(&t->read_cond, &t->pending_read_lock);
+        }
+        if (pr) {
+            TAILQ_REMOVE(&t->pending_reads, pr, entry);
+        }
+        critical_section_leave(&t->pending_read_lock);
+
+        if (!pr) {
+            break;
+        }
+
+        ctx = pr->read_ctx;
+        read_scatter(ctx->f, ctx->dst, ctx->first, ctx->n);
+        put_chunk(t, ctx->f, ctx->line);
+
+        critical_section_enter(&t->pending_read_lock);
+        --(t->num_pending_reads);
+        pthread_cond_broadcast(&t->read_cond);
+        critical_section_leave(&t->pending_read_lock);
+
+        free(ctx->first);
+        decrement_counter(ctx->cs);
+        free(ctx);
+    }
+
+    return NULL;
+}
+
 #endif /* _WIN32 */
 
 static int execute_reads(DubTree *t,
         uint8_t *dst,
-        dubtree_handle_t f,
+        dubtree_handle_t f, int line,
         Read *first, int n,
         CallbackState *cs)
 {
+#ifdef _WIN32
     int i;
     Read *rd;
-
-#ifdef _WIN32
     uint32_t size;
     int contig = 1;
     for (i = size = 0, rd = first; i < n; ++i, ++rd) {
@@ -501,56 +834,36 @@ static int execute_reads(DubTree *t,
     pending_read_insert(t, ctx);
 
 #else
-#ifdef __APPLE__
-
-    int r;
-
-    if (n > 1) {
-        struct radvisory ra = {first->src_offset,
-            first[n - 1].src_offset + first[n - 1].size - first->src_offset};
-        r = fcntl(f, F_RDADVISE, &ra);
-        assert(r >= 0);
-    }
-
-    for (i = 0, rd = first; i < n; ++i, ++rd) {
-        do {
-            r = pread(f, dst + rd->dst_offset, rd->size, rd->src_offset);
-        } while (r < 0 && errno == EINTR);
-        if (r < 0) {
-            err(1, "pread failed f=%d r %d", f, r);
-        }
+    ReadContext *ctx = calloc(1, sizeof(*ctx));
+    if (!ctx) {
+        errx(1, "%s: calloc failed", __FUNCTION__);
+        return -1;
     }
+    ctx->t = t;
+    ctx->f = f;
+    ctx->line = line;
+    ctx->first = first;
+    ctx->n = n;
+    ctx->dst = dst;
+    ctx->cs = cs;
 
-#else
-
-    int take;
-    int r;
-    for (i = 0, rd = first; i < n; i += take) {
-        int j;
-        uint32_t offset;
-        struct iovec v[IOV_MAX];
-        take = (n - i) < IOV_MAX ? (n - i): IOV_MAX;
-
-        for (j = 0, offset = rd->src_offset; j < take; ++j, ++rd) {
-            v[j].iov_base = dst + rd->dst_offset;
-            v[j].iov_len = rd->size;
-        }
-        do {
-            r = preadv(f, v, take, offset);
-        } while (r < 0 && errno == EINTR);
-        if (r < 0) {
-            err(1, "preadv failed f=%d r %d", f, r);
-        }
+    /* Released by the read thread once the read is done. Handles that did
+     * not fit in the cache get closed on release, so use a copy of those. */
+    if (line >= 0) {
+        chunk_cache_ref(&t->cache, line);
+    } else if ((ctx->f = dup(f)) < 0) {
+        err(1, "%s: dup failed", __FUNCTION__);
+        return -1;
     }
-#endif
-    free(first);
 
+    increment_counter(cs);
+    pending_read_insert(t, ctx);
 #endif
 
     return 0;
 }
 
-static int flush_chunk(DubTree *t, uint8_t *dst, dubtree_handle_t f,
+static int flush_chunk(DubTree *t, uint8_t *dst, dubtree_handle_t f, int line,
         ChunkReads *cr, CallbackState *cs)
 {
     int i, j;
@@ -569,7 +882,7 @@ static int flush_chunk(DubTree *t, uint8_t *dst, dubtree_handle_t f,
                 first = malloc((i - j) * sizeof(*first));
                 memcpy(first, reads + j, (i - j) * sizeof(*first));
             }
-            r = execute_reads(t, dst, f, first, i - j, cs);
+            r = execute_reads(t, dst, f, line, first, i - j, cs);
             if (r < 0) {
                 printf("execute_reads failed, r=%d\n", r);
                 break;
@@ -608,7 +921,7 @@ int flush_reads(DubTree *t, Chunk *c, const uint8_t *chunk0, CallbackState *cs)
 
             f = get_chunk(t, cr->chunk_id, 0, &l);
             if (f != DUBTREE_INVALID_HANDLE) {
-                r = flush_chunk(t, c->buf, f, cr, cs);
+                r = flush_chunk(t, c->buf, f, l, cr, cs);
                 put_chunk(t, f, l);
             } else {
                 free(cr->reads);
@@ -687,9 +1000,10 @@ static inline int add_chunk_id(UserData **pud, uint64_t chunk_id)
     return ud->num_chunks;
 }
 
+/* Chunk 0 holds the zero values, which take up no space anywhere. */
 static inline uint64_t get_chunk_id(const UserData *ud, int chunk)
 {
-    return ud->chunk_ids[chunk - 1];
+    return chunk ? ud->chunk_ids[chunk - 1] : 0;
 }
 
 static inline size_t ud_size(const UserData *cud, size_t n)
@@ -697,25 +1011,139 @@ static inline size_t ud_size(const UserData *cud, size_t n)
     return sizeof(*cud) + sizeof(cud->chunk_ids[0]) * n;
 }
 
-typedef struct CachedTree {
-    struct SimpleTree st;
-    uint64_t chunk;
-    dubtree_handle_t f;
-    int line;
-} CachedTree;
-
-typedef struct FindContext {
-    CachedTree cached_trees[DUBTREE_MAX_LEVELS];
-#ifdef _WIN32
-    HANDLE event;
-#endif
-} FindContext;
-
-void *dubtree_prepare_find(DubTree *t)
+/* Each tree carries a blocked Bloom filter over its keys, stored after the
+ * chunk ids in its user data, so that lookups can skip levels that cannot
+ * hold any of the keys asked for. To suit the range lookups done by
+ * dubtree_find(), the filter is over groups of 1 << KEY_FILTER_SHIFT
+ * consecutive keys rather than individual keys. Each group sets
+ * KEY_FILTER_PROBES bits within a single 512-bit block, so that a probe
+ * touches only one cache line. Trees written before the filter was added
+ * have none, and are always searched. */
+
+#define KEY_FILTER_MAGIC 0x6b666c74
+#define KEY_FILTER_SHIFT 4
+#define KEY_FILTER_BITS_PER_GROUP 10
+#define KEY_FILTER_PROBES 6
+#define KEY_FILTER_BLOCK_WORDS 8
+
+typedef struct KeyFilter {
+    uint32_t magic;
+    uint32_t num_blocks; /* Power of two. */
+    uint64_t bits[0];
+} KeyFilter;
+
+static inline uint64_t key_filter_hash(uint64_t x)
+{
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+static inline size_t key_filter_size(uint32_t num_blocks)
+{
+    return sizeof(KeyFilter) +
+        sizeof(uint64_t) * KEY_FILTER_BLOCK_WORDS * num_blocks;
+}
+
+static inline uint32_t key_filter_blocks(size_t num_groups)
+{
+    uint64_t want = (num_groups * KEY_FILTER_BITS_PER_GROUP +
+            64 * KEY_FILTER_BLOCK_WORDS - 1) / (64 * KEY_FILTER_BLOCK_WORDS);
+    uint32_t n;
+    for (n = 1; n < want; n *= 2);
+    return n;
+}
+
+static inline void key_filter_add(KeyFilter *kf, uint64_t group)
+{
+    uint64_t h = key_filter_hash(group);
+    uint64_t *block = kf->bits +
+        KEY_FILTER_BLOCK_WORDS * (h & (kf->num_blocks - 1));
+    int i;
+
+    h = key_filter_hash(h);
+    for (i = 0; i < KEY_FILTER_PROBES; ++i, h >>= 9) {
+        block[(h & 0x1ff) >> 6] |= 1ULL << (h & 0x3f);
+    }
+}
+
+static inline int key_filter_test(const KeyFilter *kf, uint64_t group)
+{
+    uint64_t h = key_filter_hash(group);
+    const uint64_t *block = kf->bits +
+        KEY_FILTER_BLOCK_WORDS * (h & (kf->num_blocks - 1));
+    int i;
+
+    h = key_filter_hash(h);
+    for (i = 0; i < KEY_FILTER_PROBES; ++i, h >>= 9) {
+        if (!(block[(h & 0x1ff) >> 6] & (1ULL << (h & 0x3f)))) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Return the key filter of a tree, or NULL if it was written without one. */
+static inline const KeyFilter *get_key_filter(SimpleTree *st)
+{
+    const UserData *cud = simpletree_get_user(st);
+    size_t size = simpletree_get_user_size(st);
+    size_t offset = ud_size(cud, cud->num_chunks);
+    const KeyFilter *kf = (const KeyFilter *) ((const uint8_t *) cud + offset);
+
+    if (size < offset + sizeof(*kf) || kf->magic != KEY_FILTER_MAGIC ||
+            size < offset + key_filter_size(kf->num_blocks)) {
+        return NULL;
+    }
+    return kf;
+}
+
+/* Check if any of the keys in [start, start + num_keys) that are still
+ * unresolved may be present in a tree with key filter kf. */
+static inline int key_filter_test_range(const KeyFilter *kf, uint64_t start,
+        int num_keys, const uint8_t *versions)
+{
+    uint64_t last = ~0ULL;
+    int i;
+
+    for (i = 0; i < num_keys; ++i) {
+        uint64_t group = (start + i) >> KEY_FILTER_SHIFT;
+        if (!versions[i] && group != last) {
+            if (key_filter_test(kf, group)) {
+                return 1;
+            }
+            last = group;
+        }
+    }
+    return 0;
+}
+
+typedef struct CachedTree {
+    struct SimpleTree st;
+    uint64_t chunk;
+    dubtree_handle_t f;
+    int line;
+} CachedTree;
+
+typedef struct FindContext {
+    CachedTree cached_trees[DUBTREE_MAX_LEVELS];
+#ifdef _WIN32
+    HANDLE event;
+#else
+    thread_event event;
+#endif
+} FindContext;
+
+void *dubtree_prepare_find(DubTree *t)
 {
     FindContext *fx = calloc(1, sizeof(FindContext));
 #ifdef _WIN32
     fx->event = CreateEvent(NULL, FALSE, FALSE, NULL);
+#else
+    thread_event_init(&fx->event);
 #endif
     return fx;
 }
@@ -735,12 +1163,14 @@ void dubtree_end_find(DubTree *t, void *ctx)
     }
 #ifdef _WIN32
     CloseHandle(fx->event);
+#else
+    thread_event_close(&fx->event);
 #endif
     free(fx);
 }
 
 int dubtree_find(DubTree *t, uint64_t start, int num_keys,
-        uint8_t *out, uint8_t *map, uint32_t *sizes,
+        uint8_t **out, uint8_t *map, uint32_t *sizes, DubTreeOrigin *origins,
         read_callback cb, void *opaque, void *ctx)
 {
     int i, r;
@@ -756,6 +1186,8 @@ int dubtree_find(DubTree *t, uint64_t start, int num_keys,
     uint8_t *versions = NULL;
     int succeeded;
     int missing;
+    uint8_t *buf;
+    size_t total;
 
     FindContext *fx = ctx;
     char relevant[DUBTREE_MAX_LEVELS] = {};
@@ -790,7 +1222,7 @@ int dubtree_find(DubTree *t, uint64_t start, int num_keys,
 #ifdef _WIN32
         cs->opaque = (void *) fx->event;
 #else
-        cs->opaque = NULL;
+        cs->opaque = (void *) &fx->event;
 #endif
 
     }
@@ -809,29 +1241,37 @@ int dubtree_find(DubTree *t, uint64_t start, int num_keys,
         if (map[i] == 0) ++missing;
     }
 
-    /* Open all the trees. */
-    critical_section_enter(&t->cache_lock);
+    /* Open all the trees. The levels only need locking against merges
+     * when they changed since we last looked. */
     for (i = 0; i < DUBTREE_MAX_LEVELS; ++i) {
         CachedTree *ct = &fx->cached_trees[i];
-        if (ct->chunk) {
-            if (ct->chunk != t->levels[i]) {
+        if (ct->chunk != t->levels[i]) {
+            break;
+        }
+        if (ct->chunk && ct->line >= 0) {
+            chunk_cache_touch(&t->cache, ct->line);
+        }
+    }
+    if (i < DUBTREE_MAX_LEVELS) {
+        critical_section_enter(&t->levels_lock);
+        for (i = 0; i < DUBTREE_MAX_LEVELS; ++i) {
+            CachedTree *ct = &fx->cached_trees[i];
+            if (ct->chunk && ct->chunk != t->levels[i]) {
                 unmap_tree(ct->st.mem, simpletree_get_nodes_size(&ct->st));
                 ct->chunk = 0;
                 if (ct->f != DUBTREE_INVALID_HANDLE) {
-                    __put_chunk(t, ct->f, ct->line);
+                    put_chunk(t, ct->f, ct->line);
                     ct->f = DUBTREE_INVALID_HANDLE;
                 }
-            } else {
-                lru_cache_touch_line(&t->lru, ct->line);
+            }
+            if (ct->chunk == 0 && (ct->chunk = t->levels[i])) {
+                ct->f = get_chunk(t, ct->chunk, 0, &ct->line);
+                assert (ct->f != DUBTREE_INVALID_HANDLE);
+                simpletree_open(&ct->st, map_tree(ct->f));
             }
         }
-        if (ct->chunk == 0 && (ct->chunk = t->levels[i])) {
-            ct->f = __get_chunk(t, ct->chunk, 0, &ct->line);
-            assert (ct->f != DUBTREE_INVALID_HANDLE);
-            simpletree_open(&ct->st, map_tree(ct->f));
-        }
+        critical_section_leave(&t->levels_lock);
     }
-    critical_section_leave(&t->cache_lock);
 
     /* Check for relevant keys in all fx->cached_trees. */
     for (i = 0; i < DUBTREE_MAX_LEVELS; ++i) {
@@ -842,6 +1282,19 @@ int dubtree_find(DubTree *t, uint64_t start, int num_keys,
         if (st != NULL) {
 
             SimpleTreeResult k;
+            const KeyFilter *kf = get_key_filter(st);
+
+            if (!missing) {
+                break;
+            }
+            if (kf) {
+                __sync_fetch_and_add(&t->filter_probes, 1);
+                if (!key_filter_test_range(kf, start, num_keys, versions)) {
+                    __sync_fetch_and_add(&t->filter_skips, 1);
+                    continue;
+                }
+            }
+
             if (simpletree_find(st, start, &it)) {
                 const UserData *cud = simpletree_get_user(st);
                 while (missing && !simpletree_at_end(st, &it)) {
@@ -864,7 +1317,7 @@ int dubtree_find(DubTree *t, uint64_t start, int num_keys,
                         versions[idx] = 1;
                         sources[idx].chunk_id = get_chunk_id(cud, k.value.chunk);
                         sources[idx].offset = k.value.offset;
-                        sources[idx].size = k.value.size;
+                        sources[idx].size = k.value.chunk ? k.value.size : -1;
                         relevant[i] = 1;
                         --missing;
                     }
@@ -875,20 +1328,60 @@ int dubtree_find(DubTree *t, uint64_t start, int num_keys,
     }
 
 
+    /* Values from a fallback may be had without reading them. */
+    if (origins) {
+        for (i = 0; i < num_keys; ++i) {
+            DubTreeOrigin *o = &origins[i];
+            if (sources[i].size <= 0) {
+                continue;
+            }
+            o->fallback = chunk_fallback(t, sources[i].chunk_id);
+            o->chunk_id = sources[i].chunk_id;
+            o->offset = sources[i].offset;
+            if (o->fallback && t->lookup_cb &&
+                    t->lookup_cb(opaque, i, o)) {
+                sources[i].size = 0;
+            }
+        }
+    }
+
+    /* Work out where the values go in the output buffer. A value shared by
+     * a run of keys is only copied out for the first of them. */
+    for (i = 0, total = 0; i < num_keys; ++i) {
+        int size = sources[i].size;
+        if (size < 0) {
+            sizes[i] = DUBTREE_ZERO_VALUE;
+        } else if (size && i && sources[i - 1].size > 0 &&
+                sources[i].chunk_id == sources[i - 1].chunk_id &&
+                sources[i].offset == sources[i - 1].offset) {
+            sizes[i] = DUBTREE_SHARED_VALUE;
+        } else {
+            sizes[i] = size;
+            total += size;
+        }
+    }
+    buf = NULL;
+    if (total) {
+        buf = malloc(total);
+        if (!buf) {
+            errx(1, "%s: malloc failed line %d", __FUNCTION__, __LINE__);
+        }
+    }
+    *out = buf;
+
     /* Copy out the values we found. */
     Chunk c = {};
-    c.buf = out;
+    c.buf = buf;
     hashtable_init(&c.ht, NULL, NULL);
 
     int dst;
     for (i = dst = 0; i < num_keys; ++i) {
-        int size = sources[i].size;
-        if (size) {
+        if (sizes[i] && sizes[i] != DUBTREE_SHARED_VALUE &&
+                sizes[i] != DUBTREE_ZERO_VALUE) {
             read_chunk(t, &c, sources[i].chunk_id, dst, sources[i].offset,
-                       size);
+                       sizes[i]);
+            dst += sizes[i];
         }
-        sizes[i] = size;
-        dst += size;
     }
 
     r = flush_reads(t, &c, NULL, cs);
@@ -915,12 +1408,23 @@ int dubtree_find(DubTree *t, uint64_t start, int num_keys,
         memcpy(map, versions, sizeof(map[0]) * num_keys);
     }
 
+    /* The caller will retry, so let reads that are still in flight drain
+     * before we free the buffer they read into. */
+    if (!succeeded && cb) {
+        cs->cb = set_event_cb;
+#ifdef _WIN32
+        cs->opaque = (void *) fx->event;
+#else
+        cs->opaque = (void *) &fx->event;
+#endif
+    }
+
     cs->result = r;
     decrement_counter(cs);
     cs = NULL;
 
+    if (!cb || !succeeded) {
 #ifdef _WIN32
-    if (!cb) {
         for (;;) {
             int r = WaitForSingleObjectEx(fx->event, INFINITE, TRUE);
             if (r == WAIT_OBJECT_0) {
@@ -931,8 +1435,17 @@ int dubtree_find(DubTree *t, uint64_t start, int num_keys,
                 Werr(1, "r %x");
             }
         }
-    }
+#else
+        thread_event_wait(&fx->event);
 #endif
+        if (!succeeded) {
+            free(buf);
+            *out = NULL;
+        }
+        if (cb) {
+            cb(opaque, r);
+        }
+    }
 
 out:
     if (num_keys > max_inline_keys) {
@@ -943,6 +1456,13 @@ out:
 }
 
 
+/* Where the value of an incoming key lies in the values passed to
+ * __dubtree_merge(). */
+struct MergeValue {
+    uint32_t offset;
+    uint32_t size;
+};
+
 /* Heap helper functions. */
 
 typedef struct {
@@ -954,6 +1474,7 @@ typedef struct {
     int offset;
     int size;
     uint64_t chunk_id;
+    HashTable values; /* Values met so far, see note_value(). */
 } HeapElem;
 
 static inline int heap_less_than(DubTree *t, HeapElem *a,
@@ -1022,71 +1543,71 @@ static inline char *name_chunk(const char *prefix, uint64_t chunk_id)
     return fn;
 }
 
-static inline dubtree_handle_t __get_chunk(DubTree *t, uint64_t chunk_id, int dirty, int *l)
+/* Return an open handle for chunk_id, pinned in the chunk cache until the
+ * matching put_chunk(). *l is set to -1 if the cache had no room for it, in
+ * which case put_chunk() closes the handle again. */
+static dubtree_handle_t get_chunk(DubTree *t, uint64_t chunk_id, int dirty, int *l)
 {
+    ChunkCache *cc = &t->cache;
+    ChunkCacheShard *sh = chunk_cache_shard(cc, chunk_id);
     dubtree_handle_t f = DUBTREE_INVALID_HANDLE;
-    uint64_t line;
-    LruCacheLine *cl;
+    uint64_t old_key;
+    uintptr_t old_value;
+    int line;
 
-    if (hashtable_find(&t->ht, chunk_id, &line)) {
-        cl = lru_cache_touch_line(&t->lru, line);
-        ++(cl->users);
-        f = (dubtree_handle_t) cl->value;
-    } else {
-        char *fn = NULL;
-        char **fb = t->fallbacks;
-        while (f == DUBTREE_INVALID_HANDLE && *fb) {
-            free(fn);
-            fn = name_chunk(*fb, chunk_id);
-            if (fb == t->fallbacks) {
-                f = dirty ?
-                    dubtree_open_new(fn, 0) :
-                    dubtree_open_existing(fn);
-            } else {
-                f = dubtree_open_existing_readonly(fn);
-            }
-            ++fb;
-        }
+    line = chunk_cache_find(cc, chunk_id);
+    if (line >= 0) {
+        __sync_fetch_and_add(&sh->hits, 1);
+        *l = line;
+        return (dubtree_handle_t) cc->lines[line].value;
+    }
 
-        if (f != DUBTREE_INVALID_HANDLE) {
-            for (;;) {
-                line = lru_cache_evict_line(&t->lru);
-                cl = lru_cache_touch_line(&t->lru, line);
-                if (cl->users == 0) {
-                    break;
-                }
-            }
-            if (cl->key) {
-                hashtable_delete(&t->ht, cl->key);
-                dubtree_close_file((dubtree_handle_t) cl->value);
-            }
+    critical_section_enter(&sh->lock);
+
+    /* Somebody may have opened it while we were waiting for the lock. */
+    line = chunk_cache_find(cc, chunk_id);
+    if (line >= 0) {
+        critical_section_leave(&sh->lock);
+        __sync_fetch_and_add(&sh->hits, 1);
+        *l = line;
+        return (dubtree_handle_t) cc->lines[line].value;
+    }
+    ++(sh->misses);
 
-            cl->key = chunk_id;
-            cl->value = (uint64_t) (uintptr_t) f;
-            cl->users = 1;
-            hashtable_insert(&t->ht, chunk_id, line);
+    char *fn = NULL;
+    char **fb = t->fallbacks;
+    while (f == DUBTREE_INVALID_HANDLE && *fb) {
+        free(fn);
+        fn = name_chunk(*fb, chunk_id);
+        if (fb == t->fallbacks) {
+            f = dirty ?
+                dubtree_open_new(fn, 0) :
+                dubtree_open_existing(fn);
         } else {
-#ifdef _WIN32
-            Wwarn("open chunk=%"PRIx64" failed, fn=%s", chunk_id, fn);
-#else
-            warn("open chunk=%"PRIx64" failed, fn=%s", chunk_id, fn);
-#endif
+            f = dubtree_open_existing_readonly(fn);
         }
-        free(fn);
+        ++fb;
     }
 
     if (f != DUBTREE_INVALID_HANDLE) {
+        line = chunk_cache_evict(cc, chunk_id, &old_key, &old_value);
+        if (line >= 0) {
+            if (old_key) {
+                dubtree_close_file((dubtree_handle_t) old_value);
+            }
+            chunk_cache_fill(cc, line, chunk_id, (uintptr_t) f);
+        }
         *l = line;
+    } else {
+#ifdef _WIN32
+        Wwarn("open chunk=%"PRIx64" failed, fn=%s", chunk_id, fn);
+#else
+        warn("open chunk=%"PRIx64" failed, fn=%s", chunk_id, fn);
+#endif
     }
-    return f;
-}
+    free(fn);
 
-static dubtree_handle_t get_chunk(DubTree *t, uint64_t chunk_id, int dirty, int *l)
-{
-    dubtree_handle_t f;
-    critical_section_enter(&t->cache_lock);
-    f = __get_chunk(t, chunk_id, dirty, l);
-    critical_section_leave(&t->cache_lock);
+    critical_section_leave(&sh->lock);
     return f;
 }
 
@@ -1122,22 +1643,32 @@ static int unlink_chunk(DubTree *t, uint64_t chunk_id, dubtree_handle_t f)
     return 0;
 }
 
-static inline void __put_chunk(DubTree *t, dubtree_handle_t _f, int line)
+static void put_chunk(DubTree *t, dubtree_handle_t f, int line)
 {
-    LruCacheLine *cl = &t->lru.lines[line];
+    ChunkCache *cc = &t->cache;
+    ChunkCacheShard *sh;
     uint64_t chunk_id = 0;
     int delete = 0;
-    dubtree_handle_t f = DUBTREE_INVALID_HANDLE;
 
-    if (cl->users-- == 1) {
-        if (cl->delete) {
-            chunk_id = cl->key;
-            f = (dubtree_handle_t) cl->value;
-            assert(f == _f);
-            hashtable_delete(&t->ht, cl->key);
-            delete = 1;
-            memset(cl, 0, sizeof(*cl));
+    if (line < 0) {
+        dubtree_close_file(f);
+        return;
+    }
+
+    if (chunk_cache_unpin(cc, line) == 0 && cc->lines[line].delete) {
+        /* Last user of a chunk that was freed while in use. Whoever claims
+         * the line gets to delete it. */
+        sh = chunk_cache_line_shard(cc, line);
+        critical_section_enter(&sh->lock);
+        if (chunk_cache_claim_line(cc, line)) {
+            if (cc->lines[line].delete) {
+                chunk_id = cc->keys[line];
+                assert(f == (dubtree_handle_t) cc->lines[line].value);
+                delete = 1;
+            }
+            chunk_cache_clear_line(cc, line);
         }
+        critical_section_leave(&sh->lock);
     }
 
     if (delete) {
@@ -1145,36 +1676,28 @@ static inline void __put_chunk(DubTree *t, dubtree_handle_t _f, int line)
     }
 }
 
-static void put_chunk(DubTree *t, dubtree_handle_t f, int line)
-{
-    critical_section_enter(&t->cache_lock);
-    __put_chunk(t, f, line);
-    critical_section_leave(&t->cache_lock);
-}
-
-static inline void __free_chunk(DubTree *t, uint64_t chunk_id)
+static inline void free_chunk(DubTree *t, uint64_t chunk_id)
 {
-    uint64_t line;
-    int delete = 1;
-    dubtree_handle_t f = DUBTREE_INVALID_HANDLE;
+    ChunkCache *cc = &t->cache;
+    ChunkCacheShard *sh = chunk_cache_shard(cc, chunk_id);
+    int line;
 
-    if (hashtable_find(&t->ht, chunk_id, &line)) {
-        LruCacheLine *cl = &t->lru.lines[line];
-        if (cl->users > 0) {
-            cl->delete = 1;
-            delete = 0;
-        } else {
-            f = (dubtree_handle_t) cl->value;
-            hashtable_delete(&t->ht, cl->key);
-            cl->key = 0;
-            cl->value = 0;
-        }
+    /* Hold the shard lock so that get_chunk() cannot open and cache the
+     * chunk while we are unlinking it. */
+    critical_section_enter(&sh->lock);
+    line = chunk_cache_find(cc, chunk_id);
+    if (line < 0) {
+        unlink_chunk(t, chunk_id, DUBTREE_INVALID_HANDLE);
+        critical_section_leave(&sh->lock);
+        return;
     }
+    critical_section_leave(&sh->lock);
 
-    if (delete) {
-        unlink_chunk(t, chunk_id, f);
-    }
+    /* Deleted by put_chunk() once the last user lets go of it. */
+    cc->lines[line].delete = 1;
+    put_chunk(t, (dubtree_handle_t) cc->lines[line].value, line);
 }
+
 static inline uint64_t alloc_chunk(DubTree *t)
 {
     return __sync_add_and_fetch(&t->header->out_chunk, 1);
@@ -1215,6 +1738,11 @@ void write_chunk(DubTree *t, Chunk *c, const uint8_t *chunk0,
     if (!c->buf) {
         errx(1, "%s: malloc failed", __FUNCTION__);
     }
+
+    thread_event event;
+    thread_event_init(&event);
+    cs->cb = set_event_cb;
+    cs->opaque = (void *) &event;
 #endif
 
     flush_reads(t, c, chunk0, cs);
@@ -1234,6 +1762,8 @@ void write_chunk(DubTree *t, Chunk *c, const uint8_t *chunk0,
     CloseHandle(event);
     UnmapViewOfFile(c->buf);
 #else
+    thread_event_wait(&event);
+    thread_event_close(&event);
     dubtree_pwrite(f, c->buf, size, 0);
     t->free_cb(t->opaque, c->buf);
 #endif
@@ -1243,23 +1773,208 @@ void write_chunk(DubTree *t, Chunk *c, const uint8_t *chunk0,
 }
 
 
+/* Any number of keys of a tree may share a value, in any order, so a value
+ * is only garbage once every key sharing it has been overwritten. The merge
+ * tracks, for each tree it reads, what became of each value it met, and adds
+ * up the values that no key kept when done with the tree. */
+#define VALUE_KEPT (1ULL << 32)
+#define VALUE_DROPPED (1ULL << 33)
+
+static inline uint64_t value_id(const HeapElem *h)
+{
+    return (h->chunk_id << 24) | h->offset;
+}
+
+/* Return the size of the values met in h that no key kept, and forget
+ * them. Only values in the chunks of keep count when given, as the rest go
+ * with their chunks. */
+static uint64_t settle_values(HeapElem *h, HashTable *keep)
+{
+    uint64_t garbage = 0;
+    int i;
+
+    if (h->values.table) {
+        for (i = 0; i < (1 << h->values.bits); ++i) {
+            HashEntry *e = &h->values.table[i];
+            if (e->present && !(e->value & VALUE_KEPT) &&
+                    (!keep || hashtable_find_entry(keep, e->key >> 24))) {
+                garbage += (uint32_t) e->value;
+            }
+        }
+    }
+    hashtable_clear(&h->values);
+    return garbage;
+}
+
+/* Note that the value of the current key of h was kept or dropped. Returns
+ * non-zero the first time a value is kept. */
+static int note_value(HeapElem *h, uint64_t how)
+{
+    HashEntry *e = hashtable_find_entry(&h->values, value_id(h));
+
+    if (!e) {
+        hashtable_insert(&h->values, value_id(h), h->size | how);
+        return how == VALUE_KEPT;
+    }
+    if (how & ~e->value & VALUE_KEPT) {
+        e->value |= how;
+        return 1;
+    }
+    e->value |= how;
+    return 0;
+}
+
+/* Work out where the value of each key inserted lies in values. Returns the
+ * number of bytes they take up. */
+static uint64_t place_values(MergeBuffer *mb, int num_keys,
+        const uint32_t *sizes)
+{
+    struct MergeValue *v;
+    uint64_t offset = 0;
+    int i;
+
+    if (num_keys > mb->values_max) {
+        mb->values_max = num_keys;
+        free(mb->values);
+        mb->values = malloc(sizeof(mb->values[0]) * num_keys);
+        if (!mb->values) {
+            errx(1, "%s: malloc failed", __FUNCTION__);
+        }
+    }
+    v = mb->values;
+    for (i = 0; i < num_keys; ++i) {
+        uint32_t size = sizes[i];
+        if (size == DUBTREE_ZERO_VALUE) {
+            v[i].offset = v[i].size = 0;
+        } else if (size == DUBTREE_SHARED_VALUE) {
+            v[i] = v[i - 1];
+        } else if (DUBTREE_IS_REF_VALUE(size)) {
+            v[i] = v[DUBTREE_REF_INDEX(size)];
+        } else {
+            v[i].offset = offset;
+            v[i].size = size;
+            offset += size;
+        }
+    }
+    return offset;
+}
+
 static inline int chunk_exceeded(size_t size)
 {
-    return (size + DUBTREE_BLOCK_SIZE - 1 > io_sz);
+    return (size + DUBTREE_MAX_VALUE_SIZE > io_sz);
 }
 
-static inline void insert_kv(SimpleTree *st,
+static inline void insert_kv(SimpleTree *st, MergeBuffer *mb, int *n_groups,
         uint64_t key, int chunk, int offset, int size)
 {
     SimpleTreeValue v;
+    uint64_t group = key >> KEY_FILTER_SHIFT;
+    int n = *n_groups;
+
     v.chunk = chunk;
     v.offset = offset;
     v.size = size;
     simpletree_insert(st, key, v);
+
+    /* Keys arrive in order, so we only need to look at the previous group to
+     * weed out duplicates. */
+    if (n && mb->groups[n - 1] == group) {
+        return;
+    }
+    if (n >= mb->groups_max) {
+        mb->groups_max = mb->groups_max ? 2 * mb->groups_max : 1024;
+        mb->groups = realloc(mb->groups, sizeof(mb->groups[0]) *
+                             mb->groups_max);
+        if (!mb->groups) {
+            errx(1, "%s: malloc failed", __FUNCTION__);
+        }
+    }
+    mb->groups[n] = group;
+    *n_groups = n + 1;
 }
 
-int dubtree_insert(DubTree *t, int num_keys, uint64_t* keys, uint8_t *values,
-        uint32_t *sizes, int force_level)
+/* Append a key filter over the key groups collected during the merge to the
+ * user data of the new tree. */
+static UserData *append_key_filter(UserData *ud, MergeBuffer *mb,
+        int n_groups, size_t *size)
+{
+    size_t offset = ud_size(ud, ud->num_chunks);
+    uint32_t num_blocks = key_filter_blocks(n_groups);
+    KeyFilter *kf;
+    int i;
+
+    ud = realloc(ud, offset + key_filter_size(num_blocks));
+    if (!ud) {
+        errx(1, "%s: malloc failed", __FUNCTION__);
+        return NULL;
+    }
+    kf = (KeyFilter *) ((uint8_t *) ud + offset);
+    memset(kf, 0, key_filter_size(num_blocks));
+    kf->magic = KEY_FILTER_MAGIC;
+    kf->num_blocks = num_blocks;
+    for (i = 0; i < n_groups; ++i) {
+        key_filter_add(kf, mb->groups[i]);
+    }
+    *size = offset + key_filter_size(num_blocks);
+    return ud;
+}
+
+/* Stay within the background compaction write budget, by sleeping
+ * whenever we are ahead of schedule. The budget is ignored while an insert is
+ * stalled waiting for us, as we are then on the critical path. */
+static void dubtree_compaction_throttle(DubTree *t, uint64_t bytes)
+{
+    int64_t due;
+
+    t->compact_written += bytes;
+    if (!t->compact_budget) {
+        return;
+    }
+
+    due = t->compact_t0 + (int64_t) (t->compact_written * CLOCK_BASE /
+                                     t->compact_budget);
+    for (;;) {
+        int64_t now = os_get_clock();
+        int64_t ms;
+        if (now >= due || t->insert_stalled || t->compact_quit) {
+            break;
+        }
+        ms = (due - now) / SCALE_MS;
+        ms = ms < 10 ? ms + 1 : 10;
+#ifdef _WIN32
+        Sleep(ms);
+#else
+        usleep(ms * 1000);
+#endif
+        t->compact_throttled += ms;
+    }
+}
+
+static void release_trees(DubTree *t, SimpleTree *trees,
+        dubtree_handle_t *tree_handles, int *tree_lines,
+        int first_level, int last_level)
+{
+    int j;
+    for (j = first_level; j <= last_level; ++j) {
+        SimpleTree *st = &trees[j];
+        if (st->mem) {
+            unmap_tree(st->mem, simpletree_get_nodes_size(st));
+            put_chunk(t, tree_handles[j], tree_lines[j]);
+            st->mem = NULL;
+        }
+    }
+}
+
+/* Merge the incoming keys (if any) with levels first_level and down into the
+ * first level at or below force_level with room for the result, then publish
+ * the merged tree at the smallest level that fits, but not above min_dest.
+ * Levels are allowed to grow to overcommit times their nominal capacity.
+ * Returns -ENOSPC if no level up to last_level has room. Caller must hold
+ * whatever locks protect the levels in the range. */
+static int __dubtree_merge(DubTree *t, MergeBuffer *mb,
+        int num_keys, uint64_t* keys, uint8_t *values, uint32_t *sizes,
+        int first_level, int last_level, int force_level, int min_dest,
+        int overcommit)
 {
     /* Find a free slot at the top level and copy the key there. */
     SimpleTree st;
@@ -1271,7 +1986,7 @@ int dubtree_insert(DubTree *t, int num_keys, uint64_t* keys, uint8_t *values,
     uint64_t garbage = 0;
     UserData *ud = NULL;
     HashTable keep;
-    hashtable_init(&keep, NULL, NULL);
+    HashTable copied; /* Values copied to the out chunk, by source. */
 
     HeapElem tuples[1 + DUBTREE_MAX_LEVELS];
     HeapElem *heap[1 + DUBTREE_MAX_LEVELS];
@@ -1284,25 +1999,27 @@ int dubtree_insert(DubTree *t, int num_keys, uint64_t* keys, uint8_t *values,
 
     uint64_t slot_size = DUBTREE_SLOT_SIZE;
 
-    critical_section_enter(&t->write_lock);
     struct buf_elem {uint64_t key; int offset; int size;};
-    struct buf_elem *buffered = t->buffered;
+    struct buf_elem *buffered = mb->buffered;
+
+    for (i = 0; i < first_level; ++i) {
+        slot_size *= DUBTREE_M;
+    }
 
     if (num_keys > 0) {
-        for (i = 0; i < num_keys; ++i) {
-            needed += sizes[i];
-        }
+        needed += place_values(mb, num_keys, sizes);
 
         min = &tuples[j];
         memset(min, 0, sizeof(*min));
         min->level = -1;
         min->key = keys[0];
-        min->size = sizes[0];
+        min->offset = mb->values[0].offset;
+        min->size = mb->values[0].size;
         heap[j] = min;
         sift_up(t, heap, j++);
     }
 
-    for (i = 0; i < DUBTREE_MAX_LEVELS; ++i) {
+    for (i = first_level; i <= last_level; ++i) {
         /* Figure out how many bytes are in use at this level. */
 
         uint64_t used = 0;
@@ -1333,6 +2050,7 @@ int dubtree_insert(DubTree *t, int num_keys, uint64_t* keys, uint8_t *values,
             min = &tuples[j];
             min->level = i;
             min->st = existing;
+            hashtable_init(&min->values, NULL, NULL);
             simpletree_begin(existing, &min->it);
             k = simpletree_read(existing, &min->it);
             min->key = k.key;
@@ -1350,7 +2068,8 @@ int dubtree_insert(DubTree *t, int num_keys, uint64_t* keys, uint8_t *values,
             cud = NULL;
         }
 
-        if (slot_size >= needed && fragments < DUBTREE_M && used >= garbage &&
+        if (overcommit * slot_size >= needed &&
+                fragments < overcommit * DUBTREE_M && used >= garbage &&
                 i >= force_level) {
             if (existing) {
                 int power;
@@ -1358,6 +2077,8 @@ int dubtree_insert(DubTree *t, int num_keys, uint64_t* keys, uint8_t *values,
                 ud = malloc(ud_size(cud, power));
                 if (!ud) {
                     warnx("%s: malloc failed on line %d", __FUNCTION__, __LINE__);
+                    release_trees(t, trees, tree_handles, tree_lines,
+                                  first_level, i);
                     return -1;
                 }
                 memcpy(ud, cud, ud_size(cud, cud->num_chunks));
@@ -1365,6 +2086,8 @@ int dubtree_insert(DubTree *t, int num_keys, uint64_t* keys, uint8_t *values,
                 ud = calloc(1, sizeof(*ud));
                 if (!ud) {
                     warnx("%s: calloc failed on line %d", __FUNCTION__, __LINE__);
+                    release_trees(t, trees, tree_handles, tree_lines,
+                                  first_level, i);
                     return -1;
                 }
             }
@@ -1375,20 +2098,34 @@ int dubtree_insert(DubTree *t, int num_keys, uint64_t* keys, uint8_t *values,
         slot_size *= DUBTREE_M;
     }
 
-    if (i == DUBTREE_MAX_LEVELS) {
-        printf("all levels full!\n");
-        return -1;
+    if (i > last_level) {
+        release_trees(t, trees, tree_handles, tree_lines,
+                      first_level, last_level);
+        return -ENOSPC;
     }
 
+    hashtable_init(&keep, NULL, NULL);
+    hashtable_init(&copied, NULL, NULL);
+    int n_tuples = j;
+
     /* Create the new B-tree to index the destination level. */
     simpletree_init(&st);
 
     uint32_t b = 0;
+    int n_groups = 0;
     int n_buffered = 0;
     int t_buffered = 0;
     uint64_t total = 0;
     int min_idx = 0;
-    uint32_t min_offset = 0;
+
+    /* Keys may share a value, which we must count and copy only once. The
+     * chunk size estimate only looks at consecutive keys, for which it
+     * remembers where the last value kept came from. Zero values take up
+     * no space and come from no chunk, so they are left out of all this. */
+    uint64_t kept_chunk_id = ~0ULL;
+    uint32_t kept_offset = 0;
+    uint32_t last_offset;
+    int shared;
 
     int done;
     uint64_t last_chunk_id = ~0ULL;
@@ -1404,26 +2141,42 @@ int dubtree_insert(DubTree *t, int num_keys, uint64_t* keys, uint8_t *values,
         int end = 0;
 
         /* Anything to flush before we consume input? */
-        if (n_buffered && ((last_chunk_id != min->chunk_id) || done ||
-                    chunk_exceeded(t_buffered))) {
+        if (n_buffered && ((min->size && last_chunk_id != min->chunk_id) ||
+                    min->level == i || done || chunk_exceeded(t_buffered))) {
             int q;
 
             if (chunk_exceeded(t_buffered) && last_chunk_id) {
 
                 hashtable_insert(&keep, last_chunk_id, 0);
                 int chunk = add_chunk_id(&ud, last_chunk_id);
+                last_offset = ~0U;
                 for (q = 0; q < n_buffered; ++q) {
                     e = &buffered[q];
-                    insert_kv(&st, e->key, chunk, e->offset, e->size);
-                    total += e->size;
+                    if (!e->size) {
+                        insert_kv(&st, mb, &n_groups, e->key, 0, 0, 0);
+                        continue;
+                    }
+                    insert_kv(&st, mb, &n_groups, e->key, chunk, e->offset,
+                              e->size);
+                    if (e->offset != last_offset) {
+                        total += e->size;
+                    }
+                    last_offset = e->offset;
                 }
 
             } else {
 
                 uint32_t b0 = b;
-                uint32_t offset0 = buffered[0].offset;
+                uint32_t offset0 = 0;
 
                 for (q = 0; q < n_buffered; ++q) {
+                    uint64_t source, copy;
+
+                    e = &buffered[q];
+                    if (!e->size) {
+                        insert_kv(&st, mb, &n_groups, e->key, 0, 0, 0);
+                        continue;
+                    }
 
                     if (!out) {
                         out_id = alloc_chunk(t);
@@ -1434,24 +2187,46 @@ int dubtree_insert(DubTree *t, int num_keys, uint64_t* keys, uint8_t *values,
                             return -1;
                         }
                         out_chunk = add_chunk_id(&ud, out_id);
+                        hashtable_clear(&copied);
                     }
 
-                    e = &buffered[q];
-                    insert_kv(&st, e->key, out_chunk, b, e->size);
+                    /* A value shared with a key before is copied once per
+                     * out chunk. */
+                    source = (last_chunk_id << 24) | e->offset;
+                    if (hashtable_find(&copied, source, &copy)) {
+                        insert_kv(&st, mb, &n_groups, e->key, out_chunk,
+                                  copy, e->size);
+                        continue;
+                    }
+
+                    /* Values are read in runs that are contiguous in the
+                     * source chunk. */
+                    if (b > b0 && e->offset != offset0 + (b - b0)) {
+                        read_chunk(t, out, last_chunk_id, b0, offset0, b - b0);
+                        b0 = b;
+                    }
+                    if (b == b0) {
+                        offset0 = e->offset;
+                    }
+                    hashtable_insert(&copied, source, b);
+                    insert_kv(&st, mb, &n_groups, e->key, out_chunk, b,
+                              e->size);
                     total += e->size;
                     b += e->size;
 
                     if (chunk_exceeded(b)) {
                         read_chunk(t, out, last_chunk_id, b0, offset0, b - b0);
-                        offset0 = e->offset + e->size;
 
                         write_chunk(t, out, values, out_id, b);
+                        if (mb->throttle) {
+                            dubtree_compaction_throttle(t, b);
+                        }
                         out = NULL;
                         b0 = b = 0;
                     }
 
                 }
-                if (out) {
+                if (out && b > b0) {
                     read_chunk(t, out, last_chunk_id, b0, offset0, b - b0);
                 }
             }
@@ -1460,6 +2235,9 @@ int dubtree_insert(DubTree *t, int num_keys, uint64_t* keys, uint8_t *values,
         if (done) {
             if (out) {
                 write_chunk(t, out, values, out_id, b);
+                if (mb->throttle) {
+                    dubtree_compaction_throttle(t, b);
+                }
                 out = NULL;
             }
             break;
@@ -1471,17 +2249,27 @@ int dubtree_insert(DubTree *t, int num_keys, uint64_t* keys, uint8_t *values,
 
         if (min->key != last_key) {
             last_key = min->key;
+            shared = 0;
+            if (min->size) {
+                shared = (min->chunk_id == kept_chunk_id &&
+                          min->offset == kept_offset);
+                kept_chunk_id = min->chunk_id;
+                kept_offset = min->offset;
+            }
 
             if (min->level == i) {
-                insert_kv(&st, min->key, min->chunk, min->offset, min->size);
-                total += min->size;
+                insert_kv(&st, mb, &n_groups, min->key, min->chunk,
+                          min->offset, min->size);
+                if (min->size && note_value(min, VALUE_KEPT)) {
+                    total += min->size;
+                }
             } else {
 
-                if (n_buffered >= t->buffer_max) {
-                    t->buffer_max = t->buffer_max ? 2 * t->buffer_max : 1;
-                    buffered = t->buffered = realloc(t->buffered,
-                                                     sizeof(buffered[0]) *
-                                                     t->buffer_max);
+                if (n_buffered >= mb->buffer_max) {
+                    mb->buffer_max = mb->buffer_max ? 2 * mb->buffer_max : 1;
+                    buffered = mb->buffered = realloc(mb->buffered,
+                                                      sizeof(buffered[0]) *
+                                                      mb->buffer_max);
                     if (!buffered) {
                         errx(1, "%s: malloc failed", __FUNCTION__);
                         return -1;
@@ -1492,21 +2280,28 @@ int dubtree_insert(DubTree *t, int num_keys, uint64_t* keys, uint8_t *values,
                 e->key = min->key;
                 e->offset = min->offset;
                 e->size = min->size;
-                t_buffered += min->size;
+                if (!shared) {
+                    t_buffered += min->size;
+                }
+                if (min->st && min->size) {
+                    note_value(min, VALUE_KEPT);
+                }
             }
-        } else {
-            garbage += min->size;
+        } else if (min->size) {
+            /* The incoming keys are the newest, so only ever kept. */
+            note_value(min, VALUE_DROPPED);
         }
 
-        last_chunk_id = min->chunk_id;
+        if (min->size) {
+            last_chunk_id = min->chunk_id;
+        }
 
         /* Find next min for next round. */
         if (min->st) {
             simpletree_next(min->st, &min->it);
             end = simpletree_at_end(min->st, &min->it);
         } else {
-            min_offset += sizes[min_idx++];
-            end = (min_idx == num_keys);
+            end = (++min_idx == num_keys);
         }
         if (end) {
             if (j == 1) {
@@ -1526,22 +2321,35 @@ int dubtree_insert(DubTree *t, int num_keys, uint64_t* keys, uint8_t *values,
                 min->size = k.value.size;
             } else {
                 min->key = keys[min_idx];
-                min->offset = min_offset;
-                min->size = sizes[min_idx];
+                min->offset = mb->values[min_idx].offset;
+                min->size = mb->values[min_idx].size;
             }
         }
         sift_down(t, heap, j);
     }
 
+    /* The chunks of the destination stay, as do those of the other levels
+     * that were kept whole rather than copied, and with them any values
+     * they hold that no key kept. */
+    for (j = 0; j < n_tuples; ++j) {
+        if (tuples[j].st) {
+            garbage += settle_values(&tuples[j],
+                                     tuples[j].level == i ? NULL : &keep);
+        }
+    }
+
     /* Finish the combined tree and commit the merge by
      * installing a globally visible reference to the merged
      * tree. */
 
+    hashtable_clear(&copied);
     simpletree_finish(&st);
     ud->size = total;
     ud->fragments = fragments + 1;
     ud->garbage = garbage;
-    simpletree_set_user(&st, ud, ud_size(ud, ud->num_chunks));
+    size_t ud_bytes;
+    ud = append_key_filter(ud, mb, n_groups, &ud_bytes);
+    simpletree_set_user(&st, ud, ud_bytes);
     free(ud);
 
     uint64_t tree_chunk = alloc_chunk(t);
@@ -1555,20 +2363,20 @@ int dubtree_insert(DubTree *t, int num_keys, uint64_t* keys, uint8_t *values,
     put_chunk(t, f, l);
     simpletree_clear(&st);
 
-    critical_section_enter(&t->cache_lock);
+    critical_section_enter(&t->levels_lock);
 
     /* Find the smallest level that this tree can fit in, and delete
      * the rest of the levels from i and up. */
 
     int dest;
-    for (dest = i; ; --dest) {
+    for (dest = i; dest > min_dest; --dest) {
         slot_size /= DUBTREE_M;
-        if (dest == 0 || slot_size < total) {
+        if (slot_size < total) {
             break;
         }
     }
 
-    for (j = i; j >= 0; --j) {
+    for (j = i; j >= first_level; --j) {
         SimpleTree *st = &trees[j];
         uint64_t chunk_id = t->levels[j];
 
@@ -1582,28 +2390,195 @@ int dubtree_insert(DubTree *t, int num_keys, uint64_t* keys, uint8_t *values,
                 for (k = 0; k < cud->num_chunks; ++k) {
                     uint64_t dead_chunk_id = cud->chunk_ids[k];
                     if (!hashtable_find_entry(&keep, dead_chunk_id)) {
-                        __free_chunk(t, dead_chunk_id);
+                        free_chunk(t, dead_chunk_id);
                     }
                 }
             }
 
             unmap_tree(st->mem, simpletree_get_nodes_size(st));
-            __put_chunk(t, tree_handles[j], tree_lines[j]);
-            __free_chunk(t, chunk_id);
+            put_chunk(t, tree_handles[j], tree_lines[j]);
+            free_chunk(t, chunk_id);
         }
     }
-    critical_section_leave(&t->cache_lock);
-    critical_section_leave(&t->write_lock);
+    critical_section_leave(&t->levels_lock);
     hashtable_clear(&keep);
 
     return 0;
 }
 
+/* Merge everything from the top of the tree and down, in the caller's
+ * context. This is what all inserts used to do, and is still used when
+ * forcing data to a specific level, or when running without the background
+ * compaction thread. */
+static int dubtree_insert_sync(DubTree *t, int num_keys, uint64_t* keys,
+        uint8_t *values, uint32_t *sizes, int force_level)
+{
+    int r;
+
+    critical_section_enter(&t->compact_lock);
+    critical_section_enter(&t->write_lock);
+    r = __dubtree_merge(t, &t->insert_buffer, num_keys, keys, values, sizes,
+                        0, DUBTREE_MAX_LEVELS - 1, force_level, 0, 1);
+    critical_section_leave(&t->write_lock);
+    critical_section_leave(&t->compact_lock);
+
+    if (r == -ENOSPC) {
+        printf("all levels full!\n");
+        r = -1;
+    }
+    return r;
+}
+
+int dubtree_insert(DubTree *t, int num_keys, uint64_t* keys, uint8_t *values,
+        uint32_t *sizes, int force_level)
+{
+    int i, r;
+
+    for (i = 0; i < num_keys; ++i) {
+        if (sizes[i] == DUBTREE_SHARED_VALUE) {
+            assert(i);
+            dubtree_require_features(t, DUBTREE_FEATURE_SHARED_VALUES);
+        } else if (sizes[i] == DUBTREE_ZERO_VALUE) {
+            dubtree_require_features(t, DUBTREE_FEATURE_ZERO_VALUES);
+        } else if (DUBTREE_IS_REF_VALUE(sizes[i])) {
+            assert(DUBTREE_REF_INDEX(sizes[i]) < i);
+            dubtree_require_features(t, DUBTREE_FEATURE_REF_VALUES);
+        }
+    }
+
+    if (force_level || !t->compact_running || t->compact_failed) {
+        return dubtree_insert_sync(t, num_keys, keys, values, sizes,
+                                   force_level);
+    }
+
+    /* Inserts only ever merge with level 0, which is bounded by
+     * DUBTREE_SLOT_SIZE. When level 0 is full, we push it down to level 1
+     * if that is free, which requires no copying, and leave it to the
+     * compaction thread to merge level 1 with the deeper levels. While
+     * compaction is busy, level 0 may grow past its nominal size for a
+     * while rather than stall the insert. */
+    critical_section_enter(&t->write_lock);
+    for (;;) {
+        r = __dubtree_merge(t, &t->insert_buffer, num_keys, keys, values,
+                            sizes, 0, 0, 0, 0, 1);
+        if (r == -ENOSPC && t->levels[1]) {
+            r = __dubtree_merge(t, &t->insert_buffer, num_keys, keys, values,
+                                sizes, 0, 0, 0, 0, DUBTREE_INSERT_OVERCOMMIT);
+        }
+        if (r != -ENOSPC) {
+            break;
+        }
+
+        if (t->levels[0] && !t->levels[1]) {
+            critical_section_enter(&t->levels_lock);
+            t->levels[1] = t->levels[0];
+            __sync_synchronize();
+            t->levels[0] = 0;
+            __sync_synchronize();
+            critical_section_leave(&t->levels_lock);
+            thread_event_set(&t->compact_event);
+            continue;
+        }
+
+        critical_section_leave(&t->write_lock);
+
+        if (!t->levels[0] || !t->compact_running || t->compact_failed) {
+            /* Batch too large for level 0 on its own, or compaction is
+             * not going to make room for us. */
+            return dubtree_insert_sync(t, num_keys, keys, values, sizes, 0);
+        }
+
+        /* Compaction has fallen behind, wait for it to free up level 1. */
+        t->insert_stalled = 1;
+        thread_event_set(&t->compact_event);
+        thread_event_wait(&t->compact_done_event);
+        t->insert_stalled = 0;
+
+        critical_section_enter(&t->write_lock);
+    }
+    critical_section_leave(&t->write_lock);
+
+    return r;
+}
+
+#ifdef _WIN32
+static DWORD WINAPI
+#else
+static void *
+#endif
+dubtree_compaction_thread(void *opaque)
+{
+    DubTree *t = opaque;
+    int r;
+
+    for (;;) {
+        thread_event_wait(&t->compact_event);
+        if (t->compact_quit) {
+            break;
+        }
+
+        /* Level 1 is only ever filled by an insert moving level 0 there
+         * while level 1 is empty, so while we hold compact_lock it is ours
+         * to merge with the levels below it. The merge result is
+         * published no higher than level 2, leaving level 1 free again. */
+        critical_section_enter(&t->compact_lock);
+        while (t->levels[1] && !t->compact_quit) {
+            t->compact_t0 = os_get_clock();
+            t->compact_written = 0;
+            r = __dubtree_merge(t, &t->compact_buffer, 0, NULL, NULL, NULL,
+                                1, DUBTREE_MAX_LEVELS - 1, 2, 2, 1);
+            if (r < 0) {
+                printf("compaction failed, r=%d\n", r);
+                t->compact_failed = 1;
+                break;
+            }
+        }
+        critical_section_leave(&t->compact_lock);
+
+        thread_event_set(&t->compact_done_event);
+        if (t->compact_failed) {
+            break;
+        }
+    }
+
+    debug_printf("%s exiting cleanly\n", __FUNCTION__);
+    return 0;
+}
+
+/* Switch between merging in the background or in the inserting thread. */
+int dubtree_set_compaction(DubTree *t, int background)
+{
+    if (background) {
+        return dubtree_start_compaction(t);
+    }
+    dubtree_stop_compaction(t);
+    return 0;
+}
+
+/* Set the background compaction write budget in bytes per second, with 0
+ * meaning unlimited. Takes effect from the next write of a merge on. */
+void dubtree_set_compaction_budget(DubTree *t, uint64_t budget)
+{
+    t->compact_budget = budget;
+}
+
+uint64_t dubtree_compaction_throttled(DubTree *t)
+{
+    return t->compact_throttled;
+}
+
+void dubtree_set_lookup(DubTree *t, lookup_callback cb)
+{
+    t->lookup_cb = cb;
+}
+
 int dubtree_delete(DubTree *t)
 {
     int i, j;
 
-    critical_section_enter(&t->cache_lock);
+    dubtree_stop_compaction(t);
+
+    critical_section_enter(&t->levels_lock);
     for (i = 0; i < DUBTREE_MAX_LEVELS; ++i) {
         uint64_t chunk_id = t->levels[i];
         if (chunk_id) {
@@ -1622,15 +2597,15 @@ int dubtree_delete(DubTree *t)
 
             cud = simpletree_get_user(&st);
             for (j = 0; j < cud->num_chunks; ++j) {
-                __free_chunk(t, cud->chunk_ids[j]);
+                free_chunk(t, cud->chunk_ids[j]);
             }
 
             unmap_tree(st.mem, simpletree_get_nodes_size(&st));
-            __put_chunk(t, f, line);
-            __free_chunk(t, chunk_id);
+            put_chunk(t, f, line);
+            free_chunk(t, chunk_id);
         }
     }
-    critical_section_leave(&t->cache_lock);
+    critical_section_leave(&t->levels_lock);
 
     char *mn;
     asprintf(&mn, "%s/"DUBTREE_MMAPPED_NAME, t->fallbacks[0]);
@@ -1652,9 +2627,14 @@ int dubtree_delete(DubTree *t)
     return 0;
 }
 
-int dubtree_sanity_check(DubTree *t)
+/* Check that every value in the tree decompresses, using dict (if not NULL)
+ * as the LZ4 dictionary. */
+int dubtree_sanity_check(DubTree *t, const char *dict, int dict_size)
 {
     int i;
+    int r = 0;
+
+    critical_section_enter(&t->compact_lock);
     for (i = 0; i < DUBTREE_MAX_LEVELS; ++i) {
         /* Figure out how many bytes are in use at this level. */
 
@@ -1667,38 +2647,51 @@ int dubtree_sanity_check(DubTree *t)
 
             f = get_chunk(t, t->levels[i], 0, &line);
             if (f == DUBTREE_INVALID_HANDLE) {
-                return -1;
+                r = -1;
+                goto out;
             }
             simpletree_open(&st, map_tree(f));
             simpletree_begin(&st, &it);
             cud = simpletree_get_user(&st);
             while (!simpletree_at_end(&st, &it)) {
                 SimpleTreeResult k;
-                uint8_t in[DUBTREE_BLOCK_SIZE];
+                uint8_t in[DUBTREE_MAX_VALUE_SIZE];
                 uint8_t out[DUBTREE_BLOCK_SIZE];
                 uint64_t chunk_id;
                 int l;
                 int got;
 
                 k = simpletree_read(&st, &it);
+                if (!k.value.chunk) {
+                    simpletree_next(&st, &it);
+                    continue;
+                }
                 chunk_id = get_chunk_id(cud, k.value.chunk);
                 cf = get_chunk(t, chunk_id, 0, &l);
                 if (cf == DUBTREE_INVALID_HANDLE) {
                     warn("unable to read chunk %"PRIx64, chunk_id);
-                    return -1;
+                    r = -1;
+                    goto out;
                 }
                 got = dubtree_pread(cf, in, k.value.size, k.value.offset);
                 assert(got == k.value.size);
                 put_chunk(t, cf, l);
 
+                /* Values larger than a block are multi-block extents, which
+                 * are left for the caller to check. */
                 int sz = k.value.size;
                 if (sz < DUBTREE_BLOCK_SIZE) {
-                    int unsz = LZ4_decompress_safe((const char*)in, (char*)out,
-                                                   sz, DUBTREE_BLOCK_SIZE);
+                    int unsz = dict ?
+                        LZ4_decompress_safe_usingDict((const char*)in,
+                                (char*)out, sz, DUBTREE_BLOCK_SIZE, dict,
+                                dict_size) :
+                        LZ4_decompress_safe((const char*)in, (char*)out,
+                                sz, DUBTREE_BLOCK_SIZE);
                     if (unsz != DUBTREE_BLOCK_SIZE) {
                         printf("%d vs %d, offset=%u size=%u\n", unsz, sz,
                                k.value.offset, sz);
-                        return -1;
+                        r = -1;
+                        goto out;
                     }
                 }
 
@@ -1708,5 +2701,35 @@ int dubtree_sanity_check(DubTree *t)
             put_chunk(t, f, line);
         }
     }
-    return 0;
+out:
+    critical_section_leave(&t->compact_lock);
+    return r;
+}
+
+void dubtree_usage(DubTree *t, uint64_t *used, uint64_t *garbage)
+{
+    int i;
+
+    *used = *garbage = 0;
+    critical_section_enter(&t->compact_lock);
+    for (i = 0; i < DUBTREE_MAX_LEVELS; ++i) {
+        if (t->levels[i]) {
+            SimpleTree st;
+            dubtree_handle_t f;
+            const UserData *cud;
+            int line;
+
+            f = get_chunk(t, t->levels[i], 0, &line);
+            if (f == DUBTREE_INVALID_HANDLE) {
+                continue;
+            }
+            simpletree_open(&st, map_tree(f));
+            cud = simpletree_get_user(&st);
+            *used += cud->size;
+            *garbage += cud->garbage;
+            unmap_tree(st.mem, simpletree_get_nodes_size(&st));
+            put_chunk(t, f, line);
+        }
+    }
+    critical_section_leave(&t->compact_lock);
 }
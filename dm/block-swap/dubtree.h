@@ -8,12 +8,50 @@
 #define __DUBTREE_H__
 
 #include <dm/config.h>
+#include <dm/thread-event.h>
 
 #include "dubtree_constants.h"
 #include "hashtable.h"
-#include "lrucache.h"
+#include "chunkcache.h"
 
 #define DUBTREE_MAX_FALLBACKS 8
+#define DUBTREE_READ_THREADS 8 /* Read threads on macOS, lacking io_uring. */
+#define DUBTREE_CACHE_LINES 512 /* Default number of open chunk handles. */
+#define DUBTREE_MAX_VALUE_SIZE 0xffff /* Value sizes are stored in 16 bits. */
+
+/* Size of a value shared with the key before it. A run of consecutive keys
+ * can share one value, which is then stored and returned only once. Older
+ * builds would read the value once per key, so inserting any requires
+ * DUBTREE_FEATURE_SHARED_VALUES. */
+#define DUBTREE_SHARED_VALUE 0xffffffff
+
+/* Size of a value of all zeroes, which is stored as a mark in the index and
+ * takes up no space in any chunk. Inserting any requires
+ * DUBTREE_FEATURE_ZERO_VALUES. */
+#define DUBTREE_ZERO_VALUE 0xfffffffe
+
+/* Size of a value that is the same as that of the j'th key of the same
+ * insert, for any j before it, and is then stored once. Unlike with
+ * DUBTREE_SHARED_VALUE the keys need not be consecutive, so that lookups
+ * return the value once per key. Inserting any requires
+ * DUBTREE_FEATURE_REF_VALUES. */
+#define DUBTREE_REF_VALUE(j) (0x80000000U | (j))
+#define DUBTREE_IS_REF_VALUE(size) (((size) & 0xc0000000U) == 0x80000000U)
+#define DUBTREE_REF_INDEX(size) ((size) & 0x3fffffff)
+
+/* Features an image may come to depend on, which older dm builds would
+ * misread. Requiring any of them bumps the header version, so that these
+ * refuse the image instead. Bits from DUBTREE_FEATURE_USER_SHIFT on are for
+ * the user of the tree to define and check. */
+#define DUBTREE_FEATURE_SHARED_VALUES (1U << 0)
+#define DUBTREE_FEATURE_ZERO_VALUES (1U << 1)
+#define DUBTREE_FEATURE_REF_VALUES (1U << 2)
+#define DUBTREE_FEATURE_USER_SHIFT 16
+#define DUBTREE_FEATURES_USER (~0U << DUBTREE_FEATURE_USER_SHIFT)
+#define DUBTREE_FEATURES_KNOWN (DUBTREE_FEATURE_SHARED_VALUES | \
+                                DUBTREE_FEATURE_ZERO_VALUES | \
+                                DUBTREE_FEATURE_REF_VALUES | \
+                                DUBTREE_FEATURES_USER)
 
 /* The per-instance in-memory representation of a dubtree. */
 
@@ -25,9 +63,23 @@ typedef struct DubTreeHeader {
     uint32_t dubtree_initialized;
     volatile uint64_t out_chunk;
     volatile uint64_t levels[DUBTREE_MAX_LEVELS];
+    volatile uint32_t features; /* Required, zero in version 12. */
 } DubTreeHeader;
 
+/* Where a value returned by dubtree_find() was read from. Values found in
+ * chunks of a read-only fallback are tagged with a non-zero id for it, which
+ * is the same in every instance opening the same fallback. */
+typedef struct DubTreeOrigin {
+    uint64_t fallback;
+    uint64_t chunk_id;
+    uint32_t offset;
+} DubTreeOrigin;
+
 typedef void (*read_callback) (void *opaque, int result);
+/* Return non-zero if the block for the idx'th key has been filled in from
+ * elsewhere, so that its value need not be read. */
+typedef int (*lookup_callback) (void *opaque, int idx,
+                                const DubTreeOrigin *origin);
 typedef void *(*malloc_callback) (void *opaque, size_t sz);
 typedef void (*free_callback) (void *opaque, void *ptr);
 
@@ -38,8 +90,21 @@ typedef struct dubtree_pending_read {
     TAILQ_ENTRY(dubtree_pending_read) entry;
 } dubtree_pending_read_t;
 
+/* Scratch space for values being copied down during a merge. Inserts and
+ * background compaction each have their own, as they may run concurrently. */
+typedef struct MergeBuffer {
+    void *buffered;
+    int buffer_max;
+    uint64_t *groups; /* Key groups for the key filter of the new level. */
+    int groups_max;
+    struct MergeValue *values; /* Where each incoming value lies. */
+    int values_max;
+    int throttle; /* Subject to the compaction write budget. */
+} MergeBuffer;
+
 typedef struct DubTree {
     critical_section write_lock;
+    critical_section compact_lock;
     DubTreeHeader *header;
     volatile uint64_t *levels;
     uxen_thread read_thread;
@@ -49,33 +114,79 @@ typedef struct DubTree {
     bool read_thread_quit;
     struct io_handler_queue ioh_queue;
     WaitObjects ioh_wait_objects;
+#ifndef _WIN32
+    uxen_thread read_threads[DUBTREE_READ_THREADS];
+    int num_read_threads;
+    pthread_cond_t read_cond;
+    int num_pending_reads;
+#endif
     char *fallbacks[DUBTREE_MAX_FALLBACKS + 1];
-    critical_section cache_lock;
-    HashTable ht;
-    LruCache lru;
-    int buffer_max;
-    void *buffered;
+    uint64_t fallback_ids[DUBTREE_MAX_FALLBACKS + 1];
+    uint64_t fallback_chunks[DUBTREE_MAX_FALLBACKS + 1]; /* Last chunk id. */
+    lookup_callback lookup_cb;
+    critical_section levels_lock; /* Publishing levels vs. opening them. */
+    ChunkCache cache;
+    MergeBuffer insert_buffer;
+    MergeBuffer compact_buffer;
+    uxen_thread compact_thread;
+    thread_event compact_event;
+    thread_event compact_done_event;
+    volatile int compact_running;
+    volatile int compact_quit;
+    volatile int compact_failed;
+    volatile int insert_stalled;
+    uint64_t compact_budget; /* Bytes/s, 0 means unlimited. */
+    uint64_t compact_written;
+    int64_t compact_t0;
+    uint64_t compact_throttled; /* Milliseconds spent held back. */
+    uint64_t filter_probes; /* Level lookups checked against a key filter. */
+    uint64_t filter_skips; /* Level lookups avoided by a key filter. */
     malloc_callback malloc_cb;
     free_callback free_cb;
     void *opaque;
 
 } DubTree;
 
+/* Keys must be sorted. Any key but the first may have size
+ * DUBTREE_SHARED_VALUE, to share the value of the key before it, or
+ * DUBTREE_REF_VALUE(j), to share that of an earlier key j. Keys with size
+ * DUBTREE_ZERO_VALUE have no bytes in values. */
 int dubtree_insert(DubTree *t, int numKeys, uint64_t* keys, uint8_t *values,
         uint32_t *sizes, int force_level);
 
 void *dubtree_prepare_find(DubTree *t);
 void dubtree_end_find(DubTree *t, void *ctx);
 
+/* Values found are returned back to back in *out, which is malloc'ed and must
+ * be freed by the caller, or NULL if there were none. Keys that share the value
+ * returned for the key before get size DUBTREE_SHARED_VALUE, and zero values
+ * get size DUBTREE_ZERO_VALUE; neither take up space in *out. If origins is
+ * given, it is filled in for the keys found, and those found in a fallback are
+ * first offered to the lookup callback with opaque; the ones it fills in get
+ * size 0. */
 int dubtree_find(DubTree *t, uint64_t start, int num_keys,
-        uint8_t *out, uint8_t *map, uint32_t *sizes,
+        uint8_t **out, uint8_t *map, uint32_t *sizes, DubTreeOrigin *origins,
         read_callback cb, void *opaque, void *ctx);
 
 int dubtree_init(DubTree *t, char **fallbacks, malloc_callback malloc_cb,
-    free_callback free_cb, void *opaque);
+    free_callback free_cb, void *opaque, int cache_lines);
 void dubtree_close(DubTree *t);
+/* Record that the image now depends on features, before anything that does
+ * is written. */
+void dubtree_require_features(DubTree *t, uint32_t features);
+uint32_t dubtree_features(DubTree *t);
+void dubtree_cache_stats(DubTree *t, uint64_t *hits, uint64_t *misses,
+    uint64_t *evictions);
 int dubtree_delete(DubTree *t);
 void dubtree_quiesce(DubTree *t);
-int dubtree_sanity_check(DubTree *t);
+int dubtree_sanity_check(DubTree *t, const char *dict, int dict_size);
+/* Bytes of values the levels address, and how many of those are estimated
+ * to no longer be addressed by any key. */
+void dubtree_usage(DubTree *t, uint64_t *used, uint64_t *garbage);
+int dubtree_set_compaction(DubTree *t, int background);
+void dubtree_set_compaction_budget(DubTree *t, uint64_t budget);
+/* Milliseconds background compaction has been held back by its budget. */
+uint64_t dubtree_compaction_throttled(DubTree *t);
+void dubtree_set_lookup(DubTree *t, lookup_callback cb);
 
 #endif /* __DUBTREE_H__ */
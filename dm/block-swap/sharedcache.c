@@ -0,0 +1,567 @@
+/*
+ * Copyright 2019, Bromium, Inc.
+ * SPDX-License-Identifier: ISC
+ */
+
+#include "dubtree_sys.h"
+#include "dubtree_constants.h"
+#include "sharedcache.h"
+
+#ifdef _WIN32
+#include <aclapi.h>
+#include <sddl.h>
+#else
+#include <errno.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#define SHARED_CACHE_MAGIC 0x73686361
+#define SHARED_CACHE_VERSION 2
+#define SHARED_CACHE_WAYS 8
+#define SHARED_CACHE_BLOCK_SIZE DUBTREE_BLOCK_SIZE
+#define SHARED_CACHE_ATTACH_TRIES 100 /* Waiting 10ms each for the creator. */
+
+typedef struct SharedCacheHeader {
+    volatile uint32_t magic; /* Set by the creator once initialized. */
+    uint32_t version;
+    uint32_t block_size;
+    uint32_t ways;
+    uint64_t num_sets;
+    uint64_t data_offset;
+} __attribute__((aligned(64))) SharedCacheHeader;
+
+/* The lock word of a slot holds its sequence count in the low half, and the
+ * pid of the process writing it in the high half. */
+#define SLOT_SEQ(l) ((uint32_t) (l))
+#define SLOT_OWNER(l) ((uint32_t) ((l) >> 32))
+#define SLOT_LOCK(owner, seq) (((uint64_t) (owner) << 32) | (uint32_t) (seq))
+
+typedef struct SharedCacheSlot {
+    volatile uint64_t lock; /* Sequence count is odd while being written. */
+    volatile uint32_t referenced;
+    uint32_t pad;
+    uint64_t sum; /* Of key and data. */
+    SharedCacheKey key;
+} SharedCacheSlot;
+
+typedef struct SharedCacheSet {
+    volatile uint32_t hand;
+    SharedCacheSlot slots[SHARED_CACHE_WAYS];
+} __attribute__((aligned(64))) SharedCacheSet;
+
+struct SharedCache {
+    SharedCacheHeader *header;
+    SharedCacheSet *sets;
+    uint8_t *data;
+    uint64_t size;
+#ifdef _WIN32
+    HANDLE h;
+#endif
+    uint32_t pid;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t inserts;
+    uint64_t corrupt;
+    uint64_t recovered;
+};
+
+static inline uint64_t shared_cache_hash(const SharedCacheKey *key)
+{
+    uint64_t h = key->image;
+
+    h = (h ^ key->chunk) * 0x9e3779b97f4a7c15ULL;
+    h = (h ^ key->offset) * 0x9e3779b97f4a7c15ULL;
+    h = (h ^ key->block) * 0x9e3779b97f4a7c15ULL;
+    return h ^ (h >> 29);
+}
+
+static inline int shared_cache_key_equal(const SharedCacheKey *a,
+                                         const SharedCacheKey *b)
+{
+    return a->image == b->image && a->chunk == b->chunk &&
+        a->offset == b->offset && a->block == b->block;
+}
+
+static uint64_t shared_cache_sum(const SharedCacheKey *key, const void *data)
+{
+    const uint64_t *w = data;
+    uint64_t h = shared_cache_hash(key);
+    int i;
+
+    for (i = 0; i < SHARED_CACHE_BLOCK_SIZE / sizeof(uint64_t); ++i) {
+        h = (h ^ w[i]) * 0x9e3779b97f4a7c15ULL;
+        h ^= h >> 32;
+    }
+    return h;
+}
+
+static inline SharedCacheSet *shared_cache_set(SharedCache *sc,
+                                               const SharedCacheKey *key,
+                                               uint64_t *idx)
+{
+    *idx = shared_cache_hash(key) % sc->header->num_sets;
+    return &sc->sets[*idx];
+}
+
+static inline uint8_t *shared_cache_data(SharedCache *sc, uint64_t set,
+                                         int way)
+{
+    return sc->data +
+        (set * SHARED_CACHE_WAYS + way) * SHARED_CACHE_BLOCK_SIZE;
+}
+
+static void shared_cache_layout(SharedCacheHeader *hdr, uint64_t size)
+{
+    uint64_t per_set = sizeof(SharedCacheSet) +
+        SHARED_CACHE_WAYS * SHARED_CACHE_BLOCK_SIZE;
+
+    hdr->num_sets = (size - sizeof(SharedCacheHeader) -
+                     SHARED_CACHE_BLOCK_SIZE) / per_set;
+    hdr->data_offset = sizeof(SharedCacheHeader) +
+        hdr->num_sets * sizeof(SharedCacheSet);
+    hdr->data_offset = (hdr->data_offset + SHARED_CACHE_BLOCK_SIZE - 1) &
+        ~(SHARED_CACHE_BLOCK_SIZE - 1);
+}
+
+#ifdef _WIN32
+/* Objects are created owned by the default owner of our token, which is
+ * the user, or the administrators group for elevated processes. */
+static PSID shared_cache_token_owner(void)
+{
+    HANDLE tok;
+    TOKEN_OWNER *to;
+    DWORD len = 0;
+    PSID sid = NULL;
+
+    if (!OpenProcessToken(GetCurrentProcess(), TOKEN_QUERY, &tok)) {
+        Wwarn("swap: OpenProcessToken failed");
+        return NULL;
+    }
+    GetTokenInformation(tok, TokenOwner, NULL, 0, &len);
+    to = len ? malloc(len) : NULL;
+    if (to && GetTokenInformation(tok, TokenOwner, to, len, &len)) {
+        len = GetLengthSid(to->Owner);
+        sid = malloc(len);
+        if (sid && !CopySid(len, sid, to->Owner)) {
+            free(sid);
+            sid = NULL;
+        }
+    }
+    if (!sid) {
+        Wwarn("swap: GetTokenInformation failed");
+    }
+    free(to);
+    CloseHandle(tok);
+    return sid;
+}
+#endif
+
+/* Each user gets a segment of their own, so that one user's dm cannot
+ * feed blocks to another's. */
+static char *shared_cache_user_name(const char *name)
+{
+    char *fn = NULL;
+#ifdef _WIN32
+    PSID sid = shared_cache_token_owner();
+    char *ssid;
+
+    if (!sid) {
+        return NULL;
+    }
+    if (!ConvertSidToStringSidA(sid, &ssid)) {
+        Wwarn("swap: ConvertSidToStringSidA failed");
+        free(sid);
+        return NULL;
+    }
+    if (asprintf(&fn, "%s-%s", name, ssid) < 0) {
+        fn = NULL;
+    }
+    LocalFree(ssid);
+    free(sid);
+#else
+    if (asprintf(&fn, "%s-%u", name, (unsigned) geteuid()) < 0) {
+        fn = NULL;
+    }
+#endif
+    if (!fn) {
+        warnx("swap: OOM error %s line %d", __FUNCTION__, __LINE__);
+    }
+    return fn;
+}
+
+/* A segment that exists already must have been created by us, otherwise
+ * someone else could have set it up to be shared. */
+static int shared_cache_check_owner(SharedCache *sc, const char *name,
+                                    int fd)
+{
+#ifdef _WIN32
+    PSID sid, owner;
+    PSECURITY_DESCRIPTOR sd;
+    int ok;
+
+    sid = shared_cache_token_owner();
+    if (!sid) {
+        return -1;
+    }
+    if (GetSecurityInfo(sc->h, SE_KERNEL_OBJECT, OWNER_SECURITY_INFORMATION,
+                        &owner, NULL, NULL, NULL, &sd) != ERROR_SUCCESS) {
+        Wwarn("swap: GetSecurityInfo %s failed", name);
+        free(sid);
+        return -1;
+    }
+    ok = EqualSid(owner, sid);
+    LocalFree(sd);
+    free(sid);
+    if (!ok) {
+        warnx("swap: shared cache %s has another owner", name);
+        return -1;
+    }
+#else
+    struct stat st;
+
+    if (fstat(fd, &st) < 0) {
+        warn("swap: fstat %s failed", name);
+        return -1;
+    }
+    if (st.st_uid != geteuid() || (st.st_mode & 077)) {
+        warnx("swap: shared cache %s has another owner or is accessible "
+              "to others", name);
+        return -1;
+    }
+#endif
+    return 0;
+}
+
+static void *shared_cache_map(SharedCache *sc, const char *name,
+                              uint64_t size, int *created)
+{
+    void *m;
+
+#ifdef _WIN32
+    sc->h = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE,
+                               size >> 32, (DWORD) size, name);
+    if (!sc->h) {
+        Wwarn("swap: CreateFileMappingA %s failed", name);
+        return NULL;
+    }
+    *created = GetLastError() != ERROR_ALREADY_EXISTS;
+    if (!*created && shared_cache_check_owner(sc, name, -1) < 0) {
+        CloseHandle(sc->h);
+        return NULL;
+    }
+
+    /* Pagefile backed sections start out zeroed, and an existing section
+     * is mapped whole, whatever size it was created with. */
+    m = MapViewOfFile(sc->h, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+    if (!m) {
+        Wwarn("swap: MapViewOfFile %s failed", name);
+        CloseHandle(sc->h);
+        return NULL;
+    }
+    if (!*created) {
+        MEMORY_BASIC_INFORMATION mbi;
+        if (!VirtualQuery(m, &mbi, sizeof(mbi))) {
+            Wwarn("swap: VirtualQuery %s failed", name);
+            UnmapViewOfFile(m);
+            CloseHandle(sc->h);
+            return NULL;
+        }
+        size = mbi.RegionSize;
+    }
+#else
+    struct stat st;
+    int fd;
+    int i;
+
+    *created = 1;
+    fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0 && errno == EEXIST) {
+        *created = 0;
+        fd = shm_open(name, O_RDWR, 0);
+    }
+    if (fd < 0) {
+        warn("swap: shm_open %s failed", name);
+        return NULL;
+    }
+
+    if (*created) {
+        if (ftruncate(fd, size) < 0) {
+            warn("swap: ftruncate %s failed", name);
+            close(fd);
+            shm_unlink(name);
+            return NULL;
+        }
+    } else {
+        if (shared_cache_check_owner(sc, name, fd) < 0) {
+            close(fd);
+            return NULL;
+        }
+        /* The creator may not have sized the segment yet. */
+        for (i = 0; i < SHARED_CACHE_ATTACH_TRIES; ++i) {
+            if (fstat(fd, &st) < 0) {
+                warn("swap: fstat %s failed", name);
+                close(fd);
+                return NULL;
+            }
+            if (st.st_size) {
+                break;
+            }
+            usleep(10000);
+        }
+        size = st.st_size;
+    }
+
+    m = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (m == MAP_FAILED) {
+        warn("swap: mmap %s failed", name);
+        return NULL;
+    }
+#endif
+
+    sc->size = size;
+    return m;
+}
+
+static void shared_cache_unmap(SharedCache *sc)
+{
+#ifdef _WIN32
+    UnmapViewOfFile(sc->header);
+    CloseHandle(sc->h);
+#else
+    munmap(sc->header, sc->size);
+#endif
+}
+
+SharedCache *shared_cache_open(const char *name, uint64_t size)
+{
+    SharedCache *sc;
+    SharedCacheHeader *hdr;
+    char *fn;
+    int created;
+    int i;
+
+    if (size < sizeof(SharedCacheHeader) + 2 * SHARED_CACHE_BLOCK_SIZE +
+            sizeof(SharedCacheSet) +
+            SHARED_CACHE_WAYS * SHARED_CACHE_BLOCK_SIZE) {
+        warnx("swap: shared cache size %"PRIu64" too small", size);
+        return NULL;
+    }
+
+    sc = calloc(1, sizeof(*sc));
+    if (!sc) {
+        warnx("swap: OOM error %s line %d", __FUNCTION__, __LINE__);
+        return NULL;
+    }
+
+    fn = shared_cache_user_name(name);
+    if (!fn) {
+        free(sc);
+        return NULL;
+    }
+
+    hdr = shared_cache_map(sc, fn, size, &created);
+    if (!hdr) {
+        free(fn);
+        free(sc);
+        return NULL;
+    }
+    sc->header = hdr;
+#ifdef _WIN32
+    sc->pid = GetCurrentProcessId();
+#else
+    sc->pid = getpid();
+#endif
+
+    if (created) {
+        /* Fresh segments are zero filled, which leaves every slot empty:
+         * no key has an image id of 0. */
+        hdr->version = SHARED_CACHE_VERSION;
+        hdr->block_size = SHARED_CACHE_BLOCK_SIZE;
+        hdr->ways = SHARED_CACHE_WAYS;
+        shared_cache_layout(hdr, sc->size);
+        __sync_synchronize();
+        hdr->magic = SHARED_CACHE_MAGIC;
+    } else {
+        for (i = 0; i < SHARED_CACHE_ATTACH_TRIES &&
+                hdr->magic != SHARED_CACHE_MAGIC; ++i) {
+#ifdef _WIN32
+            Sleep(10);
+#else
+            usleep(10000);
+#endif
+        }
+        __sync_synchronize();
+        if (hdr->magic != SHARED_CACHE_MAGIC ||
+                hdr->version != SHARED_CACHE_VERSION ||
+                hdr->block_size != SHARED_CACHE_BLOCK_SIZE ||
+                hdr->ways != SHARED_CACHE_WAYS ||
+                hdr->data_offset + hdr->num_sets * SHARED_CACHE_WAYS *
+                SHARED_CACHE_BLOCK_SIZE > sc->size) {
+            warnx("swap: shared cache %s has unexpected format", fn);
+            shared_cache_unmap(sc);
+            free(fn);
+            free(sc);
+            return NULL;
+        }
+    }
+
+    sc->sets = (SharedCacheSet *) (hdr + 1);
+    sc->data = (uint8_t *) hdr + hdr->data_offset;
+
+    debug_printf("swap: %s shared cache %s, %"PRIu64" blocks\n",
+                 created ? "created" : "attached to", fn,
+                 hdr->num_sets * SHARED_CACHE_WAYS);
+    free(fn);
+    return sc;
+}
+
+void shared_cache_close(SharedCache *sc)
+{
+    shared_cache_unmap(sc);
+    free(sc);
+}
+
+/* Tell if the process writing a slot has gone away, leaving it odd. A pid
+ * that has since been reused keeps the slot stuck, losing one way of the
+ * set. */
+static int shared_cache_owner_dead(uint32_t pid)
+{
+#ifdef _WIN32
+    HANDLE h;
+    int dead;
+
+    h = OpenProcess(SYNCHRONIZE, FALSE, pid);
+    if (!h) {
+        return GetLastError() == ERROR_INVALID_PARAMETER;
+    }
+    dead = WaitForSingleObject(h, 0) == WAIT_OBJECT_0;
+    CloseHandle(h);
+    return dead;
+#else
+    return kill(pid, 0) < 0 && errno == ESRCH;
+#endif
+}
+
+/* Take over a slot left odd by a writer that died, and empty it. */
+static void shared_cache_recover(SharedCache *sc, SharedCacheSlot *sl,
+                                 uint64_t l)
+{
+    uint32_t seq = SLOT_SEQ(l);
+
+    if (!SLOT_OWNER(l) || !shared_cache_owner_dead(SLOT_OWNER(l))) {
+        return;
+    }
+    if (!__sync_bool_compare_and_swap(&sl->lock, l,
+                                      SLOT_LOCK(sc->pid, seq + 2))) {
+        return;
+    }
+    memset(&sl->key, 0, sizeof(sl->key));
+    sl->referenced = 0;
+    __sync_synchronize();
+    sl->lock = SLOT_LOCK(0, seq + 3);
+    __sync_fetch_and_add(&sc->recovered, 1);
+}
+
+int shared_cache_lookup(SharedCache *sc, const SharedCacheKey *key,
+                        void *out)
+{
+    SharedCacheSet *set;
+    uint64_t idx;
+    int i;
+
+    set = shared_cache_set(sc, key, &idx);
+    for (i = 0; i < SHARED_CACHE_WAYS; ++i) {
+        SharedCacheSlot *sl = &set->slots[i];
+        uint64_t l = sl->lock;
+        uint64_t sum;
+
+        if (SLOT_SEQ(l) & 1) {
+            continue;
+        }
+        __sync_synchronize();
+        if (!shared_cache_key_equal(&sl->key, key)) {
+            continue;
+        }
+        sum = sl->sum;
+        memcpy(out, shared_cache_data(sc, idx, i), SHARED_CACHE_BLOCK_SIZE);
+        __sync_synchronize();
+        if (sl->lock != l) {
+            /* Overwritten while we were copying. */
+            continue;
+        }
+        if (shared_cache_sum(key, out) != sum) {
+            __sync_fetch_and_add(&sc->corrupt, 1);
+            continue;
+        }
+        sl->referenced = 1;
+        __sync_fetch_and_add(&sc->hits, 1);
+        return 1;
+    }
+    __sync_fetch_and_add(&sc->misses, 1);
+    return 0;
+}
+
+void shared_cache_insert(SharedCache *sc, const SharedCacheKey *key,
+                         const void *data)
+{
+    SharedCacheSet *set;
+    uint64_t idx;
+    int i;
+
+    set = shared_cache_set(sc, key, &idx);
+
+    /* Another instance may have got here first. */
+    for (i = 0; i < SHARED_CACHE_WAYS; ++i) {
+        SharedCacheSlot *sl = &set->slots[i];
+        if (!(SLOT_SEQ(sl->lock) & 1) &&
+                shared_cache_key_equal(&sl->key, key)) {
+            return;
+        }
+    }
+
+    /* Sweep the clock hand over the set, giving referenced slots a second
+     * chance. Two turns always find a victim, unless other writers keep
+     * claiming them, in which case the block is simply not cached. */
+    for (i = 0; i < 2 * SHARED_CACHE_WAYS; ++i) {
+        int way = __sync_fetch_and_add(&set->hand, 1) % SHARED_CACHE_WAYS;
+        SharedCacheSlot *sl = &set->slots[way];
+        uint64_t l = sl->lock;
+        uint32_t seq = SLOT_SEQ(l);
+
+        if (seq & 1) {
+            shared_cache_recover(sc, sl, l);
+            continue;
+        }
+        if (sl->referenced) {
+            sl->referenced = 0;
+            continue;
+        }
+        if (!__sync_bool_compare_and_swap(&sl->lock, l,
+                                          SLOT_LOCK(sc->pid, seq + 1))) {
+            continue;
+        }
+        sl->key = *key;
+        memcpy(shared_cache_data(sc, idx, way), data,
+               SHARED_CACHE_BLOCK_SIZE);
+        sl->sum = shared_cache_sum(key, data);
+        sl->referenced = 1;
+        __sync_synchronize();
+        sl->lock = SLOT_LOCK(0, seq + 2);
+        __sync_fetch_and_add(&sc->inserts, 1);
+        return;
+    }
+}
+
+void shared_cache_stats(SharedCache *sc, uint64_t *hits, uint64_t *misses,
+                        uint64_t *inserts, uint64_t *corrupt,
+                        uint64_t *recovered)
+{
+    *hits = sc->hits;
+    *misses = sc->misses;
+    *inserts = sc->inserts;
+    *corrupt = sc->corrupt;
+    *recovered = sc->recovered;
+}
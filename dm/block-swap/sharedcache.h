@@ -0,0 +1,44 @@
+/*
+ * Copyright 2019, Bromium, Inc.
+ * SPDX-License-Identifier: ISC
+ */
+
+#ifndef __SHAREDCACHE_H__
+#define __SHAREDCACHE_H__
+
+/* Cache of decompressed blocks, in a named shared memory segment that every
+ * dm instance run by the same user attaches to. The segment name carries the
+ * user id, or the owner SID on Windows, and a segment found to be owned by
+ * anyone else is not used. Only blocks read from read-only fallback images
+ * are cached, so that VMs cloned from the same base image share the work of
+ * reading and decompressing it.
+ *
+ * The cache is set-associative. Lookups take no locks: each slot carries a
+ * sequence count, which is odd while the slot is being written, and a reader
+ * only trusts a copy taken while the count stayed even and unchanged, and
+ * that matches the checksum stored with it. Writers claim a slot by swinging
+ * its count from even to odd, and record their pid with it so that a slot
+ * left odd by a writer that died can be taken back. Eviction within a set
+ * follows the CLOCK algorithm. */
+
+typedef struct SharedCacheKey {
+    uint64_t image; /* Identifies the fallback image, never 0. */
+    uint64_t chunk; /* Chunk and offset the value was read from. */
+    uint64_t offset;
+    uint64_t block; /* Block within the value. */
+} SharedCacheKey;
+
+typedef struct SharedCache SharedCache;
+
+/* The user is appended to name. */
+SharedCache *shared_cache_open(const char *name, uint64_t size);
+void shared_cache_close(SharedCache *sc);
+int shared_cache_lookup(SharedCache *sc, const SharedCacheKey *key,
+                        void *out);
+void shared_cache_insert(SharedCache *sc, const SharedCacheKey *key,
+                         const void *data);
+void shared_cache_stats(SharedCache *sc, uint64_t *hits, uint64_t *misses,
+                        uint64_t *inserts, uint64_t *corrupt,
+                        uint64_t *recovered);
+
+#endif /* __SHAREDCACHE_H__ */
@@ -324,3 +324,9 @@ const void *simpletree_get_user(SimpleTree *st)
         return (void *) off2ptr(st->mem, n);
     }
 }
+
+size_t simpletree_get_user_size(SimpleTree *st)
+{
+    SimpleTreeMetaNode *meta = &off2ptr(st->mem, 0)->u.mn;
+    return meta->user_size;
+}
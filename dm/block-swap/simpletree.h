@@ -92,6 +92,7 @@ int simpletree_find(SimpleTree *st, uint64_t key, SimpleTreeIterator *it);
 void simpletree_open(SimpleTree *st, void *mem);
 void simpletree_set_user(SimpleTree *st, const void *data, size_t size);
 const void *simpletree_get_user(SimpleTree *st);
+size_t simpletree_get_user_size(SimpleTree *st);
 
 /* Free the per-process in-memory tree representation and
  * NULL the pointer to it to prevent future use. */
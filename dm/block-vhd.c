@@ -11,15 +11,10 @@
 /*
  * Todo:
  * - cancel: interrupt in progress requests
- * - td_prep_{read,write}: on error, add bh to run cb with failure code
  * - aio read/write win32: handle case where there's no wait objects
  *   + qemu_add_wait_object failure needs to be propagated
  *   + td_prep_{read,write} should put tiocb on queue
  *   + try to re-issue from cb or add bh for re-issue
- * - aio flush: implement
- *   + queue incoming requests
- *   + put callback into a bh
- *   + schedule bh when in_progress goes to 0
  */
 #include "config.h"
 
@@ -80,6 +75,18 @@
 
 #define SECTOR_SHIFT 9
 
+typedef struct VhdAIOCB {
+    BlockDriverAIOCB common;
+    BH *bh;
+    int ret;
+    int nsecs_remaining;
+    int cancelled;
+#ifndef VHD_NO_AIO
+    STAILQ_ENTRY(VhdAIOCB) next;
+    td_request_t treq;
+#endif
+} VhdAIOCB;
+
 typedef struct VhdState {
 #ifdef VHD_NO_AIO
     vhd_context_t ctx;
@@ -87,18 +94,14 @@ typedef struct VhdState {
     td_driver_t td_driver;
     BlockDriverState *parent_bs;
     int has_parent;
+    /* flushes waiting for in_progress to drain, and the requests
+     * submitted behind them, which are held back until then */
+    STAILQ_HEAD(, VhdAIOCB) flushes;
+    STAILQ_HEAD(, VhdAIOCB) held;
 #endif
     int in_progress;
 } VhdState;
 
-typedef struct VhdAIOCB {
-    BlockDriverAIOCB common;
-    BH *bh;
-    int ret;
-    int nsecs_remaining;
-    int cancelled;
-} VhdAIOCB;
-
 #ifndef VHD_NO_AIO
 static void bdrv_vhd_aio_cancel(BlockDriverAIOCB *_acb);
 #endif
@@ -350,10 +353,26 @@ libvhd_aio_write_stub(int fd, const uint8_t *buf, off64_t offset, size_t bytes,
     }
     aiocb = bdrv_aio_write(h[fd].hd, offset >> SECTOR_SHIFT, buf,
 			   bytes >> SECTOR_SHIFT, cb, arg);
+    /* new blocks are not pre-allocated and are written past the end
+     * of the file -- account for them, so that a later synchronous
+     * write past the end doesn't zero-extend over them */
+    if (aiocb && offset + bytes > h[fd].size)
+	h[fd].size = offset + bytes;
     dprintf("issued aio write for %"PRIxS"@%"PRIx64" buf %p => %p\n",
 	    bytes >> SECTOR_SHIFT, offset >> SECTOR_SHIFT, buf, aiocb);
     return aiocb;
 }
+
+static BlockDriverAIOCB *
+libvhd_aio_flush_stub(int fd, libvhd_aio_stub_cb cb, void *arg)
+{
+
+    if (bad_handle(fd)) {
+	errno = EBADF;
+	return NULL;
+    }
+    return bdrv_aio_flush(h[fd].hd, cb, arg);
+}
 #endif
 
 static int bdrv_vhd_probe(const uint8_t *buf, int buf_size,
@@ -526,14 +545,19 @@ static int bdrv_vhd_aio_open(BlockDriverState *bs, const char *filename,
     if (!strncmp(filename, "vhd:", 4))
 	filename = &filename[4];
 
-    ret = _vhd_open(&s->td_driver, filename,
-		    (flags & BDRV_O_RDWR) ? 0 : TD_OPEN_RDONLY);
+    /* don't pre-allocate new blocks: this zero-fills the whole block
+     * with a synchronous write, while unwritten sectors are never read
+     * from the image, since the block's bitmap marks them absent */
+    ret = _vhd_open(&s->td_driver, filename, TD_OPEN_NO_PREALLOCATE |
+		    ((flags & BDRV_O_RDWR) ? 0 : TD_OPEN_RDONLY));
     if (ret < 0)
 	return ret;
 
     bs->total_sectors = s->td_driver.info.size;
 
     s->in_progress = 0;
+    STAILQ_INIT(&s->flushes);
+    STAILQ_INIT(&s->held);
 
     ret = vhd_get_parent_id(&s->td_driver, &parent_id);
     if (ret == 0) {
@@ -674,9 +698,12 @@ static void bdrv_vhd_aio_queue_reissue(void)
     }
 }
 
+static void bdrv_vhd_aio_drained(VhdState *s);
+
 static void bdrv_vhd_aio_cb(td_request_t treq, int res)
 {
     VhdAIOCB *acb = (VhdAIOCB *)treq.cb_data;
+    VhdState *s = (VhdState *)acb->common.bs->opaque;
 
     if (res && res != -EBUSY)
 	eprintf("bdrv_vhd_aio_cb %p failed: %x of %x: res %d\n", acb,
@@ -692,12 +719,13 @@ static void bdrv_vhd_aio_cb(td_request_t treq, int res)
 	res = bdrv_vhd_aio_queue_blocked(&treq);
 
     if (acb->nsecs_remaining == 0 || (res && res != -EBUSY)) {
-	((VhdState *)acb->common.bs->opaque)->in_progress--;
-	pprintf("acb %p returned (%d outstanding)\n", acb,
-		((VhdState *)acb->common.bs->opaque)->in_progress);
+	s->in_progress--;
+	pprintf("acb %p returned (%d outstanding)\n", acb, s->in_progress);
 	if (acb->cancelled == 0)
 	    acb->common.cb(acb->common.opaque, -res);
 	aio_release(acb);
+	if (s->in_progress == 0)
+	    bdrv_vhd_aio_drained(s);
     }
 
     if (!STAILQ_EMPTY(&queued_treqs) && res != -EBUSY)
@@ -733,6 +761,7 @@ bdrv_vhd_aio_setup(BlockDriverState *bs, td_driver_t *driver,
     treq->private = driver;
 
     acb->nsecs_remaining = nb_sectors;
+    acb->cancelled = 0;
 
     return acb;
 }
@@ -750,10 +779,15 @@ bdrv_vhd_aio_read(BlockDriverState *bs,
 			     nb_sectors, cb, opaque);
     if (acb == NULL)
 	goto out;
-    s->in_progress++;
     dprintf("bdrv_vhd_aio_read %x@%"PRIx64" buf %p => %p\n", nb_sectors,
 	    sector_num, buf, acb);
     treq.op = TD_OP_READ;
+    if (!STAILQ_EMPTY(&s->flushes)) {
+	acb->treq = treq;
+	STAILQ_INSERT_TAIL(&s->held, acb, next);
+	goto out;
+    }
+    s->in_progress++;
     vhd_queue_read(&s->td_driver, treq);
     pprintf("read acb %p submitted (%d outstanding)\n", acb,
 	    ((VhdState *)acb->common.bs->opaque)->in_progress);
@@ -773,10 +807,15 @@ static BlockDriverAIOCB *bdrv_vhd_aio_write(BlockDriverState *bs,
 			     (uint8_t *)buf, nb_sectors, cb, opaque);
     if (acb == NULL)
 	goto out;
-    s->in_progress++;
     dprintf("bdrv_vhd_aio_write %x@%"PRIx64" buf %p => %p\n", nb_sectors,
 	    sector_num, buf, acb);
     treq.op = TD_OP_WRITE;
+    if (!STAILQ_EMPTY(&s->flushes)) {
+	acb->treq = treq;
+	STAILQ_INSERT_TAIL(&s->held, acb, next);
+	goto out;
+    }
+    s->in_progress++;
     vhd_queue_write(&s->td_driver, treq);
     pprintf("write acb %p submitted (%d outstanding)\n", acb,
 	    ((VhdState *)acb->common.bs->opaque)->in_progress);
@@ -784,6 +823,94 @@ static BlockDriverAIOCB *bdrv_vhd_aio_write(BlockDriverState *bs,
     return (BlockDriverAIOCB *)acb;
 }
 
+static void bdrv_vhd_aio_flush_cb(void *opaque, int ret)
+{
+    VhdAIOCB *acb = opaque;
+
+    dprintf("bdrv_vhd_aio_flush_cb %p: ret %d\n", acb, ret);
+    if (acb->cancelled == 0)
+	acb->common.cb(acb->common.opaque, ret);
+    aio_release(acb);
+}
+
+static void bdrv_vhd_aio_flush_fail_bh(void *opaque)
+{
+
+    bdrv_vhd_aio_flush_cb(opaque, -EIO);
+}
+
+static void bdrv_vhd_aio_flush_issue(VhdAIOCB *acb)
+{
+    VhdState *s = acb->common.bs->opaque;
+    BH *bh;
+
+    if (libvhd_aio_flush_stub(vhd_fd(&s->td_driver), bdrv_vhd_aio_flush_cb,
+			      acb))
+	return;
+
+    eprintf("bdrv_vhd_aio_flush_issue: libvhd_aio_flush_stub failed\n");
+    /* complete from a bh, bdrv_vhd_aio_flush may not have returned yet */
+    bh = bh_new(bdrv_vhd_aio_flush_fail_bh, acb);
+    if (bh == NULL) {
+	eprintf("bdrv_vhd_aio_flush_issue: bh_new failed\n");
+	return;
+    }
+    bh_schedule_one_shot(bh);
+}
+
+/* all requests submitted ahead of the queued flushes have completed,
+ * along with the bitmap and BAT updates they caused: flush the image
+ * file, then let the requests held back behind the flushes go */
+static void bdrv_vhd_aio_drained(VhdState *s)
+{
+    VhdAIOCB *acb;
+
+    while ((acb = STAILQ_FIRST(&s->flushes))) {
+	STAILQ_REMOVE_HEAD(&s->flushes, next);
+	bdrv_vhd_aio_flush_issue(acb);
+    }
+
+    while ((acb = STAILQ_FIRST(&s->held))) {
+	STAILQ_REMOVE_HEAD(&s->held, next);
+	s->in_progress++;
+	switch (acb->treq.op) {
+	case TD_OP_READ:
+	    vhd_queue_read(&s->td_driver, acb->treq);
+	    break;
+	case TD_OP_WRITE:
+	    vhd_queue_write(&s->td_driver, acb->treq);
+	    break;
+	}
+    }
+}
+
+static BlockDriverAIOCB *bdrv_vhd_aio_flush(BlockDriverState *bs,
+        BlockDriverCompletionFunc *cb, void *opaque)
+{
+    VhdState *s = bs->opaque;
+    VhdAIOCB *acb;
+
+#ifdef VHD_TLOG
+    tlog_flush();
+#endif
+
+    acb = aio_get(&vhd_aio_pool, bs, cb, opaque);
+    if (acb == NULL)
+	return NULL;
+    acb->cancelled = 0;
+    dprintf("bdrv_vhd_aio_flush %p (%d outstanding)\n", acb,
+	    s->in_progress);
+
+    /* unlike bdrv_vhd_flush, don't wait on the main loop for the
+     * requests ahead of the flush: queue it until they have completed */
+    if (s->in_progress)
+	STAILQ_INSERT_TAIL(&s->flushes, acb, next);
+    else
+	bdrv_vhd_aio_flush_issue(acb);
+
+    return (BlockDriverAIOCB *)acb;
+}
+
 static void bdrv_vhd_aio_cancel(BlockDriverAIOCB *_acb)
 {
     VhdAIOCB *acb = (VhdAIOCB *)_acb;
@@ -859,6 +986,29 @@ td_tiocb_complete_cb(void *opaque, int ret)
     tiocb->cb(tiocb->arg, tiocb, ret);
 }
 
+static void
+td_tiocb_fail_bh(void *opaque)
+{
+    struct tiocb *tiocb = opaque;
+
+    tiocb->cb(tiocb->arg, tiocb, -EIO);
+}
+
+static void
+td_tiocb_fail(struct tiocb *tiocb)
+{
+    BH *bh;
+
+    /* complete from a bh, the caller doesn't expect the callback to
+     * run before td_prep_{read,write} returns */
+    bh = bh_new(td_tiocb_fail_bh, tiocb);
+    if (bh == NULL) {
+	eprintf("td_tiocb_fail: bh_new failed\n");
+	return;
+    }
+    bh_schedule_one_shot(bh);
+}
+
 void
 td_prep_read(struct tiocb *tiocb, int fd, char *buf, size_t bytes,
 	     long long offset, td_queue_callback_t cb, void *arg)
@@ -871,8 +1021,8 @@ td_prep_read(struct tiocb *tiocb, int fd, char *buf, size_t bytes,
     tiocb->opaque = libvhd_aio_read_stub(fd, (unsigned char *)buf, offset,
 					 bytes, td_tiocb_complete_cb, tiocb);
     if (tiocb->opaque == NULL) {
-	/* Add bh to run cb with failure code */
 	eprintf("td_prep_read: libvhd_aio_read_stub failed\n");
+	td_tiocb_fail(tiocb);
     }
 }
 
@@ -888,8 +1038,8 @@ td_prep_write(struct tiocb *tiocb, int fd, char *buf, size_t bytes,
     tiocb->opaque = libvhd_aio_write_stub(fd, (unsigned char *)buf, offset,
 					  bytes, td_tiocb_complete_cb, tiocb);
     if (tiocb->opaque == NULL) {
-	/* Add bh to run cb with failure code */
 	eprintf("td_prep_write: libvhd_aio_write_stub failed\n");
+	td_tiocb_fail(tiocb);
     }
 }
 #endif
@@ -925,6 +1075,7 @@ BlockDriver bdrv_vhd = {
 
     .bdrv_aio_read = bdrv_vhd_aio_read,
     .bdrv_aio_write = bdrv_vhd_aio_write,
+    .bdrv_aio_flush = bdrv_vhd_aio_flush,
 
     .protocol_name = "vhd",
 };
@@ -165,6 +165,10 @@ bdrv_add(yajl_val arg)
     id = yajl_object_get_string(arg, "id");
     proto = yajl_object_get_string(arg, "proto") ?: "raw";
     log_swap_fills = yajl_object_get_bool_default(arg, "log-swap-fill-reads", false);
+    swap_chunk_cache_lines = yajl_object_get_integer_default(
+        arg, "swap-chunk-cache-lines", 0);
+    swap_shared_cache_mb = yajl_object_get_integer_default(
+        arg, "swap-shared-cache-mb", 0);
     path = yajl_object_get_string(arg, "path");
 
 #ifndef LIBIMG
@@ -593,6 +597,7 @@ static void
 bdrv_close(BlockDriverState *bs)
 {
     if (bs->drv) {
+        bdrv_merge_close(bs);
         bs->drv->bdrv_close(bs);
         free(bs->opaque);
 #ifdef _WIN32
@@ -618,6 +623,8 @@ bdrv_flush(BlockDriverState *bs)
     if (!bs->drv)
         return -EINVAL;
 
+    bdrv_merge_dispatch(bs);
+
     if (bs->drv->bdrv_flush)
         ret = bs->drv->bdrv_flush(bs);
 
@@ -1241,12 +1248,16 @@ ic_blockstats(Monitor *mon)
                        " wr_bytes=%" PRIu64
                        " rd_operations=%" PRIu64
                        " wr_operations=%" PRIu64
+                       " rd_merged=%" PRIu64
+                       " wr_merged=%" PRIu64
                        "\n",
                        bs->device_name,
                        bs->nr_bytes[BDRV_ACCT_READ],
                        bs->nr_bytes[BDRV_ACCT_WRITE],
                        bs->nr_ops[BDRV_ACCT_READ],
-                       bs->nr_ops[BDRV_ACCT_WRITE]);
+                       bs->nr_ops[BDRV_ACCT_WRITE],
+                       bs->nr_merged[BDRV_ACCT_READ],
+                       bs->nr_merged[BDRV_ACCT_WRITE]);
 }
 #endif  /* MONITOR */
 
@@ -742,6 +742,7 @@ struct config_option config_options[] = {
     { "balloon-max-size", co_set_integer_opt, &balloon_max_mb },
     { "balloon-min-size", co_set_integer_opt, &balloon_min_mb },
     { "block", co_set_block, NULL },
+    { "block-merge", co_set_boolean_opt, &block_merge },
     { "boot-order", co_set_string_opt, &boot_order },
     { "clipboard", co_set_clipboard, NULL },
     { "clipboard-formats-blacklist-host2vm", co_set_string_opt,
@@ -798,13 +799,19 @@ struct config_option config_options[] = {
     { "process-shutdown-priority", co_ignore, NULL },
 #endif
     { "ps2-fallback", co_set_boolean_opt, &ps2_fallback },
+    { "restore-decompress-threads", co_set_integer_opt,
+      &restore_decompress_threads },
+    { "restore-direct-io", co_set_boolean_opt, &restore_direct_io },
     { "restore-framebuffer-pattern", co_set_integer_opt,
       &restore_framebuffer_pattern},
+    { "restore-postcopy", co_set_boolean_opt, &restore_postcopy },
     { "restricted-pci-emul", co_set_boolean_opt, &vm_restricted_pci_emul },
     { "restricted-vga-emul", co_set_boolean_opt, &vm_restricted_vga_emul },
     { "restricted-x86-emul", co_set_integer_opt, &vm_restricted_x86_emul },
     { "run-patcher", co_set_boolean_opt, &vm_run_patcher },
+    { "save-compress-threads", co_set_integer_opt, &save_compress_threads },
     { "save-file-prefix", co_set_string_opt, &save_file_prefix},
+    { "save-incremental", co_set_boolean_opt, &save_incremental },
     { "seed-generation", co_set_boolean_opt, &seed_generation },
     { "serial", co_set_serial, NULL },
     { "shared-folders", co_set_shared_folders, NULL },
@@ -819,6 +826,7 @@ struct config_option config_options[] = {
     { "v4v-disable-ahci-clones", co_set_boolean_opt, &vm_v4v_disable_ahci_clones },
     { "v4v-idtoken", co_set_v4v_idtoken, NULL },
     { "v4v-storage", co_set_boolean_opt, &vm_v4v_storage },
+    { "v4v-storage-queues", co_set_integer_opt, &vm_v4v_storage_queues },
     { "vcpus", co_set_integer_opt, &vm_vcpus },
     { "vga-memory-mapped", co_set_integer_opt, &vm_vga_mb_mapped },
     { "viridian", co_set_integer_opt, &vm_viridian },
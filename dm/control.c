@@ -351,6 +351,8 @@ control_command_save(void *opaque, const char *id, const char *opt,
     vm_save_info.free_mem = dict_get_boolean(d, "free-mem");
     vm_save_info.high_compress = dict_get_boolean(d, "high-compress");
     vm_save_info.ignore_framebuffer = dict_get_boolean(d, "ignore-framebuffer");
+    vm_save_info.incremental =
+        dict_get_boolean_default(d, "incremental", save_incremental);
 
     vm_save_info.command_cd = cd;
     vm_save_info.command_id = id ? strdup(id) : NULL;
@@ -385,6 +387,8 @@ control_command_resume(void *opaque, const char *id, const char *opt,
     struct control_desc *cd = (struct control_desc *)opaque;
 
     vm_save_info.resume_delete = dict_get_boolean(d, "delete-savefile");
+    vm_save_info.resume_postcopy =
+        dict_get_boolean_default(d, "post-copy", restore_postcopy);
 
     vm_save_info.resume_cd = cd;
     vm_save_info.resume_id = id ? strdup(id) : NULL;
@@ -1292,6 +1296,7 @@ struct dict_rpc_command control_commands[] = {
       .args = (struct dict_rpc_arg_desc[]) {
             { "delete-savefile", DICT_RPC_ARG_TYPE_BOOLEAN, .optional = 1,
               .defval = DICT_RPC_ARG_DEFVAL_BOOLEAN(true) },
+            { "post-copy", DICT_RPC_ARG_TYPE_BOOLEAN, .optional = 1 },
             { NULL, },
         }, },
     { "resume-abort", control_command_resume_abort, .flags = CONTROL_SUSPEND_OK, },
@@ -1307,6 +1312,7 @@ struct dict_rpc_command control_commands[] = {
               .defval = DICT_RPC_ARG_DEFVAL_BOOLEAN(true) },
             { "free-mem", DICT_RPC_ARG_TYPE_BOOLEAN, .optional = 1,
               .defval = DICT_RPC_ARG_DEFVAL_BOOLEAN(true) },
+            { "incremental", DICT_RPC_ARG_TYPE_BOOLEAN, .optional = 1 },
             { NULL, },
         }, },
     { "set-balloon-size", control_command_set_balloon_size,
@@ -34,7 +34,7 @@ struct thread_ctx {
 struct ctx {
     heap_t heap;
     HANDLE cancel_event;
-    struct thread_ctx tcs[CUCKOO_NUM_THREADS];
+    struct thread_ctx tcs[CUCKOO_MAX_THREADS];
     HANDLE mutexes[cuckoo_num_mutexes];
     void *mappings[cuckoo_num_sections];
     SIZE_T ws_min, ws_max;
@@ -420,7 +420,7 @@ int cuckoo_uxen_init(struct cuckoo_context *cuckoo_context,
     }
     ctx->cancel_event = cancel_event;
 
-    for (i = 0; i < CUCKOO_NUM_THREADS; ++i) {
+    for (i = 0; i < cuckoo_num_threads(); ++i) {
         struct thread_ctx *tc = &ctx->tcs[i];
         if (!whpx_enable) {
             DECLARE_HYPERCALL_BUFFER(uint8_t, pp_buffer);
@@ -436,7 +436,9 @@ int cuckoo_uxen_init(struct cuckoo_context *cuckoo_context,
         }
         tc->gpfn_info_list = alloc_mem(ctx, MAX_BATCH_SIZE *
                                        sizeof(tc->gpfn_info_list[0]));
-        tc->populated_pfns_max_size = ((vm_mem_mb / 4) * 1024 * 1024) >> PAGE_SHIFT;
+        /* Grown on demand, so split the initial guess across threads. */
+        tc->populated_pfns_max_size = ((vm_mem_mb * 1024 * 1024) >> PAGE_SHIFT) /
+                                      cuckoo_num_threads();
         tc->populated_pfns_idx = 0;
         tc->populated_pfns = alloc_mem(ctx, tc->populated_pfns_max_size * sizeof(uint64_t));
     }
@@ -473,7 +475,7 @@ void cuckoo_uxen_close(struct cuckoo_context *cuckoo_context, void *opaque)
 
     cuckoo_debug("uxen close\n");
 
-    for (i = 0; i < CUCKOO_NUM_THREADS; ++i) {
+    for (i = 0; i < cuckoo_num_threads(); ++i) {
         struct thread_ctx *tc = &ctx->tcs[i];
         if (!whpx_enable) {
             if (HYPERCALL_BUFFER_ARGUMENT_BUFFER(&tc->buffer_xc)) {
@@ -23,6 +23,11 @@
 #include <lz4.h>
 #include <lz4hc.h>
 
+#if defined(__i386__) || defined(__x86_64__)
+#include <immintrin.h>
+#define CUCKOO_SIMD
+#endif
+
 #include <dm/dm.h>
 #include <dm/whpx/whpx.h>
 
@@ -120,11 +125,521 @@ commit(struct cuckoo_context *cc, struct cuckoo_callbacks *ccb, void *opaque)
     __sync_synchronize();
 }
 
+/* The zero bitmap and delta encodings below spend their time finding zero
+ * bytes and equal words, so that part is done by kernels picked at runtime by
+ * cuckoo_init() from the widest vector unit the host has. Bit i of a zero mask
+ * is set if in[i] is zero, with the bits past the end of the input clear, and
+ * bit i of an equal mask is set if a[i] equals b[i]. */
+#define WORDS_PER_PAGE (PAGE_SIZE / sizeof(uint32_t))
+
+typedef void (*zero_mask_fn)(uint64_t *m, const uint8_t *in, size_t sz);
+typedef void (*equal_mask_fn)(uint64_t *m, const uint32_t *a,
+                              const uint32_t *b);
+typedef uint8_t *(*pack_fn)(uint8_t *out, const uint8_t *in, size_t sz,
+                            const uint64_t *zm);
+typedef size_t (*zero_decode_fn)(uint8_t *out, const uint8_t *in, size_t sz);
+
+/* Bit-reversed 7-bit values, for storing bitmap groups MSB first. */
+static uint8_t reverse7[128];
+
+static void
+zero_mask_scalar(uint64_t *m, const uint8_t *in, size_t sz)
+{
+    int i, k;
+
+    for (i = 0; i < sz; i += 64) {
+        int n = sz - i < 64 ? sz - i : 64;
+        uint64_t b = 0;
+        for (k = 0; k < n; ++k) {
+            b |= (uint64_t) !in[i + k] << k;
+        }
+        m[i / 64] = b;
+    }
+}
+
+static void
+equal_mask_scalar(uint64_t *m, const uint32_t *a, const uint32_t *b)
+{
+    int i, k;
+
+    for (i = 0; i < WORDS_PER_PAGE; i += 64) {
+        uint64_t e = 0;
+        for (k = 0; k < 64; ++k) {
+            e |= (uint64_t) (a[i + k] == b[i + k]) << k;
+        }
+        m[i / 64] = e;
+    }
+}
+
+/* Copy out the non-zero bytes of in, which zm marks the zeros of. Every byte
+ * gets stored, but we only move past the ones we keep. */
+static uint8_t *
+pack_scalar(uint8_t *out, const uint8_t *in, size_t sz, const uint64_t *zm)
+{
+    int i, k;
+
+    for (i = 0; i < sz; i += 64) {
+        uint64_t m = zm[i / 64];
+        int n = sz - i < 64 ? sz - i : 64;
+        if (!m) {
+            memcpy(out, in + i, n);
+            out += n;
+        } else {
+            for (k = 0; k < n; ++k) {
+                *out = in[i + k];
+                out += !((m >> k) & 1);
+            }
+        }
+    }
+    return out;
+}
+
+/* The 64 bits of m from bit i on, which is below n. */
+static inline uint64_t
+bits64(const uint64_t *m, int i, int n)
+{
+    uint64_t w = m[i / 64] >> (i % 64);
+
+    if (i % 64 && i / 64 + 1 < (n + 63) / 64) {
+        w |= m[i / 64 + 1] << (64 - i % 64);
+    }
+    return w;
+}
+
+/* Length of the run of bits equal to bit from bit i of m, which holds n. */
+static inline int
+run_length(const uint64_t *m, int i, int n, int bit)
+{
+    int j = i;
+
+    while (j < n) {
+        uint64_t w = m[j / 64] >> (j % 64);
+        int left = 64 - (j % 64);
+        if (bit) {
+            w = ~w;
+        }
+        if (left < 64) {
+            w &= (1ULL << left) - 1;
+        }
+        if (w) {
+            j += __builtin_ctzll(w);
+            break;
+        }
+        j += left;
+    }
+    return (j < n ? j : n) - i;
+}
+
+#define ZERO_DECODE_BODY(group)                                             \
+    int i, j;                                                               \
+    size_t bsz = *((uint16_t *) in);                                        \
+                                                                            \
+    if (!bsz) {                                                             \
+        memcpy(out, in + sizeof(uint16_t), sz - sizeof(uint16_t));          \
+        return sz - sizeof(uint16_t);                                       \
+    }                                                                       \
+                                                                            \
+    const uint8_t *bm = in + (sz - bsz);                                    \
+    uint8_t *o = out;                                                       \
+    sz -= bsz;                                                              \
+                                                                            \
+    for (i = 0, j = sizeof(uint16_t); i < bsz; ++i) {                       \
+        int k;                                                              \
+        uint8_t b = bm[i];                                                  \
+        if (b & 0x80) {                                                     \
+            if (j + 8 <= sz) {                                              \
+                /* No bit can run off the end of the input, and at least   \
+                 * 8 more bytes of output will follow. */                   \
+                group;                                                      \
+                continue;                                                   \
+            }                                                               \
+            for (k = 0; k < 7; ++k) {                                       \
+                b <<= 1;                                                    \
+                if (b & 0x80) {                                             \
+                    *o++ = 0;                                               \
+                } else if (j < sz) {                                        \
+                    *o++ = in[j++];                                         \
+                }                                                           \
+            }                                                               \
+        } else {                                                            \
+            if (i >= 1 && bm[i - 1] < 127) {                                \
+                /* Single set bit implied by surrounding zero ranges. */    \
+                *o++ = 0;                                                   \
+            }                                                               \
+            k = b < sz - j ? b : sz - j;                                    \
+            if (j + ((k + 15) & ~15) <= sz) {                               \
+                /* Fixed size copies get inlined. */                        \
+                int q;                                                      \
+                for (q = 0; q < k; q += 16) {                               \
+                    memcpy(o + q, in + j + q, 16);                          \
+                }                                                           \
+            } else {                                                        \
+                memcpy(o, in + j, k);                                       \
+            }                                                               \
+            o += k;                                                         \
+            j += k;                                                         \
+        }                                                                   \
+    }                                                                       \
+    return o - out;
+
+static size_t
+zero_decode_scalar(uint8_t *out, const uint8_t *in, size_t sz)
+{
+    ZERO_DECODE_BODY(
+        for (k = 6; k >= 0; --k) {
+            int set = (b >> k) & 1;
+            *o++ = set ? 0 : in[j];
+            j += !set;
+        })
+}
+
+#ifdef CUCKOO_SIMD
+/* pshufb masks that pack the non-zero bytes of 8, indexed by their zero mask,
+ * and that spread literals over the clear bits of a bitmap group. */
+static uint8_t pack_shuffle[256][8];
+static uint8_t unpack_shuffle[128][8];
+
+static __attribute__((target("sse2"))) void
+zero_mask_sse2(uint64_t *m, const uint8_t *in, size_t sz)
+{
+    const __m128i zero = _mm_setzero_si128();
+    int i;
+
+    for (i = 0; i + 64 <= sz; i += 64) {
+        uint64_t b = 0;
+        int k;
+        for (k = 0; k < 64; k += 16) {
+            __m128i v = _mm_loadu_si128((const __m128i *) (in + i + k));
+            b |= (uint64_t) (uint16_t) _mm_movemask_epi8(
+                _mm_cmpeq_epi8(v, zero)) << k;
+        }
+        m[i / 64] = b;
+    }
+    if (i < sz) {
+        zero_mask_scalar(m + i / 64, in + i, sz - i);
+    }
+}
+
+static __attribute__((target("sse2"))) void
+equal_mask_sse2(uint64_t *m, const uint32_t *a, const uint32_t *b)
+{
+    int i;
+
+    for (i = 0; i < WORDS_PER_PAGE; i += 64) {
+        uint64_t e = 0;
+        int k;
+        for (k = 0; k < 64; k += 4) {
+            __m128i va = _mm_loadu_si128((const __m128i *) (a + i + k));
+            __m128i vb = _mm_loadu_si128((const __m128i *) (b + i + k));
+            e |= (uint64_t) _mm_movemask_ps(
+                _mm_castsi128_ps(_mm_cmpeq_epi32(va, vb))) << k;
+        }
+        m[i / 64] = e;
+    }
+}
+
+static __attribute__((target("ssse3"))) uint8_t *
+pack_ssse3(uint8_t *out, const uint8_t *in, size_t sz, const uint64_t *zm)
+{
+    int i;
+
+    /* Each store is 8 bytes, but never past where the input would end. */
+    for (i = 0; i + 8 <= sz; i += 8) {
+        unsigned m = (zm[i / 64] >> (i % 64)) & 0xff;
+        __m128i v = _mm_loadl_epi64((const __m128i *) (in + i));
+        v = _mm_shuffle_epi8(v, _mm_loadl_epi64(
+                (const __m128i *) pack_shuffle[m]));
+        _mm_storel_epi64((__m128i *) out, v);
+        out += 8 - __builtin_popcount(m);
+    }
+    for (; i < sz; ++i) {
+        if (in[i]) {
+            *out++ = in[i];
+        }
+    }
+    return out;
+}
+
+static __attribute__((target("ssse3"))) size_t
+zero_decode_ssse3(uint8_t *out, const uint8_t *in, size_t sz)
+{
+    ZERO_DECODE_BODY(
+        __m128i v = _mm_loadl_epi64((const __m128i *) (in + j));
+        v = _mm_shuffle_epi8(v, _mm_loadl_epi64(
+                (const __m128i *) unpack_shuffle[b & 0x7f]));
+        _mm_storel_epi64((__m128i *) o, v);
+        o += 7;
+        j += 7 - __builtin_popcount(b & 0x7f))
+}
+
+static __attribute__((target("avx2"))) void
+zero_mask_avx2(uint64_t *m, const uint8_t *in, size_t sz)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    int i;
+
+    for (i = 0; i + 64 <= sz; i += 64) {
+        __m256i lo = _mm256_loadu_si256((const __m256i *) (in + i));
+        __m256i hi = _mm256_loadu_si256((const __m256i *) (in + i + 32));
+        m[i / 64] = (uint64_t) (uint32_t) _mm256_movemask_epi8(
+                        _mm256_cmpeq_epi8(lo, zero)) |
+                    (uint64_t) (uint32_t) _mm256_movemask_epi8(
+                        _mm256_cmpeq_epi8(hi, zero)) << 32;
+    }
+    if (i < sz) {
+        zero_mask_scalar(m + i / 64, in + i, sz - i);
+    }
+}
+
+static __attribute__((target("avx2"))) void
+equal_mask_avx2(uint64_t *m, const uint32_t *a, const uint32_t *b)
+{
+    int i;
+
+    for (i = 0; i < WORDS_PER_PAGE; i += 64) {
+        uint64_t e = 0;
+        int k;
+        for (k = 0; k < 64; k += 8) {
+            __m256i va = _mm256_loadu_si256((const __m256i *) (a + i + k));
+            __m256i vb = _mm256_loadu_si256((const __m256i *) (b + i + k));
+            e |= (uint64_t) (uint8_t) _mm256_movemask_ps(
+                _mm256_castsi256_ps(_mm256_cmpeq_epi32(va, vb))) << k;
+        }
+        m[i / 64] = e;
+    }
+}
+#endif
+
+static zero_mask_fn zero_mask = zero_mask_scalar;
+static equal_mask_fn equal_mask = equal_mask_scalar;
+static pack_fn pack_nonzero = pack_scalar;
+static zero_decode_fn zero_decode = zero_decode_scalar;
+
+static void select_kernels(void)
+{
+    int i, k;
+
+    for (i = 0; i < 128; ++i) {
+        for (k = 0; k < 7; ++k) {
+            reverse7[i] |= ((i >> k) & 1) << (6 - k);
+        }
+    }
+#ifdef CUCKOO_SIMD
+    int n;
+
+    for (i = 0; i < 256; ++i) {
+        memset(pack_shuffle[i], 0x80, sizeof(pack_shuffle[i]));
+        for (k = 0, n = 0; k < 8; ++k) {
+            if (!((i >> k) & 1)) {
+                pack_shuffle[i][n++] = k;
+            }
+        }
+    }
+    for (i = 0; i < 128; ++i) {
+        memset(unpack_shuffle[i], 0x80, sizeof(unpack_shuffle[i]));
+        for (k = 0, n = 0; k < 7; ++k) {
+            if (!((i >> (6 - k)) & 1)) {
+                unpack_shuffle[i][k] = n++;
+            }
+        }
+    }
+
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        zero_mask = zero_mask_avx2;
+        equal_mask = equal_mask_avx2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        zero_mask = zero_mask_sse2;
+        equal_mask = equal_mask_sse2;
+    }
+    if (__builtin_cpu_supports("ssse3")) {
+        pack_nonzero = pack_ssse3;
+        zero_decode = zero_decode_ssse3;
+    }
+#endif
+}
+
 /* Because of the nature of the input, even LZ4-compressed data has lots
  * (17-20%) of zero bytes, so encode these as the set bits in a compressed
  * bitmap for 6-7% extra space savings. */
 static inline
 int zero_encode(uint8_t *out, const uint8_t *in, size_t sz)
+{
+    int i, j;
+    uint8_t *o;
+    uint64_t zm[PAGE_SIZE / 64];
+    uint8_t bm[PAGE_SIZE];
+    uint8_t last = 0;
+
+    zero_mask(zm, in, sz);
+    o = pack_nonzero(out + sizeof(uint16_t), in, sz, zm);
+
+    /* A run of at least 7 non-zero bytes, and at most 127, becomes a count
+     * byte. Anything else goes 7 bytes at a time into a byte with the top bit
+     * set, with a bit per zero byte, MSB first. */
+    for (i = j = 0; i < sz;) {
+        uint64_t w = bits64(zm, i, sz);
+        if (w & 0x7f) {
+            last = bm[j++] = 0x80 | reverse7[w & 0x7f];
+            i += 7;
+        } else {
+            int count = w ? __builtin_ctzll(w) : run_length(zm, i, sz, 0);
+            if (count > 127) {
+                count = 127;
+            }
+            i += count;
+            /* A single set bit between two unset ranges is often redundant. */
+            if (i < sz && last == 0xc0 && count < 120 && j >= 2 &&
+                    bm[j - 2] < 127) {
+                --j;
+                count += 6;
+            }
+            last = bm[j++] = count;
+        }
+    }
+
+    if ((o + j) - out < sz) {
+        *((uint16_t *) out) = j;
+        memcpy(o, bm, j);
+        return (o + j) - out;
+    } else {
+        *((uint16_t *) out) = 0;
+        memcpy(out + sizeof(uint16_t), in, sz);
+        return sz + sizeof(uint16_t);
+    }
+
+}
+
+static inline
+size_t compress(void *out, const void *in, size_t in_sz, int high)
+{
+    /* Caller has allocated ample space for compression overhead, so we don't
+     * worry about about running out of space. However, there is no point in
+     * storing more than PAGE_SIZE bytes, so if we exceed that we
+     * revert to a straight memcpy(). When uncompressing we treat PAGE_SIZE'd
+     * pages as special, and use memcpy() there as well. */
+
+    uint8_t tmp[2 * PAGE_SIZE];
+    size_t sz;
+
+    if (high) {
+        sz = LZ4_compressHC((const char *)in, (char *) tmp, in_sz);
+    } else {
+        sz = LZ4_compress((const char *)in, (char *) tmp, in_sz);
+    }
+
+    if (sz + 2 >= PAGE_SIZE) {
+        memcpy(out, in, PAGE_SIZE);
+        return PAGE_SIZE;
+    } else {
+        return zero_encode(out, tmp, sz);
+    }
+}
+
+static inline
+int expand(void *out, const void *in, size_t sz)
+{
+    int unsz;
+    if (sz == PAGE_SIZE) {
+        memcpy(out, in, sz);
+        unsz = PAGE_SIZE;
+    } else {
+        uint8_t tmp[PAGE_SIZE];
+        size_t lz4_sz = zero_decode(tmp, in, sz);
+        unsz = LZ4_decompress_safe((const char *)tmp, (char *)out,
+                                   lz4_sz, PAGE_SIZE);
+        if (unsz < 0) {
+            debug_printf("%s: %d\n", __FUNCTION__, unsz);
+            return -1;
+        }
+    }
+    return unsz;
+}
+
+static inline
+int diff(uint8_t *out, const void *_a, const void *_b, int rotate)
+{
+    /* It is faster to do a quick ident-check with memcmp first. */
+    if (!rotate && !memcmp(_a, _b, PAGE_SIZE)) {
+        return 0;
+    }
+
+    const uint32_t *a = _a;
+    const uint32_t *b = _b;
+    uint32_t rotated[WORDS_PER_PAGE];
+    uint64_t em[WORDS_PER_PAGE / 64];
+    uint8_t *o = out;
+    int i;
+
+    rotate &= WORDS_PER_PAGE - 1;
+    if (rotate) {
+        memcpy(rotated, b + rotate, sizeof(b[0]) * (WORDS_PER_PAGE - rotate));
+        memcpy(rotated + WORDS_PER_PAGE - rotate, b, sizeof(b[0]) * rotate);
+        b = rotated;
+    }
+    equal_mask(em, a, b);
+
+    /* Runs alternate, starting with an unequal one, which is empty if the
+     * first words match. Each run is a count byte with the top bit set for
+     * equal words, followed by the words themselves if they differ. */
+    if (em[0] & 1) {
+        *o++ = 0;
+    }
+    for (i = 0; i < WORDS_PER_PAGE;) {
+        int equals = (em[i / 64] >> (i % 64)) & 1;
+        int run = run_length(em, i, WORDS_PER_PAGE, equals);
+        while (run) {
+            int count = run < 0x7f ? run : 0x7f;
+            *o++ = (equals << 7) | count;
+            if (!equals) {
+                memcpy(o, b + i, sizeof(b[0]) * count);
+                o += sizeof(b[0]) * count;
+            }
+            i += count;
+            run -= count;
+        }
+    }
+    return o - out;
+}
+
+static inline
+void undiff(void *_out, const void *_base, const void *_delta)
+{
+    uint8_t *o = _out;
+    uint8_t *end = o + PAGE_SIZE;
+    const uint8_t *s = _delta;
+
+    /* Start from a wide copy of the base, and patch in the unequal runs. */
+    memcpy(o, _base, PAGE_SIZE);
+    while (o < end) {
+        uint8_t c = *s++;
+        int equals = c & 0x80;
+        int count = (c & 0x7f) * sizeof(uint32_t);
+
+        if (!equals) {
+            memcpy(o, s, count);
+            s += count;
+        }
+        o += count;
+    }
+}
+
+static inline
+void copy(void *_out, const void *_in, int rotate)
+{
+    uint32_t *out = _out;
+    const uint32_t *in = _in;
+
+    int i;
+    for (i = 0; i < PAGE_SIZE / sizeof(uint32_t); ++i) {
+        out[i] = in[(i + rotate) % (PAGE_SIZE / sizeof(uint32_t))] ;
+    }
+}
+
+#ifdef CUCKOO_VERIFY
+/* The scalar encoders that the kernels replaced, as a reference. */
+static int
+zero_encode_ref(uint8_t *out, const uint8_t *in, size_t sz)
 {
     int i, j;
     uint8_t c;
@@ -182,8 +697,9 @@ int zero_encode(uint8_t *out, const uint8_t *in, size_t sz)
 
 }
 
-static inline
-size_t zero_decode(uint8_t *out, const uint8_t *in, size_t sz)
+
+static size_t
+zero_decode_ref(uint8_t *out, const uint8_t *in, size_t sz)
 {
     int i, j;
     size_t bsz = *((uint16_t *) in);
@@ -222,54 +738,8 @@ size_t zero_decode(uint8_t *out, const uint8_t *in, size_t sz)
     return o - out;
 }
 
-static inline
-size_t compress(void *out, const void *in, size_t in_sz, int high)
-{
-    /* Caller has allocated ample space for compression overhead, so we don't
-     * worry about about running out of space. However, there is no point in
-     * storing more than PAGE_SIZE bytes, so if we exceed that we
-     * revert to a straight memcpy(). When uncompressing we treat PAGE_SIZE'd
-     * pages as special, and use memcpy() there as well. */
-
-    uint8_t tmp[2 * PAGE_SIZE];
-    size_t sz;
-
-    if (high) {
-        sz = LZ4_compressHC((const char *)in, (char *) tmp, in_sz);
-    } else {
-        sz = LZ4_compress((const char *)in, (char *) tmp, in_sz);
-    }
-
-    if (sz + 2 >= PAGE_SIZE) {
-        memcpy(out, in, PAGE_SIZE);
-        return PAGE_SIZE;
-    } else {
-        return zero_encode(out, tmp, sz);
-    }
-}
-
-static inline
-int expand(void *out, const void *in, size_t sz)
-{
-    int unsz;
-    if (sz == PAGE_SIZE) {
-        memcpy(out, in, sz);
-        unsz = PAGE_SIZE;
-    } else {
-        uint8_t tmp[PAGE_SIZE];
-        size_t lz4_sz = zero_decode(tmp, in, sz);
-        unsz = LZ4_decompress_safe((const char *)tmp, (char *)out,
-                                   lz4_sz, PAGE_SIZE);
-        if (unsz < 0) {
-            debug_printf("%s: %d\n", __FUNCTION__, unsz);
-            return -1;
-        }
-    }
-    return unsz;
-}
-
-static inline
-int diff(uint8_t *out, const void *_a, const void *_b, int rotate)
+static int
+diff_ref(uint8_t *out, const void *_a, const void *_b, int rotate)
 {
     /* It is faster to do a quick ident-check with memcmp first. */
     if (!rotate && !memcmp(_a, _b, PAGE_SIZE)) {
@@ -308,10 +778,9 @@ int diff(uint8_t *out, const void *_a, const void *_b, int rotate)
     return ((uint8_t *) w) - out;
 }
 
-static inline
-void undiff(void *_out, const void *_base, const void *_delta)
+static void
+undiff_ref(void *_out, const void *_base, const void *_delta)
 {
-    typedef uint32_t uint32_t;
     uint8_t *o = _out;
     uint8_t *end = o + PAGE_SIZE;
     const uint8_t *s = _delta;
@@ -333,17 +802,152 @@ void undiff(void *_out, const void *_base, const void *_delta)
     }
 }
 
-static inline
-void copy(void *_out, const void *_in, int rotate)
+/* Check the kernels against the scalar code they replaced, on random input
+ * with a spread of zero and change densities, and time both. */
+static uint32_t
+check_random(uint32_t *seed)
 {
-    uint32_t *out = _out;
-    const uint32_t *in = _in;
+    *seed = *seed * 1103515245 + 12345;
+    return *seed >> 8;
+}
 
-    int i;
-    for (i = 0; i < PAGE_SIZE / sizeof(uint32_t); ++i) {
-        out[i] = in[(i + rotate) % (PAGE_SIZE / sizeof(uint32_t))] ;
+static void
+check_kernels_with(const char *name, zero_mask_fn zm, equal_mask_fn em,
+                   pack_fn pk, zero_decode_fn zd)
+{
+    const int iterations = 20000;
+    uint32_t seed = 1;
+    uint8_t in[PAGE_SIZE], a[PAGE_SIZE], b[PAGE_SIZE];
+    uint8_t out[2 * PAGE_SIZE], ref[2 * PAGE_SIZE];
+    uint8_t dec[PAGE_SIZE], dec_ref[PAGE_SIZE];
+    size_t sz = 0;
+    double t, t_ref;
+    int it, i;
+
+    zero_mask = zm;
+    equal_mask = em;
+    pack_nonzero = pk;
+    zero_decode = zd;
+
+    for (it = 0; it < iterations; ++it) {
+        sz = 1 + check_random(&seed) % (PAGE_SIZE - 3);
+        int zeros = check_random(&seed) % 101;
+        int rotate = 0;
+        int changes = check_random(&seed) % 101;
+        int n, n_ref;
+
+        for (i = 0; i < sz; ++i) {
+            in[i] = check_random(&seed) % 100 < zeros ? 0 :
+                1 + check_random(&seed) % 255;
+        }
+        n = zero_encode(out, in, sz);
+        n_ref = zero_encode_ref(ref, in, sz);
+        if (n != n_ref || memcmp(out, ref, n)) {
+            debug_printf("%s: zero_encode mismatch sz=%d\n", name, (int) sz);
+            assert(0);
+        }
+        if (zero_decode(dec, out, n) != sz ||
+                zero_decode_ref(dec_ref, out, n) != sz ||
+                memcmp(dec, in, sz) || memcmp(dec_ref, in, sz)) {
+            debug_printf("%s: zero_decode mismatch sz=%d\n", name, (int) sz);
+            assert(0);
+        }
+
+        for (i = 0; i < PAGE_SIZE; ++i) {
+            a[i] = check_random(&seed);
+        }
+        memcpy(b, a, PAGE_SIZE);
+        for (i = 0; i < WORDS_PER_PAGE; ++i) {
+            if (check_random(&seed) % 100 < changes) {
+                int len = 1 + check_random(&seed) % 200;
+                while (len-- && i < WORDS_PER_PAGE) {
+                    ((uint32_t *) b)[i++] ^= 1 + check_random(&seed) % 255;
+                }
+            }
+        }
+        if (check_random(&seed) % 4 == 0) {
+            rotate = (int) (check_random(&seed) % (2 * WORDS_PER_PAGE)) -
+                WORDS_PER_PAGE;
+        }
+        n = diff(out, a, b, rotate);
+        n_ref = diff_ref(ref, a, b, rotate);
+        if (n != n_ref || memcmp(out, ref, n)) {
+            debug_printf("%s: diff mismatch rotate=%d\n", name, rotate);
+            assert(0);
+        }
+        if (n) {
+            undiff(dec, a, out);
+            undiff_ref(dec_ref, a, out);
+            if (memcmp(dec, dec_ref, PAGE_SIZE)) {
+                debug_printf("%s: undiff mismatch\n", name);
+                assert(0);
+            }
+        }
+    }
+
+    /* Time both on the last inputs. */
+    t = rtc();
+    for (it = 0; it < iterations; ++it) {
+        zero_decode(dec, out, zero_encode(out, in, sz));
+    }
+    t = rtc() - t;
+    t_ref = rtc();
+    for (it = 0; it < iterations; ++it) {
+        zero_decode_ref(dec, ref, zero_encode_ref(ref, in, sz));
+    }
+    t_ref = rtc() - t_ref;
+    debug_printf("%s zero_encode/decode %.2fus vs %.2fus scalar, sz=%d\n",
+                 name, 1e6 * t / iterations, 1e6 * t_ref / iterations,
+                 (int) sz);
+
+    t = rtc();
+    for (it = 0; it < iterations; ++it) {
+        if (diff(out, a, b, 0)) {
+            undiff(dec, a, out);
+        }
+    }
+    t = rtc() - t;
+    t_ref = rtc();
+    for (it = 0; it < iterations; ++it) {
+        if (diff_ref(ref, a, b, 0)) {
+            undiff_ref(dec, a, ref);
+        }
+    }
+    t_ref = rtc() - t_ref;
+    debug_printf("%s diff/undiff %.2fus vs %.2fus scalar\n",
+                 name, 1e6 * t / iterations, 1e6 * t_ref / iterations);
+}
+
+static void
+check_kernels(void)
+{
+    zero_mask_fn zm = zero_mask;
+    equal_mask_fn em = equal_mask;
+    pack_fn pk = pack_nonzero;
+    zero_decode_fn zd = zero_decode;
+
+    check_kernels_with("scalar", zero_mask_scalar, equal_mask_scalar,
+                       pack_scalar, zero_decode_scalar);
+#ifdef CUCKOO_SIMD
+    if (__builtin_cpu_supports("sse2")) {
+        check_kernels_with("sse2", zero_mask_sse2, equal_mask_sse2,
+                           pack_scalar, zero_decode_scalar);
     }
+    if (__builtin_cpu_supports("ssse3")) {
+        check_kernels_with("ssse3", zero_mask_sse2, equal_mask_sse2,
+                           pack_ssse3, zero_decode_ssse3);
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        check_kernels_with("avx2", zero_mask_avx2, equal_mask_avx2,
+                           pack_ssse3, zero_decode_ssse3);
+    }
+#endif
+    zero_mask = zm;
+    equal_mask = em;
+    pack_nonzero = pk;
+    zero_decode = zd;
 }
+#endif
 
 static void vm_presence_map(struct cuckoo_shared *s, uuid_t exclude,
                             uint8_t *present,
@@ -396,6 +1000,17 @@ struct work_unit *grow_us(struct work_unit *us, int n,
     }
 }
 
+/* Pages per work unit before a run against a template or stable shared ref
+ * gets split. Such refs carry no data in the file, so any unit can rebuild the
+ * base page on its own, and the file layout does not change. */
+static const int max_unit_pfns = 128;
+
+static inline
+int splittable(const struct cuckoo_page *ref)
+{
+    return is_template(ref) || (is_shared(ref) && ref->c.is_stable);
+}
+
 /* Create access plan for compressing or reconstructing a VM. */
 static struct work_unit *create_plan(
         uint32_t vm,
@@ -425,6 +1040,11 @@ static struct work_unit *create_plan(
             ref = p;
         }
         if (p->c.vm == vm) {
+            if (!ref && u && u->n >= max_unit_pfns && splittable(u->ref)) {
+                /* Cut long runs against the same ref into several units, so
+                 * that a dense stretch of pages gets spread over threads. */
+                ref = u->ref;
+            }
             if (ref) {
                 us = grow_us(us, j, ccb, opaque);
                 if (!us) {
@@ -541,7 +1161,11 @@ next_a:
     return k;
 }
 
-const int num_slots = 32;
+/* Batches in flight per worker thread. Threads claim the next batch as soon
+ * as they are done with their last one, and the deeper ring keeps them busy
+ * while a slow batch holds up in-order writing. */
+#define CUCKOO_SLOTS_PER_THREAD 4
+
 struct io_slot {
     thread_event metadata_ready, data_ready, processed;
     uint8_t *buffer;
@@ -561,6 +1185,7 @@ struct thread_context {
     void *opaque;
     volatile int *idx;
     struct io_slot *slots;
+    int num_slots;
     int tid;
     int reusing_vm;
 };
@@ -688,7 +1313,7 @@ decompression_thread(void *_c)
     for (;;) {
         int idx = __sync_fetch_and_add(c->idx, 1);
         int num_tpfns = 0;
-        idx %= num_slots;
+        idx %= c->num_slots;
         struct io_slot *s = &c->slots[idx];
         int start = 0;
 
@@ -865,7 +1490,7 @@ compression_thread(void *_c)
     for (;;) {
         int idx = __sync_fetch_and_add(c->idx, 1);
         int num_pfns = 0;
-        idx %= num_slots;
+        idx %= c->num_slots;
         struct io_slot *s = &c->slots[idx];
 
         thread_event_wait(&s->metadata_ready);
@@ -945,7 +1570,8 @@ read_slot(struct filebuf *fb, struct io_slot *s, uint32_t start)
 }
 
 static int
-write_slot(struct filebuf *fb, struct io_slot *s, uint32_t start)
+write_slot(struct filebuf *fb, struct io_slot *s, uint8_t *buffer, int size,
+           uint32_t start)
 {
     int r = 0;
 
@@ -955,25 +1581,25 @@ write_slot(struct filebuf *fb, struct io_slot *s, uint32_t start)
     s->o.Offset = start;
     s->o.hEvent = s->data_ready;
 
-    cuckoo_debug("write slot offset %d size %d\n", start, s->size);
-    if (!WriteFile(fb->file, s->buffer, s->size, NULL, &s->o)) {
+    cuckoo_debug("write slot offset %d size %d\n", start, size);
+    if (!WriteFile(fb->file, buffer, size, NULL, &s->o)) {
         if (GetLastError() != ERROR_IO_PENDING) {
             Wwarn("WriteFilefails");
             r = -1;
         }
     }
     if (!GetOverlappedResult(fb->file, &s->o, &got, TRUE) ||
-            got != s->size) {
+            got != (DWORD) size) {
         debug_printf("only wrote %u instead of %u\n",
-                (uint32_t) got, s->size);
+                (uint32_t) got, size);
         Wwarn("GetOverlappedResult fails");
         r = -1;
     }
 #else
     do {
-        r = pwrite(fb->file, s->buffer, s->size, start);
+        r = pwrite(fb->file, buffer, size, start);
     } while (r < 0 && errno == EINTR);
-    if (r != s->size) {
+    if (r != size) {
         r = -1;
     }
 #endif
@@ -998,8 +1624,11 @@ execute_plan(struct cuckoo_context *cc,
     const int max_template_pfns = 128;
     const int max_pfns = 128;
 
-    uxen_thread tids[CUCKOO_NUM_THREADS];
-    struct thread_context cs[CUCKOO_NUM_THREADS];
+    const int num_threads = cuckoo_num_threads();
+    const int num_slots = CUCKOO_SLOTS_PER_THREAD * num_threads;
+    uxen_thread tids[CUCKOO_MAX_THREADS];
+    struct thread_context cs[CUCKOO_MAX_THREADS];
+    struct io_slot *slots;
     int cancelled = 0;
     int errored = 0;
     volatile int shared_i = 0;
@@ -1011,8 +1640,11 @@ execute_plan(struct cuckoo_context *cc,
     filebuf_flush(fb);
     file_offset = initial_file_offset = filebuf_tell(fb);
 
-    struct io_slot slots[num_slots];
-    memset(slots, 0, sizeof(slots));
+    slots = ccb->malloc(opaque, sizeof(slots[0]) * num_slots);
+    if (!slots) {
+        return -ENOMEM;
+    }
+    memset(slots, 0, sizeof(slots[0]) * num_slots);
 
     cuckoo_debug("executing plan\n");
     for (i = 0; i < num_slots; ++i) {
@@ -1022,7 +1654,7 @@ execute_plan(struct cuckoo_context *cc,
         thread_event_set(&slots[i].processed);
     }
 
-    for (i = 0; i < CUCKOO_NUM_THREADS; ++i) {
+    for (i = 0; i < num_threads; ++i) {
         struct thread_context *c = &cs[i];
         c->cc = cc;
         c->fb = fb;
@@ -1030,6 +1662,7 @@ execute_plan(struct cuckoo_context *cc,
         c->opaque = opaque;
         c->idx = &shared_i;
         c->slots = slots;
+        c->num_slots = num_slots;
         c->tid = i;
         c->reusing_vm = reusing_vm;
         __sync_synchronize();
@@ -1041,19 +1674,19 @@ execute_plan(struct cuckoo_context *cc,
             first = u, slot = (slot + 1) % num_slots) {
 
         struct io_slot *s = &slots[slot];
+        uint8_t *out = NULL;
+        int out_size = 0;
         int num_tpfns;
         int num_pfns;
 
         thread_event_wait(&s->processed);
         --outstanding;
 
+        /* Take the compressed output before handing out the slot again, and
+         * write it after, so the threads are not kept waiting for the I/O. */
         if (compressing && s->buffer) {
-            if (write_slot(fb, s, file_offset) < 0) {
-                cancelled = 1;
-                errored = 1;
-            }
-            file_offset += s->size;
-            ccb->free(opaque, s->buffer);
+            out = s->buffer;
+            out_size = s->size;
             s->buffer = NULL;
         }
 
@@ -1064,10 +1697,8 @@ execute_plan(struct cuckoo_context *cc,
                 s->done = 1;
                 __sync_synchronize();
                 thread_event_set(&s->metadata_ready);
-                continue;
-            } else {
-                break;
             }
+            goto write;
         }
 
         s->size = 0;
@@ -1102,9 +1733,22 @@ execute_plan(struct cuckoo_context *cc,
         cuckoo_debug("set metadata ready\n");
         thread_event_set(&s->metadata_ready);
         ++outstanding;
+
+write:
+        if (out) {
+            if (write_slot(fb, s, out, out_size, file_offset) < 0) {
+                cancelled = 1;
+                errored = 1;
+            }
+            file_offset += out_size;
+            ccb->free(opaque, out);
+        }
+        if (!outstanding) {
+            break;
+        }
     }
 
-    for (i = 0; i < CUCKOO_NUM_THREADS; ++i) {
+    for (i = 0; i < num_threads; ++i) {
         wait_thread(tids[i]);
         cuckoo_debug("finished wait for %d\n", i);
     }
@@ -1113,7 +1757,7 @@ execute_plan(struct cuckoo_context *cc,
     cancelled |= ccb->cancelled(opaque);
     bool decompression_cancelled = !compressing && cancelled;
 
-    for (i = 0; i < CUCKOO_NUM_THREADS; ++i) {
+    for (i = 0; i < num_threads; ++i) {
         /* on uxen, if cancelled, we have to undo each populated pfn. On WHP we
          * instead release CoW file mappings (whpx_ram_free) bit later */
         if (!whpx_enable && decompression_cancelled)
@@ -1130,6 +1774,7 @@ execute_plan(struct cuckoo_context *cc,
         if (s->io_queued)
             debug_printf("unexpected outstanding i/o (%d) on slot %d\n", (int)s->io_queued, i);
     }
+    ccb->free(opaque, slots);
 
     /* release WHP CoW mappings if cancelled */
     if (whpx_enable && decompression_cancelled)
@@ -1144,6 +1789,33 @@ execute_plan(struct cuckoo_context *cc,
     return errored ? -1 : file_offset - initial_file_offset;
 }
 
+/* Number of worker threads, one per host core within CUCKOO_MIN_THREADS and
+ * CUCKOO_MAX_THREADS. The lower bound keeps some threads busy while others
+ * wait in capture or populate hypercalls. */
+int cuckoo_num_threads(void)
+{
+    static int num_threads = 0;
+    int n;
+
+    if (num_threads) {
+        return num_threads;
+    }
+#ifdef _WIN32
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    n = si.dwNumberOfProcessors;
+#else
+    n = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    if (n < CUCKOO_MIN_THREADS) {
+        n = CUCKOO_MIN_THREADS;
+    } else if (n > CUCKOO_MAX_THREADS) {
+        n = CUCKOO_MAX_THREADS;
+    }
+    num_threads = n;
+    return num_threads;
+}
+
 /* List of VMs management. */
 
 static uint32_t insert_vm(struct cuckoo_shared *s, uuid_t uuid)
@@ -1291,7 +1963,16 @@ int cuckoo_reconstruct_vm(struct cuckoo_context *cc, uuid_t uuid,
 
 int cuckoo_init(struct cuckoo_context *cc)
 {
+    static int kernels_selected = 0;
+
     memset(cc, 0, sizeof(*cc));
+    if (!kernels_selected) {
+        select_kernels();
+#ifdef CUCKOO_VERIFY
+        check_kernels();
+#endif
+        kernels_selected = 1;
+    }
     return 0;
 }
 
@@ -12,7 +12,8 @@
 
 #define CUCKOO_LOG_MAX_VMS 9
 #define CUCKOO_MAX_VMS (1<<CUCKOO_LOG_MAX_VMS)
-#define CUCKOO_NUM_THREADS 4
+#define CUCKOO_MIN_THREADS 4
+#define CUCKOO_MAX_THREADS 32
 #define CUCKOO_TEMPLATE_PFN (1ULL << 63ULL)
 
 //#define CUCKOO_VERIFY
@@ -181,6 +182,7 @@ struct cuckoo_callbacks {
 };
 
 int cuckoo_init(struct cuckoo_context *cc);
+int cuckoo_num_threads(void);
 int cuckoo_compress_vm(struct cuckoo_context *cc, uuid_t uuid,
                        struct filebuf *fb,
                        int num_template, struct page_fingerprint *tfps,
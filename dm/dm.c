@@ -93,9 +93,11 @@ uint64_t vm_zero_page_setup = 1;
 uint64_t vm_apic = 1;
 uint64_t vm_hidden_mem = 1;
 uint64_t vm_ignore_storage_space_fix = 0;
+uint64_t block_merge = 1;
 uint64_t vm_use_v4v_net = 0;
 uint64_t vm_use_v4v_disk = 0;
 uint64_t vm_v4v_storage = 1;
+uint64_t vm_v4v_storage_queues = 1;
 uint64_t vm_v4v_disable_ahci_clones = 0;
 uint64_t vm_vram_dirty_tracking = 0;
 uint8_t v4v_idtoken[16] = { };
@@ -107,6 +109,9 @@ uint64_t guest_drivers_logmask = 0x2; /* Include LogRel, not Log */
 uint64_t debugkey_level = 0;
 uint64_t malloc_limit_bytes = 0;
 uint64_t restore_framebuffer_pattern = 0xffffffff;
+uint64_t restore_decompress_threads = 2; /* 0: one per host cpu */
+uint64_t restore_direct_io = 0;
+uint64_t restore_postcopy = 0;
 dict vm_audio = NULL;
 char *vm_image = NULL;
 uint64_t vm_attovm_mode = ATTOVM_MODE_NONE;
@@ -123,6 +128,8 @@ uint64_t ps2_fallback = 1;
 const char *app_dump_command = NULL;
 uint64_t event_service_mouse_moves = 0;
 char *save_file_prefix = "uxenvm-";
+uint64_t save_compress_threads = 0; /* 0: one per host cpu */
+uint64_t save_incremental = 0;
 uint64_t disp_fps_counter = 0;
 uint64_t disp_pv_vblank = PV_VBLANK_NATIVE;
 #if defined(_WIN32)
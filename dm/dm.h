@@ -51,9 +51,11 @@ extern uint64_t vm_zero_page_setup;
 extern uint64_t vm_apic;
 extern uint64_t vm_hidden_mem;
 extern uint64_t vm_ignore_storage_space_fix;
+extern uint64_t block_merge;
 extern uint64_t vm_use_v4v_net;
 extern uint64_t vm_use_v4v_disk;
 extern uint64_t vm_v4v_storage;
+extern uint64_t vm_v4v_storage_queues;
 extern uint64_t vm_v4v_disable_ahci_clones;
 extern uint64_t vm_vram_dirty_tracking;
 extern uint8_t v4v_idtoken[16];
@@ -67,6 +69,9 @@ extern uint64_t guest_drivers_logmask;
 extern uint64_t debugkey_level;
 extern uint64_t malloc_limit_bytes;
 extern uint64_t restore_framebuffer_pattern;
+extern uint64_t restore_decompress_threads;
+extern uint64_t restore_direct_io;
+extern uint64_t restore_postcopy;
 extern dict vm_hvm_params;
 extern int *disabled_keys;
 extern size_t disabled_keys_len;
@@ -80,6 +85,8 @@ extern uint64_t deferred_clipboard;
 extern uint64_t event_service_mouse_moves;
 extern uint64_t hid_touch_enabled;
 extern char *save_file_prefix;
+extern uint64_t save_compress_threads;
+extern uint64_t save_incremental;
 extern uint64_t disp_fps_counter;
 extern uint64_t disp_pv_vblank;
 struct xc_interface_core;
@@ -94,6 +101,8 @@ extern int loglevel;
 extern uint64_t log_synchronous;
 extern uint64_t hide_log_sensitive_data;
 extern uint64_t log_swap_fills;
+extern uint64_t swap_chunk_cache_lines;
+extern uint64_t swap_shared_cache_mb;
 
 extern uint64_t log_ratelimit_guest_burst;
 extern uint64_t log_ratelimit_guest_ms;
@@ -21,21 +21,285 @@
 #include <sys/mman.h>
 #endif  /* __APPLE__ */
 
+#ifndef _WIN32
+#include <sys/time.h>
+#endif  /* _WIN32 */
+
 static const size_t default_buffer_max = 1 << 20;
 
+static uint64_t
+filebuf_clock_us(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER freq, count;
+
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&count);
+    return (count.QuadPart / freq.QuadPart) * 1000000ULL +
+        (count.QuadPart % freq.QuadPart) * 1000000ULL / freq.QuadPart;
+#else  /* _WIN32 */
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000000ULL + tv.tv_usec;
+#endif  /* _WIN32 */
+}
+
+static ssize_t
+filebuf_pread(struct filebuf *fb, uint8_t *buf, size_t size, off_t offset)
+{
+#ifdef _WIN32
+    DWORD ret = 0;
+    OVERLAPPED o = { };
+
+    o.Offset = offset;
+    o.OffsetHigh = offset >> 32ULL;
+
+    if (!ReadFile(fb->file, buf, (DWORD)size, &ret, &o)) {
+        if (GetLastError() != ERROR_IO_PENDING) {
+            _set_errno(GetLastError());
+            Wwarn("%s: ReadFile failed", __FUNCTION__);
+            return -1;
+        }
+        if (!GetOverlappedResult(fb->file, &o, &ret, TRUE) &&
+            GetLastError() != ERROR_HANDLE_EOF) {
+            _set_errno(GetLastError());
+            Wwarn("%s: GetOverlappedResult failed", __FUNCTION__);
+            return -1;
+        }
+    }
+    return ret;
+#else  /* _WIN32 */
+    ssize_t ret, o = 0;
+
+    do {
+        ret = pread(fb->file, buf + o, size - o, offset + o);
+        if (ret > 0)
+            o += ret;
+    } while ((ret < 0 && errno == EINTR) || (ret > 0 && o < size));
+    if (ret < 0) {
+        warn("%s: pread failed", __FUNCTION__);
+        return -1;
+    }
+    return o;
+#endif  /* _WIN32 */
+}
+
+static ssize_t
+filebuf_pwrite(struct filebuf *fb, const uint8_t *buf, size_t size,
+               off_t offset)
+{
+#ifdef _WIN32
+    DWORD ret;
+    OVERLAPPED o = { };
+
+    o.Offset = offset;
+    o.OffsetHigh = offset >> 32ULL;
+
+    if (!WriteFile(fb->file, buf, size, &ret, &o) &&
+        GetLastError() != ERROR_IO_PENDING) {
+        Wwarn("%s: WriteFile failed", __FUNCTION__);
+        return -1;
+    }
+    if (!GetOverlappedResult(fb->file, &o, &ret, TRUE) ||
+        ret != size) {
+        Wwarn("%s: GetOverlappedResult failed", __FUNCTION__);
+        return -1;
+    }
+    return ret;
+#else  /* _WIN32 */
+    ssize_t ret, o = 0;
+
+    do {
+        ret = pwrite(fb->file, buf + o, size - o, offset + o);
+        if (ret > 0)
+            o += ret;
+    } while ((ret < 0 && errno == EINTR) || (ret > 0 && o < size));
+    if (ret < 0) {
+        warn("%s: pwrite failed", __FUNCTION__);
+        return -1;
+    }
+    return o;
+#endif  /* _WIN32 */
+}
+
+#ifndef _WIN32
+enum {
+    IO_THREAD_NONE,
+    IO_THREAD_IDLE,
+    IO_THREAD_RUN,
+    IO_THREAD_EXIT,
+};
+
+static void *
+filebuf_io_thread(void *opaque)
+{
+    struct filebuf *fb = opaque;
+    ssize_t ret;
+
+    pthread_mutex_lock(&fb->io_lock);
+    for (;;) {
+        while (fb->io_thread_state == IO_THREAD_IDLE)
+            pthread_cond_wait(&fb->io_cond, &fb->io_lock);
+        if (fb->io_thread_state == IO_THREAD_EXIT)
+            break;
+        pthread_mutex_unlock(&fb->io_lock);
+
+        ret = fb->io_write ?
+            filebuf_pwrite(fb, fb->spare, fb->io_size, fb->io_offset) :
+            filebuf_pread(fb, fb->spare, fb->io_size, fb->io_offset);
+
+        pthread_mutex_lock(&fb->io_lock);
+        fb->io_ret = ret;
+        fb->io_thread_state = IO_THREAD_IDLE;
+        pthread_cond_broadcast(&fb->io_cond);
+    }
+    pthread_mutex_unlock(&fb->io_lock);
+
+    return NULL;
+}
+
+static void
+filebuf_io_thread_exit(struct filebuf *fb)
+{
+
+    if (fb->io_thread_state == IO_THREAD_NONE)
+        return;
+
+    pthread_mutex_lock(&fb->io_lock);
+    fb->io_thread_state = IO_THREAD_EXIT;
+    pthread_cond_broadcast(&fb->io_cond);
+    pthread_mutex_unlock(&fb->io_lock);
+    pthread_join(fb->io_thread, NULL);
+    pthread_cond_destroy(&fb->io_cond);
+    pthread_mutex_destroy(&fb->io_lock);
+    fb->io_thread_state = IO_THREAD_NONE;
+}
+#endif  /* _WIN32 */
+
+/* start reading or writing the spare buffer in the background */
+static int
+filebuf_io_start(struct filebuf *fb, int write, off_t offset, size_t size)
+{
+
+    assert(!fb->io_pending);
+    fb->io_write = write;
+    fb->io_offset = offset;
+    fb->io_size = size;
+#ifdef _WIN32
+    fb->io.Internal = fb->io.InternalHigh = 0;
+    fb->io.Offset = offset;
+    fb->io.OffsetHigh = offset >> 32ULL;
+    ResetEvent(fb->io.hEvent);
+    if (!(write ? WriteFile(fb->file, fb->spare, size, NULL, &fb->io) :
+          ReadFile(fb->file, fb->spare, size, NULL, &fb->io)) &&
+        GetLastError() != ERROR_IO_PENDING)
+        return -1;
+#else  /* _WIN32 */
+    if (fb->io_thread_state == IO_THREAD_NONE) {
+        pthread_mutex_init(&fb->io_lock, NULL);
+        pthread_cond_init(&fb->io_cond, NULL);
+        fb->io_thread_state = IO_THREAD_IDLE;
+        if (pthread_create(&fb->io_thread, NULL, filebuf_io_thread, fb)) {
+            pthread_cond_destroy(&fb->io_cond);
+            pthread_mutex_destroy(&fb->io_lock);
+            fb->io_thread_state = IO_THREAD_NONE;
+            return -1;
+        }
+    }
+    pthread_mutex_lock(&fb->io_lock);
+    fb->io_thread_state = IO_THREAD_RUN;
+    pthread_cond_broadcast(&fb->io_cond);
+    pthread_mutex_unlock(&fb->io_lock);
+#endif  /* _WIN32 */
+    fb->io_pending = 1;
+    fb->stats.ios++;
+    return 0;
+}
+
+/* wait for the background I/O -- returns the bytes transferred */
+static ssize_t
+filebuf_io_wait(struct filebuf *fb)
+{
+    uint64_t start;
+    ssize_t ret;
+
+    if (!fb->io_pending)
+        return 0;
+
+    start = filebuf_clock_us();
+#ifdef _WIN32
+    {
+        DWORD got = 0;
+
+        if (GetOverlappedResult(fb->file, &fb->io, &got, TRUE) ||
+            GetLastError() == ERROR_HANDLE_EOF)
+            ret = got;
+        else {
+            _set_errno(GetLastError());
+            ret = -1;
+        }
+    }
+#else  /* _WIN32 */
+    pthread_mutex_lock(&fb->io_lock);
+    while (fb->io_thread_state == IO_THREAD_RUN)
+        pthread_cond_wait(&fb->io_cond, &fb->io_lock);
+    ret = fb->io_ret;
+    pthread_mutex_unlock(&fb->io_lock);
+#endif  /* _WIN32 */
+    fb->stats.wait_us += filebuf_clock_us() - start;
+    fb->io_pending = 0;
+
+    return ret;
+}
+
+/* complete the write behind of the spare buffer */
+static int
+filebuf_io_complete_write(struct filebuf *fb)
+{
+    ssize_t ret;
+
+    if (!fb->io_pending)
+        return 0;
+
+    assert(fb->io_write);
+    ret = filebuf_io_wait(fb);
+    if (ret < 0) {
+        Wwarn("%s: write behind failed", __FUNCTION__);
+        return -1;
+    }
+    /* short writes are completed synchronously */
+    if (ret < fb->io_size &&
+        filebuf_pwrite(fb, fb->spare + ret, fb->io_size - ret,
+                       fb->io_offset + ret) < 0)
+        return -1;
+
+    return 0;
+}
+
+static void
+filebuf_swap_buffers(struct filebuf *fb)
+{
+    uint8_t *b = fb->buffer;
+
+    fb->buffer = fb->spare;
+    fb->spare = b;
+}
+
 struct filebuf *
 filebuf_open(const char *fn, const char *mode)
 {
     struct filebuf *fb;
     int no_buffering = 0;
-#ifdef _WIN32
     int sequential = 0;
+#ifdef _WIN32
     int write_through = 0;
 #endif  /* _WIN32 */
 
     fb = calloc(1, sizeof(struct filebuf));
     if (!fb)
         return NULL;
+    fb->open_time = filebuf_clock_us();
 
     fb->buffer_max = default_buffer_max;
     fb->buffer = page_align_alloc(fb->buffer_max);
@@ -46,13 +310,16 @@ filebuf_open(const char *fn, const char *mode)
 
     while (*mode) {
         switch (*mode) {
+            case 'a':
+                fb->async = 1;
+                break;
             case 'n':
                 no_buffering = 1;
                 break;
-#ifdef _WIN32
             case 's':
                 sequential = 1;
                 break;
+#ifdef _WIN32
             case 't':
                 write_through = 1;
                 break;
@@ -68,6 +335,12 @@ filebuf_open(const char *fn, const char *mode)
 
     fb->users = 1;
 
+    if (fb->async) {
+        fb->spare = page_align_alloc(fb->buffer_max);
+        if (!fb->spare)
+            fb->async = 0;
+    }
+
 #ifdef _WIN32
     fb->file = CreateFile(
         fn, GENERIC_READ | (fb->writable ? GENERIC_WRITE | DELETE : 0),
@@ -93,18 +366,40 @@ filebuf_open(const char *fn, const char *mode)
     if (fb->file < 0) {
         warn("%s: open %s failed", __FUNCTION__, fn);
 #endif  /* _WIN32 */
+        align_free(fb->spare);
         align_free(fb->buffer);
         free(fb);
         fb = NULL;
     }
-#ifdef __APPLE__
+#ifdef _WIN32
+    else if (fb->async) {
+        fb->io.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+        if (!fb->io.hEvent) {
+            align_free(fb->spare);
+            fb->spare = NULL;
+            fb->async = 0;
+        }
+    }
+#else  /* _WIN32 */
     else {
+#ifdef __APPLE__
         if (no_buffering)
             fcntl(fb->file, F_NOCACHE, 1);
-        if (fb->file >= 0)
-            fb->filename = strdup(fn);
-    }
+        if (sequential)
+            fcntl(fb->file, F_RDAHEAD, 1);
+#else  /* __APPLE__ */
+#ifdef O_DIRECT
+        /* O_DIRECT needs aligned offsets and sizes, reads only */
+        if (no_buffering && !fb->writable &&
+            fcntl(fb->file, F_SETFL, fcntl(fb->file, F_GETFL) | O_DIRECT) == 0)
+            fb->direct = 1;
+#endif  /* O_DIRECT */
+        if (sequential)
+            posix_fadvise(fb->file, 0, 0, POSIX_FADV_SEQUENTIAL);
 #endif  /* __APPLE__ */
+        fb->filename = strdup(fn);
+    }
+#endif  /* _WIN32 */
     return fb;
 }
 
@@ -126,48 +421,50 @@ filebuf_set_readable(struct filebuf *fb)
 int
 filebuf_flush(struct filebuf *fb)
 {
-#ifdef _WIN32
-    DWORD ret;
-    OVERLAPPED o = { };
-#else  /* _WIN32 */
-    ssize_t ret, o = 0;
-#endif  /* _WIN32 */
+    uint64_t start;
+    ssize_t ret;
 
     if (!fb->writable) {
-        /* flush buffered data for read files */
+        /* flush buffered data for read files -- a read ahead stays
+         * pending, it is used if the next read is where it left off */
         fb->offset = filebuf_tell(fb);
         fb->buffered = fb->consumed = 0;
         return 0;
     }
 
-#ifdef _WIN32
-    o.Offset = fb->offset;
-    o.OffsetHigh = fb->offset >> 32ULL;
-
-    if (!WriteFile(fb->file, fb->buffer, fb->buffered, &ret, &o) &&
-        GetLastError() != ERROR_IO_PENDING) {
-        Wwarn("%s: WriteFile failed", __FUNCTION__);
+    if (filebuf_io_complete_write(fb) < 0)
         return -1;
-    }
-    if (!GetOverlappedResult(fb->file, &o, &ret, TRUE) ||
-        ret != fb->buffered) {
-        Wwarn("%s: GetOverlappedResult failed", __FUNCTION__);
+    if (!fb->buffered)
+        return 0;
+
+    start = filebuf_clock_us();
+    ret = filebuf_pwrite(fb, fb->buffer, fb->buffered, fb->offset);
+    fb->stats.wait_us += filebuf_clock_us() - start;
+    if (ret < 0)
         return -1;
-    }
-#else  /* _WIN32 */
-    do {
-        ret = pwrite(fb->file, fb->buffer + o, fb->buffered - o,
-                     fb->offset + o);
-        if (ret > 0)
-            o += ret;
-    } while (ret < 0 && errno == EINTR);
-    if (ret < 0) {
-        warn("%s: pwrite failed", __FUNCTION__);
+    fb->stats.ios++;
+    fb->stats.written += ret;
+    fb->offset += ret;
+    fb->buffered = 0;
+    return 0;
+}
+
+/* hand the full buffer to the background write, after the previous
+ * one completed, and continue with the spare buffer */
+static int
+filebuf_write_behind(struct filebuf *fb)
+{
+
+    if (filebuf_io_complete_write(fb) < 0)
         return -1;
+
+    filebuf_swap_buffers(fb);
+    if (filebuf_io_start(fb, 1, fb->offset, fb->buffered) < 0) {
+        filebuf_swap_buffers(fb);
+        return filebuf_flush(fb);
     }
-    ret = o;
-#endif  /* _WIN32 */
-    fb->offset += ret;
+    fb->stats.written += fb->buffered;
+    fb->offset += fb->buffered;
     fb->buffered = 0;
     return 0;
 }
@@ -187,8 +484,15 @@ filebuf_close(struct filebuf *fb)
 #endif  /* __APPLE__ */
     if (fb->writable)
         filebuf_flush(fb);
+    /* a read ahead, or the write behind of a deleted file */
+    filebuf_io_wait(fb);
+#ifndef _WIN32
+    filebuf_io_thread_exit(fb);
+#endif  /* _WIN32 */
 #ifdef _WIN32
     CloseHandle(fb->file);
+    if (fb->io.hEvent)
+        CloseHandle(fb->io.hEvent);
     if (fb->mapping)
         UnmapViewOfFile(fb->mapping);
 #else  /* _WIN32 */
@@ -197,6 +501,7 @@ filebuf_close(struct filebuf *fb)
         munmap(fb->mapping, fb->mapping_len);
     free(fb->filename);
 #endif  /* _WIN32 */
+    align_free(fb->spare);
     align_free(fb->buffer);
     free(fb);
 }
@@ -225,7 +530,8 @@ filebuf_write(struct filebuf *fb, void *buf, size_t size)
         size -= n;
 
         if (fb->buffered == fb->buffer_max) {
-            if (filebuf_flush(fb) < 0)
+            if ((fb->async ? filebuf_write_behind(fb) :
+                 filebuf_flush(fb)) < 0)
                 return -1;
         }
     }
@@ -235,50 +541,50 @@ filebuf_write(struct filebuf *fb, void *buf, size_t size)
 static int
 filebuf_fill(struct filebuf *fb)
 {
-    if (fb->consumed == fb->buffered) {
-#ifdef _WIN32
-        DWORD ret = 0;
-        OVERLAPPED o = { };
+    uint64_t start;
+    ssize_t ret = -1;
+
+    if (fb->consumed != fb->buffered)
+        return 0;
 
+#ifndef _WIN32
+    if (!fb->direct)
+        fb->consumed = 0;
+    else
+#endif  /* _WIN32 */
+    {
         fb->consumed = fb->offset & (ALIGN_PAGE_ALIGN - 1);
         fb->offset -= fb->consumed;
+    }
 
-        o.Offset = fb->offset;
-        o.OffsetHigh = fb->offset >> 32ULL;
-
-        if (!ReadFile(fb->file, fb->buffer, (DWORD)fb->buffer_max, &ret, &o)) {
-            if (GetLastError() != ERROR_IO_PENDING) {
-                _set_errno(GetLastError());
-                Wwarn("%s: ReadFile failed", __FUNCTION__);
-                return -1;
-            }
-            if (!GetOverlappedResult(fb->file, &o, &ret, TRUE) &&
-                GetLastError() != ERROR_HANDLE_EOF) {
-                _set_errno(GetLastError());
-                Wwarn("%s: GetOverlappedResult failed", __FUNCTION__);
-                return -1;
-            }
+    if (fb->io_pending && fb->io_offset == fb->offset) {
+        ret = filebuf_io_wait(fb);
+        if (ret >= 0) {
+            filebuf_swap_buffers(fb);
+            fb->stats.readahead_hits++;
         }
-#else  /* _WIN32 */
-        ssize_t ret, o = 0;
-
-        do {
-            ret = pread(fb->file, fb->buffer + o, fb->buffer_max - o,
-                        fb->offset + o);
-            if (ret > 0)
-                o += ret;
-        } while (ret < 0 && errno == EINTR);
-        if (ret < 0) {
-            warn("%s: pread failed", __FUNCTION__);
+    } else
+        filebuf_io_wait(fb);
+    if (ret < 0) {
+        start = filebuf_clock_us();
+        ret = filebuf_pread(fb, fb->buffer, fb->buffer_max, fb->offset);
+        fb->stats.wait_us += filebuf_clock_us() - start;
+        if (ret < 0)
             return -1;
-        }
-        ret = o;
-        fb->consumed = 0;
-#endif  /* _WIN32 */
-        fb->offset += ret;
-        fb->buffered = ret;
-        fb->eof = (fb->buffered < fb->buffer_max);
+        fb->stats.ios++;
     }
+    /* In direct mode the aligned prefix up to the old offset was read
+     * again, don't count it twice. */
+    if (ret > fb->consumed)
+        fb->stats.read += ret - fb->consumed;
+    fb->offset += ret;
+    fb->buffered = ret;
+    fb->eof = (fb->buffered < fb->buffer_max);
+
+    /* read the next buffer while this one is consumed */
+    if (fb->async && !fb->eof)
+        (void)filebuf_io_start(fb, 0, fb->offset, fb->buffer_max);
+
     return 0;
 }
 
@@ -382,6 +688,7 @@ filebuf_buffer_max(struct filebuf *fb, size_t new_buffer_max)
 {
 
     filebuf_flush(fb);
+    filebuf_io_wait(fb);
 
     fb->buffer_max = new_buffer_max;
     do {
@@ -393,6 +700,12 @@ filebuf_buffer_max(struct filebuf *fb, size_t new_buffer_max)
                 errx(1, "%s: out of memory", __FUNCTION__);
         }
     } while (!fb->buffer);
+    if (fb->async) {
+        align_free(fb->spare);
+        fb->spare = page_align_alloc(fb->buffer_max);
+        if (!fb->spare)
+            fb->async = 0;
+    }
 }
 
 int
@@ -514,3 +827,27 @@ filebuf_set_zero_data(struct filebuf *fb, off_t offset, size_t len)
 #endif
 }
 
+/* hint that a range of the file will be read soon */
+int
+filebuf_prefetch(struct filebuf *fb, off_t offset, size_t len)
+{
+#if defined(_WIN32)
+    return -1;
+#elif defined(__APPLE__)
+    struct radvisory ra;
+
+    ra.ra_offset = offset;
+    ra.ra_count = len;
+    return fcntl(fb->file, F_RDADVISE, &ra);
+#else
+    return posix_fadvise(fb->file, offset, len, POSIX_FADV_WILLNEED) ? -1 : 0;
+#endif
+}
+
+void
+filebuf_get_stats(struct filebuf *fb, struct filebuf_stats *stats)
+{
+
+    *stats = fb->stats;
+    stats->open_us = filebuf_clock_us() - fb->open_time;
+}
@@ -7,13 +7,28 @@
 #ifndef _FILEBUF_H_
 #define _FILEBUF_H_
 
+struct filebuf_stats {
+    uint64_t read;              /* bytes */
+    uint64_t written;           /* bytes */
+    uint64_t ios;
+    uint64_t readahead_hits;
+    uint64_t wait_us;           /* time blocked on I/O */
+    uint64_t open_us;           /* time since open */
+};
+
 struct filebuf {
 #ifdef _WIN32
     HANDLE file;
+    OVERLAPPED io;
 #else
     int file;
     char *filename;
     int delete_on_close;
+    pthread_t io_thread;
+    pthread_mutex_t io_lock;
+    pthread_cond_t io_cond;
+    int io_thread_state;
+    ssize_t io_ret;
 #endif
     int users;
     uint8_t *buffer;
@@ -28,6 +43,17 @@ struct filebuf {
 #ifdef __APPLE__
     size_t mapping_len;
 #endif
+    int direct;
+    /* asynchronous mode: the spare buffer is written behind, or the next
+     * buffer read ahead, while the buffer is filled or consumed */
+    int async;
+    uint8_t *spare;
+    int io_pending;
+    int io_write;
+    off_t io_offset;
+    size_t io_size;
+    uint64_t open_time;
+    struct filebuf_stats stats;
 };
 
 struct filebuf *filebuf_open(const char *fn, const char *mode);
@@ -49,5 +75,7 @@ void *filebuf_mmap(struct filebuf *fb, off_t offset, size_t len);
 void *filebuf_mmap_cow(struct filebuf *fb, off_t offset, size_t len, void *tgt_va);
 int filebuf_set_sparse(struct filebuf *fb, bool sparse_flag);
 int filebuf_set_zero_data(struct filebuf *fb, off_t offset, size_t len);
+int filebuf_prefetch(struct filebuf *fb, off_t offset, size_t len);
+void filebuf_get_stats(struct filebuf *fb, struct filebuf_stats *stats);
 
 #endif  /* __FILEBUF_H_ */
@@ -11,6 +11,7 @@
 #include <dm/dmpdev.h>
 #include <dm/hw.h>
 #include <dm/firmware.h>
+#include <dm/inet-csum.h>
 
 #include "uxen_v4v.h"
 
@@ -82,6 +83,10 @@ typedef struct uxen_net {
 
     int32_t fish;
 
+    uint32_t offload;           /* offloads advertised to the guest */
+    uint32_t offload_enabled;   /* offloads the guest enabled */
+    int peer_offload;           /* NET_OFFLOAD_* accepted by the peer */
+
 #if PCAP
     FILE *pcap;
     int pcap_last_tx_nr;
@@ -141,66 +146,18 @@ struct tcphdr {
 };
 
 
-uint16_t
-checksum (uint8_t *packet, size_t len, uint32_t sum)
-{
-
-    // make 16 bit words out of every two adjacent 8 bit words in the packet
-    // and add them up
-    while (len > 1) {
-        uint16_t w = ((packet[0] << 8) & 0xFF00) + (packet[1] & 0xFF);
-        sum += w;
-        packet += 2;
-        len -= 2;
-    }
-
-    if (len)
-        sum += packet[0] << 8;
-
-    // take only 16 bits out of the 32 bit sum and add up the carries
-    while (sum >> 16)
-        sum = (sum & 0xFFFF) + (sum >> 16);
-
-    // one's complement the result
-    sum = ~sum;
-
-    return (uint16_t) sum;
-}
-
-static uint32_t
-partial_sum (void *_d, size_t len)
-{
-    uint8_t *packet = (uint8_t *) _d;
-    uint32_t sum = 0;
-
-    while (len > 1) {
-        uint16_t w = ((packet[0] << 8) & 0xFF00) + (packet[1] & 0xFF);
-        sum += w;
-        packet += 2;
-        len -= 2;
-    }
-
-    return sum;
-}
-
 static void
 fix_checksum_udp (uint32_t saddr, uint32_t daddr, uint8_t *packet,
                   size_t len)
 {
     struct udphdr *u = (struct udphdr *) packet;
 #if 0
-    uint32_t sum = 0;
     if (len < sizeof (struct udphdr))
         return;
 
     u->uh_sum = 0;
-
-    sum += partial_sum (&saddr, sizeof (saddr));
-    sum += partial_sum (&daddr, sizeof (daddr));
-    sum += 11 << 8;
-    sum += len;
-
-    u->uh_sum = htons (checksum (packet, len, sum));
+    u->uh_sum = inet_csum (packet, len,
+                           inet_csum_pseudo (saddr, daddr, 17, len));
 
     debug_printf("fixed udp checksum to %04x\n", ntohs(u->uh_sum));
 #else
@@ -216,18 +173,12 @@ fix_checksum_tcp (uint32_t saddr, uint32_t daddr, uint8_t *packet,
                   size_t len)
 {
     struct tcphdr *t = (struct tcphdr *) packet;
-    uint32_t sum = 0;
     if (len < sizeof (struct tcphdr))
         return;
 
     t->th_sum = 0;
-
-    sum += partial_sum (&saddr, sizeof (saddr));
-    sum += partial_sum (&daddr, sizeof (daddr));
-    sum += 6;
-    sum += len;
-
-    t->th_sum = htons (checksum (packet, len, sum));
+    t->th_sum = inet_csum (packet, len,
+                           inet_csum_pseudo (saddr, daddr, 6, len));
 
     // debug_printf("fixed tcp checksum to %04x\n", ntohs(t->th_sum));
 
@@ -247,7 +198,7 @@ fix_checksum_ip (uint8_t *packet, size_t len)
         return;
 
     i->check = 0;
-    i->check = htons (checksum (packet, sizeof (struct iphdr), 0));
+    i->check = inet_csum (packet, sizeof (struct iphdr), 0);
 
     len -= hl;
     packet += hl;
@@ -298,6 +249,88 @@ fix_checksum (uint8_t *packet, size_t len)
 
 #endif
 
+/******** segmentation offload **********/
+
+/* Split a TCP frame larger than the MTU, sent by a guest with TSO enabled,
+ * into MTU sized frames for peers which did not accept TSO.  Each segment
+ * is built in place, in front of its payload, over the tail of the
+ * previous segment which has already been sent. */
+static void
+uxen_net_send_segmented (uxen_net_t *s, uint8_t *frame, size_t len)
+{
+    extern unsigned slirp_mru;
+    struct ethhdr *e = (struct ethhdr *) frame;
+    struct iphdr *i;
+    struct tcphdr *t;
+    uint8_t hdr[sizeof (struct ethhdr) + 60 + 60];
+    size_t hl, thl, hlen, end, off, seg, mss;
+    uint32_t seq;
+    uint16_t id;
+    uint8_t flags;
+
+    if (len <= slirp_mru + sizeof (struct ethhdr) ||
+        e->prot != htons (0x800))
+        goto out;
+
+    i = (struct iphdr *) (e + 1);
+    hl = i->ihl << 2;
+    if (i->protocol != 6 || hl < sizeof (struct iphdr) ||
+        len < sizeof (struct ethhdr) + hl + sizeof (struct tcphdr))
+        goto out;
+
+    t = (struct tcphdr *) ((uint8_t *) i + hl);
+    thl = t->th_off << 2;
+    end = sizeof (struct ethhdr) + ntohs (i->tot_len);
+    hlen = sizeof (struct ethhdr) + hl + thl;
+    if (thl < sizeof (struct tcphdr) || end < hlen || len < end ||
+        slirp_mru <= hl + thl)
+        goto out;
+
+    memcpy (hdr, frame, hlen);
+    mss = slirp_mru - hl - thl;
+    seq = ntohl (t->th_seq);
+    id = ntohs (i->id);
+    flags = t->th_flags;
+
+    for (off = hlen; off < end; off += seg) {
+        uint8_t *p = frame + off - hlen;
+
+        seg = end - off < mss ? end - off : mss;
+
+        memcpy (p, hdr, hlen);
+        i = (struct iphdr *) (p + sizeof (struct ethhdr));
+        t = (struct tcphdr *) ((uint8_t *) i + hl);
+        i->tot_len = htons (hl + thl + seg);
+        i->id = htons (id++);
+        t->th_seq = htonl (seq);
+        /* FIN and PSH belong to the last segment only */
+        if (off + seg < end)
+            t->th_flags = flags & ~(TH_FIN | TH_PUSH);
+        fix_checksum (p, hlen + seg);
+
+        qemu_send_packet (&s->nic->nc, p, hlen + seg);
+        seq += seg;
+    }
+    return;
+
+  out:
+    qemu_send_packet (&s->nic->nc, frame, len);
+}
+
+static void
+uxen_net_set_offload (uxen_net_t *s, uint32_t flags)
+{
+    int net_flags = 0;
+
+    s->offload_enabled = flags & s->offload;
+    if (s->offload_enabled & UXENBUS_NET_OFFLOAD_TSO)
+        net_flags |= NET_OFFLOAD_TSO;
+    s->peer_offload = qemu_set_offload (&s->nic->nc, net_flags);
+
+    debug_printf("uxn: offload enabled %x, peer accepted %x\n",
+                 s->offload_enabled, s->peer_offload);
+}
+
 
 
 /****************** packet capture *******************/
@@ -707,6 +740,15 @@ uxen_net_read_event (void *_s)
         if (len == 1)
             debug_printf("uxn: read_event got poke back\n");
 
+        if (len == sizeof (struct uxen_net_offload_msg)) {
+            struct uxen_net_offload_msg *msg =
+                (struct uxen_net_offload_msg *) s->rx_buf;
+
+            if (msg->magic == UXEN_NET_OFFLOAD_MAGIC)
+                uxen_net_set_offload (s, msg->flags);
+            continue;
+        }
+
 #if PCAP
         uxen_net_log_packet (s, s->rx_buf, len, 4);
 #endif
@@ -716,7 +758,11 @@ uxen_net_read_event (void *_s)
         // debug_printf("uxn: dispatched a packet of %"PRIdSIZE" bytes\n", len);
 
         memcpy (&s->rx_buf[6], &s->conf.macaddr.a[0], 6); //why?
-        qemu_send_packet (&s->nic->nc, s->rx_buf, len);
+        if ((s->offload_enabled & UXENBUS_NET_OFFLOAD_TSO) &&
+            !(s->peer_offload & NET_OFFLOAD_TSO))
+            uxen_net_send_segmented (s, s->rx_buf, len);
+        else
+            qemu_send_packet (&s->nic->nc, s->rx_buf, len);
     } while (1);
 
     if (!dm_v4v_notify(&s->v4v))
@@ -749,13 +795,17 @@ uxen_net_post_load (void *opaque, int version_id)
                  s->conf.macaddr.a[2], s->conf.macaddr.a[3],
                  s->conf.macaddr.a[4], s->conf.macaddr.a[5]);
 
+    /* the guest does not renegotiate after restore */
+    if (s->offload_enabled)
+        uxen_net_set_offload (s, s->offload_enabled);
+
     return 0;
 }
 
 
 static const VMStateDescription vmstate_uxen_net = {
     .name = "uxen_net",
-    .version_id = 1,
+    .version_id = 2,
     .minimum_version_id = 1,
     .minimum_version_id_old = 1,
     .post_load = uxen_net_post_load,
@@ -765,6 +815,7 @@ static const VMStateDescription vmstate_uxen_net = {
         VMSTATE_UNUSED (4),
         VMSTATE_MACADDR (conf.macaddr, uxen_net_t),
         VMSTATE_INT32 (fish, uxen_net_t),
+        VMSTATE_UINT32_V (offload_enabled, uxen_net_t, 2),
         VMSTATE_END_OF_LIST ()
     },
 };
@@ -805,6 +856,7 @@ uxen_net_initfn (UXenPlatformDevice *dev)
     extern unsigned slirp_mru;
     uxen_net_t *s = DO_UPCAST (uxen_net_t, dev, dev);
     uint16_t mru;
+    uint32_t offload;
 
     qemu_macaddr_default_if_unset (&s->conf.macaddr);
 
@@ -873,6 +925,9 @@ uxen_net_initfn (UXenPlatformDevice *dev)
         mru = htons(slirp_mru);
         uxenplatform_device_add_property(dev, UXENBUS_PROPERTY_TYPE_MTU,
                                          &mru, 2);
+        offload = htonl(s->offload);
+        uxenplatform_device_add_property(dev, UXENBUS_PROPERTY_TYPE_OFFLOAD,
+                                         &offload, 4);
 
         debug_printf("%s: mac is %02x:%02x:%02x:%02x:%02x:%02x\n"
                      " slirp_mru(guest mtu) is %d\n", __FUNCTION__,
@@ -901,6 +956,8 @@ static UXenPlatformDeviceInfo uxen_net_info = {
     .qdev.props = (Property[])
     {
         DEFINE_NIC_PROPERTIES (uxen_net_t, conf),
+        DEFINE_PROP_UINT32 ("offload", uxen_net_t, offload,
+                            UXENBUS_NET_OFFLOAD_TSO),
         DEFINE_PROP_END_OF_LIST (),
     }
     ,
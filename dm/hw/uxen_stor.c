@@ -40,6 +40,13 @@
 
 #define RING_SIZE (1024*1024) //131072
 
+/* each disk has up to UXEN_STOR_MAX_QUEUES rings, ring q is bound to
+ * port 0xd0000 + unit + q * UXEN_STOR_QUEUE_PORT_STRIDE -- the number of
+ * rings is advertised to the guest at ioport 0x32e, guest drivers which
+ * don't read it use ring 0 only */
+#define UXEN_STOR_MAX_QUEUES 8
+#define UXEN_STOR_QUEUE_PORT_STRIDE 0x100
+
 #define  PCAP 0
 
 #define LOG_ALL_SCSI_COMPLETE 0
@@ -52,6 +59,17 @@ static int processed = 0;
 static int unit_bitfield[16];
 static int stor_ctrl = 0;
 
+static int
+uxen_stor_nr_queues (void)
+{
+
+    if (vm_v4v_storage_queues < 1)
+        return 1;
+    if (vm_v4v_storage_queues > UXEN_STOR_MAX_QUEUES)
+        return UXEN_STOR_MAX_QUEUES;
+    return vm_v4v_storage_queues;
+}
+
 typedef struct v4v_disk_transfer {
     uint64_t seq;
     uint32_t cdb_size;
@@ -89,6 +107,8 @@ typedef struct uxen_stor_req {
 
     uxen_stor_state_t state;
 
+    struct uxen_stor_queue *q;
+
     size_t len;
 
 #ifdef QEMU_SCSI
@@ -97,7 +117,6 @@ typedef struct uxen_stor_req {
     ssize_t scsi_data_len;
 #else
     UXSCSI scsi;
-    struct uxen_stor *parent;
     uint8_t sense_data[18];
     size_t cdb_len;
 #endif
@@ -125,9 +144,10 @@ typedef struct uxen_stor_req {
 } uxen_stor_req_t;
 
 
-typedef struct uxen_stor {
-    ISADevice dev;
-    //DeviceState dev;
+typedef struct uxen_stor_queue {
+    struct uxen_stor *s;
+    int index;
+
     v4v_context_t v4v;
     v4v_addr_t dest;
 
@@ -138,6 +158,20 @@ typedef struct uxen_stor {
 
     v4v_ring_t *ring;
 
+    uxen_stor_req_list_t queue;
+
+    /* replies of requests completed in one main loop iteration are sent
+     * together from one run of the queue */
+    BH *reply_bh;
+} uxen_stor_queue_t;
+
+typedef struct uxen_stor {
+    ISADevice dev;
+    //DeviceState dev;
+
+    uxen_stor_queue_t q[UXEN_STOR_MAX_QUEUES];
+    int nr_queues;
+
     BlockConf conf;
 
 #ifdef QEMU_SCSI
@@ -145,8 +179,6 @@ typedef struct uxen_stor {
     SCSIDevice *scsi_dev;
 #endif
 
-    uxen_stor_req_list_t queue;
-
     uint32_t removable;
     uint32_t parasite;
 
@@ -353,16 +385,16 @@ req_remove (uxen_stor_req_list_t *list, uxen_stor_req_t *req)
 #ifdef _WIN32
 
 static void
-uxen_stor_send_reply (uxen_stor_t *s, uxen_stor_req_t *r)
+uxen_stor_send_reply (uxen_stor_queue_t *q, uxen_stor_req_t *r)
 {
-    dm_v4v_async_init(&s->v4v, &r->async, s->tx_event);
+    dm_v4v_async_init(&q->v4v, &r->async, q->tx_event);
 
 #if PCAP
-    uxen_stor_log_packet (s, &r->packet.xfr, r->reply_size, 1);
+    uxen_stor_log_packet (q->s, &r->packet.xfr, r->reply_size, 1);
 #endif
 
     int ret = dm_v4v_send(
-        &s->v4v, (v4v_datagram_t*) &r->packet,
+        &q->v4v, (v4v_datagram_t*) &r->packet,
         r->reply_size + sizeof (v4v_datagram_t), &r->async);
     if (ret && ret != ERROR_IO_PENDING) {
         Wwarn("%s: failed send, seq=%"PRIx64" ret=%d", __FUNCTION__, r->packet.xfr.seq, ret);
@@ -379,10 +411,10 @@ uxen_stor_send_reply (uxen_stor_t *s, uxen_stor_req_t *r)
 #else
 
 static void
-uxen_stor_send_reply (uxen_stor_t *s, uxen_stor_req_t *r)
+uxen_stor_send_reply (uxen_stor_queue_t *q, uxen_stor_req_t *r)
 {
     ssize_t sent_bytes = v4v_sendto(
-        &s->v4v.v4v_channel, s->dest,
+        &q->v4v.v4v_channel, q->dest,
         &r->packet.xfr, r->reply_size, r->packet.dg.flags);
     if (sent_bytes == -EAGAIN)
     {
@@ -454,13 +486,9 @@ uxen_stor_request_cancelled (SCSIRequest *req)
 }
 
 
-static void
-uxen_stor_run_q (uxen_stor_t *s);
-
 static void
 uxen_stor_command_complete (SCSIRequest *req, uint32_t status)
 {
-    uxen_stor_t *s = DO_UPCAST (uxen_stor_t, dev.qdev, req->bus->qbus.parent);
     uxen_stor_req_t *r = (uxen_stor_req_t *) req->hba_private;
     uint32_t size = 0;
 
@@ -516,14 +544,7 @@ uxen_stor_command_complete (SCSIRequest *req, uint32_t status)
     scsi_req_unref (r->req);
     r->req = NULL;
 
-    uxen_stor_send_reply (s, r);
-    
-#ifndef _WIN32
-    /* Run queue so that the request gets cleaned up and other pending replies
-     * are retried */
-    if (r->state == UXS_STATE_V4V_SENT)
-        ioh_event_set(&s->run_queue_event);
-#endif
+    bh_schedule (r->q->reply_bh);
 }
 
 static const struct SCSIBusInfo uxen_stor_scsi_info = {
@@ -542,7 +563,6 @@ static const struct SCSIBusInfo uxen_stor_scsi_info = {
 static void uxen_stor_uxscsi_complete(void *_r,UXSCSI *scsi)
 {
 uxen_stor_req_t *r=(uxen_stor_req_t *) _r;
-uxen_stor_t *s=r->parent;
 uint8_t status=uxscsi_status(scsi);
 size_t sense_len;
 uint32_t size=0;
@@ -597,7 +617,7 @@ if (status!= SCSIST_GOOD) {
 
     r->state = UXS_STATE_SCSI_DONE;
 
-    uxen_stor_send_reply (s, r);
+    bh_schedule (r->q->reply_bh);
 }
 
 
@@ -605,8 +625,9 @@ if (status!= SCSIST_GOOD) {
 
 
 static void
-uxen_stor_run_q (uxen_stor_t *s)
+uxen_stor_run_q (uxen_stor_queue_t *q)
 {
+    uxen_stor_t *s = q->s;
     uxen_stor_req_t *r, *next_r;
     int short_circuit;
 
@@ -614,7 +635,7 @@ uxen_stor_run_q (uxen_stor_t *s)
     uxen_stor_req_t *still_pending = NULL;
     int last_sent_successfully = 0;
 #endif
-    for (r = s->queue.head; r;) {
+    for (r = q->queue.head; r;) {
 
 
         switch (r->state) {
@@ -661,7 +682,7 @@ uxen_stor_run_q (uxen_stor_t *s)
 #ifndef _WIN32
                     last_sent_successfully = 0;
 #endif
-                    uxen_stor_send_reply (s, r);
+                    uxen_stor_send_reply (q, r);
 
                 } else {
 #ifdef QEMU_SCSI
@@ -702,7 +723,16 @@ uxen_stor_run_q (uxen_stor_t *s)
                 break;
 
             case UXS_STATE_SCSI_DONE:
-                /*This state is handled in the completion handler */
+                /* completed since the last run, send the reply -- a
+                 * request which failed to start has no reply */
+                if (!r->reply_size) {
+                    r->state = UXS_STATE_V4V_SENT;
+                    break;
+                }
+#ifndef _WIN32
+                last_sent_successfully = 0;
+#endif
+                uxen_stor_send_reply (q, r);
                 break;
 
             case UXS_STATE_V4V_SENDING:
@@ -711,7 +741,7 @@ uxen_stor_run_q (uxen_stor_t *s)
                     r->state = UXS_STATE_V4V_SENT;
 #else
                 last_sent_successfully = 0;
-                uxen_stor_send_reply (s, r);
+                uxen_stor_send_reply (q, r);
 #endif
 
                 break;
@@ -726,7 +756,7 @@ uxen_stor_run_q (uxen_stor_t *s)
                              " hwm is %"PRIdSIZE" kb\n", __FUNCTION__,
                              processed, s->mem >> 10, s->hwm >> 10);
             processed++;
-            req_remove (&s->queue, r);
+            req_remove (&q->queue, r);
             s->mem -= r->len;
             free (r);
 #ifndef _WIN32
@@ -745,36 +775,45 @@ uxen_stor_run_q (uxen_stor_t *s)
      * the queue on the next cycle so we always end on a failed send (or no
      * pending sends) */
     if (still_pending && last_sent_successfully)
-        ioh_event_set(&s->run_queue_event);
+        ioh_event_set(&q->run_queue_event);
 #endif
 }
 
 
 static void
-uxen_stor_write_event (void *_s)
+uxen_stor_write_event (void *_q)
 {
-    uxen_stor_t *s = (uxen_stor_t *) _s;
+    uxen_stor_queue_t *q = (uxen_stor_queue_t *) _q;
 
 #ifdef LOG_QUEUE
     debug_printf("%s: write_event\n", __FUNCTION__);
 #endif
 
-    ioh_event_reset(&s->tx_event);
+    ioh_event_reset(&q->tx_event);
 #ifndef _WIN32
-    ioh_event_reset(&s->run_queue_event);
+    ioh_event_reset(&q->run_queue_event);
 #endif
 
-    uxen_stor_run_q (s);
+    uxen_stor_run_q (q);
 
 }
 
+static void
+uxen_stor_reply_bh (void *_q)
+{
+    uxen_stor_queue_t *q = (uxen_stor_queue_t *) _q;
+
+    uxen_stor_run_q (q);
+}
+
 
 /*********************** RX path ***************************/
 
 static void
-uxen_stor_read_event (void *_s)
+uxen_stor_read_event (void *_q)
 {
-    uxen_stor_t *s = (uxen_stor_t *) _s;
+    uxen_stor_queue_t *q = (uxen_stor_queue_t *) _q;
+    uxen_stor_t *s = q->s;
     ssize_t len;
     uint32_t protocol;
     v4v_disk_transfer_t xfr;
@@ -787,7 +826,7 @@ uxen_stor_read_event (void *_s)
 
     do {
         len =
-            v4v_copy_out (s->ring, NULL, &protocol, &xfr,
+            v4v_copy_out (q->ring, NULL, &protocol, &xfr,
                           sizeof (v4v_disk_transfer_t), 0);
 
         if (len < 0)
@@ -796,7 +835,7 @@ uxen_stor_read_event (void *_s)
         if ((protocol != V4V_PROTO_DGRAM)
             || (len < sizeof (v4v_disk_transfer_t))
             || (xfr.cdb_size > MAX_CDB)) {
-            v4v_copy_out (s->ring, NULL, NULL, NULL, 0, 1);
+            v4v_copy_out (q->ring, NULL, NULL, NULL, 0, 1);
             continue;
         }
 
@@ -807,7 +846,7 @@ uxen_stor_read_event (void *_s)
             debug_printf("%s: dropped a request of size %d"
                          " sequence id %"PRIx64"\n", __FUNCTION__,
                          size, xfr.seq);
-            v4v_copy_out (s->ring, NULL, NULL, NULL, 0, 1);
+            v4v_copy_out (q->ring, NULL, NULL, NULL, 0, 1);
             continue;
         }
 
@@ -820,9 +859,7 @@ uxen_stor_read_event (void *_s)
         }
         memset (req, 0, len);
 
-#ifndef QEMU_SCSI
-        req->parent = s;
-#endif
+        req->q = q;
 
         req->len = len;
 
@@ -839,7 +876,7 @@ uxen_stor_read_event (void *_s)
 #if PCAP
         plen =
 #endif
-            v4v_copy_out (s->ring, &req->packet.dg.addr, NULL,
+            v4v_copy_out (q->ring, &req->packet.dg.addr, NULL,
                               &req->packet.xfr, size, 1);
 
 #if PCAP
@@ -862,12 +899,12 @@ uxen_stor_read_event (void *_s)
 
 
 
-        req_insert_tail (&s->queue, req);
+        req_insert_tail (&q->queue, req);
     } while (1);
 
-    dm_v4v_notify(&s->v4v);
+    dm_v4v_notify(&q->v4v);
 
-    uxen_stor_run_q (s);
+    uxen_stor_run_q (q);
 }
 
 /*******************************************************/
@@ -928,6 +965,12 @@ uxen_stor_ioport_ctrl_read (void *opaque, uint32_t addr)
     return stor_ctrl;
 }
 
+static uint32_t
+uxen_stor_ioport_queues_read (void *opaque, uint32_t addr)
+{
+    return uxen_stor_nr_queues ();
+}
+
 static void present_bitfield_set(uint32_t devid)
 {
     int offset;
@@ -959,82 +1002,119 @@ uxen_stor_cleanup (VLANClientState *nc)
 }
 #endif
 
+static void
+uxen_stor_queue_close (uxen_stor_queue_t *q)
+{
+
+    if (q->reply_bh)
+        bh_delete (q->reply_bh);
+    q->reply_bh = NULL;
+#ifndef _WIN32
+    ioh_event_close(&q->run_queue_event);
+#endif
+    ioh_event_close(&q->tx_event);
+    dm_v4v_close(&q->v4v);
+}
+
 static int
-uxen_stor_initfn (ISADevice *dev)
+uxen_stor_queue_open (uxen_stor_t *s, int index)
 {
+    uxen_stor_queue_t *q = &s->q[index];
     v4v_bind_values_t bind = { };
     int error;
 
-    uxen_stor_t *s = DO_UPCAST (uxen_stor_t, dev, dev);
-    BlockDriverState *bs = s->conf.bs;
-
-    s->queue.head = s->queue.tail = NULL;
-    s->unit = unit;
+    q->s = s;
+    q->index = index;
+    q->queue.head = q->queue.tail = NULL;
 
-    s->hwm = s->mem = 0;
-
-    debug_printf("%s: unit %d parasite is %d\n", __FUNCTION__,
-                 unit, s->parasite);
-
-#if PCAP
-    if (uxen_stor_log_init(s, unit)) {
-        debug_printf("%s: uxen_stor_log_init failed\n", __FUNCTION__);
-        return -1;
-    }
-#endif
-
-    if (!dm_v4v_have_v4v ()) {
-        debug_printf("%s: no v4v detected on the host\n", __FUNCTION__);
-        return -1;
-    }
-
-    if ((error = dm_v4v_open(&s->v4v, RING_SIZE))) {
+    if ((error = dm_v4v_open(&q->v4v, RING_SIZE))) {
         debug_printf("%s: v4v_open failed (%x)\n",
                      __FUNCTION__, error);
         return -1;
     }
 
 
-    bind.ring_id.addr.port = 0xd0000 + unit;
+    bind.ring_id.addr.port = 0xd0000 + s->unit +
+        index * UXEN_STOR_QUEUE_PORT_STRIDE;
     bind.ring_id.addr.domain = V4V_DOMID_ANY;
     bind.ring_id.partner = V4V_DOMID_UUID;
     memcpy(&bind.partner, v4v_idtoken, sizeof(bind.partner));
 
-    if ((error = dm_v4v_bind(&s->v4v, &bind))) {
+    if ((error = dm_v4v_bind(&q->v4v, &bind))) {
         debug_printf("%s: v4v_bind failed (%x)\n",
                      __FUNCTION__, error);
-        dm_v4v_close(&s->v4v);
+        dm_v4v_close(&q->v4v);
         return -1;
     }
 
-    s->dest.domain = bind.ring_id.partner;
-    s->dest.port = bind.ring_id.addr.port;
+    q->dest.domain = bind.ring_id.partner;
+    q->dest.port = bind.ring_id.addr.port;
 
-    error = dm_v4v_ring_map(&s->v4v, &s->ring);
-    if (!s->ring) {
+    error = dm_v4v_ring_map(&q->v4v, &q->ring);
+    if (!q->ring) {
         debug_printf("%s: failed to map ring (%x)\n",
                      __FUNCTION__, error);
-        dm_v4v_close(&s->v4v);
+        dm_v4v_close(&q->v4v);
         return -1;
     }
-    if ((error = dm_v4v_init_tx_event(&s->v4v, &s->tx_event))) {
+    if ((error = dm_v4v_init_tx_event(&q->v4v, &q->tx_event))) {
         debug_printf("%s: failed to create event (%x)\n",
                      __FUNCTION__, error);
-        dm_v4v_close(&s->v4v);
+        dm_v4v_close(&q->v4v);
         return -1;
     }
 
 #ifndef _WIN32
-    ioh_event_init(&s->run_queue_event);
+    ioh_event_init(&q->run_queue_event);
+#endif
+
+    q->reply_bh = bh_new(uxen_stor_reply_bh, q);
+
+    return 0;
+}
+
+static int
+uxen_stor_initfn (ISADevice *dev)
+{
+    int i;
+
+    uxen_stor_t *s = DO_UPCAST (uxen_stor_t, dev, dev);
+    BlockDriverState *bs = s->conf.bs;
+
+    s->unit = unit;
+
+    s->hwm = s->mem = 0;
+
+    debug_printf("%s: unit %d parasite is %d\n", __FUNCTION__,
+                 unit, s->parasite);
+
+#if PCAP
+    if (uxen_stor_log_init(s, unit)) {
+        debug_printf("%s: uxen_stor_log_init failed\n", __FUNCTION__);
+        return -1;
+    }
 #endif
 
+    if (!dm_v4v_have_v4v ()) {
+        debug_printf("%s: no v4v detected on the host\n", __FUNCTION__);
+        return -1;
+    }
+
     if (!bs) {
         error_report("uxen-stor: drive property not set");
-        ioh_event_close(&s->tx_event);
-        dm_v4v_close(&s->v4v);
         return -1;
     }
 
+    /* all rings are required, the guest binds as many as advertised */
+    for (i = 0; i < uxen_stor_nr_queues (); i++) {
+        if (uxen_stor_queue_open (s, i)) {
+            while (s->nr_queues)
+                uxen_stor_queue_close (&s->q[--s->nr_queues]);
+            return -1;
+        }
+        s->nr_queues++;
+    }
+
 #ifdef QEMU_SCSI
     /*
      * Hack alert: this pretends to be a block device, but it's really
@@ -1059,8 +1139,8 @@ uxen_stor_initfn (ISADevice *dev)
 
     if (!s->scsi_dev) {
         debug_printf("%s: scsi_bus_legacy_add_drive failed\n", __FUNCTION__);
-        ioh_event_close(&s->tx_event);
-        dm_v4v_close(&s->v4v);
+        for (i = 0; i < s->nr_queues; i++)
+            uxen_stor_queue_close (&s->q[i]);
         return -1;
     }
 #endif
@@ -1069,13 +1149,19 @@ uxen_stor_initfn (ISADevice *dev)
     if (vm_v4v_disable_ahci_clones)
         stor_ctrl |= 0x1;
 
-    ioh_add_wait_object (&s->v4v.recv_event, uxen_stor_read_event, s, NULL);
-    ioh_add_wait_object (&s->tx_event, uxen_stor_write_event, s, NULL);
+    for (i = 0; i < s->nr_queues; i++) {
+        uxen_stor_queue_t *q = &s->q[i];
+
+        ioh_add_wait_object (&q->v4v.recv_event, uxen_stor_read_event, q,
+                             NULL);
+        ioh_add_wait_object (&q->tx_event, uxen_stor_write_event, q, NULL);
 #ifndef _WIN32
-    ioh_add_wait_object (&s->run_queue_event, uxen_stor_write_event, s, NULL);
+        ioh_add_wait_object (&q->run_queue_event, uxen_stor_write_event, q,
+                             NULL);
 #endif
 
-    uxen_stor_read_event(s);
+        uxen_stor_read_event(q);
+    }
 
     unit++;
 
@@ -1136,8 +1222,10 @@ static ISADeviceInfo uxen_stor_info = {
 void
 uxen_stor_late_register (void)
 {
-    debug_printf("%s: registering 0x32f and 0x330 for uxen_stor\n", __FUNCTION__);
+    debug_printf("%s: registering 0x32e, 0x32f and 0x330 for uxen_stor\n",
+                 __FUNCTION__);
 
+    register_ioport_read (0x32e, 1, 1, uxen_stor_ioport_queues_read, NULL);
     register_ioport_read (0x32f, 1, 1, uxen_stor_ioport_ctrl_read, NULL);
     register_ioport_read (0x330, 16, 1, uxen_stor_ioport_read, NULL);
 }
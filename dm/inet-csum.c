@@ -0,0 +1,290 @@
+/*
+ * Copyright 2019, Bromium, Inc.
+ * SPDX-License-Identifier: ISC
+ */
+
+#include "config.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__i386__) || defined(__x86_64__)
+#include <immintrin.h>
+#define INET_CSUM_SIMD
+#endif
+
+#include "clock.h"
+#include "debug.h"
+#include "inet-csum.h"
+
+// #define INET_CSUM_VERIFY 1
+
+typedef uint64_t (*csum_partial_fn)(const uint8_t *, size_t, uint64_t);
+typedef uint64_t (*csum_copy_fn)(uint8_t *, const uint8_t *, size_t,
+                                 uint64_t);
+
+/* Sum 32-bit words into the 64-bit accumulator, which is congruent to the
+ * sum of 16-bit words modulo 0xffff, and cannot overflow for any realistic
+ * length. */
+static inline uint64_t
+csum_tail(const uint8_t *p, size_t len, uint64_t sum)
+{
+    uint32_t w;
+    uint16_t h;
+
+    while (len >= 4) {
+        memcpy(&w, p, 4);
+        sum += w;
+        p += 4;
+        len -= 4;
+    }
+    if (len >= 2) {
+        memcpy(&h, p, 2);
+        sum += h;
+        p += 2;
+        len -= 2;
+    }
+    if (len) {
+        /* pad the odd byte with zero, in memory order */
+        h = 0;
+        memcpy(&h, p, 1);
+        sum += h;
+    }
+
+    return sum;
+}
+
+static uint64_t
+csum_partial_scalar(const uint8_t *p, size_t len, uint64_t sum)
+{
+    uint32_t w[4];
+
+    while (len >= 16) {
+        memcpy(w, p, 16);
+        sum += (uint64_t)w[0] + w[1] + w[2] + w[3];
+        p += 16;
+        len -= 16;
+    }
+
+    return csum_tail(p, len, sum);
+}
+
+static uint64_t
+csum_copy_scalar(uint8_t *d, const uint8_t *s, size_t len, uint64_t sum)
+{
+    uint32_t w[4];
+
+    while (len >= 16) {
+        memcpy(w, s, 16);
+        memcpy(d, w, 16);
+        sum += (uint64_t)w[0] + w[1] + w[2] + w[3];
+        s += 16;
+        d += 16;
+        len -= 16;
+    }
+    memcpy(d, s, len);
+
+    return csum_tail(s, len, sum);
+}
+
+#ifdef INET_CSUM_SIMD
+/* Zero-extend the 32-bit lanes into 64-bit accumulators, two vectors per
+ * iteration to hide the add latency. */
+static __attribute__((target("avx2"))) uint64_t
+csum_partial_avx2(const uint8_t *p, size_t len, uint64_t sum)
+{
+    __m256i zero = _mm256_setzero_si256();
+    __m256i a0 = zero, a1 = zero;
+    uint64_t lanes[4];
+
+    while (len >= 64) {
+        __m256i v0 = _mm256_loadu_si256((const __m256i *)p);
+        __m256i v1 = _mm256_loadu_si256((const __m256i *)(p + 32));
+
+        a0 = _mm256_add_epi64(a0, _mm256_unpacklo_epi32(v0, zero));
+        a1 = _mm256_add_epi64(a1, _mm256_unpackhi_epi32(v0, zero));
+        a0 = _mm256_add_epi64(a0, _mm256_unpacklo_epi32(v1, zero));
+        a1 = _mm256_add_epi64(a1, _mm256_unpackhi_epi32(v1, zero));
+        p += 64;
+        len -= 64;
+    }
+    _mm256_storeu_si256((__m256i *)lanes, _mm256_add_epi64(a0, a1));
+    sum += lanes[0] + lanes[1] + lanes[2] + lanes[3];
+
+    return csum_partial_scalar(p, len, sum);
+}
+
+static __attribute__((target("avx2"))) uint64_t
+csum_copy_avx2(uint8_t *d, const uint8_t *s, size_t len, uint64_t sum)
+{
+    __m256i zero = _mm256_setzero_si256();
+    __m256i a0 = zero, a1 = zero;
+    uint64_t lanes[4];
+
+    while (len >= 64) {
+        __m256i v0 = _mm256_loadu_si256((const __m256i *)s);
+        __m256i v1 = _mm256_loadu_si256((const __m256i *)(s + 32));
+
+        _mm256_storeu_si256((__m256i *)d, v0);
+        _mm256_storeu_si256((__m256i *)(d + 32), v1);
+        a0 = _mm256_add_epi64(a0, _mm256_unpacklo_epi32(v0, zero));
+        a1 = _mm256_add_epi64(a1, _mm256_unpackhi_epi32(v0, zero));
+        a0 = _mm256_add_epi64(a0, _mm256_unpacklo_epi32(v1, zero));
+        a1 = _mm256_add_epi64(a1, _mm256_unpackhi_epi32(v1, zero));
+        s += 64;
+        d += 64;
+        len -= 64;
+    }
+    _mm256_storeu_si256((__m256i *)lanes, _mm256_add_epi64(a0, a1));
+    sum += lanes[0] + lanes[1] + lanes[2] + lanes[3];
+
+    return csum_copy_scalar(d, s, len, sum);
+}
+#endif
+
+static csum_partial_fn csum_partial = csum_partial_scalar;
+static csum_copy_fn csum_copy = csum_copy_scalar;
+
+uint64_t
+inet_csum_partial(const void *buf, size_t len, uint64_t sum)
+{
+    return csum_partial((const uint8_t *)buf, len, sum);
+}
+
+uint64_t
+inet_csum_copy(void *dst, const void *src, size_t len, uint64_t sum)
+{
+    return csum_copy((uint8_t *)dst, (const uint8_t *)src, len, sum);
+}
+
+#ifdef INET_CSUM_VERIFY
+/* RFC 1071 reference, 16 bits at a time. */
+static uint16_t
+csum_ref(const uint8_t *p, size_t len)
+{
+    uint32_t sum = 0;
+
+    while (len > 1) {
+        sum += (p[0] << 8) | p[1];
+        p += 2;
+        len -= 2;
+    }
+    if (len)
+        sum += p[0] << 8;
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+
+    return ~sum & 0xffff;
+}
+
+static void
+check_csum_with(const char *name, csum_partial_fn partial, csum_copy_fn copy)
+{
+    static uint8_t src[65536 + 64], dst[65536 + 64];
+    const int iterations = 20000;
+    size_t sizes[] = { 20, 40, 64, 576, 1500, 9000, 65535 };
+    size_t len, off;
+    uint16_t c, ref;
+    int64_t t, t_ref;
+    int i, it;
+
+    for (i = 0; i < sizeof(src); i++)
+        src[i] = rand();
+
+    for (it = 0; it < iterations; it++) {
+        len = rand() % 2048;
+        off = rand() % 64;
+        /* saturate now and then to exercise the carries */
+        if (!(it % 7))
+            memset(src + off, 0xff, len);
+        ref = csum_ref(src + off, len);
+        c = inet_csum_fold(partial(src + off, len, 0));
+        c = (c << 8) | (c >> 8);
+        if (c != ref)
+            debug_printf("%s: inet_csum_partial mismatch len=%d off=%d "
+                         "%04x vs %04x\n", name, (int)len, (int)off, c, ref);
+        memset(dst, 0, len + 64);
+        c = inet_csum_fold(copy(dst + (off ^ 5), src + off, len, 0));
+        c = (c << 8) | (c >> 8);
+        if (c != ref || memcmp(dst + (off ^ 5), src + off, len))
+            debug_printf("%s: inet_csum_copy mismatch len=%d off=%d\n",
+                         name, (int)len, (int)off);
+    }
+
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        len = sizes[i];
+        t = os_get_clock();
+        for (it = 0; it < iterations; it++)
+            src[it % len] ^= inet_csum_fold(partial(src, len, 0));
+        t = os_get_clock() - t;
+        t_ref = os_get_clock();
+        for (it = 0; it < iterations; it++)
+            src[it % len] ^= csum_ref(src, len);
+        t_ref = os_get_clock() - t_ref;
+        debug_printf("%s checksum len=%d %.1fns vs %.1fns reference\n",
+                     name, (int)len, (double)t / iterations,
+                     (double)t_ref / iterations);
+
+        t = os_get_clock();
+        for (it = 0; it < iterations; it++)
+            src[it % len] ^= inet_csum_fold(copy(dst, src, len, 0));
+        t = os_get_clock() - t;
+        t_ref = os_get_clock();
+        for (it = 0; it < iterations; it++) {
+            memcpy(dst, src, len);
+            src[it % len] ^= csum_ref(dst, len);
+        }
+        t_ref = os_get_clock() - t_ref;
+        debug_printf("%s copy+checksum len=%d %.1fns vs %.1fns reference\n",
+                     name, (int)len, (double)t / iterations,
+                     (double)t_ref / iterations);
+    }
+}
+
+static void
+check_csum(void)
+{
+    uint16_t c, ref, old, new;
+    uint8_t hdr[20];
+    int i;
+
+    check_csum_with("scalar", csum_partial_scalar, csum_copy_scalar);
+#ifdef INET_CSUM_SIMD
+    if (__builtin_cpu_supports("avx2"))
+        check_csum_with("avx2", csum_partial_avx2, csum_copy_avx2);
+#endif
+
+    for (i = 0; i < 10000; i++) {
+        int k;
+
+        for (k = 0; k < sizeof(hdr); k++)
+            hdr[k] = rand();
+        c = inet_csum(hdr, sizeof(hdr), 0);
+        k = 2 * (rand() % (sizeof(hdr) / 2));
+        memcpy(&old, hdr + k, 2);
+        new = i & 1 ? rand() : (uint16_t)~old;
+        memcpy(hdr + k, &new, 2);
+        c = inet_csum_update16(c, old, new);
+        ref = inet_csum(hdr, sizeof(hdr), 0);
+        /* eqn. 3 may yield either representation of zero */
+        if (c != ref && (uint16_t)(c + 1) > 1)
+            debug_printf("inet_csum_update16 mismatch %04x vs %04x\n",
+                         c, ref);
+    }
+}
+#endif
+
+initcall(inet_csum_init)
+{
+#ifdef INET_CSUM_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        csum_partial = csum_partial_avx2;
+        csum_copy = csum_copy_avx2;
+    }
+#endif
+#ifdef INET_CSUM_VERIFY
+    check_csum();
+#endif
+}
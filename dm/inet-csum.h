@@ -0,0 +1,75 @@
+/*
+ * Copyright 2019, Bromium, Inc.
+ * SPDX-License-Identifier: ISC
+ */
+
+#ifndef _INET_CSUM_H_
+#define _INET_CSUM_H_
+
+#include <stdint.h>
+#include <string.h>
+
+/* Internet checksum (RFC 1071).
+ *
+ * Partial sums are accumulated over words in host byte order in a 64-bit
+ * accumulator and only folded to 16 bits when the checksum is finalized.
+ * Since the one's complement sum does not depend on byte order, the result
+ * of inet_csum_fold() can be stored into a header as is.  Partial sums of
+ * adjacent ranges can be added together as long as the second range starts
+ * at an even offset. */
+
+uint64_t inet_csum_partial(const void *buf, size_t len, uint64_t sum);
+/* Copy len bytes from src to dst, and return the partial sum over them. */
+uint64_t inet_csum_copy(void *dst, const void *src, size_t len, uint64_t sum);
+
+static inline uint16_t
+inet_csum_fold(uint64_t sum)
+{
+    sum = (sum & 0xffffffff) + (sum >> 32);
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+
+    return (uint16_t)~sum;
+}
+
+static inline uint16_t
+inet_csum(const void *buf, size_t len, uint64_t sum)
+{
+    return inet_csum_fold(inet_csum_partial(buf, len, sum));
+}
+
+/* TCP/UDP pseudo header, addresses as stored in the IP header, proto and
+ * len in host order. */
+static inline uint64_t
+inet_csum_pseudo(uint32_t saddr, uint32_t daddr, uint8_t proto, uint16_t len)
+{
+    uint8_t b[4] = { 0, proto, len >> 8, len & 0xff };
+    uint32_t w;
+
+    memcpy(&w, b, sizeof(w));
+    return (uint64_t)saddr + daddr + w;
+}
+
+/* Incremental update (RFC 1624, eqn. 3) of checksum csum after a 16-bit
+ * header field changed from old to new, all three as stored in the
+ * packet. */
+static inline uint16_t
+inet_csum_update16(uint16_t csum, uint16_t old, uint16_t new)
+{
+    uint32_t sum;
+
+    sum = (uint16_t)~csum + (uint16_t)~old + new;
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+
+    return (uint16_t)~sum;
+}
+
+static inline uint16_t
+inet_csum_update32(uint16_t csum, uint32_t old, uint32_t new)
+{
+    csum = inet_csum_update16(csum, old >> 16, new >> 16);
+    return inet_csum_update16(csum, old & 0xffff, new & 0xffff);
+}
+
+#endif /* _INET_CSUM_H_ */
@@ -0,0 +1,636 @@
+/*
+ * Copyright 2012-2016, Bromium, Inc.
+ * Author: Christian Limpach <Christian.Limpach@gmail.com>
+ * SPDX-License-Identifier: ISC
+ */
+
+#include "config.h"
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/types.h>
+
+#include "dm.h"
+#include "ioh.h"
+#include "timer.h"
+#include "queue.h"
+
+#ifndef LIBIMG
+#include "async-op.h"
+#endif
+
+WaitObjects wait_objects;
+struct io_handler_queue io_handlers;
+
+#ifdef DEBUG_WAITOBJECTS
+int trace_waitobjects = 0;
+#define trace_waitobjects_print(fmt, ...) if (trace_waitobjects) dprintf(fmt, ## __VA_ARGS__)
+#else
+#define trace_waitobjects_print(fmt, ...) do { ; } while(0)
+#endif
+
+/* Number of epoll events collected per epoll_wait call.  A wait keeps
+ * collecting until a call returns fewer, so every ready object is
+ * dispatched in one pass. */
+#define IOH_EPOLL_BATCH 64
+
+void
+ioh_waitobjects_grow(WaitObjects *w)
+{
+    w->max += 8;
+    w->events = realloc(w->events, sizeof(ioh_wait_event) * w->max);
+    w->desc = realloc(w->desc, sizeof(WaitObjectsDesc) * w->max);
+    w->ready = realloc(w->ready, sizeof(int) * w->max);
+}
+
+static void
+fd_slot_set(WaitObjects *w, int fd, int slot)
+{
+
+    if (fd >= w->fd_slot_max) {
+        int max = w->fd_slot_max ? w->fd_slot_max : 64;
+
+        while (fd >= max)
+            max *= 2;
+        w->fd_slot = realloc(w->fd_slot, sizeof(int) * max);
+        if (!w->fd_slot)
+            err(1, "%s: realloc failed", __FUNCTION__);
+        memset(&w->fd_slot[w->fd_slot_max], 0xff,
+               sizeof(int) * (max - w->fd_slot_max));
+        w->fd_slot_max = max;
+    }
+    w->fd_slot[fd] = slot;
+}
+
+static inline int
+fd_slot_get(WaitObjects *w, int fd)
+{
+
+    return fd < w->fd_slot_max ? w->fd_slot[fd] : -1;
+}
+
+static void
+fd_slot_renumber(WaitObjects *w, int from)
+{
+    int i;
+
+    for (i = from; i < w->num; i++)
+        if (!w->desc[i].del)
+            w->fd_slot[w->events[i].fd] = i;
+}
+
+static void
+queue_ctl(WaitObjects *w, int op, int fd, uint32_t events, uint64_t data)
+{
+    struct epoll_event ev = { .events = events, .data.u64 = data };
+    int rc;
+
+    rc = epoll_ctl(w->queue_fd, op, fd, &ev);
+    if (rc == -1 && op == EPOLL_CTL_ADD && errno == EEXIST)
+        rc = epoll_ctl(w->queue_fd, EPOLL_CTL_MOD, fd, &ev);
+    /* a closed fd has already left the queue */
+    if (rc == -1 && op == EPOLL_CTL_DEL && (errno == EBADF || errno == ENOENT))
+        rc = 0;
+    if (rc == -1)
+        err(1, "%s: epoll_ctl %d failed - fd %d", __FUNCTION__, op, fd);
+}
+
+static int
+ioh_add_wait(int fd, int events, WaitObjects *w)
+{
+    uint32_t epoll_events = 0;
+
+    assert(w != NULL);
+
+    if (w->num == w->max)
+        ioh_waitobjects_grow(w);
+
+    w->events[w->num].fd = fd;
+    w->events[w->num].events = events;
+    w->events[w->num].revents = 0;
+
+    w->desc[w->num].del = 0;
+
+#ifdef DEBUG_WAITOBJECTS
+    w->desc[w->num].func_name = __FUNCTION__;
+    w->desc[w->num].triggered = 0;
+#endif
+
+    if (events & POLLIN)
+        epoll_events |= EPOLLIN;
+    if (events & POLLOUT)
+        epoll_events |= EPOLLOUT;
+    queue_ctl(w, EPOLL_CTL_ADD, fd, epoll_events, IOH_EPOLL_FD | fd);
+    fd_slot_set(w, fd, w->num);
+
+    return w->num++;
+}
+
+int
+ioh_add_wait_fd(int fd, int events, WaitObjectFunc2 *func2, void *opaque,
+                WaitObjects *w)
+{
+    int num;
+
+    if (w == NULL)
+        w = &wait_objects;
+
+    num = ioh_add_wait(fd, events, w);
+
+    w->desc[num].func2 = func2;
+    w->desc[num].opaque = opaque;
+
+    return 0;
+}
+
+void ioh_init_wait_objects(WaitObjects *w)
+{
+    int fd;
+
+    w->num = 0;
+    w->events = NULL;
+    w->desc = NULL;
+    w->ready = NULL;
+    w->max = 0;
+    w->del_state = WO_OK;
+    w->queue_len = 0;
+    w->fd_slot = NULL;
+    w->fd_slot_max = 0;
+    w->queue_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (w->queue_fd < 0)
+        err(1, "%s: epoll_create1 failed", __FUNCTION__);
+
+    fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fd < 0)
+        err(1, "%s: eventfd failed", __FUNCTION__);
+    w->interrupt = fd;
+    queue_ctl(w, EPOLL_CTL_ADD, fd, EPOLLIN, IOH_EPOLL_INTERRUPT);
+
+    w->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (w->timer_fd < 0)
+        err(1, "%s: timerfd_create failed", __FUNCTION__);
+    queue_ctl(w, EPOLL_CTL_ADD, w->timer_fd, EPOLLIN, IOH_EPOLL_TIMER);
+}
+
+void ioh_wait_interrupt(WaitObjects *w)
+{
+    uint64_t one = 1;
+    int rc;
+
+    rc = write((int)w->interrupt, &one, sizeof(one));
+    if (rc == -1 && errno != EAGAIN)
+        err(1, "%s: write failed", __FUNCTION__);
+}
+
+static void interrupt_reset(WaitObjects *w)
+{
+    uint64_t count;
+    int rc;
+
+    rc = read((int)w->interrupt, &count, sizeof(count));
+    if (rc == -1 && errno != EAGAIN)
+        err(1, "%s: read failed", __FUNCTION__);
+}
+
+static void
+timer_arm(WaitObjects *w, int64_t timeout_ns)
+{
+    struct itimerspec its = { };
+    int rc;
+
+    its.it_value.tv_sec = timeout_ns / 1000000000LL;
+    its.it_value.tv_nsec = timeout_ns % 1000000000LL;
+    rc = timerfd_settime(w->timer_fd, 0, &its, NULL);
+    if (rc == -1)
+        err(1, "%s: timerfd_settime failed", __FUNCTION__);
+}
+
+static void
+timer_reset(WaitObjects *w)
+{
+    uint64_t expirations;
+    int rc;
+
+    rc = read(w->timer_fd, &expirations, sizeof(expirations));
+    if (rc == -1 && errno != EAGAIN)
+        err(1, "%s: read failed", __FUNCTION__);
+}
+
+void ioh_cleanup_wait_objects(WaitObjects *w)
+{
+    close(w->timer_fd);
+    close((int)w->interrupt);
+    close(w->queue_fd);
+    free(w->fd_slot);
+    free(w->ready);
+    free(w->desc);
+    free(w->events);
+}
+
+#ifndef DEBUG_WAITOBJECTS
+int ioh_add_wait_object(ioh_event *event, WaitObjectFunc *func, void *opaque,
+                        WaitObjects *w)
+#else
+int _ioh_add_wait_object(ioh_event *event, WaitObjectFunc *func, void *opaque,
+                         WaitObjects *w, const char *func_name)
+#endif
+{
+
+    if (w == NULL)
+	w = &wait_objects;
+
+    event->func = func;
+    event->opaque = opaque;
+#ifdef DEBUG_WAITOBJECTS
+    event->func_name = func_name;
+#endif
+
+    queue_ctl(w, EPOLL_CTL_ADD, event->fd, EPOLLIN, (uintptr_t)event);
+
+    w->queue_len++;
+
+    return 0;
+}
+
+static void ioh_gc_del_fds(WaitObjects *w)
+{
+    int i = -1, j;
+    if (!w)
+        w = &wait_objects;
+    while (++i < w->num) {
+        if (!w->desc[i].del)
+           continue;
+        j = i+1;
+        while (j < w->num && w->desc[j].del)
+            j++;
+        if (j < w->num) {
+            memmove(&w->events[i], &w->events[j],
+                    (w->num - j) * sizeof(w->events[0]));
+            memmove(&w->desc[i], &w->desc[j],
+                    (w->num - j) * sizeof(w->desc[0]));
+        }
+        w->num -= (j-i);
+    }
+    fd_slot_renumber(w, 0);
+}
+
+void ioh_del_wait_fd(int fd, WaitObjects *w)
+{
+    int i;
+
+    if (w == NULL)
+        w = &wait_objects;
+
+    i = fd_slot_get(w, fd);
+    if (i < 0) {
+        debug_printf("ioh_del_wait_object: fd %d not found in %s\n",
+                     fd, w == &wait_objects ? "main" : "block");
+        debug_break();
+        return;
+    }
+
+    queue_ctl(w, EPOLL_CTL_DEL, fd, 0, 0);
+    w->fd_slot[fd] = -1;
+
+    if (w->del_state != WO_OK) {
+        w->desc[i].del = 1;
+        w->del_state = WO_GC;
+        return;
+    }
+    w->num--;
+    if (i < w->num) {
+	memmove(&w->events[i], &w->events[i + 1],
+		(w->num - i) * sizeof(w->events[0]));
+	memmove(&w->desc[i], &w->desc[i + 1],
+		(w->num - i) * sizeof(w->desc[0]));
+        fd_slot_renumber(w, i);
+    }
+}
+
+void ioh_del_wait_object(ioh_event *event, WaitObjects *w)
+{
+
+    if (w == NULL)
+	w = &wait_objects;
+
+    queue_ctl(w, EPOLL_CTL_DEL, event->fd, 0, 0);
+
+    /* don't dispatch an event deleted by an earlier callback */
+    if (event->processq) {
+        TAILQ_REMOVE(event->processq, event, link);
+        event->processq = NULL;
+    }
+
+    w->queue_len--;
+}
+
+#if defined(CONFIG_NETEVENT)
+static void
+ioh_object_signalled(void *context, int events)
+{
+
+    IOHandlerRecord *ioh = (IOHandlerRecord *)context;
+
+    if (ioh->deleted)
+        return;
+
+#define IOH_READ_EVENTS (POLLIN | POLLERR)
+#define IOH_WRITE_EVENTS (POLLOUT | POLLERR)
+    if (events) {
+        if (ioh->fd_read)
+            if (events & IOH_READ_EVENTS)
+                ioh->fd_read(ioh->read_opaque);
+
+        if (ioh->fd_write)
+            if (events & IOH_WRITE_EVENTS)
+                ioh->fd_write(ioh->write_opaque);
+    }
+}
+#endif  /* CONFIG_NETEVENT */
+
+static int
+revents_from_epoll(uint32_t events)
+{
+    int revents = 0;
+
+    if (events & EPOLLIN)
+        revents |= POLLIN;
+    if (events & EPOLLOUT)
+        revents |= POLLOUT;
+    if (events & (EPOLLERR | EPOLLHUP))
+        revents |= POLLERR;
+
+    return revents;
+}
+
+void ioh_wait_for_objects(struct io_handler_queue *iohq,
+                          WaitObjects *w, TimerQueue *active_timers,
+                          int *timeout, int *ret_wait)
+{
+    IOHandlerRecord *ioh, *next;
+    struct epoll_event evs[IOH_EPOLL_BATCH];
+    int ret, num, ev, nready = 0;
+    int interrupted = 0;
+    int64_t tmp_ts, timeout_ns;
+    int epoll_timeout;
+#ifdef DEBUG_WAITOBJECTS
+    uint64_t t1, t2;
+#endif
+    ioh_event_queue events = TAILQ_HEAD_INITIALIZER(events);
+
+    if (ret_wait)
+        *ret_wait = 0;
+
+    if (iohq) {
+        critical_section_enter(&iohq->lock);
+        TAILQ_FOREACH_SAFE(ioh, &iohq->queue, queue, next) {
+#if defined(CONFIG_NETEVENT)
+            int events = 0;
+
+            if (ioh->fd != -1 && !ioh->deleted) {
+                if (ioh->fd_read &&
+                    (!ioh->fd_read_poll ||
+                     ioh->fd_read_poll(ioh->read_opaque) != 0)) {
+                    events |= POLLIN | POLLERR;
+                }
+                if (ioh->fd_write &&
+                    (!ioh->fd_write_poll ||
+                     ioh->fd_write_poll(ioh->write_opaque) != 0)) {
+                    events |= POLLOUT | POLLERR;
+                }
+            }
+            if (events != ioh->object_events) {
+                if (ioh->object_events)
+                    ioh_del_wait_fd(ioh->fd, w);
+                if (events)
+                    ioh_add_wait_fd(ioh->fd, events, ioh_object_signalled,
+                                    ioh, w);
+                ioh->object_events = events;
+            }
+#endif  /* CONFIG_NETEVENT */
+        }
+        assert(!iohq->wait_queue);
+        iohq->wait_queue = w;
+        critical_section_leave(&iohq->lock);
+    }
+
+    timeout_ns = *timeout < 0 ? -1 : *timeout * SCALE_MS;
+#ifndef LIBIMG
+    if (active_timers) {
+        timer_deadline(active_timers, rt_clock, timeout);
+        timer_deadline(active_timers, vm_clock, timeout);
+        timer_deadline_ns(active_timers, rt_clock, &timeout_ns);
+        timer_deadline_ns(active_timers, vm_clock, &timeout_ns);
+    }
+#endif
+
+    /* Sub-millisecond deadlines go to the timerfd, so timers are not
+     * rounded up to the next epoll_wait millisecond. */
+    if (timeout_ns > 0 && timeout_ns % SCALE_MS) {
+        timer_arm(w, timeout_ns);
+        epoll_timeout = -1;
+    } else
+        epoll_timeout = timeout_ns < 0 ? -1 : timeout_ns / SCALE_MS;
+
+#ifdef DEBUG_WAITOBJECTS
+    t1 = os_get_clock();
+#endif
+
+    ret = 0;
+    do {
+        if (ret_wait)
+            tmp_ts = os_get_clock_ms();
+        num = epoll_wait(w->queue_fd, evs, IOH_EPOLL_BATCH, epoll_timeout);
+        if (ret_wait)
+            *ret_wait += (int) (os_get_clock_ms() - tmp_ts);
+        if (num == -1) {
+            if (errno != EINTR && !ret)
+                ret = -errno;
+            break;
+        }
+
+        for (ev = 0; ev < num; ev++) {
+            uint64_t data = evs[ev].data.u64;
+            ioh_event *event;
+            int slot;
+
+            if (data == IOH_EPOLL_INTERRUPT) {
+                interrupted = 1;
+                continue;
+            }
+            if (data == IOH_EPOLL_TIMER) {
+                timer_reset(w);
+                continue;
+            }
+            ret++;
+            if (data & IOH_EPOLL_FD) {
+                slot = fd_slot_get(w, (int)(data & ~IOH_EPOLL_FD));
+                if (slot < 0)
+                    continue;
+                if (!w->events[slot].revents)
+                    w->ready[nready++] = slot;
+                w->events[slot].revents |= revents_from_epoll(evs[ev].events);
+                continue;
+            }
+            event = (ioh_event *)(uintptr_t)data;
+            if (event->processq)
+                TAILQ_REMOVE(event->processq, event, link);
+            event->processq = &events;
+            TAILQ_INSERT_TAIL(&events, event, link);
+        }
+
+        epoll_timeout = 0;
+    } while (num == IOH_EPOLL_BATCH);
+
+    if (timeout_ns > 0 && timeout_ns % SCALE_MS)
+        timer_arm(w, 0);
+
+#ifndef LIBIMG
+#ifdef DEBUG_WAITOBJECTS
+    if (trace_waitobjects) {
+        t2 = os_get_clock();
+        trace_waitobjects_print("wait for events %d: pcount %"PRIx64
+                                "/%x\n", w->num, (uint64_t)((t2 - t1) / SCALE_MS),
+                                *timeout);
+    }
+#endif
+    if (active_timers) {
+        run_timers(active_timers, vm_clock);
+        run_timers(active_timers, rt_clock);
+    }
+#endif
+    if (ret > 0) {
+        ioh_event *event, *next;
+        int i;
+
+        w->del_state = WO_PROTECT;
+        for (i = 0; i < nready; i++) {
+            int revents;
+
+            ev = w->ready[i];
+            revents = w->events[ev].revents;
+            w->events[ev].revents = 0;
+            if (w->desc[ev].del)
+                continue;
+#ifdef DEBUG_WAITOBJECTS
+            trace_waitobjects_print("event fn %p/%s\n", w->desc[ev].func,
+                                    w->desc[ev].func_name);
+            w->desc[ev].triggered++;
+#endif
+            if (w->desc[ev].func2)
+                w->desc[ev].func2(w->desc[ev].opaque, revents);
+        }
+        TAILQ_FOREACH_SAFE(event, &events, link, next) {
+            TAILQ_REMOVE(&events, event, link);
+            event->processq = NULL;
+#ifdef DEBUG_WAITOBJECTS
+            trace_waitobjects_print("event fn %p/%s\n", event->func,
+                                    event->func_name);
+#endif
+            ioh_event_reset(event);
+            if (event->func)
+                event->func(event->opaque);
+        }
+        if (w->del_state == WO_GC)
+            ioh_gc_del_fds(w);
+        w->del_state = WO_OK;
+    } else if (ret == 0) {
+        trace_waitobjects_print("timeout\n");
+    } else {
+        debug_printf("epoll_wait error %d\n", ret);
+        for (ev = 0; ev < w->num; ev++) {
+#ifndef DEBUG_WAITOBJECTS
+            debug_printf("object %d: cb %p\n", ev,
+                         w->desc[ev].func);
+#else
+            debug_printf("object %d: cb %p/%s\n", ev,
+                         w->desc[ev].func,
+                         w->desc[ev].func_name);
+#endif
+        }
+    }
+
+    /* remove deleted IO handlers */
+    if (iohq) {
+        critical_section_enter(&iohq->lock);
+        assert(iohq->wait_queue);
+        iohq->wait_queue = NULL;
+        TAILQ_FOREACH_SAFE(ioh, &iohq->queue, queue, next) {
+#if defined(CONFIG_NETEVENT)
+            if (ioh->deleted) {
+                TAILQ_REMOVE(&iohq->queue, ioh, queue);
+                if (ioh->object_events)
+                    ioh_del_wait_fd(ioh->fd, w);
+                free(ioh);
+            }
+#endif  /* CONFIG_NETEVENT */
+        }
+        critical_section_leave(&iohq->lock);
+    }
+    if (interrupted)
+        interrupt_reset(w);
+
+#ifndef LIBIMG
+    if (active_timers) {
+        run_timers(active_timers, vm_clock);
+        run_timers(active_timers, rt_clock);
+    }
+#endif
+}
+
+void host_main_loop_wait(int *timeout)
+{
+
+#ifndef LIBIMG
+    ioh_wait_for_objects(&io_handlers, &wait_objects, main_active_timers, timeout, NULL);
+#else
+    ioh_wait_for_objects(&io_handlers, &wait_objects, NULL, timeout, NULL);
+#endif
+
+#ifndef LIBIMG
+    async_op_process(NULL);
+#endif
+}
+
+#ifdef DEBUG_WAITOBJECTS
+void
+ic_wo(struct Monitor *mon)
+{
+    int i;
+    WaitObjects *w = &wait_objects;
+
+    for (i = 0; i < w->num; i++) {
+        debug_printf("wo %d fn %p %30s triggered %10d\n", i, w->desc[i].func,
+                     w->desc[i].func_name, w->desc[i].triggered);
+    }
+}
+
+static void
+clear_wo(void)
+{
+    int i;
+    WaitObjects *w = &wait_objects;
+
+    for (i = 0; i < w->num; i++) {
+        w->desc[i].triggered = 0;
+    }
+}
+
+#ifdef MONITOR
+void
+mc_clear_stats(Monitor *mon, const dict args)
+{
+    void ioreqstat_clear(void);
+
+    clear_wo();
+    ioreqstat_clear();
+}
+#endif  /* MONITOR */
+
+#endif	/* DEBUG_WAITOBJECTS */
@@ -72,9 +72,16 @@ struct WaitObjects {
     ioh_wait_event *events;
     WaitObjectsDesc *desc;
     int max;
-#ifdef __APPLE__
+#if defined(__APPLE__)
     int queue_fd;
     int queue_len;
+#elif defined(__linux__)
+    int queue_fd;
+    int queue_len;
+    int timer_fd;
+    int *fd_slot;
+    int fd_slot_max;
+    int *ready;
 #endif
     uintptr_t interrupt;
     critical_section lock;
@@ -9,11 +9,16 @@
 
 #include "os.h"
 
+#if defined(__linux__)
+#include <limits.h>
+#include <sys/uio.h>
+#else
 struct iovec {
     void *iov_base;
     size_t iov_len;
 };
 #define IOV_MAX 1024
+#endif
 
 typedef struct IOVector {
     struct iovec *iov;
@@ -0,0 +1,278 @@
+/*
+ * Copyright 2012-2019, Bromium, Inc.
+ * Author: Christian Limpach <Christian.Limpach@gmail.com>
+ * SPDX-License-Identifier: ISC
+ */
+
+#include "config.h"
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/select.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <string.h>
+
+#include "queue.h"
+
+int initcall_logging = 0;
+
+void
+socket_set_block(int fd)
+{
+    int f;
+
+    f = fcntl(fd, F_GETFL);
+    fcntl(fd, F_SETFL, f & ~O_NONBLOCK);
+}
+
+void
+socket_set_nonblock(int fd)
+{
+    int f;
+
+    f = fcntl(fd, F_GETFL);
+    fcntl(fd, F_SETFL, f | O_NONBLOCK);
+}
+
+int
+get_timeoffset(void)
+{
+    struct tm *timeinfo;
+    time_t current_time;
+
+    time(&current_time);
+    timeinfo = localtime(&current_time);
+
+    return timeinfo->tm_gmtoff;
+}
+
+void
+critical_section_init(critical_section *cs)
+{
+    static pthread_mutexattr_t mta_recursive;
+    static int initialized = 0;
+    int ret;
+
+    if (!initialized) {
+        assert(!pthread_mutexattr_init(&mta_recursive));
+        assert(!pthread_mutexattr_settype(&mta_recursive,
+                                          PTHREAD_MUTEX_RECURSIVE));
+    }
+
+    ret = pthread_mutex_init(cs, &mta_recursive);
+    if (ret) {
+        debug_printf("%s: pthread_mutex_init failed: %s", __FUNCTION__,
+                     strerror(ret));
+        abort();
+    }
+}
+
+void
+critical_section_free(critical_section *cs)
+{
+    int ret;
+
+    ret = pthread_mutex_destroy(cs);
+    if (ret) {
+        debug_printf( "%s: pthread_mutex_destroy failed: %s", __FUNCTION__,
+                     strerror(ret));
+        abort();
+    }
+}
+
+void
+critical_section_enter(critical_section *cs)
+{
+    int ret;
+
+    ret = pthread_mutex_lock(cs);
+    if (ret) {
+        debug_printf( "%s: pthread_mutex_lock failed: %s", __FUNCTION__,
+                     strerror(ret));
+        abort();
+    }
+}
+
+void
+critical_section_leave(critical_section *cs)
+{
+    int ret;
+
+    ret = pthread_mutex_unlock(cs);
+    if (ret) {
+        debug_printf( "%s: pthread_mutex_unlock failed: %s", __FUNCTION__,
+                     strerror(ret));
+        abort();
+    }
+}
+
+int file_exists(const char *path)
+{
+    struct stat st;
+
+    if (stat(path, &st) >= 0)
+        return 1;
+    else
+        return 0;
+}
+
+void
+ioh_event_init(ioh_event *ev)
+{
+    memset(ev, 0, sizeof (*ev));
+    ev->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (ev->fd < 0)
+        err(1, "%s: eventfd failed", __FUNCTION__);
+    ev->valid = 1;
+}
+
+void
+ioh_event_set(ioh_event *ev)
+{
+    uint64_t one = 1;
+    int rc;
+
+    /* The counter saturates rather than wraps, so EAGAIN means the
+     * event is already signaled. */
+    rc = write(ev->fd, &one, sizeof(one));
+    if (rc == -1 && errno != EAGAIN)
+        err(1, "%s: write failed", __FUNCTION__);
+}
+
+void
+ioh_event_reset(ioh_event *ev)
+{
+    uint64_t count;
+    int rc;
+
+    rc = read(ev->fd, &count, sizeof(count));
+    if (rc == -1 && errno != EAGAIN)
+        err(1, "%s: read failed", __FUNCTION__);
+}
+
+void
+ioh_event_wait(ioh_event *ev)
+{
+    struct pollfd pfd = { .fd = ev->fd, .events = POLLIN };
+    int rc;
+
+    do {
+        rc = poll(&pfd, 1, -1);
+        if (rc == -1 && errno != EINTR)
+            err(1, "%s: poll failed", __FUNCTION__);
+    } while (rc != 1);
+}
+
+void
+ioh_event_close(ioh_event *ev)
+{
+
+    ev->valid = 0;
+    close(ev->fd);
+    ev->fd = -1;
+}
+
+int set_nofides(void)
+{
+    struct rlimit limit;
+
+    if (getrlimit(RLIMIT_NOFILE, &limit)) {
+        warnx("%s: getrlimit failed with %d", __FUNCTION__, errno);
+        return -1;
+    }
+    if (limit.rlim_cur >= FD_SETSIZE)
+        return 0;
+    if (limit.rlim_max < FD_SETSIZE) {
+        warnx("%s: rimit.rlim_max < FD_SETSIZE", __FUNCTION__);
+        return -1;
+    }
+    limit.rlim_cur = FD_SETSIZE < limit.rlim_max ? FD_SETSIZE : limit.rlim_max;
+    if (setrlimit(RLIMIT_NOFILE, &limit)) {
+        warn("%s: setrlimit failed", __FUNCTION__);
+        return -1;
+    }
+    debug_printf("setting RLIMIT_NOFILE to %"PRIu64" file descriptors\n",
+                 (uint64_t)limit.rlim_cur);
+    return 0;
+}
+
+static int fd_urandom = -1;
+
+initcall(os_early_init)
+{
+    fd_urandom = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+    if (fd_urandom < 0) {
+        errx(1, "open(/dev/urandom)");
+    }
+}
+
+int
+generate_random_bytes(void *buf, size_t len)
+{
+    int ret;
+    size_t l = 0;
+
+    while (l < len) {
+        ret = read(fd_urandom, buf + l, len - l);
+        if (ret < 0)
+            goto out;
+        l += ret;
+    }
+
+    ret = 0;
+
+out:
+    return ret;
+}
+
+void
+cpu_usage(float *user, float *kernel, uint64_t *user_total_ms,
+          uint64_t *kernel_total_ms)
+{
+    static uint64_t last_kernel_time_ms = 0;
+    static uint64_t last_user_time_ms = 0;
+    static uint64_t last_time = 0;
+    uint64_t current_time;
+    uint64_t kernel_time_ms;
+    uint64_t user_time_ms;
+    uint64_t time_diff_ms;
+    struct rusage r_usage = {{0}};
+    struct timespec ts;
+    int err = getrusage(RUSAGE_SELF, &r_usage);
+    if (err)
+        return;
+
+    user_time_ms = (r_usage.ru_utime.tv_sec * 1000LU) +
+                   (r_usage.ru_utime.tv_usec / 1000LU);
+    kernel_time_ms = (r_usage.ru_stime.tv_sec * 1000LU) +
+                      (r_usage.ru_stime.tv_usec / 1000LU);
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    current_time = ts.tv_sec * 1000LU + ts.tv_nsec / 1000000LU;
+    time_diff_ms = current_time - last_time;
+
+    if (!last_time || (last_time == current_time)) {
+        if (user) *user = .0f;
+        if (kernel) *kernel = .0f;
+    } else {
+        if (user) *user = (float)(user_time_ms - last_user_time_ms) /
+                          (float)time_diff_ms;
+        if (kernel) *kernel = (float)(kernel_time_ms - last_kernel_time_ms) /
+                              (float)time_diff_ms;
+    }
+
+    if (user_total_ms) *user_total_ms = user_time_ms;
+    if (kernel_total_ms) *kernel_total_ms = kernel_time_ms;
+
+    last_kernel_time_ms = kernel_time_ms;
+    last_user_time_ms = user_time_ms;
+    last_time = current_time;
+}
@@ -301,10 +301,10 @@ static mon_cmd_t mon_cmds[] = {
       .args_type = "?b:interrupt,?b:force", .help = "terminate the vm" },
     { .name = "savevm", .mhandler.cmd = mc_savevm,
       .args_type = "?s:filename,?s:compress,?b:high-compress,"
-                   "?b:single-page,?b:free-mem",
+                   "?b:single-page,?b:free-mem,?b:incremental",
       .help = "save the vm" },
     { .name = "resume", .mhandler.cmd = mc_resumevm,
-      .args_type = "?b:delete-savefile",
+      .args_type = "?b:delete-savefile,?b:post-copy",
       .help = "resume the vm" },
     { .name = "debug-break|xdbg", .mhandler.cmd = mc_debug_break,
       .help = "execute breakpoint instruction" },
@@ -20,27 +20,204 @@
 #include <wchar.h>
 #endif
 
+/* Buffers of up to the largest size class are allocated, header and data
+ * in one block, from per size class pools.  A depot of free blocks per
+ * class is shared by all threads.  The device and nickel threads, which
+ * allocate and free each other's packet buffers, additionally keep a
+ * cache per class and trade batches of blocks with the depot, so they only
+ * take a lock once per batch.  The heap is only touched when the depot
+ * runs dry or overflows. */
+#define POOL_CLASSES    4
+#define CACHE_MAX       64
+#define CACHE_BATCH     32
+
+static const size_t pool_size[POOL_CLASSES] = {
+    256, 2048, 16384, NI_MAX_MTU + 256
+};
+static const unsigned int depot_max[POOL_CLASSES] = {
+    2048, 1024, 256, 64
+};
+
+struct buff_freelist {
+    struct buff *head;
+    unsigned int n;
+};
+
+struct buff_depot {
+    critical_section lock;
+    struct buff_freelist fl;
+};
+
+/* indexed by [priv_heap][class] */
+static struct buff_depot depot[2][POOL_CLASSES];
+static __thread struct buff_freelist cache[2][POOL_CLASSES];
+static __thread int cache_enabled;
+
+#define INLINE_DATA(buf) ((uint8_t *) ((buf) + 1))
+
+static inline struct buff *fl_pop(struct buff_freelist *fl)
+{
+    struct buff *b = fl->head;
+
+    if (b) {
+        fl->head = b->pool_next;
+        fl->n--;
+    }
+    return b;
+}
+
+static inline void fl_push(struct buff_freelist *fl, struct buff *b)
+{
+    b->pool_next = fl->head;
+    fl->head = b;
+    fl->n++;
+}
+
+static int pool_class(size_t l)
+{
+    int c;
+
+    for (c = 0; c < POOL_CLASSES; c++)
+        if (l <= pool_size[c])
+            return c;
+    return -1;
+}
+
+static struct buff *pool_get(bool priv, int c)
+{
+    struct buff_freelist *fl = &cache[priv][c];
+    struct buff_depot *d = &depot[priv][c];
+    struct buff *b;
+
+    if (!cache_enabled) {
+        critical_section_enter(&d->lock);
+        b = fl_pop(&d->fl);
+        critical_section_leave(&d->lock);
+        if (b)
+            return b;
+        goto heap;
+    }
+
+    /* unlocked peek, a stale value only costs a heap allocation */
+    if (!fl->head && d->fl.n) {
+        critical_section_enter(&d->lock);
+        while (fl->n < CACHE_BATCH && (b = fl_pop(&d->fl)))
+            fl_push(fl, b);
+        critical_section_leave(&d->lock);
+    }
+
+    b = fl_pop(fl);
+    if (b)
+        return b;
+
+heap:
+    return priv ? ni_priv_malloc(sizeof(struct buff) + pool_size[c]) :
+                  malloc(sizeof(struct buff) + pool_size[c]);
+}
+
+static void pool_spill(bool priv, int c, unsigned int keep)
+{
+    struct buff_freelist *fl = &cache[priv][c];
+    struct buff_depot *d = &depot[priv][c];
+    struct buff_freelist spill = { NULL, 0 };
+    struct buff *b;
+
+    critical_section_enter(&d->lock);
+    while (fl->n > keep) {
+        b = fl_pop(fl);
+        if (d->fl.n < depot_max[c])
+            fl_push(&d->fl, b);
+        else
+            fl_push(&spill, b);
+    }
+    critical_section_leave(&d->lock);
+
+    while ((b = fl_pop(&spill))) {
+        if (priv)
+            ni_priv_free(b);
+        else
+            free(b);
+    }
+}
+
+static void pool_put(struct buff *b)
+{
+    bool priv = !!b->priv_heap;
+    int c = b->pool - 1;
+    struct buff_freelist *fl = &cache[priv][c];
+
+    fl_push(fl, b);
+    if (!cache_enabled)
+        pool_spill(priv, c, 0);
+    else if (fl->n >= CACHE_MAX)
+        pool_spill(priv, c, CACHE_MAX - CACHE_BATCH);
+}
+
+/* Give the calling thread a buffer cache, for threads which allocate or
+ * free buffers at packet rate. */
+void buff_pool_thread_init(void)
+{
+    cache_enabled = 1;
+}
+
+/* Return the calling thread's cached buffers to the depot, before it
+ * exits. */
+void buff_pool_thread_exit(void)
+{
+    int priv, c;
+
+    cache_enabled = 0;
+    for (priv = 0; priv < 2; priv++)
+        for (c = 0; c < POOL_CLASSES; c++)
+            if (cache[priv][c].n)
+                pool_spill(priv, c, 0);
+}
+
+initcall(buff_pool_init)
+{
+    int priv, c;
+
+    for (priv = 0; priv < 2; priv++)
+        for (c = 0; c < POOL_CLASSES; c++)
+            critical_section_init(&depot[priv][c].lock);
+}
+
 static struct buff * _buff_new(struct buff **pbuf, bool priv, size_t l)
 {
     struct buff *buf = NULL;
+    int c;
 
     if (l > MAX_BUFF_LEN) {
         debug_printf("%s: l > MAX_BUFF_LEN = %lu\n", __FUNCTION__,
                 (unsigned long) MAX_BUFF_LEN);
         goto cleanup;
     }
-    buf = calloc(1, sizeof(struct buff));
-    if (!buf)
-        goto cleanup;
-    if (priv)
-        buf->priv_heap = 1;
 
-    if (buf->priv_heap)
-        buf->data = ni_priv_calloc(1, l + 1);
-    else
-        buf->data = calloc(1, l + 1);
-    if (!buf->data)
-        goto cleanup;
+    c = pool_class(l + 1);
+    if (c >= 0) {
+        buf = pool_get(priv, c);
+        if (!buf)
+            goto out;
+        memset(buf, 0, sizeof(*buf));
+        buf->pool = c + 1;
+        if (priv)
+            buf->priv_heap = 1;
+        buf->data = INLINE_DATA(buf);
+        memset(buf->data, 0, l + 1);
+    } else {
+        buf = calloc(1, sizeof(struct buff));
+        if (!buf)
+            goto cleanup;
+        if (priv)
+            buf->priv_heap = 1;
+
+        if (buf->priv_heap)
+            buf->data = ni_priv_calloc(1, l + 1);
+        else
+            buf->data = calloc(1, l + 1);
+        if (!buf->data)
+            goto cleanup;
+    }
     buf->refcnt = 1;
 
     if (pbuf)
@@ -84,11 +261,16 @@ void buff_put(struct buff *buf)
     if (!atomic_dec_and_test(&buf->refcnt))
         return;
 
-    if (buf->priv_heap)
-        ni_priv_free(buf->data);
+    if (!buf->pool || buf->data != INLINE_DATA(buf)) {
+        if (buf->priv_heap)
+            ni_priv_free(buf->data);
+        else
+            free(buf->data);
+    }
+    if (buf->pool)
+        pool_put(buf);
     else
-        free(buf->data);
-    free(buf);
+        free(buf);
 }
 
 void buff_free(struct buff **pbuf)
@@ -117,7 +299,17 @@ int buff_adj(struct buff *buf, size_t newlen)
         goto out;
 
     off = buf->m - buf->data;
-    if (buf->priv_heap)
+    if (buf->pool && buf->data == INLINE_DATA(buf)) {
+        /* grow within the block, or move the data out to the heap */
+        if (newlen + 1 <= pool_size[buf->pool - 1])
+            ndata = buf->data;
+        else if (buf->priv_heap)
+            ndata = ni_priv_malloc(newlen + 1);
+        else
+            ndata = malloc(newlen + 1);
+        if (ndata && ndata != buf->data)
+            memcpy(ndata, buf->data, buf->size + 1);
+    } else if (buf->priv_heap)
         ndata = ni_priv_realloc(buf->data, newlen + 1);
     else
         ndata = realloc(buf->data, newlen + 1);
@@ -33,6 +33,8 @@ struct buff {
     uint32_t refcnt;
 
     int priv_heap;
+    int pool;                   /* size class + 1, 0 if not pooled */
+    struct buff *pool_next;
 };
 
 struct buff * buff_new(struct buff **pbuf, size_t l);
@@ -45,6 +47,8 @@ int buff_append(struct buff *buf, const char *c, size_t len);
 int __attribute__ ((__format__ (printf, 2, 3)))
 buff_appendf(struct buff *bf, const char *fmt, ...);
 int buff_gc_consume(struct buff *b, size_t l);
+void buff_pool_thread_init(void);
+void buff_pool_thread_exit(void);
 
 #define BUFF_NEW(buf, pbuf, l) ((buf) = buff_new(pbuf, l))
 #define BUFF_NEW_PRIV(buf, pbuf, l) ((buf) = buff_new_priv(pbuf, l))
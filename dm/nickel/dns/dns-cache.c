@@ -0,0 +1,569 @@
+/*
+ * Copyright 2019, Bromium, Inc.
+ * SPDX-License-Identifier: ISC
+ */
+
+#include <dm/config.h>
+#include <dm/os.h>
+#include <dm/queue.h>
+#include <dm/thread-event.h>
+#ifdef MONITOR
+#include <dm/monitor.h>
+#endif
+
+#include <ctype.h>
+
+#include <log.h>
+#include "dns.h"
+#include "dns-cache.h"
+
+/* Cache of host resolver results, shared by the guest facing resolver and
+ * the http proxy.  Names are looked up on async op worker threads, so all
+ * state is under cache_lock.  An entry is created by the first thread that
+ * misses on a name and marked resolving until that lookup completes;
+ * threads missing on the same name meanwhile queue up as waiters and are
+ * handed a copy of the result instead of querying the host again.  Hits in
+ * the last 1/PREFETCH_FRACTION of an entry's ttl mark it resolving and ask
+ * the caller to refresh it in the background, while the old result keeps
+ * being served.
+ *
+ * getaddrinfo does not report record ttls, so positive and negative
+ * results are kept for the configured cache-ttl and cache-negative-ttl. */
+
+// #define DNS_CACHE_VERIFY 1
+
+#define DNS_CACHE_HASHSIZE  8
+#define DNS_CACHE_HASH(n)   ((n) & ((1<<DNS_CACHE_HASHSIZE)-1))
+
+#define DEFAULT_MAX_ENTRIES 1024
+#define DEFAULT_TTL         60  /* s */
+#define DEFAULT_NEG_TTL     5   /* s */
+#define PREFETCH_FRACTION   8
+#define STATS_MS            (60 * 1000)
+
+struct dns_cache_waiter {
+    LIST_ENTRY(dns_cache_waiter) entry;
+    thread_event ev;
+    int done;
+    struct dns_response resp;
+};
+
+struct dns_cache_entry {
+    LIST_ENTRY(dns_cache_entry) hentry;
+    TAILQ_ENTRY(dns_cache_entry) lru;
+    uint32_t hash;
+    char *name;
+    int valid;
+    int err;
+    char *canon_name;
+    struct net_addr *a;
+    uint32_t ttl;
+    int64_t ts_expire;
+    int resolving;
+    LIST_HEAD(, dns_cache_waiter) waiters;
+};
+
+static critical_section cache_lock;
+static LIST_HEAD(, dns_cache_entry) cache_hash[1 << DNS_CACHE_HASHSIZE];
+static TAILQ_HEAD(dns_cache_lru_head, dns_cache_entry) cache_lru;
+static unsigned int cache_entries = 0;
+
+static unsigned int max_entries = DEFAULT_MAX_ENTRIES;
+static uint32_t cache_ttl = DEFAULT_TTL;
+static uint32_t cache_neg_ttl = DEFAULT_NEG_TTL;
+
+static struct {
+    uint64_t hits;
+    uint64_t neg_hits;
+    uint64_t misses;
+    uint64_t coalesced;
+    uint64_t prefetches;
+    uint64_t evictions;
+} stats;
+static int64_t stats_ts = 0;
+
+static void cache_stats(int64_t now)
+{
+    if (stats_ts && stats_ts + STATS_MS >= now)
+        return;
+    stats_ts = now;
+
+    NETLOG4("(dns) cache: #entries %u hits %"PRIu64" negative %"PRIu64" misses %"PRIu64
+            " coalesced %"PRIu64" prefetches %"PRIu64" evictions %"PRIu64,
+            cache_entries, stats.hits, stats.neg_hits, stats.misses,
+            stats.coalesced, stats.prefetches, stats.evictions);
+}
+
+static uint32_t name_hash(const char *name)
+{
+    uint32_t h = 2166136261U;
+
+    while (*name) {
+        h ^= (uint8_t) tolower((unsigned char) *name++);
+        h *= 16777619U;
+    }
+
+    return h;
+}
+
+/* ttl to cache a lookup result for, 0 for transient failures */
+static uint32_t response_ttl(const struct dns_response *r)
+{
+    if (!r->err && r->a && r->a[0].family)
+        return cache_ttl;
+    if (!r->err || r->err == EAI_NONAME
+#ifdef EAI_NODATA
+        || r->err == EAI_NODATA
+#endif
+        )
+        return cache_neg_ttl;
+
+    return 0;
+}
+
+static void response_dup(struct dns_response *d, const char *name, int err,
+                         const struct net_addr *a, const char *canon_name,
+                         uint32_t ttl)
+{
+    memset(d, 0, sizeof(*d));
+    d->cname = name;
+    d->err = err;
+    d->ttl = ttl ? ttl : 1;
+    if (a && a[0].family && !(d->a = dns_ips_dup(a)))
+        d->err = EAI_MEMORY;
+    if (canon_name)
+        d->canon_name = strdup(canon_name);
+}
+
+static struct dns_cache_entry *entry_find(const char *name, uint32_t hash)
+{
+    struct dns_cache_entry *e;
+
+    LIST_FOREACH(e, &cache_hash[DNS_CACHE_HASH(hash)], hentry)
+        if (e->hash == hash && !strcasecmp(e->name, name))
+            return e;
+
+    return NULL;
+}
+
+static inline int entry_fresh(struct dns_cache_entry *e, int64_t now)
+{
+    return e->valid && now < e->ts_expire;
+}
+
+static void entry_clear(struct dns_cache_entry *e)
+{
+    free(e->a);
+    e->a = NULL;
+    free(e->canon_name);
+    e->canon_name = NULL;
+    e->valid = 0;
+}
+
+static void entry_free(struct dns_cache_entry *e)
+{
+    assert(!e->resolving && LIST_EMPTY(&e->waiters));
+    LIST_REMOVE(e, hentry);
+    TAILQ_REMOVE(&cache_lru, e, lru);
+    entry_clear(e);
+    free(e->name);
+    free(e);
+    cache_entries--;
+}
+
+static void cache_evict(unsigned int max)
+{
+    struct dns_cache_entry *e, *pe;
+
+    for (e = TAILQ_LAST(&cache_lru, dns_cache_lru_head);
+         e && cache_entries > max; e = pe) {
+        pe = TAILQ_PREV(e, dns_cache_lru_head, lru);
+        if (e->resolving)
+            continue;
+        entry_free(e);
+        stats.evictions++;
+    }
+}
+
+static struct dns_cache_entry *entry_new(const char *name, uint32_t hash)
+{
+    struct dns_cache_entry *e;
+
+    cache_evict(max_entries - 1);
+
+    e = calloc(1, sizeof(*e));
+    if (!e)
+        return NULL;
+    e->name = strdup(name);
+    if (!e->name) {
+        free(e);
+        return NULL;
+    }
+    e->hash = hash;
+    LIST_INIT(&e->waiters);
+    LIST_INSERT_HEAD(&cache_hash[DNS_CACHE_HASH(hash)], e, hentry);
+    TAILQ_INSERT_HEAD(&cache_lru, e, lru);
+    cache_entries++;
+
+    return e;
+}
+
+static void
+entry_hit(struct dns_cache_entry *e, const char *name, struct dns_response *resp,
+          int64_t now, int *prefetch)
+{
+    int64_t left = e->ts_expire - now;
+
+    TAILQ_REMOVE(&cache_lru, e, lru);
+    TAILQ_INSERT_HEAD(&cache_lru, e, lru);
+
+    response_dup(resp, name, e->err, e->a, e->canon_name, (left + 999) / 1000);
+    if (e->err || !e->a) {
+        stats.neg_hits++;
+        return;
+    }
+    stats.hits++;
+
+    if (!e->resolving && left < (int64_t) e->ttl * 1000 / PREFETCH_FRACTION) {
+        e->resolving = 1;
+        *prefetch = 1;
+        stats.prefetches++;
+    }
+}
+
+/* Wake the waiters, handing each a copy of r, or with r NULL, sending
+ * them back to look the name up themselves.  The lock is held throughout,
+ * so that a waiter does not close its event before it has been signalled. */
+static void entry_wake(struct dns_cache_entry *e, const struct dns_response *r,
+                       uint32_t ttl)
+{
+    struct dns_cache_waiter *w, *nw;
+
+    LIST_FOREACH_SAFE(w, &e->waiters, entry, nw) {
+        LIST_REMOVE(w, entry);
+        if (r) {
+            response_dup(&w->resp, NULL, r->err, r->a, r->canon_name, ttl);
+            w->done = 1;
+        }
+        thread_event_set(&w->ev);
+    }
+}
+
+static uint32_t
+entry_complete(struct dns_cache_entry *e, const struct dns_response *r, int64_t now)
+{
+    uint32_t ttl = response_ttl(r);
+
+    e->resolving = 0;
+    if (ttl) {
+        entry_clear(e);
+        e->err = r->err;
+        if (r->a && r->a[0].family && !(e->a = dns_ips_dup(r->a)))
+            ttl = 0;
+        if (ttl && r->canon_name && !(e->canon_name = strdup(r->canon_name)))
+            ttl = 0;
+        e->valid = !!ttl;
+        e->ttl = ttl;
+        e->ts_expire = now + (int64_t) ttl * 1000;
+    }
+    entry_wake(e, r, ttl);
+    /* a transient failure to refresh keeps serving the previous result */
+    if (!entry_fresh(e, now))
+        entry_free(e);
+
+    return ttl;
+}
+
+static void entry_cancel(struct dns_cache_entry *e, int64_t now)
+{
+    e->resolving = 0;
+    entry_wake(e, NULL, 0);
+    if (!entry_fresh(e, now))
+        entry_free(e);
+}
+
+void dns_cache_config(unsigned int entries, uint32_t ttl, uint32_t negative_ttl)
+{
+    critical_section_enter(&cache_lock);
+    max_entries = entries;
+    cache_ttl = ttl;
+    cache_neg_ttl = negative_ttl;
+    cache_evict(max_entries);
+    critical_section_leave(&cache_lock);
+
+    if (max_entries)
+        NETLOG("(dns) cache: max-entries %u ttl %us negative-ttl %us",
+               max_entries, (unsigned int) cache_ttl, (unsigned int) cache_neg_ttl);
+    else
+        NETLOG("(dns) cache disabled");
+}
+
+int dns_cache_get(const char *name, struct dns_response *resp, int *prefetch)
+{
+    struct dns_cache_entry *e;
+    int64_t now;
+    int ret = -1;
+
+    *prefetch = 0;
+    if (!max_entries)
+        return -1;
+
+    critical_section_enter(&cache_lock);
+    now = os_get_clock_ms();
+    e = entry_find(name, name_hash(name));
+    if (e && entry_fresh(e, now)) {
+        entry_hit(e, name, resp, now, prefetch);
+        ret = 0;
+    }
+    cache_stats(now);
+    critical_section_leave(&cache_lock);
+
+    return ret;
+}
+
+struct dns_response
+dns_cache_lookup(const char *name, dns_resolve_fn resolve, int *prefetch)
+{
+    struct dns_cache_entry *e;
+    struct dns_cache_waiter w;
+    struct dns_response resp;
+    uint32_t hash, ttl;
+    int64_t now;
+
+    *prefetch = 0;
+    if (!max_entries) {
+        resp = resolve(name);
+        resp.ttl = 1;
+        return resp;
+    }
+
+    hash = name_hash(name);
+    critical_section_enter(&cache_lock);
+    for (;;) {
+        now = os_get_clock_ms();
+        e = entry_find(name, hash);
+        if (e && entry_fresh(e, now)) {
+            entry_hit(e, name, &resp, now, prefetch);
+            cache_stats(now);
+            critical_section_leave(&cache_lock);
+            return resp;
+        }
+        if (!e || !e->resolving)
+            break;
+
+        /* the name is being looked up already, wait for that result */
+        stats.coalesced++;
+        memset(&w, 0, sizeof(w));
+        thread_event_init(&w.ev);
+        LIST_INSERT_HEAD(&e->waiters, &w, entry);
+        critical_section_leave(&cache_lock);
+        thread_event_wait(&w.ev);
+        critical_section_enter(&cache_lock);
+        thread_event_close(&w.ev);
+        if (w.done) {
+            critical_section_leave(&cache_lock);
+            w.resp.cname = name;
+            return w.resp;
+        }
+        /* that lookup was abandoned, try again */
+    }
+    stats.misses++;
+    if (!e)
+        e = entry_new(name, hash);
+    if (e)
+        e->resolving = 1;
+    cache_stats(now);
+    critical_section_leave(&cache_lock);
+
+    resp = resolve(name);
+
+    ttl = 0;
+    if (e) {
+        /* resolving entries are never evicted */
+        critical_section_enter(&cache_lock);
+        ttl = entry_complete(e, &resp, os_get_clock_ms());
+        critical_section_leave(&cache_lock);
+    }
+    resp.ttl = ttl ? ttl : 1;
+
+    return resp;
+}
+
+void dns_cache_refresh(const char *name, dns_resolve_fn resolve)
+{
+    struct dns_cache_entry *e;
+    struct dns_response resp;
+
+    resp = resolve(name);
+
+    critical_section_enter(&cache_lock);
+    e = entry_find(name, name_hash(name));
+    if (e && e->resolving)
+        entry_complete(e, &resp, os_get_clock_ms());
+    critical_section_leave(&cache_lock);
+
+    dns_response_free(&resp);
+}
+
+void dns_cache_refresh_cancel(const char *name)
+{
+    struct dns_cache_entry *e;
+
+    critical_section_enter(&cache_lock);
+    e = entry_find(name, name_hash(name));
+    if (e && e->resolving)
+        entry_cancel(e, os_get_clock_ms());
+    critical_section_leave(&cache_lock);
+}
+
+void dns_cache_flush(void)
+{
+    critical_section_enter(&cache_lock);
+    cache_evict(0);
+    critical_section_leave(&cache_lock);
+}
+
+#ifdef MONITOR
+void dns_cache_info(Monitor *mon)
+{
+    critical_section_enter(&cache_lock);
+    monitor_printf(mon, "dns cache: %u/%u entries, hits %"PRIu64" negative %"PRIu64
+                   " misses %"PRIu64" coalesced %"PRIu64" prefetches %"PRIu64
+                   " evictions %"PRIu64"\n", cache_entries, max_entries,
+                   stats.hits, stats.neg_hits, stats.misses, stats.coalesced,
+                   stats.prefetches, stats.evictions);
+    critical_section_leave(&cache_lock);
+}
+#endif  /* MONITOR */
+
+#ifdef DNS_CACHE_VERIFY
+static volatile int verify_calls;
+static thread_event verify_ev;
+
+static struct dns_response verify_resolve(const char *name)
+{
+    struct dns_response r;
+
+    memset(&r, 0, sizeof(r));
+    r.cname = name;
+    __sync_fetch_and_add(&verify_calls, 1);
+    if (!strncmp(name, "slow", 4))
+        thread_event_wait(&verify_ev);
+    if (!strncmp(name, "nx", 2)) {
+        r.err = EAI_NONAME;
+        return r;
+    }
+    if (!strncmp(name, "fail", 4)) {
+        r.err = EAI_AGAIN;
+        return r;
+    }
+    r.a = calloc(2, sizeof(*r.a));
+    r.a[0].family = AF_INET;
+    r.a[0].ipv4.s_addr = name_hash(name);
+
+    return r;
+}
+
+#if defined(_WIN32)
+static DWORD WINAPI
+verify_thread(void *opaque)
+#else
+static void *
+verify_thread(void *opaque)
+#endif
+{
+    struct dns_response r;
+    int prefetch;
+
+    r = dns_cache_lookup("slow.example", verify_resolve, &prefetch);
+    if (r.err || !r.a || r.a[0].ipv4.s_addr != name_hash("slow.example"))
+        debug_printf("%s: bad coalesced result err %d\n", __FUNCTION__, r.err);
+    dns_response_free(&r);
+
+    return 0;
+}
+
+static void check_cache(void)
+{
+    struct dns_response r;
+    uxen_thread t[4];
+    int i, prefetch, calls;
+
+    r = dns_cache_lookup("a.example", verify_resolve, &prefetch);
+    dns_response_free(&r);
+    r = dns_cache_lookup("A.Example", verify_resolve, &prefetch);
+    if (verify_calls != 1 || r.err || !r.a || r.ttl != cache_ttl)
+        debug_printf("%s: positive hit failed calls %d\n", __FUNCTION__, verify_calls);
+    dns_response_free(&r);
+
+    r = dns_cache_lookup("nx.example", verify_resolve, &prefetch);
+    dns_response_free(&r);
+    r = dns_cache_lookup("nx.example", verify_resolve, &prefetch);
+    if (verify_calls != 2 || r.err != EAI_NONAME)
+        debug_printf("%s: negative hit failed calls %d\n", __FUNCTION__, verify_calls);
+    dns_response_free(&r);
+
+    r = dns_cache_lookup("fail.example", verify_resolve, &prefetch);
+    dns_response_free(&r);
+    r = dns_cache_lookup("fail.example", verify_resolve, &prefetch);
+    if (verify_calls != 4 || r.err != EAI_AGAIN)
+        debug_printf("%s: transient failure cached calls %d\n", __FUNCTION__, verify_calls);
+    dns_response_free(&r);
+
+    /* age the entry into the prefetch window */
+    critical_section_enter(&cache_lock);
+    entry_find("a.example", name_hash("a.example"))->ts_expire = os_get_clock_ms() + 1000;
+    critical_section_leave(&cache_lock);
+    r = dns_cache_lookup("a.example", verify_resolve, &prefetch);
+    if (!prefetch || r.err)
+        debug_printf("%s: no prefetch\n", __FUNCTION__);
+    dns_response_free(&r);
+    r = dns_cache_lookup("a.example", verify_resolve, &prefetch);
+    if (prefetch)
+        debug_printf("%s: prefetch requested twice\n", __FUNCTION__);
+    dns_response_free(&r);
+    dns_cache_refresh("a.example", verify_resolve);
+    r = dns_cache_lookup("a.example", verify_resolve, &prefetch);
+    if (verify_calls != 5 || r.ttl != cache_ttl)
+        debug_printf("%s: refresh failed calls %d ttl %u\n", __FUNCTION__,
+                     verify_calls, (unsigned int) r.ttl);
+    dns_response_free(&r);
+
+    thread_event_init(&verify_ev);
+    calls = verify_calls;
+    for (i = 0; i < 4; i++)
+        create_thread(&t[i], verify_thread, NULL);
+    do {
+        critical_section_enter(&cache_lock);
+        i = stats.coalesced < 3;
+        critical_section_leave(&cache_lock);
+    } while (i);
+    thread_event_set(&verify_ev);
+    for (i = 0; i < 4; i++) {
+        wait_thread(t[i]);
+        close_thread_handle(t[i]);
+    }
+    thread_event_close(&verify_ev);
+    if (verify_calls != calls + 1)
+        debug_printf("%s: lookups not coalesced, %d calls\n", __FUNCTION__,
+                     verify_calls - calls);
+
+    dns_cache_flush();
+    if (cache_entries)
+        debug_printf("%s: %u entries left after flush\n", __FUNCTION__, cache_entries);
+    memset(&stats, 0, sizeof(stats));
+}
+#endif  /* DNS_CACHE_VERIFY */
+
+initcall(dns_cache_init)
+{
+    int i;
+
+    critical_section_init(&cache_lock);
+    for (i = 0; i < (1 << DNS_CACHE_HASHSIZE); i++)
+        LIST_INIT(&cache_hash[i]);
+    TAILQ_INIT(&cache_lru);
+#ifdef DNS_CACHE_VERIFY
+    check_cache();
+#endif
+}
@@ -0,0 +1,26 @@
+/*
+ * Copyright 2019, Bromium, Inc.
+ * SPDX-License-Identifier: ISC
+ */
+
+#ifndef _DNS_CACHE_H_
+#define _DNS_CACHE_H_
+
+struct dns_response;
+
+typedef struct dns_response (*dns_resolve_fn)(const char *name);
+
+void dns_cache_config(unsigned int max_entries, uint32_t ttl, uint32_t negative_ttl);
+/* Non-blocking, returns 0 and a copy of the cached result on a hit. */
+int dns_cache_get(const char *name, struct dns_response *resp, int *prefetch);
+/* Returns the cached result, waits for a lookup of the same name already in
+ * flight, or calls resolve.  If *prefetch is set on return, the caller owns
+ * a refresh of the entry and must follow up with dns_cache_refresh or
+ * dns_cache_refresh_cancel. */
+struct dns_response dns_cache_lookup(const char *name, dns_resolve_fn resolve, int *prefetch);
+void dns_cache_refresh(const char *name, dns_resolve_fn resolve);
+void dns_cache_refresh_cancel(const char *name);
+void dns_cache_flush(void);
+void dns_cache_info(Monitor *mon);
+
+#endif
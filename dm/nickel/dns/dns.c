@@ -15,6 +15,7 @@
 #include <nickel.h>
 #include <log.h>
 #include "dns.h"
+#include "dns-cache.h"
 #include "dns-fake.h"
 #include "lava.h"
 
@@ -26,6 +27,9 @@
 #define SLIRP_GW_NAME "417007E91B64.bromium.com"
 #define DNS_PACKET_MAXSIZE 700
 #define DEFAULT_MAX_SCHED_DNS_QUERIES 2048
+#define DEFAULT_CACHE_ENTRIES 1024
+#define DEFAULT_CACHE_TTL 60
+#define DEFAULT_CACHE_NEG_TTL 5
 
 #define GUEST_DNS_SUFFIX ".internal-domain.local"
 
@@ -43,6 +47,10 @@ static int disable_dns_queries = 0;
 
 static unsigned max_pending_dns_queries = DEFAULT_MAX_SCHED_DNS_QUERIES;
 static unsigned pending_dns_queries = 0;
+/* ttl of answers with fake or internal addresses */
+static uint32_t fake_ttl = 1;
+/* where background refreshes of cache entries are scheduled */
+static struct nickel *resolver_ni = NULL;
 
 static void ndns_close(CharDriverState *chr);
 
@@ -219,6 +227,9 @@ static void response_dns_server_fail(char *name, union dnsmsg_header *hdr, bool
 
 static void dns_config(yajl_val config)
 {
+    unsigned int cache_entries;
+    uint32_t cache_ttl;
+
     debug_resolver = yajl_object_get_bool_default(config, "debug", 0);
     if (debug_resolver)
         debug_printf("%s: debug is on\n", __FUNCTION__);
@@ -237,6 +248,16 @@ static void dns_config(yajl_val config)
         NETLOG("(dns) max-sched-dns-queries set to %u", max_pending_dns_queries);
     else
         NETLOG("(dns) no limit for the number of scheduled DNS queries");
+
+    cache_entries = yajl_object_get_integer_default(config, "cache-max-entries",
+                                                    DEFAULT_CACHE_ENTRIES);
+    cache_ttl = yajl_object_get_integer_default(config, "cache-ttl", DEFAULT_CACHE_TTL);
+    if (yajl_object_get_bool_default(config, "disable-cache", 0) || !cache_ttl)
+        cache_entries = 0;
+    dns_cache_config(cache_entries, cache_ttl,
+                     yajl_object_get_integer_default(config, "cache-negative-ttl",
+                                                     DEFAULT_CACHE_NEG_TTL));
+    fake_ttl = cache_entries ? cache_ttl : 1;
 }
 
 bool dns_is_nickel_domain_name(const char *domain)
@@ -249,7 +270,7 @@ void dns_http_proxy_enabled(void)
     http_proxy_enabled = true;
 }
 
-struct dns_response dns_lookup(const char *cname)
+static struct dns_response dns_resolve(const char *cname)
 {
     int64_t cost_ms;
     struct dns_response ret;
@@ -353,6 +374,44 @@ out:
     return ret;
 }
 
+static void dns_prefetch_run(void *opaque)
+{
+    const char *name = opaque;
+
+    DDNS(name, "refresh %s", name);
+    dns_cache_refresh(name, dns_resolve);
+}
+
+static void dns_prefetch_done(void *opaque)
+{
+    free(opaque);
+}
+
+/* refresh a cache entry that is about to expire, off the caller's thread */
+static void dns_prefetch(const char *cname)
+{
+    char *name = NULL;
+
+    if (!resolver_ni || !(name = strdup(cname)) ||
+        ni_schedule_bh(resolver_ni, dns_prefetch_run, dns_prefetch_done, name)) {
+
+        free(name);
+        dns_cache_refresh_cancel(cname);
+    }
+}
+
+struct dns_response dns_lookup(const char *cname)
+{
+    struct dns_response ret;
+    int prefetch;
+
+    ret = dns_cache_lookup(cname, dns_resolve, &prefetch);
+    if (prefetch)
+        dns_prefetch(cname);
+
+    return ret;
+}
+
 void dns_response_free(struct dns_response *resp)
 {
     free(resp->canon_name);
@@ -616,6 +675,7 @@ static void dns_input_continue(void *opaque)
     union dnsmsg_header *hdr;
     struct dns_meta_data *meta;
     bool fakeip_dns_check = false;
+    uint32_t ttl;
 
     DDNS(dstate, "q %s", dstate->dname ? dstate->dname : "(null)");
     /* if chr needs to close, exit */
@@ -748,6 +808,10 @@ process:
     off = (char *)&hdr[1] - (char *)hdr;
     off |= (0x3 << 14);
 
+    ttl = dstate->response.ttl ? dstate->response.ttl : 1;
+    if (dstate->is_fake || dstate->is_internal)
+        ttl = fake_ttl;
+
     pri_name = cname;
     if (!dstate->is_fake && dstate->response.canon_name &&
             strcasecmp(dstate->response.canon_name, cname)) {
@@ -767,7 +831,7 @@ process:
         ans->name = htons(off);
         ans->meta.type = htons(5); /* CNAME */
         ans->meta.class = htons(1);
-        *(uint32_t *)ans->ttl = htonl(1);  /* 1s */
+        *(uint32_t *)ans->ttl = htonl(ttl);
         ans->rdata_len = htons(len);
         ans->rdata[len - 1] = 0;
 
@@ -794,7 +858,7 @@ process:
         ans->name = htons(off);
         ans->meta.type = htons(1);
         ans->meta.class = htons(1);
-        *(uint32_t *)ans->ttl = htonl(1);  /* 1s */
+        *(uint32_t *)ans->ttl = htonl(ttl);
         ans->rdata_len = htons(len);
         *(uint32_t *)ans->rdata = dstate->response.a[i].ipv4.s_addr;
         resp_len += sizeof(struct dnsmsg_answer) + len;
@@ -848,6 +912,7 @@ ndns_chr_write(CharDriverState *chr, const uint8_t *buf, int blen)
     int cname_len;
     struct dns_meta_data *meta;
     int off, len;
+    int prefetch;
 
     union dnsmsg_header *hdr;
 
@@ -982,6 +1047,17 @@ ndns_chr_write(CharDriverState *chr, const uint8_t *buf, int blen)
         goto dns_continue;
     }
 
+    /* answer hits right away, unless the containment checks need to run
+     * on a worker thread */
+    if (!(dstate->ni && dstate->ni->ac_enabled) &&
+        !dns_cache_get(dstate->dname, &dstate->response, &prefetch)) {
+
+        DDNS(dstate, "cache hit ttl %u", (unsigned int) dstate->response.ttl);
+        if (prefetch)
+            dns_prefetch(dstate->dname);
+        goto dns_continue;
+    }
+
     if (max_pending_dns_queries && pending_dns_queries >= max_pending_dns_queries) {
         static bool warn_once = false;
 
@@ -1066,6 +1142,7 @@ ndns_open(void *opaque, struct nickel *ni, CharDriverState **persist_chr,
         static int once = 0;
 
         if (!once) {
+            resolver_ni = ni;
             dns_config(config);
             once = 1;
         }
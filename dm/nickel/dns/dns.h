@@ -100,6 +100,7 @@ struct dns_response {
     int err;
     int denied;
     int64_t cost_ms;
+    uint32_t ttl;   /* s, for answers to the guest */
 };
 
 bool dns_is_nickel_domain_name(const char *domain);
@@ -43,6 +43,7 @@
 #include "log.h"
 #include "rpc.h"
 #include "socket.h"
+#include "dns/dns-cache.h"
 #include "dns/dns-fake.h"
 
 #if defined(__APPLE__)
@@ -963,6 +964,7 @@ ic_slirp(Monitor *mon)
                        s->nc.name);
         ni_connection_info(s->slirp, mon);
     }
+    dns_cache_info(mon);
 #ifdef SLIRP_THREADED
     monitor_printf(mon, "nickel threaded: queue max depth in:%lu, out:%lu\n", inq_max, outq_max);
 #endif
@@ -1038,6 +1040,11 @@ config_option(const char *name, const yajl_val arg, void *opaque)
             ni->tcp_disable_window_scale = 1;
         else if (YAJL_IS_FALSE(arg))
             ni->tcp_disable_window_scale = 0;
+    } else if (!strcmp(name, "disable-offload")) {
+        if (YAJL_IS_TRUE(arg))
+            ni->disable_offload = 1;
+        else if (YAJL_IS_FALSE(arg))
+            ni->disable_offload = 0;
     } else if (!strcmp(name, "tcpdump")) {
         if (pcap_config(ni, arg))
             /* ignore -- goto error */;
@@ -1399,6 +1406,8 @@ static void * ni_thread_run(void *opaque)
             (unsigned long) getpid(), (uintptr_t) ni_thread_run, (uintptr_t) &opaque);
 #endif
 
+    buff_pool_thread_init();
+
     while (!ni->exit_request) {
 
         if (cmpxchg(&ni->suspend_request, 1, 2) == 1) {
@@ -1430,6 +1439,7 @@ static void * ni_thread_run(void *opaque)
         ioh_event_reset(&ni->event);
     }
 
+    buff_pool_thread_exit();
     NETLOG("%s: thread exit", __FUNCTION__);
     return 0;
 }
@@ -1688,6 +1698,22 @@ static ssize_t net_nickel_receive(VLANClientState *nc, const uint8_t *buf, size_
     return size;
 }
 
+/* Segments from the guest are consumed as a byte stream, so large TSO
+ * frames need no special handling. */
+static int net_nickel_set_offload(VLANClientState *nc, int flags)
+{
+    struct nc_nickel_s *snc = DO_UPCAST(struct nc_nickel_s, nc, nc);
+    struct nickel *ni = snc->ni;
+
+    if (ni->disable_offload)
+        flags = 0;
+    flags &= NET_OFFLOAD_TSO;
+    NETLOG("%s: tso %s", __FUNCTION__,
+           (flags & NET_OFFLOAD_TSO) ? "on" : "off");
+
+    return flags;
+}
+
 static void net_nickel_cleanup(VLANClientState *nc)
 {
     struct nc_nickel_s *snc = DO_UPCAST(struct nc_nickel_s, nc, nc);
@@ -1713,6 +1739,7 @@ static NetClientInfo net_nickel_info = {
     .size = sizeof(struct nc_nickel_s),
     .receive = net_nickel_receive,
     .cleanup = net_nickel_cleanup,
+    .set_offload = net_nickel_set_offload,
 };
 
 int net_init_nickel(QemuOpts *opts, Monitor *mon, const char *name, VLANState *vlan)
@@ -1849,6 +1876,9 @@ int net_init_nickel(QemuOpts *opts, Monitor *mon, const char *name, VLANState *v
 #endif
     ioh_add_wait_object(&ni->event, NULL, NULL, &ni->wait_objects);
 
+    /* the device thread hands packets to nickel and frees its output */
+    buff_pool_thread_init();
+
     ni->tcp_disable_window_scale = 1;
     ni->mtu = NI_DEFAULT_MTU;
     ni->tcp_mss = (uint16_t) (ni->mtu - NI_TCPIP_HLEN);
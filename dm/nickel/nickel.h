@@ -114,6 +114,7 @@ struct nickel {
     int tcp_service_ok;
     int webdav_svc_ok;
     int tcp_disable_window_scale;
+    int disable_offload;
 
     int ac_enabled;
     int ac_event_log_enabled;
@@ -153,6 +154,13 @@ struct nickel {
     LIST_HEAD(, ni_socket) tcp;
     LIST_HEAD(, ni_socket) udp;
     LIST_HEAD(, ni_socket) gc_tcpip;
+    /* sockets by 4-tuple, and tcp sockets by host port */
+    LIST_HEAD(ni_socket_list, ni_socket) tcp_hash[1<<TCPIP_HASHSIZE];
+    struct ni_socket_list udp_hash[1<<TCPIP_HASHSIZE];
+    struct ni_socket_list tcp_port_hash[1<<TCPIP_HASHSIZE];
+    uint64_t so_hash_lookups;
+    uint64_t so_hash_depth;
+    uint32_t so_hash_max_depth;
     uint16_t g_last_ip;
     uint64_t us_max_ping_rtt;
     int64_t ping_sent_ts;
@@ -7,6 +7,7 @@
 #include <dm/config.h>
 #include <dm/char.h>
 #include <dm/timer.h>
+#include <dm/inet-csum.h>
 #include "nickel.h"
 #include "proto.h"
 #include "tcpip.h"
@@ -53,6 +54,8 @@
 
 struct ni_socket {
     LIST_ENTRY(ni_socket) entry;
+    LIST_ENTRY(ni_socket) hentry; /* tcp_hash, udp_hash */
+    LIST_ENTRY(ni_socket) pentry; /* tcp_port_hash */
     uint8_t type;
     uint8_t state;
     uint32_t flags;
@@ -190,6 +193,90 @@ static void socket_reset(struct ni_socket *so)
     so->bufd_len = 0;
 }
 
+static void socket_stats(struct nickel *ni, int64_t now)
+{
+    uint64_t avg;
+
+    if (ni->tcpip_stats_ts && ni->tcpip_stats_ts + STATS_MS >= now)
+        return;
+    ni->tcpip_stats_ts = now;
+
+    avg = ni->so_hash_lookups ?
+        100 * ni->so_hash_depth / ni->so_hash_lookups : 0;
+    NETLOG4("%s: #tcp %lu #udp %lu hash lookups %"PRIu64" depth avg %u.%02u max %u",
+            __FUNCTION__, (unsigned long) ni->number_tcp_sockets,
+            (unsigned long) ni->number_udp_sockets, ni->so_hash_lookups,
+            (unsigned int) (avg / 100), (unsigned int) (avg % 100),
+            (unsigned int) ni->so_hash_max_depth);
+}
+
+static inline unsigned int
+socket_hash(uint32_t gaddr, uint16_t gport, uint32_t faddr, uint16_t fport)
+{
+    uint32_t h;
+
+    h = faddr ^ (gaddr * 0x9e3779b1U) ^ (((uint32_t) fport << 16) | gport);
+    h ^= h >> 16;
+    h *= 0x85ebca6bU;
+    h ^= h >> 13;
+
+    return TCPIP_HASH(h);
+}
+
+static inline unsigned int socket_port_hash(uint16_t fport)
+{
+    /* free ports are handed out sequentially, so the low bits spread well */
+    return TCPIP_HASH(NI_NTOHS(fport));
+}
+
+static inline void socket_hash_account(struct nickel *ni, uint32_t depth)
+{
+    ni->so_hash_lookups++;
+    ni->so_hash_depth += depth;
+    if (depth > ni->so_hash_max_depth)
+        ni->so_hash_max_depth = depth;
+}
+
+static void socket_unhash(struct ni_socket *so)
+{
+    if (so->hentry.le_prev) {
+        LIST_REMOVE(so, hentry);
+        so->hentry.le_prev = NULL;
+    }
+    if (so->pentry.le_prev) {
+        LIST_REMOVE(so, pentry);
+        so->pentry.le_prev = NULL;
+    }
+}
+
+/* (re)insert the socket in the lookup tables, after its addresses changed */
+static void socket_rehash(struct ni_socket *so)
+{
+    struct nickel *ni = so->ni;
+    struct ni_socket_list *head;
+
+    socket_unhash(so);
+    head = so->type == IPPROTO_TCP ? ni->tcp_hash : ni->udp_hash;
+    LIST_INSERT_HEAD(&head[socket_hash(so->gaddr.sin_addr.s_addr,
+                                       so->gaddr.sin_port,
+                                       so->faddr.sin_addr.s_addr,
+                                       so->faddr.sin_port)], so, hentry);
+    if (so->type == IPPROTO_TCP)
+        LIST_INSERT_HEAD(&ni->tcp_port_hash[socket_port_hash(so->faddr.sin_port)],
+                         so, pentry);
+}
+
+static void
+socket_set_addr(struct ni_socket *so, uint32_t gaddr, uint16_t gport, uint32_t faddr,
+        uint16_t fport)
+{
+    so->gaddr.sin_addr.s_addr = gaddr;
+    so->gaddr.sin_port = gport;
+    so->faddr.sin_addr.s_addr = faddr;
+    so->faddr.sin_port = fport;
+    socket_rehash(so);
+}
+
 static struct ni_socket *
 socket_create(struct nickel *ni, uint8_t type, bool queue)
 {
@@ -218,12 +305,7 @@ socket_create(struct nickel *ni, uint8_t type, bool queue)
         atomic_inc(&ni->number_udp_sockets);
     }
 
-    if (!ni->tcpip_stats_ts || ni->tcpip_stats_ts + STATS_MS < so->ts_created) {
-        ni->tcpip_stats_ts = so->ts_created;
-
-        NETLOG4("%s: #tcp %lu #udp %lu", __FUNCTION__, (unsigned long) so->ni->number_tcp_sockets,
-                (unsigned long) so->ni->number_udp_sockets);
-    }
+    socket_stats(ni, so->ts_created);
 out:
     return so;
 }
@@ -248,6 +330,7 @@ socket_free(struct ni_socket *so)
     so->chr = NULL;
     if (so->ni->tcp_lst_so == so)
         so->ni->tcp_lst_so = NULL;
+    socket_unhash(so);
     if (so->entry.le_prev) {
         LIST_REMOVE(so, entry);
         queued = true;
@@ -279,12 +362,7 @@ socket_free(struct ni_socket *so)
     }
 
     now = get_clock_ms(vm_clock);
-    if (!so->ni->tcpip_stats_ts || so->ni->tcpip_stats_ts + STATS_MS < now) {
-        so->ni->tcpip_stats_ts = now;
-
-        NETLOG4("%s: #tcp %lu #udp %lu", __FUNCTION__, (unsigned long) so->ni->number_tcp_sockets,
-                (unsigned long) so->ni->number_udp_sockets);
-    }
+    socket_stats(so->ni, now);
 
     if (so->lv)
         tcpip_lava_submit(so);
@@ -310,6 +388,7 @@ find_socket_tcp(struct nickel *ni, uint32_t gaddr, uint16_t gport, uint32_t fadd
         uint16_t fport)
 {
     struct ni_socket *so = NULL;
+    uint32_t depth = 0;
 
     if (ni->tcp_lst_so && !IS_DEL(ni->tcp_lst_so) && ni->tcp_lst_so->gaddr.sin_port == gport  &&
             ni->tcp_lst_so->faddr.sin_addr.s_addr == faddr &&
@@ -320,7 +399,8 @@ find_socket_tcp(struct nickel *ni, uint32_t gaddr, uint16_t gport, uint32_t fadd
 
     }
 
-    LIST_FOREACH(so, &ni->tcp, entry) {
+    LIST_FOREACH(so, &ni->tcp_hash[socket_hash(gaddr, gport, faddr, fport)], hentry) {
+        depth++;
         if (so != ni->tcp_lst_so && !IS_DEL(so) &&
                 so->gaddr.sin_port == gport &&
                 so->faddr.sin_addr.s_addr == faddr &&
@@ -328,6 +408,7 @@ find_socket_tcp(struct nickel *ni, uint32_t gaddr, uint16_t gport, uint32_t fadd
                 so->gaddr.sin_addr.s_addr == gaddr)
             break;
     }
+    socket_hash_account(ni, depth);
 
     if (so)
         ni->tcp_lst_so = so;
@@ -340,14 +421,17 @@ find_socket_udp(struct nickel *ni, uint32_t gaddr, uint16_t gport, uint32_t fadd
         uint16_t fport)
 {
     struct ni_socket *so = NULL;
+    uint32_t depth = 0;
 
-    LIST_FOREACH(so, &ni->udp, entry) {
+    LIST_FOREACH(so, &ni->udp_hash[socket_hash(gaddr, gport, faddr, fport)], hentry) {
+        depth++;
         if (!IS_DEL(so) && so->faddr.sin_addr.s_addr == faddr &&
                 so->gaddr.sin_addr.s_addr == gaddr &&
                 so->faddr.sin_port == fport &&
                 so->gaddr.sin_port == gport)
             break;
     }
+    socket_hash_account(ni, depth);
     return so;
 }
 
@@ -401,66 +485,36 @@ static uint32_t get_rcv_win(struct ni_socket *so, struct tcp *tcp)
                                  : (uint32_t) NI_NTOHS(tcp->th_win);
 }
 
-static uint16_t checksum(uint32_t start, uint8_t *b, size_t len)
-{
-    register uint32_t sum = 0;
-
-    sum += start;
-    while (len > 1) {
-        sum += *((uint16_t *)b);
-        b += 2;
-        len -= 2;
-    }
-
-    if (len > 0)
-        sum += *b;
-
-    while (sum >> 16)
-        sum = (sum & 0xffff) + (sum >> 16);
-
-    return (uint16_t) (~sum & 0xffff);
-}
-
 static void ip_checksum(struct ip *ip, size_t tlen)
 {
     ip->ip_sum = 0;
-    ip->ip_sum = checksum(0, (uint8_t*)ip, sizeof(*ip));
+    ip->ip_sum = inet_csum(ip, sizeof(*ip), 0);
 }
 
-static void tcp_checksum(struct ip *ip, struct tcp *tcp, size_t tlen)
+/* data_sum is the partial sum of the last data_len bytes of the segment,
+ * already computed while copying them into the packet. */
+static void tcp_checksum_data(struct ip *ip, struct tcp *tcp, size_t tlen,
+                              size_t data_len, uint64_t data_sum)
 {
-    uint32_t sum = 0;
-    uint8_t prot[2];
-
-    prot[0] = 0; // zeros
-    prot[1] = ip->ip_p; // protocol from IP header
+    uint64_t sum;
 
-    sum += ((uint16_t*) (&ip->ip_src))[0];
-    sum += ((uint16_t*) (&ip->ip_src))[1];
-    sum += ((uint16_t*) (&ip->ip_dst))[0];
-    sum += ((uint16_t*) (&ip->ip_dst))[1];
-    sum += *((uint16_t*) prot);
-    sum += NI_HTONS(tlen);
+    sum = inet_csum_pseudo(ip->ip_src, ip->ip_dst, ip->ip_p, tlen);
     tcp->th_sum = 0;
-    tcp->th_sum = checksum(sum, (uint8_t*)tcp, tlen);
+    tcp->th_sum = inet_csum(tcp, tlen - data_len, sum + data_sum);
 }
 
-static void udp_checksum(struct ip *ip, struct udp *udp, size_t ulen)
+static void tcp_checksum(struct ip *ip, struct tcp *tcp, size_t tlen)
 {
-    uint32_t sum = 0;
-    uint8_t prot[2];
+    tcp_checksum_data(ip, tcp, tlen, 0, 0);
+}
 
-    prot[0] = 0; // zeros
-    prot[1] = ip->ip_p; // protocol from IP header
+static void udp_checksum(struct ip *ip, struct udp *udp, size_t ulen)
+{
+    uint64_t sum;
 
-    sum += ((uint16_t*) (&ip->ip_src))[0];
-    sum += ((uint16_t*) (&ip->ip_src))[1];
-    sum += ((uint16_t*) (&ip->ip_dst))[0];
-    sum += ((uint16_t*) (&ip->ip_dst))[1];
-    sum += *((uint16_t*) prot);
-    sum += NI_HTONS(ulen);
+    sum = inet_csum_pseudo(ip->ip_src, ip->ip_dst, ip->ip_p, ulen);
     udp->uh_sum = 0;
-    udp->uh_sum = checksum(sum, (uint8_t*)udp, ulen);
+    udp->uh_sum = inet_csum(udp, ulen, sum);
 }
 
 static size_t eth_write(struct nickel *ni, uint8_t *b)
@@ -592,8 +646,7 @@ static int icmp_echoreply(struct nickel *ni, const uint8_t *pkt, size_t len,
         return -1;
     }
 
-    if (probe->cksum != checksum(0, (uint8_t *) ((&probe->cksum) + 1),
-                len - 2)) {
+    if (probe->cksum != inet_csum((&probe->cksum) + 1, len - 2, 0)) {
 
         NETLOG("%s: PING invalid checksum", __FUNCTION__);
         return -1;
@@ -666,10 +719,10 @@ static int icmp_ping_probe(struct nickel *ni)
     probe->s_pkt_rx = ni->s_pkt_rx;
     probe->s_pkt_tx = ni->s_pkt_tx;
     probe->us_sent = (uint64_t) (os_get_clock() / 1000LL);
-    probe->cksum = checksum(0, (uint8_t *) probe, pkt_len);
+    probe->cksum = inet_csum(probe, pkt_len, 0);
 
     ping->icmp.cksum = 0;
-    ping->icmp.cksum = checksum(0, (uint8_t *) ping, icmp_l);
+    ping->icmp.cksum = inet_csum(ping, icmp_l, 0);
     ip_checksum(ip, ip_l);
 
     ni->ping_probe_n++;
@@ -696,6 +749,7 @@ tcp_send(struct ni_socket *so, int flags, const uint8_t *data, size_t len)
     size_t opt_len = 0;
     struct buff *bf = NULL;
     uint16_t win = 0;
+    uint64_t data_sum = 0;
 
     if (!data)
         len = 0;
@@ -795,7 +849,9 @@ tcp_send(struct ni_socket *so, int flags, const uint8_t *data, size_t len)
             atomic_add(&so->ni->tcp_nav_rx, (uint32_t) len);
         }
 
-        memcpy(pkt + off, data, len);
+        /* the data follows a 4-byte aligned header, so its sum can be
+         * picked up while copying */
+        data_sum = inet_csum_copy(pkt + off, data, len, 0);
         so->ack_2_ts = now;
 
         bf->ts = now;
@@ -809,7 +865,7 @@ tcp_send(struct ni_socket *so, int flags, const uint8_t *data, size_t len)
         so->flags &= ~(TF_DELAYED_ACK);
 
     /* checksum */
-    tcp_checksum(ip, tcp, tcp_l);
+    tcp_checksum_data(ip, tcp, tcp_l, len, data_sum);
     ip_checksum(ip, ip_l);
 
     buff_output(so->ni, bf);
@@ -977,6 +1033,8 @@ static void retransmit_packet(struct ni_socket *so, struct buff *bf)
 {
     struct ip *ip;
     struct tcp *tcp;
+    uint16_t old_win;
+    uint32_t old_ack;
 
     assert(so->type == IPPROTO_TCP);
     assert(so->state == TS_ESTABLISHED);
@@ -988,11 +1046,16 @@ static void retransmit_packet(struct ni_socket *so, struct buff *bf)
     ip->ip_id = NI_HTONS(so->ni->ip_id++);
     ip->ip_ttl = 34;
 
+    /* only th_win and th_ack change, patch the checksum rather than
+     * summing the whole segment again */
+    old_win = tcp->th_win;
+    old_ack = tcp->th_ack;
     tcp->th_win = NI_HTONS((uint16_t) (so->g_use_win_scaling ?
                 (so->snd_win >> so->snd_win_shift) : so->snd_win));
     tcp->th_ack =  NI_HTONL(so->rcv_iss + so->rcv_off_ack);
+    tcp->th_sum = inet_csum_update16(tcp->th_sum, old_win, tcp->th_win);
+    tcp->th_sum = inet_csum_update32(tcp->th_sum, old_ack, tcp->th_ack);
 
-    tcp_checksum(ip, tcp, bf->len - ETH_HLEN - sizeof(struct ip));
     ip_checksum(ip, bf->len - ETH_HLEN);
 
 #if DEBUG_RETRANSMIT
@@ -1166,9 +1229,10 @@ static void fwd_connect_cb(void *opaque)
         socket_reset(so);
         so->snd_iss = get_iss();
         port = tcp_get_free_port(so->ni);
-        if (port)
+        if (port) {
             so->faddr.sin_port = port;
-        else
+            socket_rehash(so);
+        } else
             NETLOG("%s: failed to obtain free port", __FUNCTION__);
 
         tcp_send(so, TH_SYN, NULL, 0);
@@ -1350,7 +1414,7 @@ static uint16_t tcp_get_free_port(struct nickel *ni)
         struct ni_socket *so;
         bool match = false;
 
-        LIST_FOREACH(so, &ni->tcp, entry) {
+        LIST_FOREACH(so, &ni->tcp_port_hash[socket_port_hash(htons(port))], pentry) {
             if (so->faddr.sin_addr.s_addr == ni->host_addr.s_addr &&
                     so->faddr.sin_port == htons(port)) {
                 match = true;
@@ -1421,10 +1485,7 @@ tcp_listen_create(struct nickel *ni, CharDriverState *chr, uint32_t faddr, uint1
     }
     if (!gaddr)
         gaddr = ni->dhcp_startaddr.s_addr;
-    so->faddr.sin_addr.s_addr = faddr;
-    so->gaddr.sin_addr.s_addr = gaddr;
-    so->gaddr.sin_port = gport;
-    so->faddr.sin_port = fport;
+    socket_set_addr(so, gaddr, gport, faddr, fport);
     so->snd_iss = get_iss();
     so->snd_win = MAX_16_WIN;
     so->rcv_mss = 1460;
@@ -1765,10 +1826,7 @@ static int tcp_input(struct nickel *ni, struct ip *ip, const uint8_t *pkt, size_
         so->flags |= TF_INPUT;
 
         so->ni = ni;
-        so->faddr.sin_addr.s_addr = daddr;
-        so->gaddr.sin_addr.s_addr = saddr;
-        so->gaddr.sin_port = tcp->th_sport;
-        so->faddr.sin_port = tcp->th_dport;
+        socket_set_addr(so, saddr, tcp->th_sport, daddr, tcp->th_dport);
         so->snd_iss = get_iss();
         so->snd_win = MAX_16_WIN;
         so->rcv_mss = 1460;
@@ -2362,7 +2420,7 @@ static int icmp_input(struct nickel *ni, const uint8_t *i_pkt, size_t i_len,
 
     icmp->type = ICMP_ECHOREPLY;
     icmp->cksum = 0;
-    icmp->cksum = checksum(0, pkt + off, pkt_len);
+    icmp->cksum = inet_csum(pkt + off, pkt_len, 0);
     ip_checksum(ip, ip_l);
 
     ni_buff_output(ni, bf);
@@ -2378,10 +2436,7 @@ udp_socket_create(struct nickel *ni, struct udp *udp, uint32_t saddr,
     so = socket_create(ni, IPPROTO_UDP, true);
     if (!so)
         goto out;
-    so->gaddr.sin_addr.s_addr = saddr;
-    so->faddr.sin_addr.s_addr = daddr;
-    so->gaddr.sin_port = udp->uh_sport;
-    so->faddr.sin_port = udp->uh_dport;
+    socket_set_addr(so, saddr, udp->uh_sport, daddr, udp->uh_dport);
 out:
     return so;
 }
@@ -2781,6 +2836,7 @@ static int tcp_socket_load(QEMUFile *f, struct nickel *ni, int version_id, uint3
                 (so->flags & TF_RST_PENDING) ? "RST" : "resumed");
 
         LIST_INSERT_HEAD(&ni->tcp, so, entry);
+        socket_rehash(so);
         atomic_inc(&ni->number_tcp_sockets);
         atomic_inc(&ni->number_total_tcp_sockets);
     }
@@ -10,6 +10,9 @@
 
 #include "buff.h"
 
+#define TCPIP_HASHSIZE  9
+#define TCPIP_HASH(n)   ((n) & ((1<<TCPIP_HASHSIZE)-1))
+
 struct nickel;
 struct ni_socket;
 struct lava_event;
@@ -484,6 +484,36 @@ static ssize_t qemu_vlan_deliver_packet(VLANClientState *sender,
     return ret;
 }
 
+/* Enable offloads on the peers of vc, and return the subset of flags all
+ * of them accepted. */
+int qemu_set_offload(VLANClientState *vc, int flags)
+{
+    VLANClientState *peer;
+
+    if (vc->peer) {
+        if (!vc->peer->info->set_offload) {
+            return 0;
+        }
+        return vc->peer->info->set_offload(vc->peer, flags);
+    }
+
+    if (!vc->vlan) {
+        return 0;
+    }
+
+    QTAILQ_FOREACH(peer, &vc->vlan->clients, next) {
+        if (peer != vc && !peer->info->set_offload) {
+            return 0;
+        }
+    }
+    QTAILQ_FOREACH(peer, &vc->vlan->clients, next) {
+        if (peer != vc) {
+            flags &= peer->info->set_offload(peer, flags);
+        }
+    }
+    return flags;
+}
+
 void qemu_purge_queued_packets(VLANClientState *vc)
 {
     NetQueue *queue;
@@ -49,6 +49,11 @@ typedef ssize_t (NetReceive)(VLANClientState *, const uint8_t *, size_t);
 typedef ssize_t (NetReceiveIOV)(VLANClientState *, const struct iovec *, int);
 typedef void (NetCleanup) (VLANClientState *);
 typedef void (LinkStatusChanged)(VLANClientState *);
+typedef int (NetSetOffload)(VLANClientState *, int);
+
+/* offloads negotiated between a NIC and its peers: with TSO the NIC passes
+ * on TCP frames larger than the MTU */
+#define NET_OFFLOAD_TSO 0x1
 
 typedef struct NetClientInfo {
     net_client_type type;
@@ -60,6 +65,7 @@ typedef struct NetClientInfo {
     NetCleanup *cleanup;
     LinkStatusChanged *link_status_changed;
     NetPoll *poll;
+    NetSetOffload *set_offload;
 } NetClientInfo;
 
 struct VLANClientState {
@@ -115,6 +121,7 @@ void qemu_send_packet(VLANClientState *vc, const uint8_t *buf, int size);
 ssize_t qemu_send_packet_raw(VLANClientState *vc, const uint8_t *buf, int size);
 ssize_t qemu_send_packet_async(VLANClientState *vc, const uint8_t *buf,
                                int size, NetPacketSent *sent_cb);
+int qemu_set_offload(VLANClientState *vc, int flags);
 void qemu_purge_queued_packets(VLANClientState *vc);
 void qemu_flush_queued_packets(VLANClientState *vc);
 void qemu_format_nic_info_str(VLANClientState *vc, uint8_t macaddr[6]);
@@ -244,3 +244,26 @@ timer_deadline(TimerQueue *active_timers, Clock *clock, int *timeout)
     if (delta < *timeout)
 	*timeout = delta;
 }
+
+void
+timer_deadline_ns(TimerQueue *active_timers, Clock *clock, int64_t *timeout_ns)
+{
+    Timer *ts;
+    int64_t delta;
+
+    if (!active_timers)
+        active_timers = main_active_timers;
+
+    if (clock_is_paused(clock))
+        return;
+
+    ts = TAILQ_FIRST(&active_timers[clock->type]);
+    if (ts == NULL)
+	return;
+
+    delta = ts->expire_time - get_clock_ns(clock);
+    if (delta < 0)
+	delta = 0;
+    if (*timeout_ns < 0 || delta < *timeout_ns)
+	*timeout_ns = delta;
+}
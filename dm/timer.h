@@ -52,6 +52,8 @@ void save_timer(QEMUFile *f, Timer *ts);
 void load_timer(QEMUFile *f, Timer *ts);
 // void run_one_timer(Timer *ts);
 void timer_deadline(TimerQueue *active_timers, Clock *clock, int *timeout);
+void timer_deadline_ns(TimerQueue *active_timers, Clock *clock,
+                       int64_t *timeout_ns);
 
 #define new_timer_ms(clock, cb, opaque) new_timer(clock, SCALE_MS, cb, opaque)
 #define new_timer_ns(clock, cb, opaque) new_timer(clock, SCALE_NS, cb, opaque)
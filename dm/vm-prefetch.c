@@ -0,0 +1,328 @@
+/*
+ * Copyright 2019, Bromium, Inc.
+ * SPDX-License-Identifier: ISC
+ */
+
+/*
+ * After a post-copy resume, the guest memory is left in the p2m as
+ * compressed populate-on-demand pages, which p2m_pod_demand_populate
+ * decompresses on first access.  The prefetcher populates these pages
+ * in the background, ahead of the guest: first the pages named by the
+ * access order recorded in the save file, then all others in pfn order.
+ *
+ * Pages found already populated have been faulted in by the guest ahead
+ * of the prefetcher.  Together with the recorded pages, these make up
+ * the access order written by the next save.
+ *
+ * Only pages saved as single page LZ4 records are left compressed, the
+ * hypervisor keeps compressed pages in that form.  Pages from batches
+ * compressed as a whole, cuckoo and uncompressed pages are populated
+ * during the restore.  The whole save file is still read before the
+ * vcpus run: post-copy defers the decompression and population of the
+ * pages, not the file i/o.
+ */
+
+#include "config.h"
+
+#include <err.h>
+#include <errno.h>
+#include <stdint.h>
+
+#include "bitops.h"
+#include "clock.h"
+#include "dm.h"
+#include "vm-prefetch.h"
+
+#include <xenctrl.h>
+#include <xc_private.h>
+
+#undef APRINTF
+#define APRINTF(fmt, ...) debug_printf(fmt "\n", ## __VA_ARGS__)
+#undef EPRINTF
+#define EPRINTF(fmt, ...) error_printf("%s: " fmt "\n", __FUNCTION__, \
+                                       ## __VA_ARGS__)
+
+#define PREFETCH_BATCH 256
+
+static struct {
+    uxen_thread thread;
+    int running;
+    volatile int stop;
+    int active;                 /* started, and not yet run to the end */
+
+    int p2m_size;
+    uint8_t *seen;              /* pfns of the access order visited */
+
+    /* access order read from the save file */
+    uint32_t *order;
+    uint32_t order_nr;
+    uint32_t order_pos;         /* next entry to visit */
+    int scan_pfn;               /* next pfn to visit, after the order */
+
+    /* access order of this run */
+    uint32_t *log;
+    uint32_t log_nr;
+    uint32_t log_max;
+
+    int populated;
+    int faulted;
+    int64_t run_ms;
+} prefetch;
+
+static void
+prefetch_log(uint32_t pfn)
+{
+
+    if (prefetch.log_nr == prefetch.log_max) {
+        uint32_t max = prefetch.log_max ? 2 * prefetch.log_max : 1024;
+        uint32_t *l;
+
+        /* best effort, the access order is only a hint */
+        l = realloc(prefetch.log, max * sizeof(prefetch.log[0]));
+        if (!l)
+            return;
+        prefetch.log = l;
+        prefetch.log_max = max;
+    }
+    prefetch.log[prefetch.log_nr++] = pfn;
+}
+
+/* the page type query only looks at the p2m: unlike a memory capture,
+ * it neither copies the page contents nor populates the pages */
+static int
+prefetch_batch(xen_pfn_t *pfns, int nr, int from_order, xen_pfn_t *types,
+               int *pfn_err)
+{
+    xen_pfn_t fetch[PREFETCH_BATCH];
+    void *mem;
+    int j, n;
+    int ret;
+
+    memcpy(types, pfns, nr * sizeof(types[0]));
+    ret = xc_get_pfn_type_batch(xc_handle, vm_id, nr, types);
+    if (ret) {
+        EPRINTF("xc_get_pfn_type_batch failed: ret %d errno %d",
+                ret, errno);
+        return -1;
+    }
+
+    n = 0;
+    for (j = 0; j < nr; j++) {
+        switch (types[j]) {
+        case XEN_DOMCTL_PFINFO_XPOD:
+            /* still compressed */
+            fetch[n++] = pfns[j];
+            if (from_order)
+                prefetch_log(pfns[j]);
+            break;
+        case XEN_DOMCTL_PFINFO_NOTAB:
+            prefetch_log(pfns[j]);
+            prefetch.faulted++;
+            break;
+        default:
+            /* zero pod page, or not guest memory */
+            break;
+        }
+    }
+    if (!n)
+        return 0;
+
+    /* a read-only mapping populates pod pages through
+     * p2m_pod_demand_populate, the same as a guest access */
+    mem = xc_map_foreign_bulk(xc_handle, vm_id, PROT_READ, fetch, pfn_err,
+                              n);
+    if (!mem) {
+        EPRINTF("xc_map_foreign_bulk failed: errno %d", errno);
+        return -1;
+    }
+    xc_munmap(xc_handle, vm_id, mem, n << PAGE_SHIFT);
+    prefetch.populated += n;
+
+    return 0;
+}
+
+static void
+prefetch_reset(void)
+{
+
+    free(prefetch.seen);
+    prefetch.seen = NULL;
+    free(prefetch.order);
+    prefetch.order = NULL;
+    prefetch.order_nr = prefetch.order_pos = 0;
+    prefetch.scan_pfn = 0;
+    prefetch.p2m_size = 0;
+    prefetch.populated = prefetch.faulted = 0;
+    prefetch.run_ms = 0;
+    prefetch.active = 0;
+}
+
+/* A run stops between batches, and picks up where it stopped when the
+ * prefetcher is resumed: no batch is left half done. */
+#if defined(_WIN32)
+static DWORD WINAPI
+vm_prefetch_run(void *opaque)
+#else
+static void *
+vm_prefetch_run(void *opaque)
+#endif
+{
+    xen_pfn_t pfns[PREFETCH_BATCH];
+    xen_pfn_t types[PREFETCH_BATCH];
+    int pfn_err[PREFETCH_BATCH];
+    int64_t start = os_get_clock_ms();
+    int pfn, nr;
+    int ret = -1;
+
+    if (!prefetch.seen) {
+        prefetch.p2m_size = xc_domain_maximum_gpfn(xc_handle, vm_id);
+        if (prefetch.p2m_size < 0) {
+            EPRINTF("xc_domain_maximum_gpfn failed");
+            goto out;
+        }
+        prefetch.p2m_size++;
+
+        prefetch.seen = calloc((prefetch.p2m_size + 7) / 8, 1);
+        if (!prefetch.seen) {
+            EPRINTF("allocation failed");
+            goto out;
+        }
+    }
+
+    while (prefetch.order_pos < prefetch.order_nr && !prefetch.stop) {
+        nr = 0;
+        while (prefetch.order_pos < prefetch.order_nr &&
+               nr < PREFETCH_BATCH) {
+            pfn = prefetch.order[prefetch.order_pos++];
+            if (pfn >= prefetch.p2m_size || test_bit(pfn, prefetch.seen))
+                continue;
+            __set_bit(pfn, prefetch.seen);
+            pfns[nr++] = pfn;
+        }
+        if (nr && prefetch_batch(pfns, nr, 1, types, pfn_err))
+            goto out;
+    }
+
+    while (prefetch.scan_pfn < prefetch.p2m_size && !prefetch.stop) {
+        nr = 0;
+        while (prefetch.scan_pfn < prefetch.p2m_size &&
+               nr < PREFETCH_BATCH) {
+            pfn = prefetch.scan_pfn++;
+            if (!test_bit(pfn, prefetch.seen))
+                pfns[nr++] = pfn;
+        }
+        if (nr && prefetch_batch(pfns, nr, 0, types, pfn_err))
+            goto out;
+    }
+
+    ret = 0;
+  out:
+    prefetch.run_ms += os_get_clock_ms() - start;
+    if (ret || !prefetch.stop) {
+        APRINTF("prefetch %s: %d pages populated, %d faulted in by guest,"
+                " %"PRId64" ms", ret ? "failed" : "done", prefetch.populated,
+                prefetch.faulted, prefetch.run_ms);
+        /* the part of the recorded access order which wasn't reached is
+         * still reported by vm_prefetch_get_order */
+        free(prefetch.seen);
+        prefetch.seen = NULL;
+        prefetch.active = 0;
+    } else
+        APRINTF("prefetch stopped: %d pages populated, %d faulted in by"
+                " guest, %"PRId64" ms", prefetch.populated, prefetch.faulted,
+                prefetch.run_ms);
+
+    return 0;
+}
+
+static int
+prefetch_create_thread(void)
+{
+
+    prefetch.stop = 0;
+    if (create_thread(&prefetch.thread, vm_prefetch_run, NULL) < 0) {
+        Wwarn("%s: create_thread failed", __FUNCTION__);
+        return -1;
+    }
+    prefetch.running = 1;
+    return 0;
+}
+
+int
+vm_prefetch_start(uint32_t *order, uint32_t order_nr)
+{
+
+    vm_prefetch_stop();
+    prefetch_reset();
+
+    free(prefetch.log);
+    prefetch.log = NULL;
+    prefetch.log_nr = prefetch.log_max = 0;
+
+    prefetch.order = order;
+    prefetch.order_nr = order_nr;
+    prefetch.active = 1;
+
+    if (prefetch_create_thread()) {
+        prefetch_reset();
+        return -1;
+    }
+
+    APRINTF("prefetch started: access order %d pages", order_nr);
+    return 0;
+}
+
+void
+vm_prefetch_stop(void)
+{
+
+    if (!prefetch.running)
+        return;
+
+    prefetch.stop = 1;
+    wait_thread(prefetch.thread);
+    close_thread_handle(prefetch.thread);
+    prefetch.running = 0;
+}
+
+/* continue a run which was stopped for a save, once the vm runs again on
+ * the same memory */
+int
+vm_prefetch_resume(void)
+{
+
+    if (prefetch.running || !prefetch.active)
+        return 0;
+
+    if (prefetch_create_thread())
+        return -1;
+
+    APRINTF("prefetch resumed: access order %d of %d pages visited",
+            prefetch.order_pos, prefetch.order_nr);
+    return 0;
+}
+
+/* the vm memory was replaced, what is left of a run no longer applies */
+void
+vm_prefetch_discard(void)
+{
+
+    vm_prefetch_stop();
+    prefetch_reset();
+    free(prefetch.log);
+    prefetch.log = NULL;
+    prefetch.log_nr = prefetch.log_max = 0;
+}
+
+/* the access order of this run is the pages logged so far, followed by
+ * the part of the recorded order which wasn't reached */
+void
+vm_prefetch_get_order(const uint32_t **log, uint32_t *log_nr,
+                      const uint32_t **rest, uint32_t *rest_nr)
+{
+
+    *log = prefetch.log;
+    *log_nr = prefetch.log_nr;
+    *rest = prefetch.order + prefetch.order_pos;
+    *rest_nr = prefetch.order_nr - prefetch.order_pos;
+}
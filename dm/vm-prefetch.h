@@ -0,0 +1,16 @@
+/*
+ * Copyright 2019, Bromium, Inc.
+ * SPDX-License-Identifier: ISC
+ */
+
+#ifndef _VM_PREFETCH_H_
+#define _VM_PREFETCH_H_
+
+int vm_prefetch_start(uint32_t *order, uint32_t order_nr);
+void vm_prefetch_stop(void);
+int vm_prefetch_resume(void);
+void vm_prefetch_discard(void);
+void vm_prefetch_get_order(const uint32_t **log, uint32_t *log_nr,
+                           const uint32_t **rest, uint32_t *rest_nr);
+
+#endif  /* _VM_PREFETCH_H_ */
@@ -32,8 +32,10 @@
 #include "qemu_savevm.h"
 #include "timer.h"
 #include "vm.h"
+#include "vm-prefetch.h"
 #include "vm-save.h"
 #include "vm-savefile.h"
+#include "uuidgen.h"
 #include "uxen.h"
 #include "hw/uxen_platform.h"
 #include "mapcache.h"
@@ -48,6 +50,8 @@
 
 #include <fingerprint.h>
 
+#include <attoimg/sha256.h>
+
 #include <xenctrl.h>
 #include <xc_private.h>
 
@@ -56,7 +60,7 @@
 #include <dm/whpx/whpx.h>
 
 #define DECOMPRESS_THREADED
-#define DECOMPRESS_THREADS 2
+#define DECOMPRESS_MAX_THREADS 16
 
 #ifdef DEBUG
 #define VERBOSE 1
@@ -116,6 +120,9 @@ typedef uint16_t cs16_t;
 #define skip_pci_hole(pfn) ((pfn) < PCI_HOLE_END_PFN ?                  \
                             (pfn) :                                     \
                             (pfn) - (PCI_HOLE_END_PFN - PCI_HOLE_START_PFN))
+#define unskip_pci_hole(idx) ((idx) < PCI_HOLE_START_PFN ?              \
+                              (idx) :                                   \
+                              (idx) + (PCI_HOLE_END_PFN - PCI_HOLE_START_PFN))
 #define poi_valid_pfn(poi, pfn) ((pfn) < (poi)->max_gpfn &&      \
                                  ((pfn) < PCI_HOLE_START_PFN ||  \
                                   (pfn) >= PCI_HOLE_END_PFN))
@@ -125,10 +132,294 @@ struct page_offset_info {
     uint32_t max_gpfn;
     uint64_t *pfn_off;
     struct filebuf *fb;
+    uint32_t *pfn_dir;
+    struct xc_save_page_extent *extents;
+    uint32_t extents_nr;
+    uint32_t extents_max;
 };
 #define PAGE_OFFSET_INDEX_PFN_OFF_COMPRESSED (1ULL << 63)
 #define PAGE_OFFSET_INDEX_PFN_OFF_MASK (~(PAGE_OFFSET_INDEX_PFN_OFF_COMPRESSED))
 
+static void
+poi_dir_free(struct page_offset_info *poi)
+{
+
+    free(poi->pfn_dir);
+    poi->pfn_dir = NULL;
+    free(poi->extents);
+    poi->extents = NULL;
+    poi->extents_nr = poi->extents_max = 0;
+}
+
+/* allocate the next extent of the page directory -- the page directory
+ * is best effort, and is dropped if it can't grow */
+static struct xc_save_page_extent *
+poi_dir_extent(struct page_offset_info *poi)
+{
+    struct xc_save_page_extent *e;
+
+    if (!poi->pfn_dir)
+        return NULL;
+
+    if (poi->extents_nr == poi->extents_max) {
+        /* the top extent index would encode PAGE_DIRECTORY_NONE */
+        uint32_t limit = page_directory_extent(PAGE_DIRECTORY_NONE);
+        uint32_t max = poi->extents_max ? 2 * poi->extents_max : 1024;
+
+        if (max > limit)
+            max = limit;
+        if (poi->extents_nr == max)
+            e = NULL;
+        else
+            e = realloc(poi->extents, max * sizeof(poi->extents[0]));
+        if (!e) {
+            EPRINTF("extents realloc failed, dropping page directory");
+            poi_dir_free(poi);
+            return NULL;
+        }
+        poi->extents = e;
+        poi->extents_max = max;
+    }
+
+    return &poi->extents[poi->extents_nr++];
+}
+
+/* record an extent of nr_pages pages of pfns[], stored at offset */
+static void
+poi_dir_add(struct page_offset_info *poi, const int *pfns, int nr_pages,
+            uint64_t offset, uint32_t size, uint16_t flags)
+{
+    struct xc_save_page_extent *e;
+    int i;
+
+    e = poi_dir_extent(poi);
+    if (!e)
+        return;
+
+    e->offset = offset;
+    e->size = size;
+    e->nr_pages = nr_pages;
+    e->flags = flags;
+    for (i = 0; i < nr_pages; i++)
+        if (poi_valid_pfn(poi, pfns[i]))
+            poi->pfn_dir[poi_pfn_index(poi, pfns[i])] =
+                page_directory_entry(poi->extents_nr - 1, i);
+}
+
+/* record a page of an incremental save as the page of the base save,
+ * given by its page directory entry -- the extents of the base are
+ * copied on first use, one ancestor further up, and inherit_map maps
+ * them to their copies */
+static void
+poi_dir_inherit(struct page_offset_info *poi, int pfn,
+                const struct page_directory *base, uint32_t entry,
+                uint32_t *inherit_map)
+{
+    const struct xc_save_page_extent *b;
+    struct xc_save_page_extent *e;
+    uint32_t ext = page_directory_extent(entry);
+
+    if (!poi->pfn_dir)
+        return;
+
+    if (inherit_map[ext] == PAGE_DIRECTORY_NONE) {
+        e = poi_dir_extent(poi);
+        if (!e)
+            return;
+        b = &base->extents[ext];
+        *e = *b;
+        e->flags = (b->flags & PAGE_EXTENT_RAW) |
+            ((page_extent_ancestor(b->flags) + 1) <<
+             PAGE_EXTENT_ANCESTOR_SHIFT);
+        inherit_map[ext] = poi->extents_nr - 1;
+    }
+    poi->pfn_dir[poi_pfn_index(poi, pfn)] =
+        page_directory_entry(inherit_map[ext], page_directory_page(entry));
+}
+
+/* The save file the vm memory was restored from is the base of
+ * incremental saves.  The content hash of each page is recorded as it
+ * is restored, and pages which still hash the same when saved are
+ * referenced in the base.  Pages restored compressed, and which are
+ * still compressed when saved, were not accessed since the restore.
+ * The guest controls the page contents, so the hash has to be
+ * collision resistant, or the guest could make a restore of the
+ * incremental save silently load stale pages from the base. */
+#define SAVE_PAGE_HASH_SIZE 32
+
+struct save_page_hash {
+    uint8_t h[SAVE_PAGE_HASH_SIZE];
+};
+
+static struct {
+    char *file;
+    struct save_page_hash *hash; /* by pfn index */
+    uint8_t *hashed;            /* bitmap of pfn indexes with a hash */
+    uint32_t pfn_nr;
+    int recording;
+    int compressed_clean;
+} save_base;
+
+static void
+save_page_hash(const uint8_t *page, struct save_page_hash *hash)
+{
+    SHA256_CTX ctx;
+
+    sha256_init(&ctx);
+    sha256_update(&ctx, page, PAGE_SIZE);
+    sha256_final(&ctx, hash->h);
+}
+
+static void
+save_base_record(uint64_t pfn, const uint8_t *page)
+{
+
+    if (!save_base.recording)
+        return;
+    if (pfn >= PCI_HOLE_START_PFN && pfn < PCI_HOLE_END_PFN)
+        return;
+    pfn = skip_pci_hole(pfn);
+    if (pfn < save_base.pfn_nr) {
+        save_page_hash(page, &save_base.hash[pfn]);
+        __set_bit(pfn, save_base.hashed);
+    }
+}
+
+static void
+save_base_record_batch(const xen_pfn_t *pfn_type, const uint8_t *mem,
+                       int batch)
+{
+    int j;
+
+    if (!save_base.recording)
+        return;
+    for (j = 0; j < batch; j++)
+        save_base_record(pfn_type[j], &mem[j << PAGE_SHIFT]);
+}
+
+static void
+save_base_clear(void)
+{
+
+    free(save_base.file);
+    free(save_base.hash);
+    free(save_base.hashed);
+    memset(&save_base, 0, sizeof(save_base));
+}
+
+static void
+save_base_start(const char *file)
+{
+
+    save_base_clear();
+    if (!save_incremental)
+        return;
+
+    save_base.pfn_nr = vm_mem_mb << (20 - UXEN_PAGE_SHIFT);
+    save_base.hash = malloc(save_base.pfn_nr * sizeof(save_base.hash[0]));
+    save_base.hashed = calloc((save_base.pfn_nr + 7) / 8, 1);
+    save_base.file = strdup(file);
+    if (!save_base.hash || !save_base.hashed || !save_base.file) {
+        EPRINTF("allocation failed, incremental saves disabled");
+        save_base_clear();
+        return;
+    }
+    save_base.recording = 1;
+    save_base.compressed_clean = 1;
+}
+
+struct save_parent {
+    char *file;
+    uint64_t page_directory_offset;
+    uint8_t save_id[16];
+};
+
+static void
+save_parents_free(struct save_parent *parents, uint32_t parents_nr)
+{
+    uint32_t i;
+
+    for (i = 0; i < parents_nr; i++)
+        free(parents[i].file);
+    free(parents);
+}
+
+/* the ancestors an incremental save references, and the page directory
+ * of the base, its parent */
+struct save_incr {
+    struct filebuf *f;
+    struct page_directory pd;
+    uint64_t page_directory_offset;
+    uint8_t save_id[16];
+    struct save_parent *parents;
+    uint32_t parents_nr;
+    uint32_t *inherit_map;      /* base extent -> extent of this save */
+};
+
+static int save_incr_open(struct save_incr *si, char **err_msg);
+static void save_incr_close(struct save_incr *si);
+
+/* a page is unchanged since the restore from the base if it is still
+ * compressed, or if it still hashes the same */
+static int
+save_incr_clean(struct save_incr *si, int pfn, int compressed,
+                const uint8_t *page, uint32_t *entry)
+{
+    struct save_page_hash hash;
+    uint32_t idx;
+
+    if (pfn >= PCI_HOLE_START_PFN && pfn < PCI_HOLE_END_PFN)
+        return 0;
+    idx = skip_pci_hole(pfn);
+    if (idx >= si->pd.pfn_nr || idx >= save_base.pfn_nr)
+        return 0;
+    *entry = si->pd.pfn_entry[idx];
+    if (*entry == PAGE_DIRECTORY_NONE ||
+        page_directory_extent(*entry) >= si->pd.extents_nr)
+        return 0;
+
+    if (compressed && save_base.compressed_clean)
+        return 1;
+    if (!test_bit(idx, save_base.hashed))
+        return 0;
+    save_page_hash(page, &hash);
+    return !memcmp(&hash, &save_base.hash[idx], sizeof(hash));
+}
+
+static void
+save_incr_write_parents(struct filebuf *f, struct save_incr *si)
+{
+    struct xc_save_parent_files s_parent_files;
+    struct xc_save_parent_file s_parent_file;
+    uint32_t i;
+    uint64_t size;
+
+    size = sizeof(s_parent_files) + sizeof(s_parent_file) +
+        strlen(save_base.file);
+    for (i = 0; i < si->parents_nr; i++)
+        size += sizeof(s_parent_file) + strlen(si->parents[i].file);
+
+    s_parent_files.marker = XC_SAVE_ID_PARENT_FILES;
+    s_parent_files.size = size;
+    s_parent_files.files_nr = si->parents_nr + 1;
+    filebuf_write(f, &s_parent_files, sizeof(s_parent_files));
+
+    s_parent_file.page_directory_offset = si->page_directory_offset;
+    memcpy(s_parent_file.save_id, si->save_id, sizeof(s_parent_file.save_id));
+    s_parent_file.size = strlen(save_base.file);
+    filebuf_write(f, &s_parent_file, sizeof(s_parent_file));
+    filebuf_write(f, save_base.file, s_parent_file.size);
+    for (i = 0; i < si->parents_nr; i++) {
+        s_parent_file.page_directory_offset =
+            si->parents[i].page_directory_offset;
+        memcpy(s_parent_file.save_id, si->parents[i].save_id,
+               sizeof(s_parent_file.save_id));
+        s_parent_file.size = strlen(si->parents[i].file);
+        filebuf_write(f, &s_parent_file, sizeof(s_parent_file));
+        filebuf_write(f, si->parents[i].file, s_parent_file.size);
+    }
+}
+
 #define uxenvm_read_struct_size(s) (sizeof(*(s)) - sizeof(marker))
 #define uxenvm_read_struct(f, s)                                        \
     filebuf_read(f, (uint8_t *)(s) + sizeof(marker),                    \
@@ -431,28 +722,376 @@ vm_save_abort(void)
     check_aborted();
 }
 
+static int
+host_cpus(void)
+{
+#ifdef _WIN32
+    SYSTEM_INFO si;
+
+    GetSystemInfo(&si);
+    return si.dwNumberOfProcessors;
+#else
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+    return n > 0 ? n : 1;
+#endif
+}
+
+/* LZ4 batches are compressed by a pool of compress threads while the main
+ * thread captures the next batches.  Each batch is copied out of the
+ * capture buffer into a compress_buf_ctx, and completed batches are written
+ * from the main thread strictly in the order they were captured, so the
+ * save file layout is the same as when compressing inline. */
+#define COMPRESS_MAX_THREADS 16
+
+struct compress_ctx;
+
+struct compress_buf_ctx {
+    int seq;
+    int done;
+    int batch;
+    int *pfn_batch;
+    char *mem;
+    char *compress_buf;
+    uint32_t compress_size;
+    int v_run;
+    struct compress_ctx *cc;
+    LIST_ENTRY(compress_buf_ctx) elem;
+};
+
+struct compress_ctx {
+    struct async_op_ctx *async_op_ctx;
+    LIST_HEAD(, compress_buf_ctx) list;
+    struct compress_buf_ctx **ring;
+    int nr_bufs;
+    int next_seq;
+    int write_seq;
+    ioh_event process_event;
+    struct filebuf *f;
+    struct page_offset_info *poi;
+    int single_page;
+    int total_compressed_pages;
+    int total_compress_in_vain;
+    size_t total_compress_save;
+};
+
+static void
+compress_cb(void *opaque)
+{
+    struct compress_buf_ctx *cbc = (struct compress_buf_ctx *)opaque;
+    char *src, *dst;
+    int i, cs1;
+
+    if (!cbc->cc->single_page) {
+        cbc->compress_size = uxenvm_compress_lz4(
+            cbc->mem, cbc->compress_buf, cbc->batch << PAGE_SHIFT);
+        if (cbc->compress_size >= cbc->batch << PAGE_SHIFT)
+            cbc->compress_size = -1;
+        return;
+    }
+
+    cbc->compress_size = 0;
+    cbc->v_run = 0;
+    for (i = 0; i < cbc->batch; i++) {
+        src = &cbc->mem[i << PAGE_SHIFT];
+        dst = &cbc->compress_buf[cbc->compress_size + sizeof(cs16_t)];
+        cs1 = uxenvm_compress_lz4(src, dst, PAGE_SIZE);
+        if (cs1 >= PAGE_SIZE) {
+            memcpy(dst, src, PAGE_SIZE);
+            cs1 = PAGE_SIZE;
+            cbc->v_run++;
+        }
+        *(cs16_t *)&cbc->compress_buf[cbc->compress_size] = cs1;
+        cbc->compress_size += sizeof(cs16_t) + cs1;
+    }
+}
+
+static void
+compress_write(struct compress_buf_ctx *cbc)
+{
+    struct compress_ctx *cc = cbc->cc;
+    struct filebuf *f = cc->f;
+    struct page_offset_info *poi = cc->poi;
+    uint64_t mem_pos;
+    uint32_t pos;
+    int _batch;
+    int i, pfn;
+    cs16_t cs1;
+
+    _batch = cbc->batch + (cc->single_page ? 2 * MAX_BATCH_SIZE :
+                           MAX_BATCH_SIZE);
+    filebuf_write(f, &_batch, sizeof(_batch));
+    filebuf_write(f, cbc->pfn_batch, cbc->batch * sizeof(cbc->pfn_batch[0]));
+    filebuf_write(f, &cbc->compress_size, sizeof(cbc->compress_size));
+    mem_pos = filebuf_tell(f);
+
+    if (!cc->single_page) {
+        if (cbc->compress_size != -1)
+            poi_dir_add(poi, cbc->pfn_batch, cbc->batch, mem_pos,
+                        cbc->compress_size, 0);
+        else
+            poi_dir_add(poi, cbc->pfn_batch, cbc->batch, mem_pos,
+                        cbc->batch << PAGE_SHIFT, PAGE_EXTENT_RAW);
+        if (cbc->compress_size != -1) {
+            filebuf_write(f, cbc->compress_buf, cbc->compress_size);
+            cc->total_compressed_pages += cbc->batch;
+            cc->total_compress_save +=
+                (cbc->batch << PAGE_SHIFT) - cbc->compress_size;
+        } else {
+            SAVE_DPRINTF("compressed size larger for pages %08x:%08x",
+                         cbc->pfn_batch[0],
+                         cbc->pfn_batch[cbc->batch - 1] + 1);
+            filebuf_write(f, cbc->mem, cbc->batch << PAGE_SHIFT);
+            cc->total_compress_in_vain += cbc->batch;
+        }
+        return;
+    }
+
+    for (i = 0, pos = 0; i < cbc->batch; i++) {
+        pfn = cbc->pfn_batch[i];
+        cs1 = *(cs16_t *)&cbc->compress_buf[pos];
+        /* if the page is not compressed, then record the offset of the
+         * page data, otherwise record the offset of the size field and
+         * set the PAGE_OFFSET_INDEX_PFN_OFF_COMPRESSED indicator */
+        if (poi_valid_pfn(poi, pfn))
+            poi->pfn_off[poi_pfn_index(poi, pfn)] = (mem_pos + pos) +
+                (cs1 == PAGE_SIZE ? sizeof(cs16_t) :
+                 PAGE_OFFSET_INDEX_PFN_OFF_COMPRESSED);
+        poi_dir_add(poi, &cbc->pfn_batch[i], 1, mem_pos + pos + sizeof(cs16_t),
+                    cs1, cs1 == PAGE_SIZE ? PAGE_EXTENT_RAW : 0);
+        pos += sizeof(cs16_t) + cs1;
+    }
+    filebuf_write(f, cbc->compress_buf, cbc->compress_size);
+    cc->total_compressed_pages += cbc->batch - cbc->v_run;
+    cc->total_compress_in_vain += cbc->v_run;
+    cc->total_compress_save += (cbc->batch << PAGE_SHIFT) - cbc->compress_size;
+}
+
+static void
+compress_complete(void *opaque)
+{
+    struct compress_buf_ctx *cbc = (struct compress_buf_ctx *)opaque;
+    struct compress_ctx *cc = cbc->cc;
+
+    cbc->done = 1;
+    while ((cbc = cc->ring[cc->write_seq % cc->nr_bufs]) && cbc->done) {
+        compress_write(cbc);
+        cc->ring[cc->write_seq % cc->nr_bufs] = NULL;
+        cc->write_seq++;
+        LIST_INSERT_HEAD(&cc->list, cbc, elem);
+    }
+}
+
+static int
+compress_init(struct compress_ctx *cc, struct filebuf *f,
+              struct page_offset_info *poi, char **err_msg)
+{
+    struct compress_buf_ctx *cbc;
+    int nr_threads;
+    int i;
+    int ret;
+
+    nr_threads = save_compress_threads ? : host_cpus();
+    if (nr_threads > COMPRESS_MAX_THREADS)
+        nr_threads = COMPRESS_MAX_THREADS;
+
+    cc->f = f;
+    cc->poi = poi;
+    cc->single_page = vm_save_info.single_page;
+    LIST_INIT(&cc->list);
+    /* one batch being filled and one waiting to be written, in addition
+     * to one per compress thread */
+    cc->nr_bufs = nr_threads + 2;
+    cc->ring = calloc(cc->nr_bufs, sizeof(cc->ring[0]));
+    if (!cc->ring) {
+        asprintf(err_msg, "calloc compress ring failed");
+        ret = -ENOMEM;
+        goto out;
+    }
+    for (i = 0; i < cc->nr_bufs; i++) {
+        cbc = calloc(1, sizeof(struct compress_buf_ctx));
+        if (!cbc) {
+            asprintf(err_msg, "calloc cbc failed");
+            ret = -ENOMEM;
+            goto out;
+        }
+        cbc->cc = cc;
+        LIST_INSERT_HEAD(&cc->list, cbc, elem);
+        cbc->pfn_batch = malloc(MAX_BATCH_SIZE * sizeof(cbc->pfn_batch[0]));
+        cbc->mem = malloc(MAX_BATCH_SIZE << PAGE_SHIFT);
+        /* The LZ4_compressBound macro is unsafe, so we have to wrap the
+         * argument.  The bound also covers a single_page batch of
+         * uncompressed pages with their size fields. */
+        cbc->compress_buf = malloc(LZ4_compressBound(
+                                       (MAX_BATCH_SIZE << PAGE_SHIFT)));
+        if (!cbc->pfn_batch || !cbc->mem || !cbc->compress_buf) {
+            asprintf(err_msg, "malloc compress buffers failed");
+            ret = -ENOMEM;
+            goto out;
+        }
+    }
+
+    cc->async_op_ctx = async_op_init();
+    async_op_set_prop(cc->async_op_ctx, NULL, nr_threads, 0, 0);
+    ioh_event_init(&cc->process_event);
+
+    APRINTF("compress threads: %d", nr_threads);
+    ret = 0;
+  out:
+    return ret;
+}
+
+static struct compress_buf_ctx *
+compress_get_buf(struct compress_ctx *cc)
+{
+    struct compress_buf_ctx *cbc;
+
+    for (;;) {
+        ioh_event_reset(&cc->process_event);
+        async_op_process(cc->async_op_ctx);
+        cbc = LIST_FIRST(&cc->list);
+        if (cbc)
+            break;
+        ioh_event_wait(&cc->process_event);
+    }
+    LIST_REMOVE(cbc, elem);
+
+    return cbc;
+}
+
+static int
+compress_submit(struct compress_ctx *cc, struct compress_buf_ctx *cbc)
+{
+    int ret;
+
+    cbc->seq = cc->next_seq;
+    cbc->done = 0;
+    cc->ring[cbc->seq % cc->nr_bufs] = cbc;
+    ret = async_op_add(cc->async_op_ctx, cbc, &cc->process_event,
+                       compress_cb, compress_complete);
+    if (ret) {
+        cc->ring[cbc->seq % cc->nr_bufs] = NULL;
+        LIST_INSERT_HEAD(&cc->list, cbc, elem);
+        return ret;
+    }
+    cc->next_seq++;
+
+    return 0;
+}
+
+static void
+compress_wait_all(struct compress_ctx *cc)
+{
+
+    if (!cc->async_op_ctx)
+        return;
+
+    for (;;) {
+        ioh_event_reset(&cc->process_event);
+        async_op_process(cc->async_op_ctx);
+        if (cc->write_seq == cc->next_seq)
+            break;
+        ioh_event_wait(&cc->process_event);
+    }
+}
+
+static void
+compress_free(struct compress_ctx *cc)
+{
+    struct compress_buf_ctx *cbc, *cbc_next;
+
+    if (cc->async_op_ctx) {
+        compress_wait_all(cc);
+        ioh_event_close(&cc->process_event);
+        async_op_exit_wait(cc->async_op_ctx);
+        cc->async_op_ctx = NULL;
+    }
+
+    LIST_FOREACH_SAFE(cbc, &cc->list, elem, cbc_next) {
+        LIST_REMOVE(cbc, elem);
+        free(cbc->pfn_batch);
+        free(cbc->mem);
+        free(cbc->compress_buf);
+        free(cbc);
+    }
+    free(cc->ring);
+    cc->ring = NULL;
+}
+
+/* pages not populated since a post-copy resume are captured as their
+ * compressed size and lz4 data -- expand these, so that the batch holds
+ * whole pages at the offsets of its pfns */
+static int
+uxenvm_savevm_expand_compressed(xen_memory_capture_gpfn_info_t *gpfn_info_list,
+                                int nr, uint8_t *mem_buffer,
+                                uint8_t **expand_buffer, char **err_msg)
+{
+    uint8_t *src, *dst;
+    uint16_t cs;
+    int j;
+    int ret;
+
+    for (j = 0; j < nr; j++)
+        if ((gpfn_info_list[j].type & XENMEM_MCGI_TYPE_MASK) ==
+            XENMEM_MCGI_TYPE_NORMAL &&
+            (gpfn_info_list[j].type & XENMEM_MCGI_TYPE_COMPRESSED))
+            break;
+    if (j == nr)
+        return 0;
+
+    if (!*expand_buffer) {
+        *expand_buffer = malloc(MAX_BATCH_SIZE << PAGE_SHIFT);
+        if (!*expand_buffer) {
+            asprintf(err_msg, "expand_buffer = malloc(%d) failed",
+                     MAX_BATCH_SIZE << PAGE_SHIFT);
+            return -ENOMEM;
+        }
+    }
+
+    for (j = 0; j < nr; j++) {
+        if ((gpfn_info_list[j].type & XENMEM_MCGI_TYPE_MASK) !=
+            XENMEM_MCGI_TYPE_NORMAL)
+            continue;
+        src = &mem_buffer[gpfn_info_list[j].offset];
+        dst = &(*expand_buffer)[j << PAGE_SHIFT];
+        if (gpfn_info_list[j].type & XENMEM_MCGI_TYPE_COMPRESSED) {
+            cs = *(uint16_t *)src;
+            ret = LZ4_decompress_safe((const char *)src + sizeof(cs),
+                                      (char *)dst, cs, PAGE_SIZE);
+            if (ret != PAGE_SIZE) {
+                asprintf(err_msg, "decompression of captured page %d"
+                         " failed: %d", j, ret);
+                return -EINVAL;
+            }
+        } else
+            memcpy(dst, src, PAGE_SIZE);
+        gpfn_info_list[j].offset = j << PAGE_SHIFT;
+    }
+    memcpy(mem_buffer, *expand_buffer, nr << PAGE_SHIFT);
+
+    return 0;
+}
+
 static int
 uxenvm_savevm_write_pages(struct filebuf *f, char **err_msg)
 {
     uint8_t *hvm_buf = NULL;
-    int p2m_size, pfn, batch, _batch, run, b_run, m_run, v_run, rezero, clone;
+    int p2m_size, pfn, batch, _batch, run, b_run, m_run, rezero, clone;
     int _zero;
     unsigned long batch_done;
     int total_pages = 0, total_zero = 0, total_rezero = 0, total_clone = 0;
-    int total_compressed_pages = 0, total_compress_in_vain = 0;
-    size_t total_compress_save = 0;
+    int total_inherited = 0;
     int j;
     int *pfn_batch = NULL;
     uint8_t *zero_bitmap = NULL, *zero_bitmap_compressed = NULL;
     uint32_t zero_bitmap_size;
     struct xc_save_zero_bitmap s_zero_bitmap;
-    char *compress_mem = NULL;
-    char *compress_buf = NULL;
-    uint32_t compress_size = 0;
+    struct compress_ctx cc = { };
+    struct compress_buf_ctx *cbc = NULL;
     DECLARE_HYPERCALL_BUFFER(uint8_t, mem_buffer);
 #define MEM_BUFFER_SIZE (MAX_BATCH_SIZE * PAGE_SIZE)
     xen_memory_capture_gpfn_info_t *gpfn_info_list = NULL;
-    uint64_t mem_pos = 0, pos;
+    uint64_t pos;
     struct page_offset_info poi = { 0 };
     int rezero_nr = 0;
     xen_pfn_t *rezero_pfns = NULL;
@@ -466,6 +1105,17 @@ uxenvm_savevm_write_pages(struct filebuf *f, char **err_msg)
     int trivial_nr = 0;
     struct xc_save_vm_fingerprints s_vm_fingerprints;
     struct xc_save_index fingerprints_index = { 0, XC_SAVE_ID_FINGERPRINTS };
+    struct xc_save_page_directory s_page_directory;
+    struct xc_save_index page_directory_index =
+        { 0, XC_SAVE_ID_PAGE_DIRECTORY };
+    struct xc_save_save_id s_save_id;
+    struct xc_save_index save_id_index = { 0, XC_SAVE_ID_SAVE_ID };
+    struct xc_save_access_order s_access_order;
+    const uint32_t *access_order, *access_order_rest;
+    uint32_t access_order_nr, access_order_rest_nr;
+    uint8_t *expand_buffer = NULL;
+    struct save_incr si = { };
+    struct xc_save_index parent_files_index = { 0, XC_SAVE_ID_PARENT_FILES };
     int free_mem;
     int ret;
 
@@ -513,52 +1163,46 @@ uxenvm_savevm_write_pages(struct filebuf *f, char **err_msg)
 	goto out;
     }
 
-    if (!free_mem) {
-        rezero_pfns = malloc(MAX_BATCH_SIZE * sizeof(*rezero_pfns));
-        if (rezero_pfns == NULL) {
-            asprintf(err_msg, "rezero_pfns = malloc(%"PRIdSIZE") failed",
-                     MAX_BATCH_SIZE * sizeof(*rezero_pfns));
-            ret = -ENOMEM;
-            goto out;
-        }
-    }
-
-    if (vm_save_info.compress_mode == VM_SAVE_COMPRESS_LZ4) {
-        if (!vm_save_info.single_page) {
-            /* The LZ4_compressBound macro is unsafe, so we have to wrap the
-             * argument. */
-            compress_buf =
-                (char *)malloc(LZ4_compressBound(
-                                   (MAX_BATCH_SIZE << PAGE_SHIFT)));
-            if (!compress_buf) {
-                asprintf(err_msg, "malloc(compress_buf) failed");
-                ret = -ENOMEM;
-                goto out;
-            }
-            compress_mem = (char *)malloc(MAX_BATCH_SIZE << PAGE_SHIFT);
-            if (!compress_mem) {
-                asprintf(err_msg, "malloc(compress_mem) failed");
-                ret = -ENOMEM;
-                goto out;
-            }
-        } else {
-            compress_buf = (char *)malloc(
-                sizeof(compress_size) +
-                MAX_BATCH_SIZE * (sizeof(cs16_t) + PAGE_SIZE));
-            if (!compress_buf) {
-                asprintf(err_msg, "malloc(compress_buf) failed");
-                ret = -ENOMEM;
-                goto out;
-            }
-        }
+    rezero_pfns = malloc(MAX_BATCH_SIZE * sizeof(*rezero_pfns));
+    if (rezero_pfns == NULL) {
+        asprintf(err_msg, "rezero_pfns = malloc(%"PRIdSIZE") failed",
+                 MAX_BATCH_SIZE * sizeof(*rezero_pfns));
+        ret = -ENOMEM;
+        goto out;
     }
 
     poi.max_gpfn = vm_mem_mb << (20 - UXEN_PAGE_SHIFT);
     poi.pfn_off = calloc(1, poi.max_gpfn * sizeof(poi.pfn_off[0]));
+    if (!compression_is_cuckoo()) {
+        BUILD_BUG_ON(MAX_BATCH_SIZE > (1 << PAGE_DIRECTORY_PAGE_BITS));
+        poi.pfn_dir = malloc(poi.max_gpfn * sizeof(poi.pfn_dir[0]));
+        if (poi.pfn_dir)
+            memset(poi.pfn_dir, 0xff, poi.max_gpfn * sizeof(poi.pfn_dir[0]));
+    }
     /* adjust max_gpfn to account for pci hole after allocating pfn_off */
     if (poi.max_gpfn > PCI_HOLE_START_PFN)
         poi.max_gpfn += PCI_HOLE_END_PFN - PCI_HOLE_START_PFN;
 
+    if (vm_save_info.compress_mode == VM_SAVE_COMPRESS_LZ4) {
+        ret = compress_init(&cc, f, &poi, err_msg);
+        if (ret)
+            goto out;
+    }
+
+    /* an incremental save references the unchanged pages in the save
+     * file the vm was restored from, which it must not replace */
+    if (vm_save_info.incremental && save_base.hash && poi.pfn_dir &&
+        vm_save_compress_mode_batched(vm_save_info.compress_mode)) {
+        if (!strcmp(save_base.file, vm_save_info.filename))
+            APRINTF("incremental save: can't overwrite base %s,"
+                    " saving in full", save_base.file);
+        else if (save_incr_open(&si, err_msg)) {
+            APRINTF("incremental save: %s, saving in full", *err_msg);
+            free(*err_msg);
+            *err_msg = NULL;
+        }
+    }
+
     /* store start of batch file offset, to allow restoring page data
      * without parsing the entire save file */
     vm_save_info.page_batch_offset = filebuf_tell(f);
@@ -580,11 +1224,22 @@ uxenvm_savevm_write_pages(struct filebuf *f, char **err_msg)
             EPRINTF("xc_domain_memory_capture fail/incomple: ret %d"
                     " errno %d done %ld/%d", ret, errno, batch_done, batch);
         }
+        ret = uxenvm_savevm_expand_compressed(gpfn_info_list, batch_done,
+                                              mem_buffer, &expand_buffer,
+                                              err_msg);
+        if (ret)
+            goto out;
         rezero = 0;
         clone = 0;
         _batch = 0;
         _zero = 0;
         for (j = 0; j < batch_done; j++) {
+            int compressed =
+                !!(gpfn_info_list[j].type & XENMEM_MCGI_TYPE_COMPRESSED);
+            uint32_t entry;
+            /* the capture doesn't remove compressed pages */
+            if (free_mem && compressed)
+                rezero_pfns[rezero_nr++] = pfn + j;
             gpfn_info_list[j].type &= XENMEM_MCGI_TYPE_MASK;
             if (gpfn_info_list[j].type == XENMEM_MCGI_TYPE_NORMAL) {
                 uint32_t *p = (uint32_t *)&mem_buffer[gpfn_info_list[j].offset];
@@ -604,6 +1259,16 @@ uxenvm_savevm_write_pages(struct filebuf *f, char **err_msg)
                     }
                 }
             }
+            if (gpfn_info_list[j].type == XENMEM_MCGI_TYPE_NORMAL &&
+                si.inherit_map &&
+                save_incr_clean(&si, pfn + j, compressed,
+                                &mem_buffer[gpfn_info_list[j].offset],
+                                &entry)) {
+                poi_dir_inherit(&poi, pfn + j, &si.pd, entry,
+                                si.inherit_map);
+                gpfn_info_list[j].type = XENMEM_MCGI_TYPE_NOT_PRESENT;
+                total_inherited++;
+            }
             if (gpfn_info_list[j].type == XENMEM_MCGI_TYPE_NORMAL) {
                 pfn_batch[_batch] = pfn + j;
                 _batch++;
@@ -628,23 +1293,20 @@ uxenvm_savevm_write_pages(struct filebuf *f, char **err_msg)
                 SAVE_DPRINTF("page batch %08x:%08x = %03x pages,"
                              " rezero %03x, clone %03x, zero %03x",
                              pfn, pfn + batch, _batch, rezero, clone, _zero);
-                if (vm_save_info.compress_mode == VM_SAVE_COMPRESS_LZ4)
-                    _batch += vm_save_info.single_page ?
-                        2 * MAX_BATCH_SIZE : MAX_BATCH_SIZE;
-                filebuf_write(f, &_batch, sizeof(_batch));
-                if (vm_save_info.compress_mode == VM_SAVE_COMPRESS_LZ4)
-                    _batch -= vm_save_info.single_page ?
-                        2 * MAX_BATCH_SIZE : MAX_BATCH_SIZE;
-                filebuf_write(f, pfn_batch, _batch * sizeof(pfn_batch[0]));
-                if (vm_save_info.compress_mode == VM_SAVE_COMPRESS_LZ4 &&
-                    vm_save_info.single_page) {
-                    compress_size = 0;
-                    mem_pos = filebuf_tell(f) + sizeof(compress_size);
+                if (vm_save_info.compress_mode == VM_SAVE_COMPRESS_LZ4) {
+                    /* the batch header is written along with the
+                     * compressed data, once the batch is compressed */
+                    cbc = compress_get_buf(&cc);
+                    cbc->batch = _batch;
+                    memcpy(cbc->pfn_batch, pfn_batch,
+                           _batch * sizeof(pfn_batch[0]));
+                } else {
+                    filebuf_write(f, &_batch, sizeof(_batch));
+                    filebuf_write(f, pfn_batch, _batch * sizeof(pfn_batch[0]));
                 }
             }
             j = 0;
             m_run = 0;
-            v_run = 0;
             while (j != batch) {
                 while (j != batch &&
                        gpfn_info_list[j].type != XENMEM_MCGI_TYPE_NORMAL)
@@ -659,7 +1321,14 @@ uxenvm_savevm_write_pages(struct filebuf *f, char **err_msg)
                         "     write %08x:%08x = %03x pages",
                         pfn + run, pfn + j, b_run);
                     if (vm_save_info.fingerprint) {
+                        const uint8_t *pages[MAX_BATCH_SIZE];
+                        uint64_t fps[MAX_BATCH_SIZE];
+                        uint16_t rotates[MAX_BATCH_SIZE];
                         int i;
+                        for (i = 0; i < b_run; i++)
+                            pages[i] =
+                                &mem_buffer[gpfn_info_list[run + i].offset];
+                        page_fingerprint_many(pages, b_run, fps, rotates);
                         for (i = 0; i < b_run; i++) {
                             if (!((hashes_nr - 1) & hashes_nr)) {
                                 hashes = realloc(
@@ -674,10 +1343,8 @@ uxenvm_savevm_write_pages(struct filebuf *f, char **err_msg)
                                 }
                             }
                             hashes[hashes_nr].pfn = pfn + run + i;
-                            hashes[hashes_nr].hash =
-                                page_fingerprint(
-                                    &mem_buffer[gpfn_info_list[run + i].offset],
-                                    &hashes[hashes_nr].rotate);
+                            hashes[hashes_nr].hash = fps[i];
+                            hashes[hashes_nr].rotate = rotates[i];
                             hashes_nr++;
                         }
                     }
@@ -690,53 +1357,18 @@ uxenvm_savevm_write_pages(struct filebuf *f, char **err_msg)
                             poi.pfn_off[poi_pfn_index(&poi, pfn + run + i)] =
                                 pos + (i << PAGE_SHIFT);
                         }
+                        poi_dir_add(&poi, &pfn_batch[m_run], b_run, pos,
+                                    b_run << PAGE_SHIFT, PAGE_EXTENT_RAW);
+                        m_run += b_run;
                         filebuf_write(
                             f, &mem_buffer[gpfn_info_list[run].offset],
                             b_run << PAGE_SHIFT);
                     } else if (vm_save_info.compress_mode ==
                                VM_SAVE_COMPRESS_LZ4) {
-                        if (vm_save_info.single_page) {
-                            int i, cs1;
-                            for (i = 0; i < b_run; i++) {
-                                cs1 = uxenvm_compress_lz4(
-                                    (const char *)&mem_buffer[
-                                        gpfn_info_list[run + i].offset],
-                                    &compress_buf[compress_size +
-                                                  sizeof(cs16_t)],
-                                    PAGE_SIZE);
-                                if (cs1 >= PAGE_SIZE) {
-                                    memcpy(&compress_buf[compress_size +
-                                                         sizeof(cs16_t)],
-                                           &mem_buffer[
-                                               gpfn_info_list[run + i].offset],
-                                           PAGE_SIZE);
-                                    cs1 = PAGE_SIZE;
-                                    v_run++;
-                                } else
-                                    m_run++;
-                                /* if the page is not compressed, then
-                                 * record the offset of the page data,
-                                 * otherwise record the offset of the
-                                 * size field and set the
-                                 * PAGE_OFFSET_INDEX_PFN_OFF_COMPRESSED
-                                 * indicator */
-                                if (poi_valid_pfn(&poi, pfn + run + i))
-                                    poi.pfn_off[
-                                        poi_pfn_index(&poi,
-                                                      pfn + run + i)] =
-                                        (mem_pos + compress_size) +
-                                        (cs1 == PAGE_SIZE ? sizeof(cs16_t) :
-                                         PAGE_OFFSET_INDEX_PFN_OFF_COMPRESSED);
-                                *(cs16_t *)&compress_buf[compress_size] = cs1;
-                                compress_size += sizeof(cs16_t) + cs1;
-                            }
-                        } else if (vm_save_info.compress_mode ==
-                                   VM_SAVE_COMPRESS_LZ4) {
-                            memcpy(&compress_mem[m_run << PAGE_SHIFT],
-                                   &mem_buffer[gpfn_info_list[run].offset],
-                                   b_run << PAGE_SHIFT);
-                            m_run += b_run;
-                        }
+                        memcpy(&cbc->mem[m_run << PAGE_SHIFT],
+                               &mem_buffer[gpfn_info_list[run].offset],
+                               b_run << PAGE_SHIFT);
+                        m_run += b_run;
                     }
                     run += b_run;
                     _batch -= b_run;
@@ -747,39 +1379,31 @@ uxenvm_savevm_write_pages(struct filebuf *f, char **err_msg)
             if (_batch)
                 debug_printf("%d stray pages\n", _batch);
             if (vm_save_info.compress_mode == VM_SAVE_COMPRESS_LZ4) {
-                if (!vm_save_info.single_page) {
-                    compress_size = uxenvm_compress_lz4(
-                        compress_mem, compress_buf, m_run << PAGE_SHIFT);
-                    if (compress_size >= m_run << PAGE_SHIFT) {
-                        SAVE_DPRINTF("compressed size larger for pages "
-                                     "%08x:%08x by %d", pfn, pfn + m_run,
-                                     compress_size - (m_run << PAGE_SHIFT));
-                        compress_size = -1;
-                    }
-                    filebuf_write(f, &compress_size, sizeof(compress_size));
-                    if (compress_size != -1) {
-                        filebuf_write(f, compress_buf, compress_size);
-                        total_compressed_pages += m_run;
-                        total_compress_save +=
-                            (m_run << PAGE_SHIFT) - compress_size;
-                    } else {
-                        filebuf_write(f, compress_mem,
-                                      m_run << PAGE_SHIFT);
-                        total_compress_in_vain += m_run;
-                    }
-                } else {
-                    filebuf_write(f, &compress_size, sizeof(compress_size));
-                    filebuf_write(f, compress_buf, compress_size);
-                    total_compressed_pages += m_run;
-                    total_compress_save +=
-                        ((m_run + v_run) << PAGE_SHIFT) - compress_size;
-                    total_compress_in_vain += v_run;
+                ret = compress_submit(&cc, cbc);
+                cbc = NULL;
+                if (ret) {
+                    asprintf(err_msg, "async_op_add failed");
+                    goto out;
                 }
             }
 	}
 	pfn += batch;
     }
 
+    /* flush the batches still being compressed */
+    compress_wait_all(&cc);
+
+    if (si.inherit_map && !check_aborted()) {
+        /* the page directory is the only reference to inherited pages */
+        if (!poi.pfn_dir) {
+            asprintf(err_msg, "incremental save without page directory");
+            ret = -ENOMEM;
+            goto out;
+        }
+        parent_files_index.offset = filebuf_tell(f);
+        save_incr_write_parents(f, &si);
+    }
+
     if (!check_aborted()) {
 
 #ifdef SAVE_CUCKOO_ENABLED
@@ -857,6 +1481,48 @@ uxenvm_savevm_write_pages(struct filebuf *f, char **err_msg)
             filebuf_write(f, hashes,
                           s_vm_fingerprints.size - sizeof(s_vm_fingerprints));
         }
+
+        if (poi.pfn_dir) {
+            /* the id by which incremental saves know this file */
+            s_save_id.marker = XC_SAVE_ID_SAVE_ID;
+            s_save_id.size = sizeof(s_save_id);
+            uuid_generate_truly_random(s_save_id.id);
+            save_id_index.offset = filebuf_tell(f);
+            filebuf_write(f, &s_save_id, sizeof(s_save_id));
+
+            s_page_directory.marker = XC_SAVE_ID_PAGE_DIRECTORY;
+            s_page_directory.pfn_nr = poi_pfn_index(&poi, poi.max_gpfn);
+            s_page_directory.extents_nr = poi.extents_nr;
+            s_page_directory.size = sizeof(s_page_directory) +
+                s_page_directory.extents_nr * sizeof(poi.extents[0]) +
+                s_page_directory.pfn_nr * sizeof(poi.pfn_dir[0]);
+            page_directory_index.offset = filebuf_tell(f);
+            APRINTF("page directory: pos %"PRId64" size %d extents %d",
+                    page_directory_index.offset, s_page_directory.size,
+                    s_page_directory.extents_nr);
+            filebuf_write(f, &s_page_directory, sizeof(s_page_directory));
+            filebuf_write(f, poi.extents, s_page_directory.extents_nr *
+                          sizeof(poi.extents[0]));
+            filebuf_write(f, poi.pfn_dir, s_page_directory.pfn_nr *
+                          sizeof(poi.pfn_dir[0]));
+        }
+
+        vm_prefetch_get_order(&access_order, &access_order_nr,
+                              &access_order_rest, &access_order_rest_nr);
+        if (access_order_nr + access_order_rest_nr) {
+            s_access_order.marker = XC_SAVE_ID_ACCESS_ORDER;
+            s_access_order.pfn_nr = access_order_nr + access_order_rest_nr;
+            s_access_order.size = sizeof(s_access_order) +
+                s_access_order.pfn_nr * sizeof(s_access_order.pfn[0]);
+            APRINTF("access order: pos %"PRId64" nr pfns %d",
+                    (uint64_t)filebuf_tell(f), s_access_order.pfn_nr);
+            filebuf_write(f, &s_access_order, sizeof(s_access_order));
+            filebuf_write(f, (void *)access_order,
+                          access_order_nr * sizeof(s_access_order.pfn[0]));
+            filebuf_write(f, (void *)access_order_rest,
+                          access_order_rest_nr *
+                          sizeof(s_access_order.pfn[0]));
+        }
     }
 
     if (!check_aborted()) {
@@ -868,17 +1534,25 @@ uxenvm_savevm_write_pages(struct filebuf *f, char **err_msg)
         filebuf_write(f, &page_offsets_index, sizeof(page_offsets_index));
         if (vm_save_info.fingerprint)
             filebuf_write(f, &fingerprints_index, sizeof(fingerprints_index));
-
-        APRINTF("memory: pages %d zero %d rezero %d clone %d trivial %d",
-                total_pages, total_zero - total_rezero, total_rezero,
-                total_clone, trivial_nr);
+        if (parent_files_index.offset)
+            filebuf_write(f, &parent_files_index, sizeof(parent_files_index));
+        if (save_id_index.offset)
+            filebuf_write(f, &save_id_index, sizeof(save_id_index));
+        /* footer: the page directory index is always the last entry */
+        if (page_directory_index.offset)
+            filebuf_write(f, &page_directory_index,
+                          sizeof(page_directory_index));
+
+        APRINTF("memory: pages %d zero %d rezero %d clone %d trivial %d"
+                " inherited %d", total_pages, total_zero - total_rezero,
+                total_rezero, total_clone, trivial_nr, total_inherited);
         if (vm_save_info.compress_mode == VM_SAVE_COMPRESS_LZ4 && total_pages) {
             int pct;
-            pct = 10000 * (total_compress_save >> PAGE_SHIFT) / total_pages;
+            pct = 10000 * (cc.total_compress_save >> PAGE_SHIFT) / total_pages;
             APRINTF("        compressed %d in-vain %d -- saved %"PRIdSIZE
                     " bytes (%d.%02d%%)",
-                    total_compressed_pages, total_compress_in_vain,
-                    total_compress_save, pct / 100, pct % 100);
+                    cc.total_compressed_pages, cc.total_compress_in_vain,
+                    cc.total_compress_save, pct / 100, pct % 100);
         }
     } else
         APRINTF("%s: save aborted%s", __FUNCTION__,
@@ -886,18 +1560,20 @@ uxenvm_savevm_write_pages(struct filebuf *f, char **err_msg)
 
     ret = 0;
   out:
+    compress_free(&cc);
     if (mem_buffer)
         xc_hypercall_buffer_free_pages(xc_handle, mem_buffer,
                                        MEM_BUFFER_SIZE >> PAGE_SHIFT);
     free(zero_bitmap);
     free(zero_bitmap_compressed);
     free(poi.pfn_off);
+    poi_dir_free(&poi);
+    save_incr_close(&si);
+    free(expand_buffer);
     free(rezero_pfns);
     free(hashes);
     free(pfn_batch);
     free(gpfn_info_list);
-    free(compress_mem);
-    free(compress_buf);
     free(hvm_buf);
     return ret;
 }
@@ -1018,6 +1694,7 @@ struct decompress_buf_ctx {
 struct decompress_ctx {
     struct async_op_ctx *async_op_ctx;
     LIST_HEAD(, decompress_buf_ctx) list;
+    int nr_bufs;
     ioh_event process_event;
     int ret;
     xc_interface *xc_handle;
@@ -1039,6 +1716,9 @@ decompress_cb(void *opaque)
             dbc->dc->err_msg);
         if (ret)
             goto out;
+        save_base_record_batch(
+            dbc->pfn_type, HYPERCALL_BUFFER_ARGUMENT_BUFFER(&dbc->pp_buffer),
+            dbc->batch);
     } else
         memcpy(HYPERCALL_BUFFER_ARGUMENT_BUFFER(&dbc->pp_buffer),
                dbc->compress_buf, dbc->compress_size);
@@ -1076,7 +1756,7 @@ decompress_wait_all(struct decompress_ctx *dc, char **err_msg)
     APRINTF("waiting for decompress threads");
     assert(dc->async_op_ctx);
     assert(dc->xc_handle);
-    for (i = 0; i < DECOMPRESS_THREADS; i++) {
+    for (i = 0; i < dc->nr_bufs; i++) {
         ioh_event_reset(&dc->process_event);
         async_op_process(dc->async_op_ctx);
         dbc = LIST_FIRST(&dc->list);
@@ -1168,6 +1848,7 @@ uxenvm_load_readbatch(struct filebuf *f, int batch, xen_pfn_t *pfn_type,
         LOAD_DPRINTF("      read %08"PRIx64":%08"PRIx64" = %03x pages",
                      pfn_type[0], pfn_type[batch - 1] + 1, batch);
         uxenvm_load_read(f, mem, batch << PAGE_SHIFT, ret, err_msg, out);
+        save_base_record_batch(pfn_type, mem, batch);
     } else {
 #ifdef DECOMPRESS_THREADED
         struct decompress_buf_ctx *dbc;
@@ -1222,6 +1903,9 @@ uxenvm_load_readbatch(struct filebuf *f, int batch, xen_pfn_t *pfn_type,
                 compress_buf, compress_size, single_page, err_msg);
             if (ret)
                 goto out;
+            save_base_record_batch(
+                pfn_type, HYPERCALL_BUFFER_ARGUMENT_BUFFER(&dc->pp_buffer),
+                batch);
         } else
             memcpy(HYPERCALL_BUFFER_ARGUMENT_BUFFER(&dc->pp_buffer),
                    compress_buf, compress_size);
@@ -1249,6 +1933,8 @@ uxenvm_load_readbatch(struct filebuf *f, int batch, xen_pfn_t *pfn_type,
 }
 
 static uint32_t uxenvm_load_progress = 0;
+/* pages installed compressed, populated on first access */
+static uint32_t uxenvm_load_compressed = 0;
 
 static int
 uxenvm_load_alloc(xen_pfn_t **pfn_type, int **pfn_err, int **pfn_info,
@@ -1281,6 +1967,7 @@ uxenvm_load_alloc(xen_pfn_t **pfn_type, int **pfn_err, int **pfn_info,
     }
 
     uxenvm_load_progress = 0;
+    uxenvm_load_compressed = 0;
 
   out:
     return ret;
@@ -1319,7 +2006,11 @@ uxenvm_load_batch(struct filebuf *f, int32_t marker, xen_pfn_t *pfn_type,
             dc->ret = 0;
             dc->async_op_ctx = async_op_init();
             LIST_INIT(&dc->list);
-            for (i = 0; i < DECOMPRESS_THREADS; i++) {
+            /* one buffer per decompress thread */
+            dc->nr_bufs = restore_decompress_threads ? : host_cpus();
+            if (dc->nr_bufs > DECOMPRESS_MAX_THREADS)
+                dc->nr_bufs = DECOMPRESS_MAX_THREADS;
+            for (i = 0; i < dc->nr_bufs; i++) {
                 dbc = calloc(1, sizeof(struct decompress_buf_ctx));
                 if (!dbc) {
                     asprintf(err_msg, "calloc dbc failed");
@@ -1372,6 +2063,8 @@ uxenvm_load_batch(struct filebuf *f, int32_t marker, xen_pfn_t *pfn_type,
     if ((uxenvm_load_progress * 10 / (vm_mem_mb << 8UL)) !=
         ((uxenvm_load_progress - marker) * 10 / (vm_mem_mb << 8UL)))
         APRINTF("memory load %d pages", uxenvm_load_progress);
+    if (single_page && populate_compressed)
+        uxenvm_load_compressed += marker;
     ret = uxenvm_load_readbatch(f, marker, pfn_type, pfn_info, pfn_err,
                                 decompress, dc, single_page,
                                 populate_compressed, err_msg);
@@ -1425,39 +2118,640 @@ apply_immutable_memory(struct immutable_range *r, int nranges)
 	(s).marker = (_marker);						\
     } while (0)
 
-#ifdef SAVE_CUCKOO_ENABLED
+/* walk the indexes at the end of the save file, back to the end marker,
+ * for the offset of the section with the given marker */
 static int
-map_template_fingerprints(struct filebuf *t,
-                          struct page_fingerprint **tfps,
-                          int *n, char **err_msg)
+uxenvm_find_index(struct filebuf *f, int32_t marker, uint64_t *offset,
+                  char **err_msg)
 {
-    uint64_t fingerprints_pos = 0;
-    struct xc_save_vm_fingerprints s_vm_fingerprints = { };
-    int32_t marker = 0;
-    size_t sz;
+    struct xc_save_index index;
     off_t pos;
     int ret = 0;
 
-    filebuf_seek(t, 0, FILEBUF_SEEK_END);
+    *offset = 0;
+    filebuf_seek(f, 0, FILEBUF_SEEK_END);
     for (;;) {
-        struct xc_save_index index;
-
-        pos = filebuf_seek(t, -(off_t)sizeof(index), FILEBUF_SEEK_CUR);
-        uxenvm_load_read(t, &index, sizeof(index), ret, err_msg, out);
+        pos = filebuf_seek(f, -(off_t)sizeof(index), FILEBUF_SEEK_CUR);
+        uxenvm_load_read(f, &index, sizeof(index), ret, err_msg, out);
         if (!index.marker) {
             break;
-        } else if (index.marker == XC_SAVE_ID_FINGERPRINTS) {
-            fingerprints_pos = index.offset;
+        } else if (index.marker == marker) {
+            *offset = index.offset;
             break;
         }
-        filebuf_seek(t, pos, FILEBUF_SEEK_SET);
+        filebuf_seek(f, pos, FILEBUF_SEEK_SET);
     }
+    ret = 0;
+  out:
+    return ret;
+}
 
-    if (!fingerprints_pos) {
-        asprintf(err_msg, "no fingerprints section found in template file");
-        ret = -ENOENT;
-        goto out;
-    }
+static int
+uxenvm_load_access_order(struct filebuf *f, uint32_t **order,
+                         uint32_t *order_nr, char **err_msg)
+{
+    struct xc_save_access_order s_access_order;
+    int32_t marker = XC_SAVE_ID_ACCESS_ORDER;
+    int ret;
+
+    uxenvm_load_read_struct(f, s_access_order, marker, ret, err_msg, out);
+    if (s_access_order.size != sizeof(s_access_order) +
+        (uint64_t)s_access_order.pfn_nr * sizeof(s_access_order.pfn[0])) {
+        asprintf(err_msg, "invalid access order size %d",
+                 s_access_order.size);
+        ret = -EINVAL;
+        goto out;
+    }
+
+    free(*order);
+    *order_nr = 0;
+    *order = malloc(s_access_order.pfn_nr * sizeof(**order));
+    if (!*order && s_access_order.pfn_nr) {
+        asprintf(err_msg, "access order = malloc(%"PRIdSIZE") failed",
+                 s_access_order.pfn_nr * sizeof(**order));
+        ret = -ENOMEM;
+        goto out;
+    }
+    uxenvm_load_read(f, *order, s_access_order.pfn_nr * sizeof(**order),
+                     ret, err_msg, out);
+    *order_nr = s_access_order.pfn_nr;
+    APRINTF("access order: %d pfns", *order_nr);
+
+    ret = 0;
+  out:
+    return ret;
+}
+
+static int
+uxenvm_load_parent_files(struct filebuf *f, struct save_parent **parents,
+                         uint32_t *parents_nr, char **err_msg)
+{
+    struct xc_save_parent_files s_parent_files = { };
+    struct xc_save_parent_file s_parent_file;
+    struct save_parent *p = NULL;
+    int32_t marker = XC_SAVE_ID_PARENT_FILES;
+    uint64_t left;
+    uint32_t i;
+    int ret;
+
+    *parents = NULL;
+    *parents_nr = 0;
+
+    uxenvm_load_read_struct(f, s_parent_files, marker, ret, err_msg, out);
+    if (!s_parent_files.files_nr ||
+        s_parent_files.files_nr > PAGE_EXTENT_ANCESTOR_MAX) {
+        asprintf(err_msg, "invalid number of parent files %d",
+                 s_parent_files.files_nr);
+        ret = -EINVAL;
+        goto out;
+    }
+    if (s_parent_files.size < sizeof(s_parent_files)) {
+        asprintf(err_msg, "invalid parent files size %d",
+                 s_parent_files.size);
+        ret = -EINVAL;
+        goto out;
+    }
+    left = s_parent_files.size - sizeof(s_parent_files);
+
+    p = calloc(s_parent_files.files_nr, sizeof(*p));
+    if (!p) {
+        asprintf(err_msg, "parents = calloc(%d) failed",
+                 s_parent_files.files_nr);
+        ret = -ENOMEM;
+        goto out;
+    }
+    for (i = 0; i < s_parent_files.files_nr; i++) {
+        if (left < sizeof(s_parent_file)) {
+            asprintf(err_msg, "parent files section truncated");
+            ret = -EINVAL;
+            goto out;
+        }
+        uxenvm_load_read(f, &s_parent_file, sizeof(s_parent_file),
+                         ret, err_msg, out);
+        left -= sizeof(s_parent_file);
+        if (left < s_parent_file.size) {
+            asprintf(err_msg, "parent files section truncated");
+            ret = -EINVAL;
+            goto out;
+        }
+        left -= s_parent_file.size;
+        p[i].page_directory_offset = s_parent_file.page_directory_offset;
+        memcpy(p[i].save_id, s_parent_file.save_id, sizeof(p[i].save_id));
+        p[i].file = calloc(1, s_parent_file.size + 1);
+        if (!p[i].file) {
+            asprintf(err_msg, "parent file = calloc(%d) failed",
+                     s_parent_file.size + 1);
+            ret = -ENOMEM;
+            goto out;
+        }
+        uxenvm_load_read(f, p[i].file, s_parent_file.size, ret, err_msg, out);
+        APRINTF("parent file %d: %s", i + 1, p[i].file);
+    }
+
+    *parents = p;
+    *parents_nr = s_parent_files.files_nr;
+    p = NULL;
+    ret = 0;
+  out:
+    if (p)
+        save_parents_free(p, s_parent_files.files_nr);
+    return ret;
+}
+
+/* the parent files of the save file, none if it is not incremental */
+static int
+uxenvm_find_parent_files(struct filebuf *f, struct save_parent **parents,
+                         uint32_t *parents_nr, char **err_msg)
+{
+    uint64_t pos;
+    int32_t marker;
+    int ret;
+
+    *parents = NULL;
+    *parents_nr = 0;
+
+    ret = uxenvm_find_index(f, XC_SAVE_ID_PARENT_FILES, &pos, err_msg);
+    if (ret || !pos)
+        goto out;
+
+    filebuf_seek(f, pos, FILEBUF_SEEK_SET);
+    uxenvm_load_read(f, &marker, sizeof(marker), ret, err_msg, out);
+    if (marker != XC_SAVE_ID_PARENT_FILES) {
+        asprintf(err_msg, "no parent files section at offset %"PRId64, pos);
+        ret = -EINVAL;
+        goto out;
+    }
+    ret = uxenvm_load_parent_files(f, parents, parents_nr, err_msg);
+  out:
+    return ret;
+}
+
+/* the save id of a save file with a page directory */
+static int
+uxenvm_find_save_id(struct filebuf *f, uint8_t *id, char **err_msg)
+{
+    struct xc_save_save_id s_save_id;
+    uint64_t pos;
+    int ret;
+
+    ret = uxenvm_find_index(f, XC_SAVE_ID_SAVE_ID, &pos, err_msg);
+    if (ret)
+        goto out;
+    if (!pos) {
+        asprintf(err_msg, "no save id");
+        ret = -ENOENT;
+        goto out;
+    }
+
+    filebuf_seek(f, pos, FILEBUF_SEEK_SET);
+    uxenvm_load_read(f, &s_save_id, sizeof(s_save_id), ret, err_msg, out);
+    if (s_save_id.marker != XC_SAVE_ID_SAVE_ID ||
+        s_save_id.size != sizeof(s_save_id)) {
+        asprintf(err_msg, "invalid save id at offset %"PRId64, pos);
+        ret = -EINVAL;
+        goto out;
+    }
+    memcpy(id, s_save_id.id, sizeof(s_save_id.id));
+    ret = 0;
+  out:
+    return ret;
+}
+
+/* populate the pages an incremental save references in its ancestors,
+ * following the parent files section -- the page directory of the save
+ * file gives the pages and the extents of the ancestors holding them */
+static int
+uxenvm_load_inherited(struct filebuf *f, xen_pfn_t *pfn_type,
+                      char **err_msg)
+{
+    DECLARE_HYPERCALL_BUFFER(uint8_t, pp_buffer);
+    struct xc_save_page_directory s_page_directory;
+    struct xc_save_page_extent *extents = NULL, *e;
+    struct save_parent *parents = NULL;
+    uint32_t parents_nr = 0;
+    struct filebuf **pf = NULL;
+    uint32_t *pfn_entry = NULL;
+    uint32_t *ext_start = NULL, *ext_pfns = NULL;
+    uint8_t *data = NULL, *pages = NULL;
+    const uint8_t *src;
+    uint64_t dir_pos, parent_dir_pos;
+    uint8_t parent_save_id[16];
+    off_t resume_pos;
+    uint32_t i, x, a, n, page, total = 0;
+    int ret;
+
+    ret = uxenvm_load_parent_files(f, &parents, &parents_nr, err_msg);
+    if (ret)
+        goto out;
+    resume_pos = filebuf_tell(f);
+
+    ret = uxenvm_find_index(f, XC_SAVE_ID_PAGE_DIRECTORY, &dir_pos, err_msg);
+    if (ret)
+        goto out;
+    if (!dir_pos) {
+        asprintf(err_msg, "no page directory in incremental save file");
+        ret = -EINVAL;
+        goto out;
+    }
+    filebuf_seek(f, dir_pos, FILEBUF_SEEK_SET);
+    uxenvm_load_read(f, &s_page_directory, sizeof(s_page_directory),
+                     ret, err_msg, out);
+    if (s_page_directory.marker != XC_SAVE_ID_PAGE_DIRECTORY ||
+        s_page_directory.size != sizeof(s_page_directory) +
+        (uint64_t)s_page_directory.extents_nr * sizeof(extents[0]) +
+        (uint64_t)s_page_directory.pfn_nr * sizeof(pfn_entry[0])) {
+        asprintf(err_msg, "invalid page directory at offset %"PRId64,
+                 dir_pos);
+        ret = -EINVAL;
+        goto out;
+    }
+    extents = malloc(s_page_directory.extents_nr * sizeof(extents[0]));
+    pfn_entry = malloc(s_page_directory.pfn_nr * sizeof(pfn_entry[0]));
+    ext_start = calloc(s_page_directory.extents_nr + 1, sizeof(ext_start[0]));
+    ext_pfns = malloc(s_page_directory.pfn_nr * sizeof(ext_pfns[0]));
+    data = malloc(MAX_BATCH_SIZE << PAGE_SHIFT);
+    pages = malloc(MAX_BATCH_SIZE << PAGE_SHIFT);
+    pf = calloc(parents_nr + 1, sizeof(pf[0]));
+    pp_buffer = xc_hypercall_buffer_alloc_pages(xc_handle, pp_buffer,
+                                                MAX_BATCH_SIZE);
+    if ((!extents && s_page_directory.extents_nr) ||
+        (!pfn_entry && s_page_directory.pfn_nr) || !ext_start ||
+        (!ext_pfns && s_page_directory.pfn_nr) || !data || !pages || !pf ||
+        !pp_buffer) {
+        asprintf(err_msg, "page directory allocation failed");
+        ret = -ENOMEM;
+        goto out;
+    }
+    uxenvm_load_read(f, extents,
+                     s_page_directory.extents_nr * sizeof(extents[0]),
+                     ret, err_msg, out);
+    uxenvm_load_read(f, pfn_entry,
+                     s_page_directory.pfn_nr * sizeof(pfn_entry[0]),
+                     ret, err_msg, out);
+
+    for (a = 1; a <= parents_nr; a++) {
+        pf[a] = filebuf_open(parents[a - 1].file, "rb");
+        if (!pf[a]) {
+            asprintf(err_msg, "filebuf_open(parent file %s) failed",
+                     parents[a - 1].file);
+            ret = -errno;
+            goto out;
+        }
+        ret = uxenvm_find_index(pf[a], XC_SAVE_ID_PAGE_DIRECTORY,
+                                &parent_dir_pos, err_msg);
+        if (ret)
+            goto out;
+        ret = uxenvm_find_save_id(pf[a], parent_save_id, err_msg);
+        if (ret)
+            goto out;
+        if (parent_dir_pos != parents[a - 1].page_directory_offset ||
+            memcmp(parent_save_id, parents[a - 1].save_id,
+                   sizeof(parent_save_id))) {
+            asprintf(err_msg, "parent file %s changed", parents[a - 1].file);
+            ret = -ESTALE;
+            goto out;
+        }
+    }
+
+    /* the pfns of each inherited extent -- count them, then fill them in
+     * with ext_start[x] advancing to the start of extent x + 1 */
+    for (i = 0; i < s_page_directory.pfn_nr; i++) {
+        if (pfn_entry[i] == PAGE_DIRECTORY_NONE)
+            continue;
+        x = page_directory_extent(pfn_entry[i]);
+        if (x >= s_page_directory.extents_nr) {
+            asprintf(err_msg, "invalid page directory entry %x for pfn %"PRIx64,
+                     pfn_entry[i], (uint64_t)unskip_pci_hole(i));
+            ret = -EINVAL;
+            goto out;
+        }
+        if (page_extent_ancestor(extents[x].flags))
+            ext_start[x + 1]++;
+    }
+    for (x = 0; x < s_page_directory.extents_nr; x++)
+        ext_start[x + 1] += ext_start[x];
+    for (i = 0; i < s_page_directory.pfn_nr; i++) {
+        if (pfn_entry[i] == PAGE_DIRECTORY_NONE)
+            continue;
+        x = page_directory_extent(pfn_entry[i]);
+        if (page_extent_ancestor(extents[x].flags))
+            ext_pfns[ext_start[x]++] = i;
+    }
+
+    /* the extents are read by seeking around the parent files, hint the
+     * ranges up front so that the reads don't stall one by one */
+    for (x = 0, i = 0; x < s_page_directory.extents_nr; i = ext_start[x++]) {
+        if (i == ext_start[x])
+            continue;
+        a = page_extent_ancestor(extents[x].flags);
+        if (a <= parents_nr)
+            filebuf_prefetch(pf[a], extents[x].offset, extents[x].size);
+    }
+
+    for (x = 0, i = 0; x < s_page_directory.extents_nr; i = ext_start[x++]) {
+        if (i == ext_start[x])
+            continue;
+        e = &extents[x];
+        a = page_extent_ancestor(e->flags);
+        if (a > parents_nr || !e->nr_pages || e->nr_pages > MAX_BATCH_SIZE ||
+            e->size > e->nr_pages << PAGE_SHIFT ||
+            ((e->flags & PAGE_EXTENT_RAW) &&
+             e->size != e->nr_pages << PAGE_SHIFT)) {
+            asprintf(err_msg, "invalid extent %d", x);
+            ret = -EINVAL;
+            goto out;
+        }
+
+        if (filebuf_seek(pf[a], e->offset, FILEBUF_SEEK_SET) == -1) {
+            asprintf(err_msg, "filebuf_seek(parent file %s) failed",
+                     parents[a - 1].file);
+            ret = -EIO;
+            goto out;
+        }
+        uxenvm_load_read(pf[a], data, e->size, ret, err_msg, out);
+        if (e->flags & PAGE_EXTENT_RAW)
+            src = data;
+        else {
+            ret = LZ4_decompress_safe((const char *)data, (char *)pages,
+                                      e->size, e->nr_pages << PAGE_SHIFT);
+            if (ret != e->nr_pages << PAGE_SHIFT) {
+                asprintf(err_msg, "decompression of extent %d of parent"
+                         " file %s failed", x, parents[a - 1].file);
+                ret = -EINVAL;
+                goto out;
+            }
+            src = pages;
+        }
+
+        for (n = 0; i < ext_start[x]; i++, n++) {
+            page = page_directory_page(pfn_entry[ext_pfns[i]]);
+            if (page >= e->nr_pages) {
+                asprintf(err_msg, "invalid page %d of extent %d", page, x);
+                ret = -EINVAL;
+                goto out;
+            }
+            pfn_type[n] = unskip_pci_hole(ext_pfns[i]);
+            memcpy(&pp_buffer[n << PAGE_SHIFT], &src[page << PAGE_SHIFT],
+                   PAGE_SIZE);
+            save_base_record(pfn_type[n], &src[page << PAGE_SHIFT]);
+        }
+        ret = xc_domain_populate_physmap_from_buffer(
+            xc_handle, vm_id, n, 0, XENMEMF_populate_from_buffer, pfn_type,
+            HYPERCALL_BUFFER(pp_buffer));
+        if (ret) {
+            asprintf(err_msg, "xc_domain_populate_physmap_from_buffer failed");
+            goto out;
+        }
+        total += n;
+    }
+    APRINTF("inherited pages: %d from %d parent files", total, parents_nr);
+
+    if (filebuf_seek(f, resume_pos, FILEBUF_SEEK_SET) == -1) {
+        asprintf(err_msg, "filebuf_seek(parent files) failed");
+        ret = -EIO;
+        goto out;
+    }
+    ret = 0;
+  out:
+    if (pp_buffer)
+        xc_hypercall_buffer_free_pages(xc_handle, pp_buffer, MAX_BATCH_SIZE);
+    if (pf) {
+        for (a = 1; a <= parents_nr; a++)
+            if (pf[a])
+                filebuf_close(pf[a]);
+        free(pf);
+    }
+    save_parents_free(parents, parents_nr);
+    free(pages);
+    free(data);
+    free(ext_pfns);
+    free(ext_start);
+    free(pfn_entry);
+    free(extents);
+    return ret;
+}
+
+int
+page_directory_open(struct page_directory *pd, struct filebuf *f,
+                    char **err_msg)
+{
+    struct xc_save_page_directory s_page_directory;
+    uint64_t dir_pos;
+    off_t file_size;
+    uint8_t *base;
+    int ret;
+
+    memset(pd, 0, sizeof(*pd));
+
+    ret = uxenvm_find_index(f, XC_SAVE_ID_PAGE_DIRECTORY, &dir_pos, err_msg);
+    if (ret)
+        goto out;
+    if (!dir_pos) {
+        asprintf(err_msg, "no page directory in save file");
+        ret = -ENOENT;
+        goto out;
+    }
+
+    file_size = filebuf_seek(f, 0, FILEBUF_SEEK_END);
+    if (file_size < 0 ||
+        dir_pos + sizeof(s_page_directory) > (uint64_t)file_size) {
+        asprintf(err_msg, "page directory at %"PRId64" past end of file",
+                 dir_pos);
+        ret = -EINVAL;
+        goto out;
+    }
+
+    /* map the whole file, page data is read from the mapping */
+    base = filebuf_mmap(f, 0, file_size);
+    memcpy(&s_page_directory, base + dir_pos, sizeof(s_page_directory));
+    if (s_page_directory.marker != XC_SAVE_ID_PAGE_DIRECTORY ||
+        s_page_directory.size != sizeof(s_page_directory) +
+        (uint64_t)s_page_directory.extents_nr *
+        sizeof(struct xc_save_page_extent) +
+        (uint64_t)s_page_directory.pfn_nr * sizeof(uint32_t) ||
+        dir_pos + s_page_directory.size > (uint64_t)file_size) {
+        asprintf(err_msg, "invalid page directory at offset %"PRId64,
+                 dir_pos);
+        ret = -EINVAL;
+        goto out;
+    }
+
+    pd->base = base;
+    pd->file_size = file_size;
+    pd->extents_nr = s_page_directory.extents_nr;
+    pd->pfn_nr = s_page_directory.pfn_nr;
+    pd->extents = (const struct xc_save_page_extent *)
+        (base + dir_pos + sizeof(s_page_directory));
+    pd->pfn_entry = (const uint32_t *)&pd->extents[pd->extents_nr];
+    pd->cached_extent = -1;
+    pd->cache = malloc(MAX_BATCH_SIZE << PAGE_SHIFT);
+    if (!pd->cache) {
+        asprintf(err_msg, "malloc page directory cache failed");
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    APRINTF("page directory: %d extents, %d pfns", pd->extents_nr,
+            pd->pfn_nr);
+    ret = 0;
+  out:
+    return ret;
+}
+
+void
+page_directory_close(struct page_directory *pd)
+{
+
+    /* the mapping is owned by the filebuf */
+    free(pd->cache);
+    pd->cache = NULL;
+    pd->base = NULL;
+}
+
+static int
+save_incr_open(struct save_incr *si, char **err_msg)
+{
+    uint32_t x;
+    int ret;
+
+    si->f = filebuf_open(save_base.file, "rb");
+    if (!si->f) {
+        asprintf(err_msg, "filebuf_open(%s) failed", save_base.file);
+        ret = -errno;
+        goto out;
+    }
+    ret = uxenvm_find_parent_files(si->f, &si->parents, &si->parents_nr,
+                                   err_msg);
+    if (ret)
+        goto out;
+    if (si->parents_nr + 1 > PAGE_EXTENT_ANCESTOR_MAX) {
+        asprintf(err_msg, "too many ancestors: %d", si->parents_nr + 1);
+        ret = -E2BIG;
+        goto out;
+    }
+    ret = uxenvm_find_index(si->f, XC_SAVE_ID_PAGE_DIRECTORY,
+                            &si->page_directory_offset, err_msg);
+    if (ret)
+        goto out;
+    /* a base without a save id can't be told apart from its successor */
+    ret = uxenvm_find_save_id(si->f, si->save_id, err_msg);
+    if (ret)
+        goto out;
+    ret = page_directory_open(&si->pd, si->f, err_msg);
+    if (ret)
+        goto out;
+
+    si->inherit_map = malloc(si->pd.extents_nr * sizeof(si->inherit_map[0]));
+    if (!si->inherit_map && si->pd.extents_nr) {
+        asprintf(err_msg, "inherit_map = malloc(%d) failed",
+                 si->pd.extents_nr);
+        ret = -ENOMEM;
+        goto out;
+    }
+    for (x = 0; x < si->pd.extents_nr; x++)
+        si->inherit_map[x] = PAGE_DIRECTORY_NONE;
+
+    APRINTF("incremental save: base %s, %d ancestors", save_base.file,
+            si->parents_nr + 1);
+    ret = 0;
+  out:
+    if (ret)
+        save_incr_close(si);
+    return ret;
+}
+
+static void
+save_incr_close(struct save_incr *si)
+{
+
+    free(si->inherit_map);
+    si->inherit_map = NULL;
+    if (si->pd.cache)
+        page_directory_close(&si->pd);
+    save_parents_free(si->parents, si->parents_nr);
+    si->parents = NULL;
+    si->parents_nr = 0;
+    if (si->f) {
+        filebuf_close(si->f);
+        si->f = NULL;
+    }
+}
+
+/* copy the data of one page from the save file -- returns -ENOENT if the
+ * save file has no data for the pfn, i.e. it is a zero or pod page, and
+ * -EXDEV if the data is in a parent file of an incremental save */
+int
+page_directory_read_page(struct page_directory *pd, uint64_t pfn,
+                         void *dst)
+{
+    const struct xc_save_page_extent *e;
+    uint32_t entry, ext, page;
+    int ret;
+
+    if (pfn >= PCI_HOLE_START_PFN && pfn < PCI_HOLE_END_PFN)
+        return -ENOENT;
+    pfn = skip_pci_hole(pfn);
+    if (pfn >= pd->pfn_nr)
+        return -ENOENT;
+    entry = pd->pfn_entry[pfn];
+    if (entry == PAGE_DIRECTORY_NONE)
+        return -ENOENT;
+    ext = page_directory_extent(entry);
+    page = page_directory_page(entry);
+    if (ext >= pd->extents_nr)
+        return -EINVAL;
+    e = &pd->extents[ext];
+    /* the data of the page is in an ancestor of an incremental save */
+    if (page_extent_ancestor(e->flags))
+        return -EXDEV;
+    if (page >= e->nr_pages || e->offset + e->size > pd->file_size)
+        return -EINVAL;
+
+    if (e->flags & PAGE_EXTENT_RAW) {
+        if (e->size != e->nr_pages << PAGE_SHIFT)
+            return -EINVAL;
+        memcpy(dst, pd->base + e->offset + (page << PAGE_SHIFT), PAGE_SIZE);
+        return 0;
+    }
+
+    /* pages of an extent tend to be faulted in together, so keep the
+     * last decompressed extent */
+    if (pd->cached_extent != ext) {
+        pd->cached_extent = -1;
+        ret = LZ4_decompress_safe((const char *)pd->base + e->offset,
+                                  (char *)pd->cache, e->size,
+                                  e->nr_pages << PAGE_SHIFT);
+        if (ret != e->nr_pages << PAGE_SHIFT)
+            return -EIO;
+        pd->cached_extent = ext;
+    }
+    memcpy(dst, pd->cache + (page << PAGE_SHIFT), PAGE_SIZE);
+
+    return 0;
+}
+
+#ifdef SAVE_CUCKOO_ENABLED
+static int
+map_template_fingerprints(struct filebuf *t,
+                          struct page_fingerprint **tfps,
+                          int *n, char **err_msg)
+{
+    uint64_t fingerprints_pos = 0;
+    struct xc_save_vm_fingerprints s_vm_fingerprints = { };
+    int32_t marker = 0;
+    size_t sz;
+    int ret = 0;
+
+    ret = uxenvm_find_index(t, XC_SAVE_ID_FINGERPRINTS, &fingerprints_pos,
+                            err_msg);
+    if (ret)
+        goto out;
+
+    if (!fingerprints_pos) {
+        asprintf(err_msg, "no fingerprints section found in template file");
+        ret = -ENOENT;
+        goto out;
+    }
 
     filebuf_seek(t, fingerprints_pos, FILEBUF_SEEK_SET);
     uxenvm_load_read(t, &s_vm_fingerprints.marker,
@@ -1649,6 +2943,8 @@ uxenvm_loadvm_execute(struct filebuf *f, int restore_mode, char **err_msg)
     struct xc_save_mapcache_params s_mapcache_params = { };
     struct xc_save_vm_template_file s_vm_template_file = { };
     struct xc_save_vm_page_offsets s_vm_page_offsets = { };
+    struct xc_save_page_directory s_page_directory = { };
+    struct xc_save_save_id s_save_id = { };
     struct xc_save_zero_bitmap s_zero_bitmap = { };
     struct xc_save_vm_fingerprints s_vm_fingerprints = { };
 #ifdef SAVE_CUCKOO_ENABLED
@@ -1661,7 +2957,10 @@ uxenvm_loadvm_execute(struct filebuf *f, int restore_mode, char **err_msg)
     xen_pfn_t *pfn_type = NULL;
     int *pfn_err = NULL, *pfn_info = NULL;
     struct decompress_ctx dc = { 0 };
-    int populate_compressed = (restore_mode == VM_RESTORE_TEMPLATE);
+    int populate_compressed = (restore_mode == VM_RESTORE_TEMPLATE) ||
+        (restore_mode == VM_RESTORE_NORMAL && restore_postcopy);
+    uint32_t *access_order = NULL;
+    uint32_t access_order_nr = 0;
     int32_t marker;
     int mapcache_init_done = 0;
     int ret;
@@ -1682,9 +2981,11 @@ uxenvm_loadvm_execute(struct filebuf *f, int restore_mode, char **err_msg)
         goto out;
     }
     uxenvm_load_read_struct(f, s_version_info, marker, ret, err_msg, out);
-    if (s_version_info.version != SAVE_FORMAT_VERSION) {
-        asprintf(err_msg, "version info mismatch: %d != %d",
-                 s_version_info.version, SAVE_FORMAT_VERSION);
+    if (s_version_info.version < SAVE_FORMAT_VERSION_MIN ||
+        s_version_info.version > SAVE_FORMAT_VERSION) {
+        asprintf(err_msg, "version info mismatch: %d not in %d-%d",
+                 s_version_info.version, SAVE_FORMAT_VERSION_MIN,
+                 SAVE_FORMAT_VERSION);
         ret = -EINVAL;
         goto out;
     }
@@ -1839,6 +3140,41 @@ uxenvm_loadvm_execute(struct filebuf *f, int restore_mode, char **err_msg)
                     sizeof(s_vm_page_offsets.pfn_off[0]),
                     filebuf_tell(f) - s_vm_page_offsets.size);
             break;
+        case XC_SAVE_ID_PAGE_DIRECTORY:
+            uxenvm_load_read_struct(f, s_page_directory, marker, ret,
+                                    err_msg, out);
+            ret = filebuf_seek(f, s_page_directory.size -
+                               sizeof(s_page_directory),
+                               FILEBUF_SEEK_CUR) != -1 ? 0 : -EIO;
+            if (ret < 0) {
+                asprintf(err_msg, "filebuf_seek(page_directory) failed");
+                goto out;
+            }
+            APRINTF("page directory: %d extents, skipped %"PRIdSIZE" bytes",
+                    s_page_directory.extents_nr,
+                    s_page_directory.size - sizeof(s_page_directory));
+            break;
+        case XC_SAVE_ID_SAVE_ID: {
+            char uuid_str[37];
+
+            uxenvm_load_read_struct(f, s_save_id, marker, ret, err_msg, out);
+            uuid_unparse_lower(s_save_id.id, uuid_str);
+            APRINTF("save id: %s", uuid_str);
+            break;
+        }
+        case XC_SAVE_ID_ACCESS_ORDER:
+            ret = uxenvm_load_access_order(f, &access_order,
+                                           &access_order_nr, err_msg);
+            if (ret)
+                goto out;
+            break;
+        case XC_SAVE_ID_PARENT_FILES:
+            uxenvm_check_restore_clone(restore_mode);
+            uxenvm_check_mapcache_init();
+            ret = uxenvm_load_inherited(f, pfn_type, err_msg);
+            if (ret)
+                goto out;
+            break;
         case XC_SAVE_ID_ZERO_BITMAP:
             uxenvm_load_read_struct(f, s_zero_bitmap, marker, ret, err_msg,
                                     out);
@@ -2008,6 +3344,14 @@ uxenvm_loadvm_execute(struct filebuf *f, int restore_mode, char **err_msg)
     if (dc.async_op_ctx)
         (void)decompress_wait_all(&dc, NULL);
 #endif  /* DECOMPRESS_THREADED */
+    /* post-copy restore: populate the pages left compressed in the
+     * background, once they are all installed */
+    if (!ret && restore_mode == VM_RESTORE_NORMAL && uxenvm_load_compressed) {
+        uxenvm_load_compressed = 0;
+        vm_prefetch_start(access_order, access_order_nr);
+        access_order = NULL;
+    }
+    free(access_order);
     free(pfn_err);
     free(pfn_info);
     free(pfn_type);
@@ -2114,6 +3458,8 @@ mc_savevm(Monitor *mon, const dict args)
     vm_save_info.free_mem = dict_get_boolean_default(args, "free-mem", 1);
     vm_save_info.high_compress = dict_get_boolean_default(args,
                                                           "high-compress", 0);
+    vm_save_info.incremental = dict_get_boolean_default(args, "incremental",
+                                                        save_incremental);
 
     vm_save();
 }
@@ -2124,6 +3470,8 @@ mc_resumevm(Monitor *mon, const dict args)
 
     vm_save_info.resume_delete =
         dict_get_boolean_default(args, "delete-savefile", 1);
+    vm_save_info.resume_postcopy =
+        dict_get_boolean_default(args, "post-copy", restore_postcopy);
 
     vm_save_abort();
 }
@@ -2167,6 +3515,21 @@ char *vm_save_file_temp_filename(char *name)
 	asprintf(&err_msg, fmt, ## __VA_ARGS__); \
     } while (0)
 
+static void
+print_io_stats(const char *what, struct filebuf *f)
+{
+    struct filebuf_stats st;
+    uint64_t bytes;
+
+    filebuf_get_stats(f, &st);
+    bytes = st.read + st.written;
+    APRINTF("%s: %"PRIu64" bytes in %"PRIu64" ios, %"PRIu64" read ahead,"
+            " blocked %"PRIu64" of %"PRIu64" ms, %"PRIu64" MB/s", what,
+            bytes, st.ios, st.readahead_hits, st.wait_us / 1000,
+            st.open_us / 1000,
+            st.open_us ? bytes / st.open_us : 0);
+}
+
 void
 vm_save_execute(void)
 {
@@ -2175,6 +3538,7 @@ vm_save_execute(void)
     uint8_t *dm_state_buf = NULL;
     int dm_state_size;
     struct cuckoo_page_fingerprint *hashes = NULL;
+    const char *mode;
     int ret;
 
     if (!vm_save_info.filename)
@@ -2182,11 +3546,18 @@ vm_save_execute(void)
 
     APRINTF("device model saving state: %s", vm_save_info.filename);
 
+    /* the prefetcher's access order is written with the page data, the
+     * prefetcher is resumed with the vm, see vm_resume */
+    vm_prefetch_stop();
+
+    /* cuckoo and whpx write around the buffer, no write behind for
+     * those */
+    mode = (!whpx_enable && !compression_is_cuckoo()) ? "wba" : "wb";
     if (!vm_save_info.save_via_temp)
-        f = filebuf_open(vm_save_info.filename, "wb");
+        f = filebuf_open(vm_save_info.filename, mode);
     else {
         char *temp = vm_save_file_temp_filename(vm_save_info.filename);
-        f = filebuf_open(temp, "wb");
+        f = filebuf_open(temp, mode);
         free(temp);
     }
     if (f == NULL) {
@@ -2247,6 +3618,7 @@ vm_save_execute(void)
     if (ret == 0) {
         APRINTF("total file size: %"PRIu64" bytes", (uint64_t)filebuf_tell(f));
         filebuf_flush(f);
+        print_io_stats("save", f);
         if (vm_save_info.save_via_temp && !check_aborted()) {
             filebuf_delete_on_close(f, 0);
             filebuf_close(f);
@@ -2256,7 +3628,7 @@ vm_save_execute(void)
                 debug_printf("MoveFile failed: %x\n", (int)GetLastError());
 #endif
             /* reopen for potential resume */
-            vm_save_info.f = filebuf_open(vm_save_info.filename, "rb");
+            vm_save_info.f = filebuf_open(vm_save_info.filename, "rba");
         }
     } else {
         if (f)
@@ -2297,13 +3669,13 @@ vm_save_finalize(void)
 }
 
 static int
-vm_restore_memory(void)
+vm_restore_memory(uint32_t **access_order, uint32_t *access_order_nr)
 {
     struct filebuf *f;
     xen_pfn_t *pfn_type = NULL;
     int *pfn_err = NULL, *pfn_info = NULL;
     struct decompress_ctx dc = { };
-    int populate_compressed = 0;
+    int populate_compressed = vm_save_info.resume_postcopy;
     int32_t marker;
     struct xc_save_generic s_generic;
 #ifdef SAVE_CUCKOO_ENABLED
@@ -2334,14 +3706,31 @@ vm_restore_memory(void)
     if (ret < 0)
         goto out;
 
+    /* pages populated compressed no longer match the base file */
+    if (populate_compressed)
+        save_base.compressed_clean = 0;
+
     while (1) {
         uxenvm_load_read(f, &marker, sizeof(marker), ret, &err_msg, out);
 	if (marker == 0)	/* end marker */
 	    break;
         switch (marker) {
+        case XC_SAVE_ID_ACCESS_ORDER:
+            ret = uxenvm_load_access_order(f, access_order, access_order_nr,
+                                           &err_msg);
+            if (ret)
+                goto out;
+            break;
+        case XC_SAVE_ID_PARENT_FILES:
+            ret = uxenvm_load_inherited(f, pfn_type, &err_msg);
+            if (ret)
+                goto out;
+            break;
         case XC_SAVE_ID_PAGE_OFFSETS:
+        case XC_SAVE_ID_PAGE_DIRECTORY:
         case XC_SAVE_ID_ZERO_BITMAP:
         case XC_SAVE_ID_FINGERPRINTS:
+        case XC_SAVE_ID_SAVE_ID:
             uxenvm_load_read_struct(f, s_generic, marker, ret, &err_msg,
                                     out);
             ret = filebuf_seek(f, s_generic.size - sizeof(s_generic),
@@ -2408,7 +3797,8 @@ vm_load(const char *name, int restore_mode)
 
     APRINTF("device model loading state: %s", name);
 
-    f = filebuf_open(name, "rb");
+    /* read ahead, so that reads overlap with decompression */
+    f = filebuf_open(name, restore_direct_io ? "rbasn" : "rbas");
     if (f == NULL) {
 	ret = -errno;
         asprintf(&err_msg, "filebuf_open(%s) failed", name);
@@ -2416,10 +3806,18 @@ vm_load(const char *name, int restore_mode)
 	goto out;
     }
 
+    /* the restored save file is the base of incremental saves */
+    if (restore_mode == VM_RESTORE_NORMAL && !whpx_enable)
+        save_base_start(name);
+    else
+        save_base_clear();
+
     ret = uxenvm_loadvm_execute(f, restore_mode, &err_msg);
+    save_base.recording = 0;
     if (ret) {
 	if (err_msg)
             EPRINTF("%s: ret %d", err_msg, ret);
+        save_base_clear();
 	goto out;
     }
 
@@ -2428,7 +3826,10 @@ vm_load(const char *name, int restore_mode)
         vm_template_file = strdup(name);
 
   out:
-    filebuf_close(f);
+    if (f) {
+        print_io_stats("load", f);
+        filebuf_close(f);
+    }
 
     if (ret < 0) {
         _set_errno(-ret);
@@ -2461,6 +3862,9 @@ vm_resume_abort(void)
 int
 vm_resume(void)
 {
+    uint32_t *access_order = NULL;
+    uint32_t access_order_nr = 0;
+    int restored = 0;
     int ret = 0;
     char *err_msg = NULL;
 
@@ -2468,9 +3872,10 @@ vm_resume(void)
         filebuf_set_readable(vm_save_info.f);
 
         if (vm_save_info.free_mem) {
-            ret = vm_restore_memory();
+            ret = vm_restore_memory(&access_order, &access_order_nr);
             if (ret == -EINTR)
                 goto out;
+            restored = 1;
         }
 
         qemu_savevm_resume();
@@ -2492,7 +3897,21 @@ vm_resume(void)
         goto out;
     }
 
+    /* post-copy resume: the vcpus run while the pages left compressed
+     * are populated in the background.  Otherwise continue the prefetch
+     * stopped for the save, if the vm still runs on the same memory,
+     * which is also the case when the save was aborted. */
+    if (restored && uxenvm_load_compressed) {
+        uxenvm_load_compressed = 0;
+        vm_prefetch_start(access_order, access_order_nr);
+        access_order = NULL;
+    } else if (restored)
+        vm_prefetch_discard();
+    else
+        vm_prefetch_resume();
+
   out:
+    free(access_order);
     if (ret == -EINTR) {
         asprintf(&err_msg, "resume aborted");
         EPRINTF("%s: ret %d", err_msg, ret);
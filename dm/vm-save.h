@@ -48,8 +48,10 @@ struct vm_save_info {
     int high_compress;
     int ignore_framebuffer;
     int fingerprint;
+    int incremental;
 
     int resume_delete;
+    int resume_postcopy;
 
     off_t page_batch_offset;
 };
@@ -72,6 +74,26 @@ void vm_resume_abort(void);
 int vm_load(const char *, int);
 int vm_load_finish(void);
 
+struct filebuf;
+struct xc_save_page_extent;
+
+struct page_directory {
+    const uint8_t *base;
+    uint64_t file_size;
+    const struct xc_save_page_extent *extents;
+    const uint32_t *pfn_entry;
+    uint32_t extents_nr;
+    uint32_t pfn_nr;
+    int64_t cached_extent;
+    uint8_t *cache;
+};
+
+int page_directory_open(struct page_directory *pd, struct filebuf *f,
+                        char **err_msg);
+void page_directory_close(struct page_directory *pd);
+int page_directory_read_page(struct page_directory *pd, uint64_t pfn,
+                             void *dst);
+
 #ifdef SAVE_CUCKOO_ENABLED
 struct page_fingerprint;
 
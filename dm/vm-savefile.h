@@ -11,7 +11,9 @@
 #include <fingerprint.h>
 #include <xen/hvm/params.h>
 
-#define SAVE_FORMAT_VERSION 5
+#define SAVE_FORMAT_VERSION 9
+/* oldest format version which can still be restored */
+#define SAVE_FORMAT_VERSION_MIN 5
 // #include <xg_save_restore.h>
 #define XC_SAVE_ID_VCPU_INFO          -2 /* Additional VCPU info */
 #define XC_SAVE_ID_TSC_INFO           -7
@@ -31,6 +33,10 @@
 #define XC_SAVE_ID_CLOCK_INFO         -25
 #define XC_SAVE_ID_WHPX_MEMORY_DATA   -26
 #define XC_SAVE_ID_WHPX_HVM_CONTEXT   -27
+#define XC_SAVE_ID_PAGE_DIRECTORY     -28
+#define XC_SAVE_ID_ACCESS_ORDER       -29
+#define XC_SAVE_ID_PARENT_FILES       -30
+#define XC_SAVE_ID_SAVE_ID            -31
 
 #define MAX_BATCH_SIZE 1023
 
@@ -135,6 +141,81 @@ struct PACKED xc_save_index {
                                  * an index end marker */
 };
 
+/* Page directory (format version 6): the page data of the save file as
+ * a list of extents, each a run of pages stored contiguously, either as
+ * one LZ4 block or uncompressed, followed by a table with one entry per
+ * pfn (pci hole skipped, as for the page offsets) giving the extent and
+ * the page within the extent.  The index entry of the page directory is
+ * written last, so that it is the footer of the save file. */
+struct xc_save_page_extent {
+    uint64_t offset;
+    uint32_t size;
+    uint16_t nr_pages;
+    uint16_t flags;
+};
+#define PAGE_EXTENT_RAW 0x1
+/* extents of an incremental save which are data of an ancestor save
+ * file, 1 for the parent */
+#define PAGE_EXTENT_ANCESTOR_SHIFT 8
+#define PAGE_EXTENT_ANCESTOR_MAX 0xff
+#define page_extent_ancestor(flags) ((flags) >> PAGE_EXTENT_ANCESTOR_SHIFT)
+
+#define PAGE_DIRECTORY_PAGE_BITS 10
+#define PAGE_DIRECTORY_NONE 0xffffffff
+#define page_directory_entry(extent, page)              \
+    (((uint32_t)(extent) << PAGE_DIRECTORY_PAGE_BITS) | (page))
+#define page_directory_extent(entry) ((entry) >> PAGE_DIRECTORY_PAGE_BITS)
+#define page_directory_page(entry)                      \
+    ((entry) & ((1 << PAGE_DIRECTORY_PAGE_BITS) - 1))
+
+struct xc_save_page_directory {
+    struct xc_save_generic;
+
+    uint32_t pfn_nr;
+    uint32_t extents_nr;
+    /* struct xc_save_page_extent extents[extents_nr]; */
+    /* uint32_t pfn_entry[pfn_nr]; */
+};
+
+/* Access order (format version 7): the pfns which the guest accessed
+ * early after the last post-copy resume, in the order the resume
+ * prefetcher should populate them. */
+struct xc_save_access_order {
+    struct xc_save_generic;
+
+    uint32_t pfn_nr;
+    uint32_t pfn[];
+};
+
+/* Save id (format version 9): random, generated anew for every save
+ * file with a page directory, such that a file can be told apart from
+ * any other file later written under the same name. */
+struct xc_save_save_id {
+    struct xc_save_generic;
+
+    uint8_t id[16];
+};
+
+/* Parent files (format version 9): an incremental save holds the data
+ * of the pages dirtied since the vm was restored from its parent save
+ * file only.  The page directory references the data of all other
+ * pages in the ancestor files by extent, and the ancestors are listed
+ * here, the parent first.  The save id of each ancestor is recorded,
+ * to detect a file which was replaced. */
+struct PACKED xc_save_parent_file {
+    uint64_t page_directory_offset;
+    uint8_t save_id[16];
+    uint16_t size;
+    char file[];
+};
+
+struct xc_save_parent_files {
+    struct xc_save_generic;
+
+    uint32_t files_nr;
+    /* struct xc_save_parent_file files[files_nr]; */
+};
+
 struct xc_save_cuckoo_data {
     int32_t marker;
     int32_t simple_mode;
@@ -25,6 +25,7 @@
 #include "hw.h"
 #include "uxen.h"
 #include "vm.h"
+#include "vm-prefetch.h"
 #include "vm-save.h"
 #include "shared-folders.h"
 #include "clipboard.h"
@@ -824,6 +825,7 @@ vm_exit(void *opaque)
     static uint32_t ending = 0;
 
     if (cmpxchg(&destroy_done, 0, 1) == 0) {
+        vm_prefetch_stop();
         if (!whpx_enable)
             uxen_destroy(vm_uuid);
         else
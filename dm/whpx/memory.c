@@ -1127,6 +1127,8 @@ compression_is_cuckoo(void)
         vm_save_info.compress_mode == VM_SAVE_COMPRESS_CUCKOO_SIMPLE;
 }
 
+#define FINGERPRINT_BATCH 64
+
 struct private_hashes {
     struct page_fingerprint *hashes;
     int hashes_nr;
@@ -1143,18 +1145,29 @@ calculate_hashes_cb(uint64_t pfn, uint64_t count, void *opaque)
     assert(len == (count << PAGE_SHIFT));
 
     while (pfn != end) {
-        if (!((h->hashes_nr - 1) & h->hashes_nr)) {
-            h->hashes = realloc(h->hashes, sizeof(h->hashes[0]) *
-                (h->hashes_nr ? 2 * h->hashes_nr : 1));
-            assert(h->hashes);
+        const uint8_t *pages[FINGERPRINT_BATCH];
+        uint64_t fps[FINGERPRINT_BATCH];
+        uint16_t rotates[FINGERPRINT_BATCH];
+        int i, n;
+
+        n = end - pfn < FINGERPRINT_BATCH ? end - pfn : FINGERPRINT_BATCH;
+        for (i = 0; i < n; i++)
+            pages[i] = (const uint8_t *)data + ((uint64_t)i << PAGE_SHIFT);
+        page_fingerprint_many(pages, n, fps, rotates);
+
+        for (i = 0; i < n; i++) {
+            if (!((h->hashes_nr - 1) & h->hashes_nr)) {
+                h->hashes = realloc(h->hashes, sizeof(h->hashes[0]) *
+                    (h->hashes_nr ? 2 * h->hashes_nr : 1));
+                assert(h->hashes);
+            }
+            h->hashes[h->hashes_nr].pfn = pfn;
+            h->hashes[h->hashes_nr].hash = fps[i];
+            h->hashes[h->hashes_nr].rotate = rotates[i];
+            h->hashes_nr++;
+            pfn++;
         }
-        h->hashes[h->hashes_nr].pfn = pfn;
-        h->hashes[h->hashes_nr].hash =
-            page_fingerprint(
-                data, &h->hashes[h->hashes_nr].rotate);
-        data += PAGE_SIZE;
-        h->hashes_nr++;
-        pfn++;
+        data += (uint64_t)n << PAGE_SHIFT;
     }
 }
 
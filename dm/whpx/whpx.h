@@ -159,6 +159,8 @@ int whpx_memory_populate_from_buffer(unsigned long nr_pfns, uint64_t *pfns, void
 
 #define WHPX_UNSUPPORTED errx(1, "whpx unsupported on this platform\n");
 
+struct filebuf;
+
 static inline int whpx_vm_init(void) { WHPX_UNSUPPORTED; return -1; }
 static inline int whpx_vm_start(void) { WHPX_UNSUPPORTED; return -1; }
 static inline void whpx_destroy(void) { WHPX_UNSUPPORTED; }
@@ -0,0 +1,23 @@
+#
+# Copyright 2019, Bromium, Inc.
+# SPDX-License-Identifier: ISC
+#
+
+UXEN_TARGET_FORMAT ?= elf
+
+# everything below only for builds under linux/
+ifeq (,$(patsubst $(TARGET_HOST)/%,,$(SUBDIR)/))
+
+# this is CC ?= but honouring CC from the environment
+CC := $(if $(subst cc,,$(CC)),$(CC),cc)
+CXX := $(if $(subst c++,,$(CXX)),$(CXX),c++)
+AR := $(if $(subst ar,,$(AR)),$(AR),ar)
+RANLIB := $(if $(subst ranlib,,$(RANLIB)),$(RANLIB),ranlib)
+STRIP := $(if $(subst strip,,$(STRIP)),$(STRIP),strip)
+
+CPPFLAGS += -D_GNU_SOURCE
+CPPFLAGS += -I$(abspath $(TOPDIR)/common/include)
+
+LDLIBS += -luuid -lpthread
+
+endif
@@ -671,6 +671,16 @@ Return Value:
 
     uxen_msg("Using ReportedMTU of %d", (int) Adapter->ulMTU);
 
+    {
+        ULONG offload = 0;
+
+        platform_get_offload(Adapter->Pdo, &offload);
+        Adapter->LsoSupported = uxen_net_enable_offload(&Adapter->uxen_net,
+                                                        offload);
+        uxen_msg("Host offloads 0x%x, large send %s", offload,
+                 Adapter->LsoSupported ? "enabled" : "disabled");
+    }
+
     //
     // Just for testing purposes, let us make up a dummy mac address.
     // In order to avoid conflicts with MAC addresses, it is usually a good
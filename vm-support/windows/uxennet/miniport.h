@@ -97,6 +97,10 @@ Notes:
 #define NIC_MAX_LOOKAHEAD               ETH_MAX_DATA_SIZE
 #define NIC_BUFFER_SIZE                 (ETH_REAL_MAX_PACKET_SIZE)
 #define NIC_LINK_SPEED                  10000000    // in 100 bps 
+// TCP payload of a large send, which must fit one IPv4 datagram with
+// the largest IP and TCP headers
+#define NIC_LSO_MAX_SIZE                (0xffff - 60 - 60)
+#define NIC_LSO_MIN_SEGMENTS            2
 
 
 #define NIC_SUPPORTED_FILTERS ( \
@@ -242,6 +246,7 @@ typedef struct _MP_ADAPTER {
 
 
     ULONG           ulMTU;
+    BOOLEAN         LsoSupported;   // host takes TCP frames above the MTU
 
     //
     // Packet Filter and look ahead size.
@@ -120,3 +120,31 @@ platform_get_mtu(IN PDEVICE_OBJECT pdo, ULONG *mtu)
 
     return STATUS_SUCCESS;
 }
+
+NTSTATUS
+platform_get_offload(IN PDEVICE_OBJECT pdo, ULONG *offload)
+{
+    NTSTATUS status;
+    UCHAR property_id;
+    ULONG o;
+
+    ASSERT(offload != NULL);
+
+    property_id = UXENBUS_PROPERTY_TYPE_OFFLOAD;
+
+    /* Hosts without offload support lack the property. */
+    *offload = 0;
+
+    status = SendDownStreamIrp(pdo,
+                               IOCTL_UXEN_PLATFORM_BUS_GET_DEVICE_PROPERTY,
+                               &property_id, sizeof(property_id),
+                               &o, sizeof(o));
+    if (!NT_SUCCESS(status)) {
+        uxen_msg("no offload property - 0x%.08X", status);
+        return status;
+    }
+
+    *offload = RtlUlongByteSwap(o);
+
+    return STATUS_SUCCESS;
+}
@@ -8,3 +8,5 @@ NTSTATUS uxen_net_stop_adapter(MP_ADAPTER *a);
 void NICSendQueuedPackets( MP_ADAPTER *adapter);
 NTSTATUS platform_get_mac_address(IN PDEVICE_OBJECT pdo, UCHAR *mac_address);
 NTSTATUS platform_get_mtu(IN PDEVICE_OBJECT pdo, ULONG *mtu);
+NTSTATUS platform_get_offload(IN PDEVICE_OBJECT pdo, ULONG *offload);
+BOOLEAN uxen_net_enable_offload(Uxennet *n, ULONG offload);
@@ -644,6 +644,30 @@ Notes: Read "Minimizing Miniport Driver Initialization Time" in the DDK
                 pInfo = (PVOID) buf;
                 ulInfoLen = sizeof(*h) + FIELD_OFFSET(NDIS_TASK_OFFLOAD, TaskBuffer) + sizeof(*checksum_buffer);
 
+                // The host segments large sends, and fixes up their
+                // checksums, unless its backend takes them whole.
+                if (Adapter->LsoSupported) {
+                    NDIS_TASK_OFFLOAD *lso;
+                    NDIS_TASK_TCP_LARGE_SEND *lso_buffer;
+
+                    checksum->OffsetNextTask = FIELD_OFFSET(NDIS_TASK_OFFLOAD, TaskBuffer) + checksum->TaskBufferLength;
+                    lso = (NDIS_TASK_OFFLOAD *) ((PUCHAR) checksum + checksum->OffsetNextTask);
+                    lso->Version = NDIS_TASK_OFFLOAD_VERSION;
+                    lso->Size = sizeof(*lso);
+                    lso->Task = TcpLargeSendNdisTask;
+                    lso->OffsetNextTask = 0;
+                    lso->TaskBufferLength = sizeof(*lso_buffer);
+
+                    lso_buffer = (NDIS_TASK_TCP_LARGE_SEND *) lso->TaskBuffer;
+                    lso_buffer->Version = NDIS_TASK_TCP_LARGE_SEND_V0;
+                    lso_buffer->MaxOffLoadSize = NIC_LSO_MAX_SIZE;
+                    lso_buffer->MinSegmentCount = NIC_LSO_MIN_SEGMENTS;
+                    lso_buffer->TcpOptions = TRUE;
+                    lso_buffer->IpOptions = TRUE;
+
+                    ulInfoLen = (ULONG) ((PUCHAR) (lso_buffer + 1) - buf);
+                }
+
                 uxen_msg("uxennet - lied through our teeth about checksums!");
 
                 break;
@@ -744,6 +768,37 @@ Return Value:
 
             break;
 
+        case OID_TCP_TASK_OFFLOAD: {
+                NDIS_TASK_OFFLOAD_HEADER *h = (NDIS_TASK_OFFLOAD_HEADER *)InformationBuffer;
+                NDIS_TASK_OFFLOAD *task = NULL;
+                ULONG offset;
+
+                //
+                // The protocol enables a subset of the tasks we reported.
+                // Large sends are only reported when the host takes them.
+                //
+                if (InformationBufferLength < sizeof(*h) ||
+                    h->Version != NDIS_TASK_OFFLOAD_VERSION ||
+                    h->EncapsulationFormat.Encapsulation != IEEE_802_3_Encapsulation) {
+                    Status = NDIS_STATUS_NOT_SUPPORTED;
+                    break;
+                }
+
+                for (offset = h->OffsetFirstTask; offset;
+                     offset = task->OffsetNextTask ? offset + task->OffsetNextTask : 0) {
+                    if (offset + FIELD_OFFSET(NDIS_TASK_OFFLOAD, TaskBuffer) > InformationBufferLength) {
+                        Status = NDIS_STATUS_INVALID_LENGTH;
+                        break;
+                    }
+                    task = (NDIS_TASK_OFFLOAD *) ((PUCHAR) InformationBuffer + offset);
+                    if (task->Task == TcpLargeSendNdisTask && !Adapter->LsoSupported) {
+                        Status = NDIS_STATUS_NOT_SUPPORTED;
+                        break;
+                    }
+                }
+                break;
+            }
+
         case OID_GEN_CURRENT_LOOKAHEAD:
             //
             // A protocol driver can set a suggested value for the number
@@ -5,7 +5,67 @@
 
 #include "uxennet_private.h"
 
-#define MAX_IOV 16
+#include <uxen/platform_interface.h>
+
+/* Large sends come in more pieces. */
+#define MAX_IOV 64
+
+/* Offloads this driver can make use of. */
+#define UXEN_NET_OFFLOADS UXENBUS_NET_OFFLOAD_TSO
+
+/* Return the TCP payload length of an IPv4 frame, or 0. */
+static ULONG
+uxen_net_tcp_payload (v4v_iov_t *iov, unsigned niov, UINT len)
+{
+    UCHAR h[ETH_HEADER_SIZE + 60 + 60];
+    ULONG hl, ihl, thl;
+    unsigned i;
+
+    for (i = hl = 0; i < niov && hl < sizeof(h); ++i) {
+        ULONG n = (ULONG) iov[i].iov_len;
+
+        if (n > sizeof(h) - hl)
+            n = (ULONG) (sizeof(h) - hl);
+        memcpy(h + hl, (void *) (uintptr_t) iov[i].iov_base, n);
+        hl += n;
+    }
+
+    if (hl < ETH_HEADER_SIZE + 20 || h[12] != 0x08 || h[13] != 0x00)
+        return 0;
+    ihl = (h[ETH_HEADER_SIZE] & 0xf) << 2;
+    if (hl < ETH_HEADER_SIZE + ihl + 20 || h[ETH_HEADER_SIZE + 9] != 6)
+        return 0;
+    thl = (h[ETH_HEADER_SIZE + ihl + 12] >> 4) << 2;
+    if (len < ETH_HEADER_SIZE + ihl + thl)
+        return 0;
+
+    return len - ETH_HEADER_SIZE - ihl - thl;
+}
+
+/* Enable the offloads the host advertised and this driver supports, by
+ * sending it a uxen_net_offload_msg. Returns TRUE if large sends may be
+ * passed on whole. */
+BOOLEAN
+uxen_net_enable_offload (Uxennet *n, ULONG offload)
+{
+    struct uxen_net_offload_msg msg;
+    unsigned ret;
+
+    offload &= UXEN_NET_OFFLOADS;
+    if (!offload)
+        return FALSE;
+
+    msg.magic = UXEN_NET_OFFLOAD_MAGIC;
+    msg.flags = offload;
+    ret = uxen_v4v_send_from_ring(n->recv_ring, &n->dest_addr, &msg,
+                                  sizeof(msg), V4V_PROTO_DGRAM);
+    if (ret != sizeof(msg)) {
+        uxen_err("failed to enable offloads: %d\n", ret);
+        return FALSE;
+    }
+
+    return !!(offload & UXENBUS_NET_OFFLOAD_TSO);
+}
 
 
 NDIS_STATUS
@@ -17,6 +77,7 @@ uxen_net_send_packet (Uxennet *n, PNDIS_PACKET p)
     void *va;
     v4v_iov_t iov[MAX_IOV];
     unsigned niov = 0, ret;
+    ULONG mss;
 
 
     UNREFERENCED_PARAMETER (n);
@@ -58,6 +119,14 @@ uxen_net_send_packet (Uxennet *n, PNDIS_PACKET p)
         return NDIS_STATUS_FAILURE;
     }
 
+    /* The host segments large sends if need be, and the stack wants to
+     * know how much TCP payload went out with them. */
+    mss = PtrToUlong(NDIS_PER_PACKET_INFO_FROM_PACKET(p,
+                                                      TcpLargeSendPacketInfo));
+    if (mss)
+        NDIS_PER_PACKET_INFO_FROM_PACKET(p, TcpLargeSendPacketInfo) =
+            UlongToPtr(uxen_net_tcp_payload(iov, niov, len));
+
     return NDIS_STATUS_SUCCESS;
 }
 
@@ -105,6 +105,7 @@ void csq_remove_irp(PIO_CSQ csq, PIRP irp)
 void csq_complete_cancelled_irp(PIO_CSQ csq, PIRP irp)
 {
     PUXENSTOR_DEV_EXT dev_ext;
+    ULONG q;
 
     perfcnt_inc(v4v_scsi_cancelled);
 
@@ -112,9 +113,11 @@ void csq_complete_cancelled_irp(PIO_CSQ csq, PIRP irp)
 
     dev_ext = GET_DEV_EXT(csq);
 
-    /* this is synchronous call */
-    uxen_v4v_cancel_async(&dev_ext->v4v_addr,
-                          stor_v4v_e_again_callback, dev_ext, irp);
+    /* this is synchronous call -- the request may have been sent on
+     * any of the rings */
+    for (q = 0; q < dev_ext->nr_queues; q++)
+        uxen_v4v_cancel_async(&dev_ext->queue[q].v4v_addr,
+                              stor_v4v_e_again_callback, dev_ext, irp);
 
     irp->IoStatus.Status = STATUS_CANCELLED;
     irp->IoStatus.Information = 0;
@@ -124,6 +127,7 @@ void csq_complete_cancelled_irp(PIO_CSQ csq, PIRP irp)
 void stor_v4v_callback(uxen_v4v_ring_handle_t *ring, void *ctx, void *ctx2)
 {
     PUXENSTOR_DEV_EXT dev_ext;
+    PUXENSTOR_QUEUE queue;
     ssize_t len;
     XFER_HEADER hdr;
     PIRP irp;
@@ -131,15 +135,14 @@ void stor_v4v_callback(uxen_v4v_ring_handle_t *ring, void *ctx, void *ctx2)
     PSCSI_REQUEST_BLOCK srb;
     NTSTATUS status;
 
-    UNREFERENCED_PARAMETER(ctx2);
-
     ASSERT(KeGetCurrentIrql() == DISPATCH_LEVEL);
 
     perfcnt_inc(stor_v4v_callback);
 
     dev_ext = (PUXENSTOR_DEV_EXT)ctx;
+    queue = (PUXENSTOR_QUEUE)ctx2;
     
-    KeAcquireSpinLockAtDpcLevel(&dev_ext->v4v_lock);
+    KeAcquireSpinLockAtDpcLevel(&queue->v4v_lock);
     do {
         len = uxen_v4v_copy_out(ring, NULL, NULL,
                                 &hdr, sizeof(hdr), 0);
@@ -148,7 +151,7 @@ void stor_v4v_callback(uxen_v4v_ring_handle_t *ring, void *ctx, void *ctx2)
                 break; /* ring empty - leave */
             uxen_err("datagram smaller than header size (%d < %d)", 
                      len, (int)sizeof(hdr));
-            uxen_v4v_copy_out(dev_ext->v4v_ring, NULL, NULL, NULL, 0, 1);
+            uxen_v4v_copy_out(ring, NULL, NULL, NULL, 0, 1);
             continue;
         }
 
@@ -184,7 +187,7 @@ void stor_v4v_callback(uxen_v4v_ring_handle_t *ring, void *ctx, void *ctx2)
 #endif /* DUMP_SENSE_DATA */
                 } else {
                     uxen_err("target sense data buffer NULL");
-                    uxen_v4v_copy_out(dev_ext->v4v_ring, NULL, NULL, NULL, 0, 1);
+                    uxen_v4v_copy_out(ring, NULL, NULL, NULL, 0, 1);
                 }
 
                 srb->SrbStatus = SRB_STATUS_ERROR; /* FIXME: be more specific */
@@ -196,12 +199,12 @@ void stor_v4v_callback(uxen_v4v_ring_handle_t *ring, void *ctx, void *ctx2)
                            (LONG_PTR)irp->Tail.Overlay.DriverContext[0]);
                 irp->Tail.Overlay.DriverContext[0] = NULL;
 
-                KeReleaseSpinLockFromDpcLevel(&dev_ext->v4v_lock);
+                KeReleaseSpinLockFromDpcLevel(&queue->v4v_lock);
 
                 irp->IoStatus.Status = status;
                 IoCompleteRequest(irp, IO_DISK_INCREMENT);
 
-                KeAcquireSpinLockAtDpcLevel(&dev_ext->v4v_lock);
+                KeAcquireSpinLockAtDpcLevel(&queue->v4v_lock);
 
                 continue;
             }
@@ -234,7 +237,7 @@ void stor_v4v_callback(uxen_v4v_ring_handle_t *ring, void *ctx, void *ctx2)
                                DUMP_IN_DATA_BEGIN_BYTES, DUMP_IN_DATA_END_BYTES);
 #endif
             } else {
-                uxen_v4v_copy_out(dev_ext->v4v_ring, NULL, NULL, NULL, 0, 1);
+                uxen_v4v_copy_out(ring, NULL, NULL, NULL, 0, 1);
                 perfcnt_arr_add_if(out_bytes, IS_PAGING_IO(srb),
                                    srb->DataTransferLength,
                                    TEST_FLAG(srb->SrbFlags, SRB_FLAGS_DATA_OUT));
@@ -244,22 +247,22 @@ void stor_v4v_callback(uxen_v4v_ring_handle_t *ring, void *ctx, void *ctx2)
                        (LONG_PTR)irp->Tail.Overlay.DriverContext[0]);
             irp->Tail.Overlay.DriverContext[0] = NULL;
 
-            KeReleaseSpinLockFromDpcLevel(&dev_ext->v4v_lock);
+            KeReleaseSpinLockFromDpcLevel(&queue->v4v_lock);
 
             srb->SrbStatus = SRB_STATUS_SUCCESS;
             irp->IoStatus.Status = STATUS_SUCCESS;
             IoCompleteRequest(irp, IO_DISK_INCREMENT);
 
-            KeAcquireSpinLockAtDpcLevel(&dev_ext->v4v_lock);
+            KeAcquireSpinLockAtDpcLevel(&queue->v4v_lock);
 
         } else {
             /* IRP was cancelled - discard message */
             uxen_msg("request 0x%p not in the queue", hdr.seq);
-            uxen_v4v_copy_out(dev_ext->v4v_ring, NULL, NULL, NULL, 0, 1);
+            uxen_v4v_copy_out(ring, NULL, NULL, NULL, 0, 1);
             perfcnt_inc(zombie_requests);
         }
     } while (1, 1);
-    KeReleaseSpinLockFromDpcLevel(&dev_ext->v4v_lock);
+    KeReleaseSpinLockFromDpcLevel(&queue->v4v_lock);
     
     uxen_v4v_notify();
 }
@@ -268,6 +271,7 @@ static
 NTSTATUS stor_v4v_scsi(PUXENSTOR_DEV_EXT dev_ext, PIRP irp,
                        PSCSI_REQUEST_BLOCK srb, BOOLEAN retry_path)
 {
+    PUXENSTOR_QUEUE queue;
     XFER_HEADER *hdr;
     UCHAR hdr_data[ROUNDUP_16(sizeof(*hdr) + 16)];
     v4v_iov_t iov[2];
@@ -325,11 +329,16 @@ NTSTATUS stor_v4v_scsi(PUXENSTOR_DEV_EXT dev_ext, PIRP irp,
 #endif
     }
 
+    /* spread the requests over the rings by cpu, replies come back on
+     * the ring the request was sent on */
+    queue = &dev_ext->queue[KeGetCurrentProcessorNumber() %
+                            dev_ext->nr_queues];
+
     irql = ExAcquireSpinLockShared(&dev_ext->v4v_resume_lock);
     IoCsqInsertIrp(&dev_ext->io_queue, irp, NULL);
     trace_scsi(irp, srb, STATUS_PENDING, (LONG_PTR)new_req_id);
     ret = uxen_v4v_sendv_from_ring_async(
-        dev_ext->v4v_ring, &dev_ext->v4v_addr, 
+        queue->v4v_ring, &queue->v4v_addr, 
         iov, 2 - (!TEST_FLAG(srb->SrbFlags, SRB_FLAGS_DATA_OUT)),
         V4V_PROTO_DGRAM,
         stor_v4v_e_again_callback, dev_ext, (PVOID)new_req_id);
@@ -504,7 +513,7 @@ NTSTATUS stor_dispatch_scsi(PDEVICE_OBJECT dev_obj, PIRP irp)
 
     srb = io_stack->Parameters.Scsi.Srb;
 
-    if (!dev_ext->v4v_ring)
+    if (!dev_ext->nr_queues)
         goto pass_thru;
 
     perfcnt_arr_inc(stor_dispatch_scsi, srb->Function);
@@ -577,7 +586,7 @@ NTSTATUS stor_dispatch_scsi(PDEVICE_OBJECT dev_obj, PIRP irp)
     default:
         uxen_msg("[0x%p:0x%p] %sSRB_func: 0x%x (%s)",
                  dev_obj, irp,
-                 (dev_ext->v4v_ring ? "unhandled v4v " : ""),
+                 (dev_ext->nr_queues ? "unhandled v4v " : ""),
                  srb->Function, srb_function_name(srb->Function));
 #endif /* LOG_SRB_UNHANDLED */
     }
@@ -599,7 +608,7 @@ NTSTATUS stor_dispatch_scsi(PDEVICE_OBJECT dev_obj, PIRP irp)
 #if LOG_DROPPED_AHCI_REQUESTS
         uxen_msg("[0x%p:0x%p] dropping %sSRB_func: 0x%x (%s)",
                  dev_obj, irp,
-                 (dev_ext->v4v_ring ? "unhandled v4v " : ""),
+                 (dev_ext->nr_queues ? "unhandled v4v " : ""),
                  srb->Function, srb_function_name(srb->Function));
 #endif /* LOG_DROPPED_AHCI_REQUESTS */
         status = STATUS_UNSUCCESSFUL;
@@ -14,6 +14,7 @@ typedef struct _STOR_CONTEXT {
     ULONG storage_dev_desc_size;
     ULONG allow_attach;
     BOOLEAN v4v_storage;
+    ULONG v4v_queues;
 } STOR_CONTEXT, *PSTOR_CONTEXT;
 
 static
@@ -188,6 +189,15 @@ NTSTATUS DriverEntry(PDRIVER_OBJECT drv_obj,
 #else
     uxenstor_ctx.v4v_storage = FALSE;
 #endif
+    if (uxenstor_ctx.v4v_storage) {
+        uxenstor_ctx.v4v_queues =
+            READ_PORT_UCHAR((PUCHAR)V4V_STOR_QUEUES_PORT);
+        /* the port reads as 0xff on hosts which don't back it */
+        if (uxenstor_ctx.v4v_queues < 1 ||
+            uxenstor_ctx.v4v_queues > V4V_STOR_MAX_QUEUES)
+            uxenstor_ctx.v4v_queues = 1;
+        uxen_msg("v4v storage rings per disk: %d", uxenstor_ctx.v4v_queues);
+    }
 
     extract_storage_device_data();
 
@@ -270,30 +280,36 @@ NTSTATUS stor_add_device(PDRIVER_OBJECT drv_obj,
     
     InitializeListHead(&dev_ext->pending_irp_list);
     KeInitializeSpinLock(&dev_ext->io_queue_lock);
-    KeInitializeSpinLock(&dev_ext->v4v_lock);
 
+    dev_ext->nr_queues = 0;
     if (uxenstor_ctx.v4v_storage) {
         acquire_stor_v4v_addr(dev_ext);
-        dev_ext->v4v_ring = uxen_v4v_ring_bind(dev_ext->v4v_addr.port, 
-                                               dev_ext->v4v_addr.domain,
-                                               V4V_STOR_RING_LEN,
-                                               stor_v4v_callback,
-                                               dev_ext, NULL);
-        if (dev_ext->v4v_ring) {
+        while (dev_ext->nr_queues < uxenstor_ctx.v4v_queues) {
+            PUXENSTOR_QUEUE queue = &dev_ext->queue[dev_ext->nr_queues];
+
+            KeInitializeSpinLock(&queue->v4v_lock);
+            queue->v4v_ring = uxen_v4v_ring_bind(queue->v4v_addr.port, 
+                                                 queue->v4v_addr.domain,
+                                                 V4V_STOR_RING_LEN,
+                                                 stor_v4v_callback,
+                                                 dev_ext, queue);
+            if (!queue->v4v_ring) {
+                uxen_err("failed to bound v4v ring (%d:0x%x)",
+                         queue->v4v_addr.domain, queue->v4v_addr.port);
+                break;
+            }
+            dev_ext->nr_queues++;
+        }
+        if (dev_ext->nr_queues) {
             dev_ext->v4v_resume_lock = 0;
             KeInitializeDpc(&dev_ext->v4v_resume_dpc,
                             stor_v4v_resume_callback, dev_ext);
             uxen_v4vlib_set_resume_dpc(&dev_ext->v4v_resume_dpc, NULL);
-            uxen_msg("using v4v storage stack");
-        } else {
-            uxen_err("failed to bound v4v ring (%d:0x%x)",
-                     dev_ext->v4v_addr.domain, dev_ext->v4v_addr.port);
+            uxen_msg("using v4v storage stack, %d rings", dev_ext->nr_queues);
+        } else
             release_stor_v4v_addr(dev_ext);
-        }
-    } else {
-        dev_ext->v4v_ring = NULL;
+    } else
         uxen_msg("using native storage stack");
-    }
 
     dev_obj->Flags &= ~DO_DEVICE_INITIALIZING;
 
@@ -576,8 +592,13 @@ NTSTATUS stor_dispatch_pnp(PDEVICE_OBJECT dev_obj,
 
         IoReleaseRemoveLockAndWait(&dev_ext->remove_lock, irp);
 
-        if (dev_ext->v4v_ring) {
-            uxen_v4v_ring_free(dev_ext->v4v_ring);
+        if (dev_ext->nr_queues) {
+            while (dev_ext->nr_queues) {
+                dev_ext->nr_queues--;
+                uxen_v4v_ring_free(
+                    dev_ext->queue[dev_ext->nr_queues].v4v_ring);
+                dev_ext->queue[dev_ext->nr_queues].v4v_ring = NULL;
+            }
             release_stor_v4v_addr(dev_ext);
         }
 
@@ -67,6 +67,25 @@ __forceinline ULONG CPUID(int id, int reg)
 
 #pragma warning(disable: 4200)
 
+/* v4v stuffs */
+#define V4V_STOR_RING_LEN (1 << 20)
+#define V4V_STOR_PORT_BASE 0xd0000
+#define V4V_STOR_PARTNER_DOMAIN V4V_DOMID_DM
+
+/* Each disk has up to V4V_STOR_MAX_QUEUES rings, ring q of disk n is bound
+ * to port V4V_STOR_PORT_BASE + n + q * V4V_STOR_QUEUE_PORT_STRIDE. The host
+ * advertises the number of rings at ioport V4V_STOR_QUEUES_PORT, hosts
+ * which don't back the port serve ring 0 only. */
+#define V4V_STOR_MAX_QUEUES 8
+#define V4V_STOR_QUEUE_PORT_STRIDE 0x100
+#define V4V_STOR_QUEUES_PORT 0x32e
+
+typedef struct _UXENSTOR_QUEUE {
+    KSPIN_LOCK v4v_lock;
+    v4v_addr_t v4v_addr;
+    uxen_v4v_ring_handle_t *v4v_ring;
+} UXENSTOR_QUEUE, *PUXENSTOR_QUEUE;
+
 typedef struct _UXENSTOR_DEV_EXT {
     PDEVICE_OBJECT lower_dev_obj;
     IO_REMOVE_LOCK remove_lock;
@@ -78,9 +97,8 @@ typedef struct _UXENSTOR_DEV_EXT {
     EX_SPIN_LOCK v4v_resume_lock;
     KDPC v4v_resume_dpc;
 
-    KSPIN_LOCK v4v_lock;
-    v4v_addr_t v4v_addr;
-    uxen_v4v_ring_handle_t *v4v_ring;
+    ULONG nr_queues;
+    UXENSTOR_QUEUE queue[V4V_STOR_MAX_QUEUES];
 } UXENSTOR_DEV_EXT, *PUXENSTOR_DEV_EXT;
 
 #define GET_DEV_EXT(csq) CONTAINING_RECORD(csq, UXENSTOR_DEV_EXT, io_queue)
@@ -128,19 +146,18 @@ typedef struct _XFER_HEADER {
 } XFER_HEADER, *PXFER_HEADER;
 #pragma pack(pop)
 
-/* v4v stuffs */
-#define V4V_STOR_RING_LEN (1 << 20)
-#define V4V_STOR_PORT_BASE 0xd0000
-#define V4V_STOR_PARTNER_DOMAIN V4V_DOMID_DM
-
 static __inline
 void acquire_stor_v4v_addr(PUXENSTOR_DEV_EXT dev_ext) 
 {
     static uint32_t port = 0;
+    ULONG q;
 
     ASSERT(dev_ext);
-    dev_ext->v4v_addr.port = V4V_STOR_PORT_BASE + port;
-    dev_ext->v4v_addr.domain = (domid_t)V4V_STOR_PARTNER_DOMAIN;
+    for (q = 0; q < V4V_STOR_MAX_QUEUES; q++) {
+        dev_ext->queue[q].v4v_addr.port = V4V_STOR_PORT_BASE + port +
+                                          q * V4V_STOR_QUEUE_PORT_STRIDE;
+        dev_ext->queue[q].v4v_addr.domain = (domid_t)V4V_STOR_PARTNER_DOMAIN;
+    }
 
     port++;
 }
@@ -148,9 +165,13 @@ void acquire_stor_v4v_addr(PUXENSTOR_DEV_EXT dev_ext)
 static __inline
 void release_stor_v4v_addr(PUXENSTOR_DEV_EXT dev_ext) 
 {
+    ULONG q;
+
     ASSERT(dev_ext);
-    dev_ext->v4v_addr.port = 0;
-    dev_ext->v4v_addr.domain = (domid_t)-1;
+    for (q = 0; q < V4V_STOR_MAX_QUEUES; q++) {
+        dev_ext->queue[q].v4v_addr.port = 0;
+        dev_ext->queue[q].v4v_addr.domain = (domid_t)-1;
+    }
 }
 
 /* diag.c */
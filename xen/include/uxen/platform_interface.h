@@ -40,8 +40,25 @@ struct uxp_state_bar {
 #define UXENBUS_PROPERTY_TYPE_MACADDR   0x0
 #define UXENBUS_PROPERTY_TYPE_MTU       0x1
 #define UXENBUS_PROPERTY_TYPE_HIDTYPE   0x2
+#define UXENBUS_PROPERTY_TYPE_OFFLOAD   0x3
 #define UXENBUS_PROPERTY_TYPE_LIST_END  0xff
 
+/* UXENBUS_PROPERTY_TYPE_OFFLOAD (big endian uint32_t) flags: with TSO the
+ * guest may send TCP frames of up to 64KiB, which the host segments if its
+ * network backend cannot take them. */
+#define UXENBUS_NET_OFFLOAD_TSO         0x1
+
+/* Sent by the guest as a datagram on the net device ring to enable the
+ * advertised offloads it supports, fields in host byte order.  It is
+ * shorter than an ethernet header, so hosts without offload support drop
+ * it. */
+#define UXEN_NET_OFFLOAD_MAGIC          0x6f666c64
+
+struct uxen_net_offload_msg {
+    uint32_t magic;
+    uint32_t flags;
+};
+
 struct uxp_bus_device_property {
     uint8_t property_type;
     uint8_t length;